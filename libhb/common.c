@@ -3729,6 +3729,8 @@ static void job_clean( hb_job_t * job )
         job->encoder_level = NULL;
         free(job->file);
         job->file = NULL;
+        free(job->affinity);
+        job->affinity = NULL;
 
         // clean up chapter list
         while( ( chapter = hb_list_item( job->list_chapter, 0 ) ) )
@@ -3772,6 +3774,8 @@ static void job_clean( hb_job_t * job )
 
         // clean up metadata
         hb_metadata_close( &job->metadata );
+
+        hb_segment_set_close( &job->segments );
     }
 }
 
@@ -3899,6 +3903,18 @@ void hb_job_set_file(hb_job_t *job, const char *file)
     }
 }
 
+void hb_job_set_affinity(hb_job_t *job, const char *affinity)
+{
+    if (job != NULL)
+    {
+        if (affinity == NULL || affinity[0] == 0)
+        {
+            affinity = NULL;
+        }
+        hb_update_str(&job->affinity, affinity);
+    }
+}
+
 hb_filter_object_t * hb_filter_copy( hb_filter_object_t * filter )
 {
     if( filter == NULL )
@@ -3912,6 +3928,21 @@ hb_filter_object_t * hb_filter_copy( hb_filter_object_t * filter )
     return filter_copy;
 }
 
+/**********************************************************************
+ * hb_filter_thread_count
+ **********************************************************************
+ * Number of parallel tasks a threaded filter should split its work
+ * into.  Set from the job's thread budget, otherwise one per CPU.
+ *********************************************************************/
+int hb_filter_thread_count( hb_filter_object_t * filter )
+{
+    if (filter->thread_count > 0)
+    {
+        return filter->thread_count;
+    }
+    return hb_get_cpu_count();
+}
+
 /**********************************************************************
  * hb_filter_list_copy
  **********************************************************************
@@ -150,6 +150,7 @@ void hb_job_set_encoder_options(hb_job_t *job, const char *options);
 void hb_job_set_encoder_profile(hb_job_t *job, const char *profile);
 void hb_job_set_encoder_level  (hb_job_t *job, const char *level);
 void hb_job_set_file           (hb_job_t *job, const char *file);
+void hb_job_set_affinity       (hb_job_t *job, const char *affinity);
 
 hb_audio_t *hb_audio_copy(const hb_audio_t *src);
 hb_list_t *hb_audio_list_copy(const hb_list_t *src);
@@ -542,7 +543,8 @@ struct hb_job_s
     int             cfr;
     PRIVATE int     pass_id;
     int             twopass;        // Enable 2-pass encode. Boolean
-    int             fastfirstpass;
+    int             fastfirstpass;  // 0 = off, 1 = turbo first pass,
+                                    // 2 = fastest first pass analysis
     char           *encoder_preset;
     char           *encoder_tune;
     char           *encoder_options;
@@ -630,7 +632,31 @@ struct hb_job_s
     int             mp4_optimize;
     int             ipod_atom;
 
+    int             thread_budget;      // CPU threads shared by decoder,
+                                        // filters and encoder, 0 = no limit
+    int             segment_count;      // encode the video in this many
+                                        // chapter ranges at the same time
+                                        // and stitch them, 0 = off
+    int             frame_cache_budget; // MiB of disk for the pictures of
+                                        // pass 1 of a two-pass encode,
+                                        // reused by pass 2, 0 = off
+    int             fifo_budget;        // MiB of raw video the fifos may
+                                        // hold, 0 = default (256)
+    char          * affinity;           // CPUs the job's threads run on,
+                                        // "0-7,16-23" or "node:1",
+                                        // NULL = any
+    int             memory_limit;       // MiB of data the unbounded queues
+                                        // keep in memory before spilling
+                                        // to disk, 0 = no limit
+    int             decode_skip;        // let the video decoder drop the
+                                        // frames of an integer frame rate
+                                        // reduction of a CFR source,
+                                        // 0 = off
+
     int                     indepth_scan;
+    int                     indepth_scan_first_pass; // search during the
+                                                     // first pass of a
+                                                     // two-pass encode
     hb_subtitle_config_t    select_subtitle_config;
 
     int             angle;              // dvd angle to encode
@@ -687,6 +713,38 @@ struct hb_job_s
 
     hb_list_t     * list_work;
 
+    // thread_budget split, see job_setup_threads() in work.c.
+    // 0 lets the stage pick its own thread count.
+    int             threads_decode;
+    int             threads_encode;
+
+    hb_profile_t  * profile;            // per-stage statistics, profile.c
+
+    // With decode_skip, source frames that the CFR frame rate reduction
+    // of the vfr filter would drop are dropped by the video decoder
+    // instead, see job_setup_frame_skip() in work.c.  Frame durations of the source
+    // and the output in 90 kHz ticks, 0 when off.
+    double          skip_in_duration;
+    double          skip_out_duration;
+
+    // Data carried between the passes of this job's sequence, owned
+    // by the work thread.  See hb_interjob_t.
+    struct hb_interjob_s * interjob;
+
+    // Split-and-stitch encoding, see hb_job_setup_passes().  'segment'
+    // is 1..segment_count for the passes that encode a chapter range
+    // and 0 for the pass that stitches them.
+    hb_segment_set_t * segments;
+    int                segment;
+
+    // Pass 1 to pass 2 frame cache, see framecache.c.  Set when this
+    // pass writes the cache or takes its input from it.
+    hb_frame_cache_t * frame_cache;
+
+    // Store for the data of queued buffers spilled to disk, see
+    // spill.c.  NULL when the job has no memory_limit.
+    hb_spill_t       * spill;
+
     hb_esconfig_t config;
 
     hb_mux_data_t * mux_data;
@@ -950,6 +1008,9 @@ struct hb_subtitle_s
     hb_fifo_t * fifo_raw; /* Decoded SPU */
     hb_fifo_t * fifo_out; /* Correct Timestamps, ready to be muxed */
     hb_mux_data_t * mux_data;
+
+    int search;     /* Foreign Audio Search candidate, hits are counted
+                       but nothing is output */
 #endif
 };
 
@@ -1199,6 +1260,7 @@ struct hb_work_object_s
     hb_work_object_t  * next;
 
     hb_handle_t       * h;
+    hb_stage_stats_t  * stats;          // NULL when not profiled
 #endif
 };
 
@@ -1223,6 +1285,9 @@ extern hb_work_object_t hb_decavcodecv;
 extern hb_work_object_t hb_declpcm;
 extern hb_work_object_t hb_encvorbis;
 extern hb_work_object_t hb_muxer;
+extern hb_work_object_t hb_stitch;
+extern hb_work_object_t hb_frame_cache_writer;
+extern hb_work_object_t hb_frame_cache_reader;
 extern hb_work_object_t hb_encca_aac;
 extern hb_work_object_t hb_encca_haac;
 extern hb_work_object_t hb_encavcodeca;
@@ -1281,6 +1346,8 @@ struct hb_filter_object_s
     hb_thread_t         * thread;
     volatile int        * done;
     int                   status;
+    int                   thread_count; // parallelism from the job's
+                                        // thread_budget, 0 = automatic
 
     // Filters can drop frames and thus chapter marks
     // These are used to bridge the chapter to the next buffer
@@ -1288,6 +1355,7 @@ struct hb_filter_object_s
     int64_t               chapter_time;
 
     hb_filter_object_t  * sub_filter;
+    hb_stage_stats_t    * stats;        // NULL when not profiled
 #endif
 };
 
@@ -18,15 +18,15 @@
 
 #include "hb.h"
 #include "hbffmpeg.h"
+#include "taskset.h"
+#include "deblock.h"
 
 #define PP7_QP_DEFAULT    5
-#define PP7_MODE_DEFAULT  2
+#define PP7_MODE_DEFAULT  PP7_MODE_MEDIUM
 
 #define XMIN(a,b) ((a) < (b) ? (a) : (b))
 #define XMAX(a,b) ((a) > (b) ? (a) : (b))
 
-typedef short DCTELEM;
-
 //===========================================================================//
 static const uint8_t  __attribute__((aligned(8))) pp7_dither[8][8] =
 {
@@ -40,13 +40,42 @@ static const uint8_t  __attribute__((aligned(8))) pp7_dither[8][8] =
     { 42,  26,  38,  22,  41,  25,  37,  21, },
 };
 
+typedef struct pp7_plane_s {
+    uint8_t     * dst;
+    uint8_t     * src;      // padded copy of the plane
+    int           stride;   // of the padded copy
+    int           width;
+    int           height;
+    uint8_t     * qp_store;
+    int           qp_stride;
+    int           is_luma;
+} pp7_plane_t;
+
+typedef struct pp7_arguments_s {
+    DCTELEM     * temp;     // transform scratch of the segment
+    int         * qp;       // quantizer of each run of 8 pixels
+} pp7_arguments_t;
+
+typedef struct pp7_thread_arg_s {
+    hb_filter_private_t * pv;
+    int                   segment;
+} pp7_thread_arg_t;
+
 struct hb_filter_private_s
 {
     int           pp7_qp;
     int           pp7_mode;
     int           pp7_mpeg2;
-    int           pp7_temp_stride;
-    uint8_t     * pp7_src;
+    int           pp7_width;    // largest plane the buffers hold
+    int           pp7_height;
+    uint8_t     * pp7_src[3];
+    pp7_plane_t   pp7_plane[3];
+
+    pp7_functions_t functions;
+
+    int               cpu_count;
+    taskset_t         pp7_taskset;     // Tasks - one per CPU
+    pp7_arguments_t * pp7_arguments;   // Arguments to thread for work
 };
 
 static int hb_deblock_init( hb_filter_object_t * filter,
@@ -73,7 +102,7 @@ hb_filter_object_t hb_filter_deblock =
     .settings_template = deblock_template,
 };
 
-static inline void pp7_dct_a( DCTELEM * dst, uint8_t * src, int stride )
+static inline void pp7_dct_a( DCTELEM * dst, const uint8_t * src, int stride )
 {
     int i;
 
@@ -100,7 +129,7 @@ static inline void pp7_dct_a( DCTELEM * dst, uint8_t * src, int stride )
     }
 }
 
-static void pp7_dct_b( DCTELEM * dst, DCTELEM * src )
+static void pp7_dct_b( DCTELEM * dst, const DCTELEM * src )
 {
     int i;
 
@@ -135,7 +164,7 @@ static void pp7_dct_b( DCTELEM * dst, DCTELEM * src )
 #define SN1 2.2360679775
 #define SN2 3.16227766017
 
-static const int pp7_factor[16] =
+const int pp7_factor[16] =
 {
     N/(N0*N0), N/(N0*N1), N/(N0*N0),N/(N0*N2),
     N/(N1*N0), N/(N1*N1), N/(N1*N0),N/(N1*N2),
@@ -143,7 +172,7 @@ static const int pp7_factor[16] =
     N/(N2*N0), N/(N2*N1), N/(N2*N0),N/(N2*N2),
 };
 
-static int pp7_threshold[99][16];
+int pp7_threshold[99][16];
 
 static void pp7_init_threshold( void )
 {
@@ -161,7 +190,7 @@ static void pp7_init_threshold( void )
     }
 }
 
-static int pp7_hard_threshold( DCTELEM * src, int qp )
+static int pp7_hard_threshold( const DCTELEM * src, const int * threshold )
 {
     int i;
     int a;
@@ -169,7 +198,7 @@ static int pp7_hard_threshold( DCTELEM * src, int qp )
     a = src[0] * pp7_factor[0];
     for( i = 1; i < 16; i++ )
     {
-        unsigned int threshold1 = pp7_threshold[qp][i];
+        unsigned int threshold1 = threshold[i];
         unsigned int threshold2 = (threshold1<<1);
         int level= src[i];
         if( ((unsigned)(level+threshold1)) > threshold2 )
@@ -180,7 +209,7 @@ static int pp7_hard_threshold( DCTELEM * src, int qp )
     return (a + (1<<11)) >> 12;
 }
 
-static int pp7_medium_threshold( DCTELEM * src, int qp )
+static int pp7_medium_threshold( const DCTELEM * src, const int * threshold )
 {
     int i;
     int a;
@@ -188,7 +217,7 @@ static int pp7_medium_threshold( DCTELEM * src, int qp )
     a = src[0] * pp7_factor[0];
     for( i = 1; i < 16; i++ )
     {
-        unsigned int threshold1 = pp7_threshold[qp][i];
+        unsigned int threshold1 = threshold[i];
         unsigned int threshold2 = (threshold1<<1);
         int level= src[i];
         if( ((unsigned)(level+threshold1)) > threshold2 )
@@ -213,7 +242,7 @@ static int pp7_medium_threshold( DCTELEM * src, int qp )
     return (a + (1<<11)) >> 12;
 }
 
-static int pp7_soft_threshold( DCTELEM * src, int qp )
+static int pp7_soft_threshold( const DCTELEM * src, const int * threshold )
 {
     int i;
     int a;
@@ -221,7 +250,7 @@ static int pp7_soft_threshold( DCTELEM * src, int qp )
     a = src[0] * pp7_factor[0];
     for( i = 1; i < 16; i++ )
     {
-        unsigned int threshold1 = pp7_threshold[qp][i];
+        unsigned int threshold1 = threshold[i];
         unsigned int threshold2 = (threshold1<<1);
         int level= src[i];
         if( ((unsigned)(level+threshold1))>threshold2 )
@@ -239,29 +268,80 @@ static int pp7_soft_threshold( DCTELEM * src, int qp )
     return (a + (1<<11)) >> 12;
 }
 
-static int ( * pp7_requantize )( DCTELEM * src, int qp ) = pp7_hard_threshold;
-
-static void pp7_filter( hb_filter_private_t * pv,
-                        uint8_t * dst,
-                        uint8_t * src,
-                        int width,
-                        int height,
-                        uint8_t * qp_store,
-                        int qp_stride,
-                        int is_luma)
+static void pp7_filter_row( uint8_t        * dst,
+                            const uint8_t  * src,
+                            int              stride,
+                            int              width,
+                            const int      * qp,
+                            const int     (* threshold)[16],
+                            const int      * factor,
+                            int              mode,
+                            const uint8_t  * dither,
+                            DCTELEM        * temp )
 {
-    int x, y;
+    int x;
+    DCTELEM block[16];
+    int ( * requantize )( const DCTELEM * src, const int * threshold );
 
-    const int  stride = is_luma ? pv->pp7_temp_stride : ((width+16+15)&(~15));
-    uint8_t  * p_src  = pv->pp7_src + 8*stride;
-    DCTELEM  * block  = (DCTELEM *)(pv->pp7_src);
-    DCTELEM  * temp   = (DCTELEM *)(pv->pp7_src + 32);
+    switch( mode )
+    {
+        case PP7_MODE_SOFT:
+            requantize = pp7_soft_threshold;
+            break;
+        case PP7_MODE_MEDIUM:
+            requantize = pp7_medium_threshold;
+            break;
+        default:
+            requantize = pp7_hard_threshold;
+            break;
+    }
 
-    if( !src || !dst )
+    for( x = -8; x < 0; x += 4 )
     {
-        return;
+        pp7_dct_a( temp + 4*x + 4*8, src + x + 5, stride );
     }
 
+    for( x = 0; x < width; x++ )
+    {
+        DCTELEM * tp = temp + 4*x;
+        int v;
+
+        if( (x&3) == 0 )
+        {
+            pp7_dct_a( tp + 4*8, src + x + 5, stride );
+        }
+
+        pp7_dct_b( block, tp );
+
+        v = requantize( block, threshold[qp[x>>3]] );
+        v = (v + dither[x&7]) >> 6;
+        if( (unsigned)v > 255 )
+        {
+            v = (-v) >> 31;
+        }
+        dst[x] = v;
+    }
+}
+
+void pp7_init_c( pp7_functions_t * functions )
+{
+    pp7_init_threshold();
+    functions->filter_row = pp7_filter_row;
+}
+
+/*
+ * Copies 'src' into the plane's buffer with a mirrored border of 8
+ * pixels on each side.
+ */
+static void pp7_pad( pp7_plane_t * plane, uint8_t * src )
+{
+    int x, y;
+
+    const int  stride = plane->stride;
+    const int  width  = plane->width;
+    const int  height = plane->height;
+    uint8_t  * p_src  = plane->src;
+
     for( y = 0; y < height; y++ )
     {
         int index = 8 + 8*stride + y*stride;
@@ -281,23 +361,36 @@ static void pp7_filter( hb_filter_private_t * pv,
         memcpy( p_src + (height+8+y)*stride,
                 p_src + (height-y+7)*stride, stride );
     }
+}
 
-    for( y = 0; y < height; y++ )
-    {
-        for( x = -8; x < 0; x += 4 )
-        {
-            const int index = x + y*stride + (8-3)*(1+stride) + 8;
-            uint8_t * src   = p_src + index;
-            DCTELEM * tp    = temp+4*x;
+/*
+ * Filters rows 'y_start' to 'y_stop' of a padded plane.  Rows only read
+ * the padded copy, so any band of them can be filtered independently.
+ */
+static void pp7_filter( hb_filter_private_t * pv,
+                        pp7_plane_t * plane,
+                        pp7_arguments_t * args,
+                        int y_start,
+                        int y_stop )
+{
+    int x, y;
 
-            pp7_dct_a( tp+4*8, src, stride );
-        }
+    const int  stride = plane->stride;
+    const int  width  = plane->width;
+    const int  height = plane->height;
+    const int  qps    = 3 + plane->is_luma;
+    uint8_t  * p_src  = plane->src;
+    uint8_t  * dst    = plane->dst;
 
-        for( x = 0; x < width; )
-        {
-            const int qps = 3 + is_luma;
-            int end = XMIN(x+8, width);
+    if( !plane->src || !dst )
+    {
+        return;
+    }
 
+    for( y = y_start; y < y_stop; y++ )
+    {
+        for( x = 0; x < width; x += 8 )
+        {
             int qp;
             if( pv->pp7_qp )
             {
@@ -305,39 +398,87 @@ static void pp7_filter( hb_filter_private_t * pv,
             }
             else
             {
-                qp = qp_store[ (XMIN(x, width-1)>>qps) +
-                               (XMIN(y, height-1)>>qps) * qp_stride ];
+                qp = plane->qp_store[ (XMIN(x, width-1)>>qps) +
+                                      (XMIN(y, height-1)>>qps) * plane->qp_stride ];
 
                 if( pv->pp7_mpeg2 )
                 {
                     qp >>= 1;
                 }
             }
+            args->qp[x>>3] = qp;
+        }
 
-            for( ; x < end; x++ )
-            {
-                const int index = x + y*stride + (8-3)*(1+stride) + 8;
-                uint8_t * src   = p_src + index;
-                DCTELEM * tp    = temp+4*x;
-                int v;
+        pv->functions.filter_row( dst + y*width,
+                                  p_src + (y+5)*stride + 8,
+                                  stride,
+                                  width,
+                                  args->qp,
+                                  (const int (*)[16])pp7_threshold,
+                                  pp7_factor,
+                                  pv->pp7_mode,
+                                  pp7_dither[y&7],
+                                  args->temp );
+    }
+}
 
-                if( (x&3) == 0 )
-                {
-                    pp7_dct_a( tp+4*8, src, stride );
-                }
+/*
+ * Deblock this segment of all three planes in a single task.
+ */
+static void pp7_filter_thread( void * thread_args_v )
+{
+    pp7_thread_arg_t    * thread_args = thread_args_v;
+    hb_filter_private_t * pv = thread_args->pv;
+    int                   segment = thread_args->segment;
+    int                   c;
 
-                pp7_dct_b( block, tp );
+    for( c = 0; c < 3; c++ )
+    {
+        pp7_plane_t * plane = &pv->pp7_plane[c];
+        int           start = plane->height *  segment      / pv->cpu_count;
+        int           stop  = plane->height * (segment + 1) / pv->cpu_count;
 
-                v = pp7_requantize( block, qp );
-                v = (v + pp7_dither[y&7][x&7]) >> 6;
-                if( (unsigned)v > 255 )
-                {
-                    v = (-v) >> 31;
-                }
-                dst[x + y*width] = v;
-            }
+        pp7_filter( pv, plane, &pv->pp7_arguments[segment], start, stop );
+    }
+}
+
+/*
+ * Allocates the padded planes and the scratch of each segment for
+ * planes of up to 'width' x 'height'.
+ */
+static int pp7_alloc( hb_filter_private_t * pv, int width, int height )
+{
+    int ii, c;
+
+    const int stride = (width + 16 + 15) & (~15);
+    const int h      = (height + 16 + 15) & (~15);
+
+    for( c = 0; c < 3; c++ )
+    {
+        free( pv->pp7_src[c] );
+        pv->pp7_src[c] = calloc( stride*(h+8), sizeof(uint8_t) );
+        if( pv->pp7_src[c] == NULL )
+        {
+            return -1;
         }
     }
+    for( ii = 0; ii < pv->cpu_count; ii++ )
+    {
+        pp7_arguments_t * args = &pv->pp7_arguments[ii];
+
+        free( args->temp );
+        free( args->qp );
+        args->temp = calloc( 4 * (stride + 64), sizeof(DCTELEM) );
+        args->qp   = calloc( stride / 8 + 1, sizeof(int) );
+        if( args->temp == NULL || args->qp == NULL )
+        {
+            return -1;
+        }
+    }
+    pv->pp7_width  = width;
+    pv->pp7_height = height;
+
+    return 0;
 }
 
 static int hb_deblock_init( hb_filter_object_t * filter, 
@@ -358,28 +499,52 @@ static int hb_deblock_init( hb_filter_object_t * filter,
         pv->pp7_qp = 0;
     }
 
-    pp7_init_threshold();
+    pp7_init_c( &pv->functions );
+#if defined(ARCH_X86)
+    pp7_init_x86( &pv->functions );
+#endif
 
-    switch( pv->pp7_mode )
+    pv->cpu_count = hb_filter_thread_count( filter );
+
+    /*
+     * Create deblock taskset.
+     */
+    pv->pp7_arguments = calloc( pv->cpu_count, sizeof(pp7_arguments_t) );
+    if( pv->pp7_arguments == NULL ||
+        taskset_init( &pv->pp7_taskset, pv->cpu_count,
+                      sizeof( pp7_thread_arg_t ) ) == 0 )
     {
-        case 0:
-            pp7_requantize = pp7_hard_threshold;
-            break;
-        case 1:
-            pp7_requantize = pp7_soft_threshold;
-            break;
-        case 2:
-            pp7_requantize = pp7_medium_threshold;
-            break;
+        hb_error( "deblock could not initialize taskset" );
+        goto fail;
     }
 
-    int h = (init->geometry.height + 16 + 15) & (~15);
+    int ii;
+    for( ii = 0; ii < pv->cpu_count; ii++ )
+    {
+        pp7_thread_arg_t * thread_args;
 
-    pv->pp7_temp_stride = (init->geometry.width + 16 + 15) & (~15);
+        thread_args = taskset_thread_args( &pv->pp7_taskset, ii );
+        thread_args->pv = pv;
+        thread_args->segment = ii;
 
-    pv->pp7_src = (uint8_t*)malloc( pv->pp7_temp_stride*(h+8)*sizeof(uint8_t) );
+        if( taskset_thread_spawn( &pv->pp7_taskset, ii,
+                                  "deblock_filter_segment",
+                                  pp7_filter_thread,
+                                  HB_NORMAL_PRIORITY ) == 0 )
+        {
+            hb_error( "deblock could not spawn thread" );
+            goto fail;
+        }
+    }
 
     return 0;
+
+fail:
+    taskset_fini( &pv->pp7_taskset );
+    free( pv->pp7_arguments );
+    free( pv );
+    filter->private_data = NULL;
+    return -1;
 }
 
 static void hb_deblock_close( hb_filter_object_t * filter )
@@ -391,6 +556,19 @@ static void hb_deblock_close( hb_filter_object_t * filter )
         return;
     }
 
+    taskset_fini( &pv->pp7_taskset );
+
+    int ii;
+    for( ii = 0; ii < pv->cpu_count; ii++ )
+    {
+        free( pv->pp7_arguments[ii].temp );
+        free( pv->pp7_arguments[ii].qp );
+    }
+    free( pv->pp7_arguments );
+    free( pv->pp7_src[0] );
+    free( pv->pp7_src[1] );
+    free( pv->pp7_src[2] );
+
     free( pv );
     filter->private_data = NULL;
 }
@@ -413,32 +591,38 @@ static int hb_deblock_work( hb_filter_object_t * filter,
     {
         out = hb_video_buffer_init( in->f.width, in->f.height );
 
-        pp7_filter( pv,
-                out->plane[0].data,
-                in->plane[0].data,
-                in->plane[0].stride,
-                in->plane[0].height,
-                NULL, /* TODO: mpi->qscale*/
-                0,    /* TODO: mpi->qstride*/
-                1 );
-
-        pp7_filter( pv,
-                out->plane[1].data,
-                in->plane[1].data,
-                in->plane[1].stride,
-                in->plane[1].height,
-                NULL, /* TODO: mpi->qscale*/
-                0,    /* TODO: mpi->qstride*/
-                0 );
-
-        pp7_filter( pv,
-                out->plane[2].data,
-                in->plane[2].data,
-                in->plane[2].stride,
-                in->plane[2].height,
-                NULL, /* TODO: mpi->qscale*/
-                0,    /* TODO: mpi->qstride*/
-                0 );
+        if( in->plane[0].stride > pv->pp7_width ||
+            in->plane[0].height > pv->pp7_height )
+        {
+            if( pp7_alloc( pv, in->plane[0].stride, in->plane[0].height ) < 0 )
+            {
+                hb_error( "deblock could not allocate buffers" );
+                hb_buffer_close( &out );
+                return HB_FILTER_FAILED;
+            }
+        }
+
+        int c;
+        for( c = 0; c < 3; c++ )
+        {
+            pp7_plane_t * plane = &pv->pp7_plane[c];
+
+            plane->dst       = out->plane[c].data;
+            plane->src       = pv->pp7_src[c];
+            plane->width     = in->plane[c].stride;
+            plane->height    = in->plane[c].height;
+            plane->stride    = (plane->width + 16 + 15) & (~15);
+            plane->qp_store  = NULL; /* TODO: mpi->qscale*/
+            plane->qp_stride = 0;    /* TODO: mpi->qstride*/
+            plane->is_luma   = c == 0;
+
+            pp7_pad( plane, in->plane[c].data );
+        }
+
+        /*
+         * Run one task per segment on the shared pool.
+         */
+        taskset_cycle( &pv->pp7_taskset );
 
         out->s = in->s;
 
@@ -0,0 +1,42 @@
+/* deblock.h
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+typedef short DCTELEM;
+
+#define PP7_MODE_HARD   0
+#define PP7_MODE_SOFT   1
+#define PP7_MODE_MEDIUM 2
+
+typedef struct
+{
+    // Filters one row of 'width' pixels into 'dst'.  'src' points to the
+    // first pixel of the row 3 lines above the one filtered, in a plane
+    // padded by 8 pixels on each side.  'qp' holds the quantizer of each
+    // run of 8 pixels, 'threshold' the thresholds of each quantizer and
+    // 'dither' the dither of the row.  'temp' is scratch memory of
+    // 4 * (width + 64) elements.
+    void (*filter_row)( uint8_t        * dst,
+                        const uint8_t  * src,
+                        int              stride,
+                        int              width,
+                        const int      * qp,
+                        const int     (* threshold)[16],
+                        const int      * factor,
+                        int              mode,
+                        const uint8_t  * dither,
+                        DCTELEM        * temp );
+} pp7_functions_t;
+
+// The factors of the requantizers and the thresholds of each quantizer
+// that filter_row is passed, pp7_init_c() sets up the thresholds
+extern const int pp7_factor[16];
+extern int       pp7_threshold[99][16];
+
+void pp7_init_c( pp7_functions_t * functions );
+void pp7_init_x86( pp7_functions_t * functions );
@@ -0,0 +1,326 @@
+/* deblock_x86.c
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "hb.h"     // needed for ARCH_X86
+
+#if defined(ARCH_X86)
+
+#include "libavutil/cpu.h"
+#include "deblock.h"
+
+// The kernels are compiled for their instruction set with function
+// attributes and only run on CPUs that have it.
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define PP7_HAVE_SIMD 1
+#include <immintrin.h>
+#define PP7_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#if defined(PP7_HAVE_SIMD)
+
+/*
+ * The kernels work on 8 pixels at a time.  The vertical transform of
+ * each column (pp7_dct_a) is computed once per row into 4 planes of
+ * 'temp', one per vertical frequency, so that the horizontal transform
+ * (pp7_dct_b) of 8 neighbouring pixels reads 7 unaligned vectors of each
+ * plane.  All transform values fit in 16 bits, the requantization is done
+ * in 32 bits.  The results are the same as those of the scalar code.
+ */
+
+#define PP7_TEMP_PLANE(temp, width, i) ((temp) + (i) * ((width) + 64))
+
+// One step of the 7 point transform, shared by both directions
+#define PP7_DCT(add, sub, p0, p1, p2, p3, p4, p5, p6, d0, d1, d2, d3) \
+    do {                                                                \
+        __typeof__(p0) s0 = add(p0, p6);                                \
+        __typeof__(p0) s1 = add(p1, p5);                                \
+        __typeof__(p0) s2 = add(p2, p4);                                \
+        __typeof__(p0) s  = add(p3, p3);                                \
+        __typeof__(p0) s3 = sub(s, s0);                                 \
+        s0 = add(s, s0);                                                \
+        s  = add(s2, s1);                                               \
+        s2 = sub(s2, s1);                                               \
+        d0 = add(s0, s);                                                \
+        d2 = sub(s0, s);                                                \
+        d1 = add(add(s3, s3), s2);                                      \
+        d3 = sub(s3, add(s2, s2));                                      \
+    } while (0)
+
+PP7_TARGET("sse4.1")
+static inline __m128i requantize_sse4( __m128i level, __m128i a,
+                                       int threshold1, int factor, int mode )
+{
+    const __m128i t1   = _mm_set1_epi32(threshold1);
+    const __m128i t2   = _mm_set1_epi32(threshold1 << 1);
+    const __m128i f    = _mm_set1_epi32(factor);
+    __m128i       sum, keep, pos, v;
+
+    // (unsigned)(level + threshold1) > threshold2
+    sum  = _mm_add_epi32(level, t1);
+    keep = _mm_xor_si128(_mm_cmpeq_epi32(_mm_max_epu32(sum, t2), t2),
+                         _mm_set1_epi32(-1));
+
+    v = level;
+    if (mode != PP7_MODE_HARD)
+    {
+        // level - threshold1 for positive levels, level + threshold1 else
+        pos = _mm_cmpgt_epi32(level, _mm_setzero_si128());
+        v   = _mm_add_epi32(level, _mm_sub_epi32(_mm_xor_si128(t1, pos), pos));
+        if (mode == PP7_MODE_MEDIUM)
+        {
+            // Levels past twice the threshold are kept as they are
+            __m128i big;
+            sum = _mm_add_epi32(level, _mm_add_epi32(t1, t1));
+            big = _mm_xor_si128(_mm_cmpeq_epi32(_mm_max_epu32(sum,
+                                                _mm_add_epi32(t2, t2)),
+                                                _mm_add_epi32(t2, t2)),
+                                _mm_set1_epi32(-1));
+            v   = _mm_blendv_epi8(_mm_add_epi32(v, v), level, big);
+        }
+    }
+    v = _mm_and_si128(_mm_mullo_epi32(v, f), keep);
+    return _mm_add_epi32(a, v);
+}
+
+PP7_TARGET("sse4.1")
+static void filter_row_sse4( uint8_t        * dst,
+                             const uint8_t  * src,
+                             int              stride,
+                             int              width,
+                             const int      * qp,
+                             const int     (* threshold)[16],
+                             const int      * factor,
+                             int              mode,
+                             const uint8_t  * dither,
+                             DCTELEM        * temp )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const int     end  = (width + 7) & ~7;
+    int           c, x, i, j;
+
+    // Vertical transform of columns -3 .. end+2
+    for (c = -3; c < end + 3; c += 8)
+    {
+        const uint8_t *s = src + c;
+        __m128i p[7], d0, d1, d2, d3;
+
+        for (i = 0; i < 7; i++)
+        {
+            p[i] = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(s + i*stride)), zero);
+        }
+        PP7_DCT(_mm_add_epi16, _mm_sub_epi16,
+                p[0], p[1], p[2], p[3], p[4], p[5], p[6], d0, d1, d2, d3);
+        _mm_storeu_si128((__m128i*)(PP7_TEMP_PLANE(temp, width, 0) + c + 3), d0);
+        _mm_storeu_si128((__m128i*)(PP7_TEMP_PLANE(temp, width, 1) + c + 3), d1);
+        _mm_storeu_si128((__m128i*)(PP7_TEMP_PLANE(temp, width, 2) + c + 3), d2);
+        _mm_storeu_si128((__m128i*)(PP7_TEMP_PLANE(temp, width, 3) + c + 3), d3);
+    }
+
+    const __m128i dither_lo = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(*(const int*)dither));
+    const __m128i dither_hi = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(*(const int*)(dither + 4)));
+
+    for (x = 0; x < width; x += 8)
+    {
+        const int *t = threshold[qp[x >> 3]];
+        __m128i    a_lo = zero, a_hi = zero;
+        __m128i    block[16];
+
+        // Horizontal transform, coefficient 4*h+i is frequency h, i
+        for (i = 0; i < 4; i++)
+        {
+            const DCTELEM *p = PP7_TEMP_PLANE(temp, width, i) + x;
+            __m128i w[7];
+
+            for (j = 0; j < 7; j++)
+            {
+                w[j] = _mm_loadu_si128((const __m128i*)(p + j));
+            }
+            PP7_DCT(_mm_add_epi16, _mm_sub_epi16,
+                    w[0], w[1], w[2], w[3], w[4], w[5], w[6],
+                    block[i], block[4 + i], block[8 + i], block[12 + i]);
+        }
+
+        a_lo = _mm_mullo_epi32(_mm_cvtepi16_epi32(block[0]), _mm_set1_epi32(factor[0]));
+        a_hi = _mm_mullo_epi32(_mm_cvtepi16_epi32(_mm_unpackhi_epi64(block[0], block[0])),
+                               _mm_set1_epi32(factor[0]));
+        for (j = 1; j < 16; j++)
+        {
+            a_lo = requantize_sse4(_mm_cvtepi16_epi32(block[j]), a_lo,
+                                   t[j], factor[j], mode);
+            a_hi = requantize_sse4(_mm_cvtepi16_epi32(_mm_unpackhi_epi64(block[j], block[j])),
+                                   a_hi, t[j], factor[j], mode);
+        }
+
+        // v = (((a + (1<<11)) >> 12) + dither) >> 6, clipped to 0..255
+        a_lo = _mm_srai_epi32(_mm_add_epi32(a_lo, _mm_set1_epi32(1 << 11)), 12);
+        a_hi = _mm_srai_epi32(_mm_add_epi32(a_hi, _mm_set1_epi32(1 << 11)), 12);
+        a_lo = _mm_srai_epi32(_mm_add_epi32(a_lo, dither_lo), 6);
+        a_hi = _mm_srai_epi32(_mm_add_epi32(a_hi, dither_hi), 6);
+        a_lo = _mm_packus_epi32(a_lo, a_hi);
+        a_lo = _mm_packus_epi16(a_lo, a_lo);
+
+        if (x + 8 <= width)
+        {
+            _mm_storel_epi64((__m128i*)(dst + x), a_lo);
+        }
+        else
+        {
+            uint8_t tail[8];
+            _mm_storel_epi64((__m128i*)tail, a_lo);
+            memcpy(dst + x, tail, width - x);
+        }
+    }
+}
+
+PP7_TARGET("avx2")
+static inline __m256i requantize_avx2( __m256i level, __m256i a,
+                                       int threshold1, int factor, int mode )
+{
+    const __m256i t1   = _mm256_set1_epi32(threshold1);
+    const __m256i t2   = _mm256_set1_epi32(threshold1 << 1);
+    const __m256i f    = _mm256_set1_epi32(factor);
+    __m256i       sum, keep, pos, v;
+
+    // (unsigned)(level + threshold1) > threshold2
+    sum  = _mm256_add_epi32(level, t1);
+    keep = _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(sum, t2), t2),
+                            _mm256_set1_epi32(-1));
+
+    v = level;
+    if (mode != PP7_MODE_HARD)
+    {
+        // level - threshold1 for positive levels, level + threshold1 else
+        pos = _mm256_cmpgt_epi32(level, _mm256_setzero_si256());
+        v   = _mm256_add_epi32(level, _mm256_sub_epi32(_mm256_xor_si256(t1, pos), pos));
+        if (mode == PP7_MODE_MEDIUM)
+        {
+            // Levels past twice the threshold are kept as they are
+            const __m256i t4 = _mm256_add_epi32(t2, t2);
+            __m256i big;
+            sum = _mm256_add_epi32(level, _mm256_add_epi32(t1, t1));
+            big = _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(sum, t4), t4),
+                                   _mm256_set1_epi32(-1));
+            v   = _mm256_blendv_epi8(_mm256_add_epi32(v, v), level, big);
+        }
+    }
+    v = _mm256_and_si256(_mm256_mullo_epi32(v, f), keep);
+    return _mm256_add_epi32(a, v);
+}
+
+PP7_TARGET("avx2")
+static void filter_row_avx2( uint8_t        * dst,
+                             const uint8_t  * src,
+                             int              stride,
+                             int              width,
+                             const int      * qp,
+                             const int     (* threshold)[16],
+                             const int      * factor,
+                             int              mode,
+                             const uint8_t  * dither,
+                             DCTELEM        * temp )
+{
+    const int end = (width + 7) & ~7;
+    int       c, x, i, j;
+
+    // Vertical transform of columns -3 .. end+2, 16 at a time
+    for (c = -3; c < end + 3; c += 16)
+    {
+        const uint8_t *s = src + c;
+        __m256i p[7], d0, d1, d2, d3;
+
+        for (i = 0; i < 7; i++)
+        {
+            p[i] = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + i*stride)));
+        }
+        PP7_DCT(_mm256_add_epi16, _mm256_sub_epi16,
+                p[0], p[1], p[2], p[3], p[4], p[5], p[6], d0, d1, d2, d3);
+        _mm256_storeu_si256((__m256i*)(PP7_TEMP_PLANE(temp, width, 0) + c + 3), d0);
+        _mm256_storeu_si256((__m256i*)(PP7_TEMP_PLANE(temp, width, 1) + c + 3), d1);
+        _mm256_storeu_si256((__m256i*)(PP7_TEMP_PLANE(temp, width, 2) + c + 3), d2);
+        _mm256_storeu_si256((__m256i*)(PP7_TEMP_PLANE(temp, width, 3) + c + 3), d3);
+    }
+
+    const __m256i dith = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)dither));
+
+    for (x = 0; x < width; x += 8)
+    {
+        const int *t = threshold[qp[x >> 3]];
+        __m128i    block[16];
+        __m256i    a;
+        __m128i    v;
+
+        // Horizontal transform, coefficient 4*h+i is frequency h, i
+        for (i = 0; i < 4; i++)
+        {
+            const DCTELEM *p = PP7_TEMP_PLANE(temp, width, i) + x;
+            __m128i w[7];
+
+            for (j = 0; j < 7; j++)
+            {
+                w[j] = _mm_loadu_si128((const __m128i*)(p + j));
+            }
+            PP7_DCT(_mm_add_epi16, _mm_sub_epi16,
+                    w[0], w[1], w[2], w[3], w[4], w[5], w[6],
+                    block[i], block[4 + i], block[8 + i], block[12 + i]);
+        }
+
+        a = _mm256_mullo_epi32(_mm256_cvtepi16_epi32(block[0]),
+                               _mm256_set1_epi32(factor[0]));
+        for (j = 1; j < 16; j++)
+        {
+            a = requantize_avx2(_mm256_cvtepi16_epi32(block[j]), a,
+                                t[j], factor[j], mode);
+        }
+
+        // v = (((a + (1<<11)) >> 12) + dither) >> 6, clipped to 0..255
+        a = _mm256_srai_epi32(_mm256_add_epi32(a, _mm256_set1_epi32(1 << 11)), 12);
+        a = _mm256_srai_epi32(_mm256_add_epi32(a, dith), 6);
+        v = _mm_packus_epi32(_mm256_castsi256_si128(a),
+                             _mm256_extracti128_si256(a, 1));
+        v = _mm_packus_epi16(v, v);
+
+        if (x + 8 <= width)
+        {
+            _mm_storel_epi64((__m128i*)(dst + x), v);
+        }
+        else
+        {
+            uint8_t tail[8];
+            _mm_storel_epi64((__m128i*)tail, v);
+            memcpy(dst + x, tail, width - x);
+        }
+    }
+}
+
+#endif // PP7_HAVE_SIMD
+
+void pp7_init_x86( pp7_functions_t * functions )
+{
+#if defined(PP7_HAVE_SIMD)
+    const int   flags = av_get_cpu_flags();
+    const char *isa   = NULL;
+
+    if (flags & AV_CPU_FLAG_SSE4)
+    {
+        functions->filter_row = filter_row_sse4;
+        isa = "SSE4.1";
+    }
+    if (flags & AV_CPU_FLAG_AVX2)
+    {
+        functions->filter_row = filter_row_avx2;
+        isa = "AVX2";
+    }
+    if (isa != NULL)
+    {
+        hb_log("pp7 using %s optimizations", isa);
+    }
+#endif
+}
+
+#endif // ARCH_X86
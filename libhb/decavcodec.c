@@ -1287,6 +1287,38 @@ fail:
     return 1;
 }
 
+/*
+ * Whether the vfr filter would drop the source frame starting at
+ * 'start' when it reduces the frame rate, see job_setup_frame_skip()
+ * in work.c.  Kept are the frames with an output frame interval
+ * starting within half a source frame of their start.
+ */
+static int frame_skipped( hb_work_private_t * pv, int64_t start )
+{
+    hb_job_t * job = pv->job;
+    double     half;
+
+    if (job == NULL || job->skip_out_duration <= 0 ||
+        start == AV_NOPTS_VALUE)
+    {
+        return 0;
+    }
+    half = job->skip_in_duration / 2;
+    return floor((start + half) / job->skip_out_duration) ==
+           floor((start - half) / job->skip_out_duration);
+}
+
+static void output_frame( hb_work_private_t * pv, hb_buffer_t * buf )
+{
+    // Frames carrying a chapter mark are kept, vfr moves the drop
+    if (buf->s.new_chap == 0 && frame_skipped(pv, buf->s.start))
+    {
+        hb_buffer_close(&buf);
+        return;
+    }
+    hb_buffer_list_append(&pv->list, buf);
+}
+
 static void filter_video(hb_work_private_t *pv)
 {
     reinit_video_filters(pv);
@@ -1299,7 +1331,7 @@ static void filter_video(hb_work_private_t *pv)
         while (result >= 0)
         {
             hb_buffer_t * buf = copy_frame(pv);
-            hb_buffer_list_append(&pv->list, buf);
+            output_frame(pv, buf);
             av_frame_unref(pv->frame);
             ++pv->nframes;
 
@@ -1310,7 +1342,7 @@ static void filter_video(hb_work_private_t *pv)
     else
     {
         hb_buffer_t * buf = copy_frame(pv);
-        hb_buffer_list_append(&pv->list, buf);
+        output_frame(pv, buf);
         av_frame_unref(pv->frame);
         ++pv->nframes;
     }
@@ -1377,6 +1409,22 @@ static int decodeFrame( hb_work_object_t *w, packet_info_t * packet_info )
         hb_buffer_close(&pv->palette);
     }
 
+    // A frame the vfr filter would drop need not be decoded at all,
+    // unless other frames reference it.  Set per packet, frame threads
+    // take the setting along with the packet.
+    if (pv->job != NULL && pv->job->skip_out_duration > 0)
+    {
+        if (packet_info != NULL && packet_info->new_chap == 0 &&
+            frame_skipped(pv, packet_info->pts))
+        {
+            pv->context->skip_frame = AVDISCARD_NONREF;
+        }
+        else
+        {
+            pv->context->skip_frame = AVDISCARD_DEFAULT;
+        }
+    }
+
     ret = avcodec_send_packet(pv->context, &avp);
     av_packet_unref(&avp);
     if (ret < 0 && ret != AVERROR_EOF)
@@ -1588,7 +1636,8 @@ static int decavcodecvInit( hb_work_object_t * w, hb_job_t * job )
 
     if( pv->job && pv->job->title && !pv->job->title->has_resolution_change )
     {
-        pv->threads = HB_FFMPEG_THREADS_AUTO;
+        pv->threads = pv->job->threads_decode > 0 ?
+                      pv->job->threads_decode : HB_FFMPEG_THREADS_AUTO;
     }
 
     AVCodec *codec = NULL;
@@ -1619,6 +1668,12 @@ static int decavcodecvInit( hb_work_object_t * w, hb_job_t * job )
         pv->context->workaround_bugs = FF_BUG_AUTODETECT;
         pv->context->err_recognition = AV_EF_CRCCHECK;
         pv->context->error_concealment = FF_EC_GUESS_MVS|FF_EC_DEBLOCK;
+        if (!pv->qsv.decode)
+        {
+            // decode straight into hb_buffer frames so that decoded
+            // pictures can be passed downstream without a copy
+            pv->context->get_buffer2 = hb_avcodec_get_buffer2;
+        }
 
 #ifdef USE_QSV
         if (pv->qsv.decode &&
@@ -1797,6 +1852,11 @@ static int decavcodecvWork( hb_work_object_t * w, hb_buffer_t ** buf_in,
             return HB_WORK_OK;
         }
 
+        if (!pv->qsv.decode)
+        {
+            pv->context->get_buffer2 = hb_avcodec_get_buffer2;
+        }
+
 #ifdef USE_QSV
         if (pv->qsv.decode &&
             pv->qsv.config.io_pattern == MFX_IOPATTERN_OUT_OPAQUE_MEMORY)
@@ -175,7 +175,7 @@ static int decsubWork( hb_work_object_t * w, hb_buffer_t ** buf_in,
         return HB_WORK_DONE;
     }
 
-    if ( !pv->job->indepth_scan &&
+    if ( !pv->job->indepth_scan && !w->subtitle->search &&
          w->subtitle->config.dest == PASSTHRUSUB &&
          hb_subtitle_can_pass( PGSSUB, pv->job->mux ) )
     {
@@ -228,7 +228,8 @@ static int decsubWork( hb_work_object_t * w, hb_buffer_t ** buf_in,
 
         /* Subtitles are "usable" if:
          *   1. Libav returned a subtitle (has_subtitle) AND
-         *   2. we're not doing Foreign Audio Search (!pv->job->indepth_scan) AND
+         *   2. we're not doing Foreign Audio Search (!pv->job->indepth_scan,
+         *      !w->subtitle->search) AND
          *   3. the sub is non-empty or we've seen one such sub before (!pv->discard_subtitle)
          * For forced-only extraction, usable subtitles also need to:
          *   a. be forced (subtitle.rects[0]->flags & AV_SUBTITLE_FLAG_FORCED) OR
@@ -254,7 +255,7 @@ static int decsubWork( hb_work_object_t * w, hb_buffer_t ** buf_in,
                 clear_subtitle = 1;
             }
             // are we doing Foreign Audio Search?
-            if (!pv->job->indepth_scan)
+            if (!pv->job->indepth_scan && !w->subtitle->search)
             {
                 // do we want to discard this subtitle?
                 pv->discard_subtitle = pv->discard_subtitle && clear_subtitle;
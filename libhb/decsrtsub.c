@@ -697,6 +697,14 @@ fail:
     return 1;
 }
 
+static int reader_pts_offset_ready( void * opaque )
+{
+    hb_job_t * job = opaque;
+
+    return job->reader_pts_offset != AV_NOPTS_VALUE ||
+           job->done || *job->die;
+}
+
 static int decsrtWork( hb_work_object_t * w, hb_buffer_t ** buf_in,
                        hb_buffer_t ** buf_out )
 {
@@ -707,8 +715,12 @@ static int decsrtWork( hb_work_object_t * w, hb_buffer_t ** buf_in,
     {
         // We need to wait for reader to initialize it's pts offset so that
         // we know where to start reading SRTs.
-        *buf_out = NULL;
-        return HB_WORK_OK;
+        hb_work_wait(pv->job->h, reader_pts_offset_ready, pv->job);
+        if (pv->job->reader_pts_offset == AV_NOPTS_VALUE)
+        {
+            *buf_out = NULL;
+            return HB_WORK_OK;
+        }
     }
     if (pv->start_time == AV_NOPTS_VALUE)
     {
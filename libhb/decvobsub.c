@@ -638,7 +638,8 @@ static hb_buffer_t * Decode( hb_work_object_t * w )
         return NULL;
     }
 
-    if( job->indepth_scan || ( w->subtitle->config.force && pv->pts_forced == 0 ) )
+    if( job->indepth_scan || w->subtitle->search ||
+        ( w->subtitle->config.force && pv->pts_forced == 0 ) )
     {
         /*
          * Don't encode subtitles when doing a scan.
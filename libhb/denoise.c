@@ -19,16 +19,47 @@
 
 #include "hb.h"
 #include "hbffmpeg.h"
+#include "taskset.h"
+#include "denoise.h"
 
 #define HQDN3D_SPATIAL_LUMA_DEFAULT    4.0f
 #define HQDN3D_SPATIAL_CHROMA_DEFAULT  3.0f
 #define HQDN3D_TEMPORAL_LUMA_DEFAULT   6.0f
 
+/*
+ * The planes are split into bands of at least HQDN3D_BAND_MIN_HEIGHT rows
+ * that are denoised independently.  The bands depend only on the height,
+ * not on the number of threads, so the output does not depend on the
+ * machine.  The vertical spatial filter of a band starts
+ * HQDN3D_BAND_OVERLAP rows above it, so that it has settled where the
+ * band starts.
+ */
+#define HQDN3D_BAND_MIN_HEIGHT         64
+#define HQDN3D_BAND_OVERLAP            16
+
+typedef struct hqdn3d_arguments_s {
+    hb_buffer_t    * src;
+    hb_buffer_t    * dst;
+    unsigned short * line;      // line state of the current band
+    unsigned int   * pixel;     // horizontal pass of the current row
+} hqdn3d_arguments_t;
+
+typedef struct hqdn3d_thread_arg_s {
+    hb_filter_private_t * pv;
+    int                   segment;
+} hqdn3d_thread_arg_t;
+
 struct hb_filter_private_s
 {
-    short            hqdn3d_coef[6][512*16];
-    unsigned short * hqdn3d_line;
+    short            hqdn3d_coef[6][HQDN3D_COEF_SIZE];
     unsigned short * hqdn3d_frame[3];
+
+    hqdn3d_functions_t functions;
+
+    int                  cpu_count;
+    int                  line_size;
+    taskset_t            hqdn3d_taskset;   // Tasks - one per CPU
+    hqdn3d_arguments_t * hqdn3d_arguments; // Arguments to thread for work
 };
 
 static int hb_denoise_init( hb_filter_object_t * filter,
@@ -58,8 +89,8 @@ hb_filter_object_t hb_filter_denoise =
     .settings_template = denoise_template,
 };
 
-static void hqdn3d_precalc_coef( short * ct,
-                                 double dist25 )
+void hqdn3d_precalc_coef( short * ct,
+                          double dist25 )
 {
     int i;
     double gamma, simil, c;
@@ -80,32 +111,74 @@ static void hqdn3d_precalc_coef( short * ct,
 
 static inline unsigned int hqdn3d_lowpass_mul( int prev_mul,
                                                int curr_mul,
-                                               short * coef )
+                                               const short * coef )
 {
     int d = (prev_mul - curr_mul)>>4;
     return curr_mul + coef[d];
 }
 
-static void hqdn3d_denoise_temporal( unsigned char * frame_src,
+static void hqdn3d_temporal_row( const unsigned char  * frame_src,
+                                 unsigned char        * frame_dst,
+                                 unsigned short       * frame_ant,
+                                 int                    w,
+                                 const short          * temporal )
+{
+    int x;
+    unsigned int tmp;
+
+    for( x = 0; x < w; x++ )
+    {
+        frame_ant[x] = tmp = hqdn3d_lowpass_mul( frame_ant[x],
+                                                 frame_src[x]<<8,
+                                                 temporal );
+        frame_dst[x] = (tmp+0x7F)>>8;
+    }
+}
+
+static void hqdn3d_spatial_row( const unsigned int    * pixel_ant,
+                                unsigned char         * frame_dst,
+                                unsigned short        * line_ant,
+                                unsigned short        * frame_ant,
+                                int                     w,
+                                const short           * spatial,
+                                const short           * temporal )
+{
+    int x;
+    unsigned int tmp;
+
+    for( x = 0; x < w; x++ )
+    {
+        line_ant[x] = tmp =  hqdn3d_lowpass_mul( line_ant[x],
+                                                 pixel_ant[x],
+                                                 spatial );
+        frame_ant[x] = tmp = hqdn3d_lowpass_mul( frame_ant[x],
+                                                 tmp,
+                                                 temporal );
+        frame_dst[x] = (tmp+0x7F)>>8;
+    }
+}
+
+void hqdn3d_init_c( hqdn3d_functions_t * functions )
+{
+    functions->temporal_row = hqdn3d_temporal_row;
+    functions->spatial_row  = hqdn3d_spatial_row;
+}
+
+static void hqdn3d_denoise_temporal( hqdn3d_functions_t * functions,
+                                     unsigned char * frame_src,
                                      unsigned char * frame_dst,
                                      unsigned short * frame_ant,
                                      int w, int h,
                                      short * temporal)
 {
-    int x, y;
-    unsigned int tmp;
+    int y;
 
     temporal += 0x1000;
 
     for( y = 0; y < h; y++ )
     {
-        for( x = 0; x < w; x++ )
-        {
-            frame_ant[x] = tmp = hqdn3d_lowpass_mul( frame_ant[x],
-                                                     frame_src[x]<<8,
-                                                     temporal );
-            frame_dst[x] = (tmp+0x7F)>>8;
-        }
+        functions->temporal_row( frame_src, frame_dst, frame_ant,
+                                 w, temporal );
 
         frame_src += w;
         frame_dst += w;
@@ -113,11 +186,67 @@ static void hqdn3d_denoise_temporal( unsigned char * frame_src,
     }
 }
 
-static void hqdn3d_denoise_spatial( unsigned char * frame_src,
+// Horizontal spatial pass of one row
+static void hqdn3d_spatial_horizontal( const unsigned char * frame_src,
+                                       unsigned int * pixel_ant_row,
+                                       int w,
+                                       const short * spatial )
+{
+    int x;
+    unsigned int pixel_ant;
+
+    pixel_ant = frame_src[0]<<8;
+    for ( x = 0; x < w-1; x++ )
+    {
+        pixel_ant_row[x] = pixel_ant;
+        pixel_ant =        hqdn3d_lowpass_mul( pixel_ant,
+                                               frame_src[x+1]<<8,
+                                               spatial );
+    }
+    pixel_ant_row[x] = pixel_ant;
+}
+
+/*
+ * Runs the vertical spatial filter over the 'h' rows at 'frame_src'
+ * without output, to set up the line state for the row that follows.
+ */
+static void hqdn3d_spatial_warmup( const unsigned char * frame_src,
+                                   unsigned short * line_ant,
+                                   unsigned int * pixel_ant_row,
+                                   int w, int h,
+                                   const short * spatial )
+{
+    int x, y;
+
+    hqdn3d_spatial_horizontal( frame_src, pixel_ant_row, w, spatial );
+    for ( x = 0; x < w; x++ )
+    {
+        line_ant[x] = pixel_ant_row[x];
+    }
+    for ( y = 1; y < h; y++ )
+    {
+        frame_src += w;
+        hqdn3d_spatial_horizontal( frame_src, pixel_ant_row, w, spatial );
+        for ( x = 0; x < w; x++ )
+        {
+            line_ant[x] = hqdn3d_lowpass_mul( line_ant[x],
+                                              pixel_ant_row[x],
+                                              spatial );
+        }
+    }
+}
+
+/*
+ * 'warmup' rows above 'frame_src' are read to set up the line state,
+ * with none the first row has no top neighbor.
+ */
+static void hqdn3d_denoise_spatial( hqdn3d_functions_t * functions,
+                                    unsigned char * frame_src,
                                     unsigned char * frame_dst,
                                     unsigned short * line_ant,
+                                    unsigned int * pixel_ant_row,
                                     unsigned short * frame_ant,
-                                    int w, int h,
+                                    int w, int h, int warmup,
                                     short * spatial,
                                     short * temporal )
 {
@@ -128,89 +257,79 @@ static void hqdn3d_denoise_spatial( unsigned char * frame_src,
     spatial  += 0x1000;
     temporal += 0x1000;
 
-    /* First line has no top neighbor. Only left one for each tmp and last frame */
-    pixel_ant = frame_src[0]<<8;
-    for ( x = 0; x < w; x++)
+    if( warmup > 0 )
     {
-        line_ant[x] = tmp = pixel_ant = hqdn3d_lowpass_mul( pixel_ant,
-                                                            frame_src[x]<<8,
-                                                            spatial );
-        frame_ant[x] = tmp = hqdn3d_lowpass_mul( frame_ant[x],
-                                                 tmp,
-                                                 temporal );
-        frame_dst[x] = (tmp+0x7F)>>8;
+        hqdn3d_spatial_warmup( frame_src - warmup * w, line_ant,
+                               pixel_ant_row, w, warmup, spatial );
+        y = 0;
     }
-
-    for( y = 1; y < h; y++ )
+    else
     {
-        frame_src += w;
-        frame_dst += w;
-        frame_ant += w;
+        /* First line has no top neighbor. Only left one for each tmp and last frame */
         pixel_ant = frame_src[0]<<8;
-        for ( x = 0; x < w-1; x++ )
+        for ( x = 0; x < w; x++)
         {
-            line_ant[x] = tmp =  hqdn3d_lowpass_mul( line_ant[x],
-                                                     pixel_ant,
-                                                     spatial );
-            pixel_ant =          hqdn3d_lowpass_mul( pixel_ant,
-                                                     frame_src[x+1]<<8,
-                                                     spatial );
+            line_ant[x] = tmp = pixel_ant = hqdn3d_lowpass_mul( pixel_ant,
+                                                                frame_src[x]<<8,
+                                                                spatial );
             frame_ant[x] = tmp = hqdn3d_lowpass_mul( frame_ant[x],
                                                      tmp,
                                                      temporal );
             frame_dst[x] = (tmp+0x7F)>>8;
         }
-        line_ant[x] = tmp =  hqdn3d_lowpass_mul( line_ant[x],
-                                                 pixel_ant,
-                                                 spatial );
-        frame_ant[x] = tmp = hqdn3d_lowpass_mul( frame_ant[x],
-                                                 tmp,
-                                                 temporal );
-        frame_dst[x] = (tmp+0x7F)>>8;
+        frame_src += w;
+        frame_dst += w;
+        frame_ant += w;
+        y = 1;
+    }
+
+    for( ; y < h; y++ )
+    {
+        /* The horizontal pass is serial, the rest of the row is not */
+        hqdn3d_spatial_horizontal( frame_src, pixel_ant_row, w, spatial );
+        functions->spatial_row( pixel_ant_row, frame_dst, line_ant, frame_ant,
+                                w, spatial, temporal );
+
+        frame_src += w;
+        frame_dst += w;
+        frame_ant += w;
     }
 }
 
-static void hqdn3d_denoise( unsigned char * frame_src,
+static void hqdn3d_denoise( hqdn3d_functions_t * functions,
+                            unsigned char * frame_src,
                             unsigned char * frame_dst,
                             unsigned short * line_ant,
-                            unsigned short ** frame_ant_ptr,
+                            unsigned int * pixel_ant_row,
+                            unsigned short * frame_ant,
                             int w,
                             int h,
+                            int warmup,
                             short * spatial,
                             short * temporal )
 {
-    int x, y;
-    unsigned short* frame_ant = (*frame_ant_ptr);
-
-    if( !frame_ant)
+    if( h <= 0 )
     {
-        unsigned char * src = frame_src;
-        (*frame_ant_ptr) = frame_ant = malloc( w*h*sizeof(unsigned short) );
-        for ( y = 0; y < h; y++, frame_src += w, frame_ant += w )
-        {
-            for( x = 0; x < w; x++ )
-            {
-                frame_ant[x] = frame_src[x]<<8;
-            }
-        }
-        frame_src = src;
-        frame_ant = *frame_ant_ptr;
+        return;
     }
 
     /* If no spatial coefficients, do temporal denoise only */
     if( spatial[0] )
     {
-        hqdn3d_denoise_spatial( frame_src,
+        hqdn3d_denoise_spatial( functions,
+                                frame_src,
                                 frame_dst,
                                 line_ant,
+                                pixel_ant_row,
                                 frame_ant,
-                                w, h,
+                                w, h, warmup,
                                 spatial,
                                 temporal );
     }
     else
     {
-        hqdn3d_denoise_temporal( frame_src,
+        hqdn3d_denoise_temporal( functions,
+                                 frame_src,
                                  frame_dst,
                                  frame_ant,
                                  w, h,
@@ -218,6 +337,46 @@ static void hqdn3d_denoise( unsigned char * frame_src,
     }
 }
 
+/*
+ * Denoise the bands of all three planes that fall to this segment,
+ * every cpu_count-th band starting at the segment's own.
+ */
+static void hqdn3d_filter_thread( void * thread_args_v )
+{
+    hqdn3d_thread_arg_t  * thread_args = thread_args_v;
+    hb_filter_private_t  * pv = thread_args->pv;
+    int                    segment = thread_args->segment;
+    hqdn3d_arguments_t   * args = &pv->hqdn3d_arguments[segment];
+    hb_buffer_t          * src = args->src;
+    hb_buffer_t          * dst = args->dst;
+    int                    c, band;
+
+    for ( c = 0; c < 3; c++ )
+    {
+        int w     = src->plane[c].stride;
+        int h     = src->plane[c].height;
+        int bands = MAX(1, h / HQDN3D_BAND_MIN_HEIGHT);
+
+        for ( band = segment; band < bands; band += pv->cpu_count )
+        {
+            int start = h *  band      / bands;
+            int stop  = h * (band + 1) / bands;
+
+            hqdn3d_denoise( &pv->functions,
+                            src->plane[c].data + start * w,
+                            dst->plane[c].data + start * w,
+                            args->line,
+                            args->pixel,
+                            pv->hqdn3d_frame[c] + start * w,
+                            w,
+                            stop - start,
+                            MIN(start, HQDN3D_BAND_OVERLAP),
+                            pv->hqdn3d_coef[c * 2],
+                            pv->hqdn3d_coef[c * 2 + 1] );
+        }
+    }
+}
+
 static int hb_denoise_init( hb_filter_object_t * filter,
                             hb_filter_init_t * init )
 {
@@ -261,7 +420,54 @@ static int hb_denoise_init( hb_filter_object_t * filter,
     hqdn3d_precalc_coef( pv->hqdn3d_coef[4], spatial_chroma_r );
     hqdn3d_precalc_coef( pv->hqdn3d_coef[5], temporal_chroma_r );
 
+    hqdn3d_init_c( &pv->functions );
+#if defined(ARCH_X86)
+    hqdn3d_init_x86( &pv->functions );
+#endif
+
+    // More segments than luma bands would be idle
+    pv->cpu_count = MIN(hb_filter_thread_count( filter ),
+                        MAX(1, init->geometry.height / HQDN3D_BAND_MIN_HEIGHT));
+
+    /*
+     * Create denoise taskset.
+     */
+    pv->hqdn3d_arguments = calloc( pv->cpu_count, sizeof(hqdn3d_arguments_t) );
+    if( pv->hqdn3d_arguments == NULL ||
+        taskset_init( &pv->hqdn3d_taskset, pv->cpu_count,
+                      sizeof( hqdn3d_thread_arg_t ) ) == 0 )
+    {
+        hb_error( "hqdn3d could not initialize taskset" );
+        goto fail;
+    }
+
+    int ii;
+    for( ii = 0; ii < pv->cpu_count; ii++ )
+    {
+        hqdn3d_thread_arg_t * thread_args;
+
+        thread_args = taskset_thread_args( &pv->hqdn3d_taskset, ii );
+        thread_args->pv = pv;
+        thread_args->segment = ii;
+
+        if( taskset_thread_spawn( &pv->hqdn3d_taskset, ii,
+                                  "hqdn3d_filter_segment",
+                                  hqdn3d_filter_thread,
+                                  HB_NORMAL_PRIORITY ) == 0 )
+        {
+            hb_error( "hqdn3d could not spawn thread" );
+            goto fail;
+        }
+    }
+
     return 0;
+
+fail:
+    taskset_fini( &pv->hqdn3d_taskset );
+    free( pv->hqdn3d_arguments );
+    free( pv );
+    filter->private_data = NULL;
+    return -1;
 }
 
 static void hb_denoise_close( hb_filter_object_t * filter )
@@ -273,11 +479,16 @@ static void hb_denoise_close( hb_filter_object_t * filter )
         return;
     }
 
-	if( pv->hqdn3d_line )
+    taskset_fini( &pv->hqdn3d_taskset );
+
+    int ii;
+    for( ii = 0; ii < pv->cpu_count; ii++ )
     {
-        free( pv->hqdn3d_line );
-        pv->hqdn3d_line = NULL;
+        free( pv->hqdn3d_arguments[ii].line );
+        free( pv->hqdn3d_arguments[ii].pixel );
     }
+    free( pv->hqdn3d_arguments );
+
 	if( pv->hqdn3d_frame[0] )
     {
         free( pv->hqdn3d_frame[0] );
@@ -314,25 +525,65 @@ static int hb_denoise_work( hb_filter_object_t * filter,
 
     out = hb_video_buffer_init( in->f.width, in->f.height );
 
-    if( !pv->hqdn3d_line )
+    int c, ii, x, y;
+
+    if( pv->line_size < in->plane[0].stride )
     {
-        pv->hqdn3d_line = malloc( in->plane[0].stride * sizeof(unsigned short) );
-    }
+        pv->line_size = in->plane[0].stride;
+        for( ii = 0; ii < pv->cpu_count; ii++ )
+        {
+            hqdn3d_arguments_t * args = &pv->hqdn3d_arguments[ii];
 
-    int c, coef_index;
+            free( args->line );
+            free( args->pixel );
+            args->line  = malloc( pv->line_size * sizeof(unsigned short) );
+            args->pixel = malloc( pv->line_size * sizeof(unsigned int) );
+            if( args->line == NULL || args->pixel == NULL )
+            {
+                hb_error( "hqdn3d could not allocate line buffers" );
+                pv->line_size = 0;
+                hb_buffer_close( &out );
+                return HB_FILTER_FAILED;
+            }
+        }
+    }
 
     for ( c = 0; c < 3; c++ )
     {
-        coef_index = c * 2;
-        hqdn3d_denoise( in->plane[c].data,
-                        out->plane[c].data,
-                        pv->hqdn3d_line,
-                        &pv->hqdn3d_frame[c],
-                        in->plane[c].stride,
-                        in->plane[c].height,
-                        pv->hqdn3d_coef[coef_index],
-                        pv->hqdn3d_coef[coef_index+1] );
+        /* The first frame is its own previous frame */
+        if( !pv->hqdn3d_frame[c] )
+        {
+            int              w = in->plane[c].stride;
+            unsigned char  * src = in->plane[c].data;
+            unsigned short * frame_ant;
+
+            pv->hqdn3d_frame[c] = frame_ant =
+                malloc( w * in->plane[c].height * sizeof(unsigned short) );
+            if( frame_ant == NULL )
+            {
+                hb_error( "hqdn3d could not allocate frame buffer" );
+                hb_buffer_close( &out );
+                return HB_FILTER_FAILED;
+            }
+            for ( y = 0; y < in->plane[c].height; y++, src += w, frame_ant += w )
+            {
+                for( x = 0; x < w; x++ )
+                {
+                    frame_ant[x] = src[x]<<8;
+                }
+            }
+        }
+    }
+
+    /*
+     * Run one task per segment on the shared pool.
+     */
+    for( ii = 0; ii < pv->cpu_count; ii++ )
+    {
+        pv->hqdn3d_arguments[ii].src = in;
+        pv->hqdn3d_arguments[ii].dst = out;
     }
+    taskset_cycle( &pv->hqdn3d_taskset );
 
     out->s = in->s;
     *buf_out = out;
@@ -0,0 +1,41 @@
+/* denoise.h
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*
+ * Size of one hqdn3d coefficient table.  The tables are indexed by
+ * -4096..4095 from their middle, the SIMD code reads 32 bits at each
+ * index so one extra entry is needed past the end.
+ */
+#define HQDN3D_COEF_SIZE (512*16 + 2)
+
+typedef struct
+{
+    // Temporal denoise of one row of 'w' pixels
+    void (*temporal_row)( const unsigned char  * frame_src,
+                          unsigned char        * frame_dst,
+                          unsigned short       * frame_ant,
+                          int                    w,
+                          const short          * temporal );
+    // Vertical spatial and temporal denoise of one row of 'w' pixels,
+    // 'pixel_ant' holds the row after the horizontal spatial pass
+    void (*spatial_row)( const unsigned int    * pixel_ant,
+                         unsigned char         * frame_dst,
+                         unsigned short        * line_ant,
+                         unsigned short        * frame_ant,
+                         int                     w,
+                         const short           * spatial,
+                         const short           * temporal );
+} hqdn3d_functions_t;
+
+// Fills 'ct' with the coefficients of strength 'dist25'.  The row
+// functions take a pointer to the middle entry, ct + 0x1000.
+void hqdn3d_precalc_coef( short * ct, double dist25 );
+
+void hqdn3d_init_c( hqdn3d_functions_t * functions );
+void hqdn3d_init_x86( hqdn3d_functions_t * functions );
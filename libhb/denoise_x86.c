@@ -0,0 +1,154 @@
+/* denoise_x86.c
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "hb.h"     // needed for ARCH_X86
+
+#if defined(ARCH_X86)
+
+#include "libavutil/cpu.h"
+#include "denoise.h"
+
+// The kernels need gathers for the coefficient lookups, they are compiled
+// for AVX2 with function attributes and only run on CPUs that have it.
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define HQDN3D_HAVE_AVX2 1
+#include <immintrin.h>
+#define HQDN3D_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#if defined(HQDN3D_HAVE_AVX2)
+
+static inline unsigned int lowpass_mul( int prev_mul, int curr_mul,
+                                        const short * coef )
+{
+    int d = (prev_mul - curr_mul)>>4;
+    return curr_mul + coef[d];
+}
+
+// Same as hqdn3d_lowpass_mul() for 8 pixels.  'coef' points to the middle
+// of its table, the 32 bit gather reads the entry and the one after it.
+HQDN3D_TARGET("avx2")
+static inline __m256i lowpass_mul_avx2( __m256i prev_mul, __m256i curr_mul,
+                                        const short * coef )
+{
+    __m256i d, c;
+
+    d = _mm256_srai_epi32(_mm256_sub_epi32(prev_mul, curr_mul), 4);
+    c = _mm256_i32gather_epi32((const int*)coef, d, 2);
+    c = _mm256_srai_epi32(_mm256_slli_epi32(c, 16), 16);
+    return _mm256_add_epi32(curr_mul, c);
+}
+
+// Truncates 8 values to 16 bits and stores them
+HQDN3D_TARGET("avx2")
+static inline void store_u16_avx2( unsigned short * dst, __m256i v )
+{
+    v = _mm256_and_si256(v, _mm256_set1_epi32(0xFFFF));
+    _mm_storeu_si128((__m128i*)dst,
+                     _mm_packus_epi32(_mm256_castsi256_si128(v),
+                                      _mm256_extracti128_si256(v, 1)));
+}
+
+// Stores the 8 output pixels (tmp+0x7F)>>8, truncated to 8 bits
+HQDN3D_TARGET("avx2")
+static inline void store_pixels_avx2( unsigned char * dst, __m256i tmp )
+{
+    __m128i p;
+
+    tmp = _mm256_srli_epi32(_mm256_add_epi32(tmp, _mm256_set1_epi32(0x7F)), 8);
+    tmp = _mm256_and_si256(tmp, _mm256_set1_epi32(0xFF));
+    p   = _mm_packus_epi32(_mm256_castsi256_si128(tmp),
+                           _mm256_extracti128_si256(tmp, 1));
+    _mm_storel_epi64((__m128i*)dst, _mm_packus_epi16(p, p));
+}
+
+HQDN3D_TARGET("avx2")
+static void temporal_row_avx2( const unsigned char  * frame_src,
+                               unsigned char        * frame_dst,
+                               unsigned short       * frame_ant,
+                               int                    w,
+                               const short          * temporal )
+{
+    int x;
+    unsigned int tmp;
+
+    for( x = 0; x + 8 <= w; x += 8 )
+    {
+        __m256i src, ant;
+
+        src = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(frame_src + x)));
+        src = _mm256_slli_epi32(src, 8);
+        ant = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(frame_ant + x)));
+
+        ant = lowpass_mul_avx2(ant, src, temporal);
+        store_u16_avx2(frame_ant + x, ant);
+        store_pixels_avx2(frame_dst + x, ant);
+    }
+    for( ; x < w; x++ )
+    {
+        frame_ant[x] = tmp = lowpass_mul( frame_ant[x],
+                                          frame_src[x]<<8,
+                                          temporal );
+        frame_dst[x] = (tmp+0x7F)>>8;
+    }
+}
+
+HQDN3D_TARGET("avx2")
+static void spatial_row_avx2( const unsigned int    * pixel_ant,
+                              unsigned char         * frame_dst,
+                              unsigned short        * line_ant,
+                              unsigned short        * frame_ant,
+                              int                     w,
+                              const short           * spatial,
+                              const short           * temporal )
+{
+    int x;
+    unsigned int tmp;
+
+    for( x = 0; x + 8 <= w; x += 8 )
+    {
+        __m256i pixel, line, ant;
+
+        pixel = _mm256_loadu_si256((const __m256i*)(pixel_ant + x));
+        line  = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(line_ant + x)));
+        ant   = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(frame_ant + x)));
+
+        line = lowpass_mul_avx2(line, pixel, spatial);
+        store_u16_avx2(line_ant + x, line);
+        ant  = lowpass_mul_avx2(ant, line, temporal);
+        store_u16_avx2(frame_ant + x, ant);
+        store_pixels_avx2(frame_dst + x, ant);
+    }
+    for( ; x < w; x++ )
+    {
+        line_ant[x]  = tmp = lowpass_mul( line_ant[x],
+                                          pixel_ant[x],
+                                          spatial );
+        frame_ant[x] = tmp = lowpass_mul( frame_ant[x],
+                                          tmp,
+                                          temporal );
+        frame_dst[x] = (tmp+0x7F)>>8;
+    }
+}
+
+#endif // HQDN3D_HAVE_AVX2
+
+void hqdn3d_init_x86( hqdn3d_functions_t * functions )
+{
+#if defined(HQDN3D_HAVE_AVX2)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_AVX2)
+    {
+        functions->temporal_row = temporal_row_avx2;
+        functions->spatial_row  = spatial_row_avx2;
+        hb_log("hqdn3d using AVX2 optimizations");
+    }
+#endif
+}
+
+#endif // ARCH_X86
@@ -289,7 +289,8 @@ int encavcodecInit( hb_work_object_t * w, hb_job_t * job )
         job->pass_id == HB_PASS_ENCODE_2ND )
     {
         char filename[1024]; memset( filename, 0, 1024 );
-        hb_get_tempory_filename( job->h, filename, "ffmpeg.log" );
+        hb_get_tempory_filename( job->h, filename, "ffmpeg.%d.log",
+                                 job->sequence_id );
 
         if( job->pass_id == HB_PASS_ENCODE_1ST )
         {
@@ -346,7 +347,9 @@ int encavcodecInit( hb_work_object_t * w, hb_job_t * job )
         }
     }
 
-    if (hb_avcodec_open(context, codec, &av_opts, HB_FFMPEG_THREADS_AUTO))
+    if (hb_avcodec_open(context, codec, &av_opts,
+                        job->threads_encode > 0 ? job->threads_encode :
+                                                  HB_FFMPEG_THREADS_AUTO))
     {
         hb_log( "encavcodecInit: avcodec_open failed" );
     }
@@ -454,6 +454,13 @@ int encx264Init( hb_work_object_t * w, hb_job_t * job )
         param.vui.i_colmatrix = job->title->color_matrix;
     }
 
+    /* Thread count from the job's thread budget, the encoder_options
+     * string can still override it */
+    if (job->threads_encode > 0)
+    {
+        param.i_threads = job->threads_encode;
+    }
+
     /* place job->encoder_options in an hb_dict_t for convenience */
     hb_dict_t * x264_opts = NULL;
     if (job->encoder_options != NULL && *job->encoder_options)
@@ -543,7 +550,8 @@ int encx264Init( hb_work_object_t * w, hb_job_t * job )
             job->pass_id == HB_PASS_ENCODE_2ND )
         {
             memset( pv->filename, 0, 1024 );
-            hb_get_tempory_filename( job->h, pv->filename, "x264.log" );
+            hb_get_tempory_filename( job->h, pv->filename, "x264.%d.log",
+                                     job->sequence_id );
         }
         switch( job->pass_id )
         {
@@ -582,11 +590,37 @@ int encx264Init( hb_work_object_t * w, hb_job_t * job )
     }
 
     /* Turbo first pass */
-    if( job->pass_id == HB_PASS_ENCODE_1ST && job->fastfirstpass == 1 )
+    if( job->pass_id == HB_PASS_ENCODE_1ST && job->fastfirstpass >= 1 )
     {
         pv->api->param_apply_fastfirstpass( &param );
     }
 
+    /*
+     * Fastest first pass.  The second pass requires statistics of the
+     * same resolution, so the first pass can not be downscaled; reduce
+     * the analysis further instead.  The frame types, B-frame and
+     * mb-tree settings the second pass checks its statistics against
+     * are left alone.  The second pass then has less accurate frame
+     * complexities to distribute the bitrate with, which typically
+     * costs a few percent of bitrate accuracy.
+     */
+    if( job->pass_id == HB_PASS_ENCODE_1ST && job->fastfirstpass >= 2 )
+    {
+        if( param.analyse.i_subpel_refine > 1 )
+        {
+            param.analyse.i_subpel_refine = 1;
+        }
+        if( param.i_bframe_adaptive == X264_B_ADAPT_TRELLIS )
+        {
+            param.i_bframe_adaptive = X264_B_ADAPT_FAST;
+        }
+        param.analyse.b_fast_pskip = 1;
+        param.analyse.b_mixed_references = 0;
+        param.analyse.f_psy_rd = 0.;
+        param.analyse.f_psy_trellis = 0.;
+        param.analyse.i_me_range = 16;
+    }
+
     /* B-pyramid is enabled by default. */
     job->areBframes = 2;
     
@@ -195,6 +195,17 @@ int encx265Init(hb_work_object_t *w, hb_job_t *job)
         goto fail;
     }
 
+    /*
+     * Size the thread pool from the job's thread budget,
+     * the encoder_options string can still override it.
+     */
+    if (job->threads_encode > 0)
+    {
+        char pools[16];
+        snprintf(pools, sizeof(pools), "%d", job->threads_encode);
+        param_parse(pv, param, "pools", pools);
+    }
+
     /* iterate through x265_opts and parse the options */
     hb_dict_t *x265_opts;
     x265_opts = hb_encopts_to_dict(job->encoder_options, job->vcodec);
@@ -258,7 +269,8 @@ int encx265Init(hb_work_object_t *w, hb_job_t *job)
             char stats_file[1024] = "";
             char pass[2];
             snprintf(pass, sizeof(pass), "%d", job->pass_id);
-            hb_get_tempory_filename(job->h, stats_file, "x265.log");
+            hb_get_tempory_filename(job->h, stats_file, "x265.%d.log",
+                                    job->sequence_id);
             if (param_parse(pv, param, "stats", stats_file) ||
                 param_parse(pv, param, "pass", pass))
             {
@@ -273,6 +285,16 @@ int encx265Init(hb_work_object_t *w, hb_job_t *job)
                 {
                     goto fail;
                 }
+
+                // Fastest first pass, see encx264.c.  x265 has already
+                // reduced the analysis for !slow-firstpass.
+                if (job->fastfirstpass >= 2 &&
+                    (param_parse(pv, param, "rd", "1") ||
+                     param_parse(pv, param, "b-intra", "0") ||
+                     param_parse(pv, param, "early-skip", "1")))
+                {
+                    goto fail;
+                }
             }
         }
     }
@@ -283,7 +305,8 @@ int encx265Init(hb_work_object_t *w, hb_job_t *job)
     {
         if (param->csvfn == NULL)
         {
-            hb_get_tempory_filename(job->h, pv->csvfn, "x265.csv");
+            hb_get_tempory_filename(job->h, pv->csvfn, "x265.%d.csv",
+                                    job->sequence_id);
             param->csvfn = pv->csvfn;
         }
         else
@@ -20,7 +20,6 @@
 #endif
 #endif
 
-#define FIFO_TIMEOUT 200
 //#define HB_FIFO_DEBUG 1
 // defining HB_BUFFER_DEBUG and HB_NO_BUFFER_POOL allows tracking
 // buffer memory leaks using valgrind.  The source of the leak
@@ -41,13 +40,36 @@ struct hb_fifo_s
     hb_cond_t    * cond_empty;
     int            wait_empty;
     hb_cond_t    * cond_alert_full;
+    int            shutdown;
     uint32_t       capacity;
     uint32_t       thresh;
     uint32_t       size;
+    // See hb_fifo_set_capacity()
+    uint32_t       max_capacity;
+    uint32_t       init_capacity;
+    uint32_t       init_thresh;
+    // Microseconds threads spent blocked on this fifo being empty or
+    // full, protected by lock
+    uint64_t       wait_empty_time;
+    uint64_t       wait_full_time;
     uint32_t       buffer_size;
     hb_buffer_t  * first;
     hb_buffer_t  * last;
 
+    // Single producer / single consumer ring, see hb_fifo_set_spsc()
+    int            spsc;
+    int            overflow;    // first/last hold buffers, protected by lock
+    int            bytes;
+    hb_buffer_t  * front;       // owned by the consumer
+    hb_buffer_t ** ring;
+    uint32_t       ring_mask;
+    uint32_t       ring_head;   // written by the consumer
+    uint32_t       ring_tail;   // written by the producer
+
+    // Spilling to disk, see hb_fifo_set_spill()
+    hb_spill_t   * spill;
+    hb_buffer_t  * spill_last;  // last buffer considered for spilling
+
 #if defined(HB_FIFO_DEBUG)
     // Fifo list for debugging
     hb_fifo_t    * next;
@@ -75,12 +97,51 @@ static hb_fifo_t fifo_list =
  * too much memory. */
 #define BUFFER_POOL_MAX_ELEMENTS 32
 
+/* Each thread keeps a small cache (a "magazine") of free buffers per size
+ * class in front of the shared pools so that hb_buffer_init/hb_buffer_close
+ * do not touch any lock in the common case.  When a thread's cache for a
+ * size class runs empty it refills half of its depth (cache_depth) from
+ * the shared pool in one locked operation, and when it overflows it
+ * returns half the same way.  The depth of a cache is limited by
+ * BUFFER_CACHE_BYTES so that large frame buffers are not hoarded. */
+#define BUFFER_CACHE_MAX_ELEMENTS 16
+#define BUFFER_CACHE_MIN_ELEMENTS 2
+#define BUFFER_CACHE_BYTES        (2 * 1024 * 1024)
+
+/* On NUMA systems each node has its own set of shared pools.  A buffer
+ * remembers the node it was allocated on (hb_buffer_t.node) and always
+ * goes back to the pools of that node, whichever thread frees it.
+ * Thread caches refill from the pools of the node they run on and only
+ * keep buffers of that node, so that a freed frame buffer is reused on
+ * the node it was allocated on rather than by a thread on another
+ * node.  Nodes beyond BUFFER_POOL_MAX_NODES share pools. */
+#define BUFFER_POOL_MAX_NODES     8
+
+typedef struct hb_buffer_cache_s hb_buffer_cache_t;
+struct hb_buffer_cache_s
+{
+#if !defined(HB_NO_BUFFER_POOL)
+    hb_buffer_t       * list[MAX_BUFFER_POOLS];
+    int                 count[MAX_BUFFER_POOLS];
+#endif
+    // Bytes allocated by this thread. Only the owning thread adds to it,
+    // hb_buffer_pool_free() collects it with an atomic exchange.
+    int64_t             allocated;
+    hb_buffer_cache_t * next;
+};
+
 struct hb_buffer_pools_s
 {
     int64_t allocated;
     hb_lock_t *lock;
+    int        users;       // jobs and scans, see hb_buffer_pool_retain()
+    hb_tls_t  *cache_key;
+    hb_buffer_cache_t *caches;  // all live thread caches, protected by lock
 #if !defined(HB_NO_BUFFER_POOL)
-    hb_fifo_t *pool[MAX_BUFFER_POOLS];
+    // pool[0] is also used by threads without a buffer cache
+    hb_fifo_t *pool[BUFFER_POOL_MAX_NODES][MAX_BUFFER_POOLS];
+    int        nodes;
+    int        cache_depth[MAX_BUFFER_POOLS];
 #endif
 #if defined(HB_BUFFER_DEBUG)
     hb_list_t *alloc_list;
@@ -91,11 +152,14 @@ struct hb_buffer_pools_s
 #if defined(HB_BUFFER_DEBUG)
 static int hb_fifo_contains( hb_fifo_t *f, hb_buffer_t *b );
 #endif
+static void buffer_cache_close( void * _c );
 
 void hb_buffer_pool_init( void )
 {
     buffers.lock = hb_lock_init();
     buffers.allocated = 0;
+    buffers.caches = NULL;
+    buffers.cache_key = hb_tls_init( buffer_cache_close );
 
 #if defined(HB_BUFFER_DEBUG)
     buffers.alloc_list = hb_list_init();
@@ -104,24 +168,216 @@ void hb_buffer_pool_init( void )
 #if !defined(HB_NO_BUFFER_POOL)
     /* we allocate pools for sizes 2^10 through 2^25. requests larger than
      * 2^25 will get passed through to malloc. */
-    int i;
+    int i, n;
+
+    buffers.nodes = MIN( hb_get_numa_node_count(), BUFFER_POOL_MAX_NODES );
+    for ( n = 0; n < buffers.nodes; ++n )
+    {
+        hb_fifo_t ** pool = buffers.pool[n];
+
+        // Create larger queue for 2^10 bucket since all allocations smaller
+        // than 2^10 come from here.
+        pool[BUFFER_POOL_FIRST] = hb_fifo_init(BUFFER_POOL_MAX_ELEMENTS*10, 1);
+        pool[BUFFER_POOL_FIRST]->buffer_size = 1 << 10;
+
+        /* requests smaller than 2^10 are satisfied from the 2^10 pool. */
+        for ( i = 1; i < BUFFER_POOL_FIRST; ++i )
+        {
+            pool[i] = pool[BUFFER_POOL_FIRST];
+        }
+        for ( i = BUFFER_POOL_FIRST + 1; i <= BUFFER_POOL_LAST; ++i )
+        {
+            pool[i] = hb_fifo_init(BUFFER_POOL_MAX_ELEMENTS, 1);
+            pool[i]->buffer_size = 1 << i;
+        }
+    }
+    for ( i = BUFFER_POOL_FIRST; i <= BUFFER_POOL_LAST; ++i )
+    {
+        int depth = BUFFER_CACHE_BYTES >> i;
+        if ( depth > BUFFER_CACHE_MAX_ELEMENTS )
+            depth = BUFFER_CACHE_MAX_ELEMENTS;
+        if ( depth < BUFFER_CACHE_MIN_ELEMENTS )
+            depth = BUFFER_CACHE_MIN_ELEMENTS;
+        buffers.cache_depth[i] = depth;
+    }
+#endif
+}
+
+/* Returns the calling thread's buffer cache, creating it on first use.
+ * The cache is released by buffer_cache_close() when the thread exits. */
+static hb_buffer_cache_t * buffer_cache_get( void )
+{
+    hb_buffer_cache_t * c;
+
+    if ( buffers.cache_key == NULL )
+        return NULL;
+
+    c = hb_tls_get( buffers.cache_key );
+    if ( c == NULL )
+    {
+        c = calloc( sizeof( hb_buffer_cache_t ), 1 );
+        if ( c == NULL )
+            return NULL;
+
+        hb_lock( buffers.lock );
+        c->next = buffers.caches;
+        buffers.caches = c;
+        hb_unlock( buffers.lock );
+
+        hb_tls_set( buffers.cache_key, c );
+    }
+    return c;
+}
+
+static void buffer_cache_account( hb_buffer_cache_t * c, int64_t size )
+{
+    if ( c != NULL )
+    {
+        hb_atomic_add( &c->allocated, size );
+    }
+    else
+    {
+        hb_lock( buffers.lock );
+        buffers.allocated += size;
+        hb_unlock( buffers.lock );
+    }
+}
+
+// Sums the per-thread allocation counters into buffers.allocated.
+// Must be called with buffers.lock held.
+static void buffer_cache_collect_allocated( void )
+{
+    hb_buffer_cache_t * c;
+
+    for ( c = buffers.caches; c != NULL; c = c->next )
+    {
+        buffers.allocated += hb_atomic_exchange( &c->allocated, 0 );
+    }
+}
+
+#if !defined(HB_NO_BUFFER_POOL)
+// Returns the pools node the calling thread runs on
+static int buffer_current_node( void )
+{
+    if ( buffers.nodes > 1 )
+    {
+        return hb_get_numa_node() % buffers.nodes;
+    }
+    return 0;
+}
+
+static void buffer_free( hb_buffer_t * b )
+{
+    if ( b->data )
+    {
+        free( b->data );
+        hb_lock( buffers.lock );
+        buffers.allocated -= b->alloc;
+        hb_unlock( buffers.lock );
+    }
+    free( b );
+}
+
+// Moves up to 'count' buffers from the shared pool to the cache
+// taking the pool lock only once.
+static void buffer_cache_refill( hb_buffer_cache_t * c, int idx, int count )
+{
+    hb_fifo_t   * pool = buffers.pool[buffer_current_node()][idx];
+    hb_buffer_t * b;
+
+    hb_lock( pool->lock );
+    while ( count-- > 0 && pool->size > 0 )
+    {
+        b           = pool->first;
+        pool->first = b->next;
+        pool->size -= 1;
+        b->next     = c->list[idx];
+        c->list[idx] = b;
+        c->count[idx]++;
+    }
+    hb_unlock( pool->lock );
+}
+
+// Returns up to 'count' buffers from the cache to the shared pools of
+// their nodes, taking a pool lock only once per run of buffers of the
+// same node.  Buffers that do not fit in their shared pool are freed.
+static void buffer_cache_drain( hb_buffer_cache_t * c, int idx, int count )
+{
+    hb_fifo_t   * pool = NULL;
+    hb_buffer_t * b, * overflow = NULL;
 
-    // Create larger queue for 2^10 bucket since all allocations smaller than
-    // 2^10 come from here.
-    buffers.pool[BUFFER_POOL_FIRST] = hb_fifo_init(BUFFER_POOL_MAX_ELEMENTS*10, 1);
-    buffers.pool[BUFFER_POOL_FIRST]->buffer_size = 1 << 10;
+    while ( count-- > 0 && c->list[idx] != NULL )
+    {
+        b            = c->list[idx];
+        c->list[idx] = b->next;
+        c->count[idx]--;
+        if ( pool != buffers.pool[b->node][idx] )
+        {
+            if ( pool != NULL )
+            {
+                hb_unlock( pool->lock );
+            }
+            pool = buffers.pool[b->node][idx];
+            hb_lock( pool->lock );
+        }
+        if ( pool->size < pool->capacity )
+        {
+            b->next     = pool->first;
+            if ( pool->size == 0 )
+            {
+                pool->last = b;
+            }
+            pool->first = b;
+            pool->size += 1;
+        }
+        else
+        {
+            b->next  = overflow;
+            overflow = b;
+        }
+    }
+    if ( pool != NULL )
+    {
+        hb_unlock( pool->lock );
+    }
 
-    /* requests smaller than 2^10 are satisfied from the 2^10 pool. */
-    for ( i = 1; i < BUFFER_POOL_FIRST; ++i )
+    while ( overflow != NULL )
     {
-        buffers.pool[i] = buffers.pool[BUFFER_POOL_FIRST];
+        b        = overflow;
+        overflow = b->next;
+        buffer_free( b );
     }
-    for ( i = BUFFER_POOL_FIRST + 1; i <= BUFFER_POOL_LAST; ++i )
+}
+#endif
+
+static void buffer_cache_close( void * _c )
+{
+    hb_buffer_cache_t * c = _c, ** link;
+
+    if ( c == NULL )
+        return;
+
+#if !defined(HB_NO_BUFFER_POOL)
+    int i;
+    for ( i = BUFFER_POOL_FIRST; i <= BUFFER_POOL_LAST; ++i )
     {
-        buffers.pool[i] = hb_fifo_init(BUFFER_POOL_MAX_ELEMENTS, 1);
-        buffers.pool[i]->buffer_size = 1 << i;
+        buffer_cache_drain( c, i, c->count[i] );
     }
 #endif
+
+    hb_lock( buffers.lock );
+    for ( link = &buffers.caches; *link != NULL; link = &(*link)->next )
+    {
+        if ( *link == c )
+        {
+            *link = c->next;
+            break;
+        }
+    }
+    buffers.allocated += hb_atomic_exchange( &c->allocated, 0 );
+    hb_unlock( buffers.lock );
+
+    free( c );
 }
 
 #if defined(HB_FIFO_DEBUG)
@@ -192,10 +448,13 @@ static void buffer_pool_validate( hb_fifo_t * f )
 
 static void buffer_pools_validate( void )
 {
-    int ii;
-    for ( ii = BUFFER_POOL_FIRST; ii <= BUFFER_POOL_LAST; ++ii )
+    int ii, n;
+    for ( n = 0; n < buffers.nodes; ++n )
     {
-        buffer_pool_validate( buffers.pool[ii] );
+        for ( ii = BUFFER_POOL_FIRST; ii <= BUFFER_POOL_LAST; ++ii )
+        {
+            buffer_pool_validate( buffers.pool[n][ii] );
+        }
     }
 }
 
@@ -267,12 +526,69 @@ void fifo_list_validate( void )
 #endif
 #endif
 
+/*
+ * Jobs and scans hold the buffer pools while they run.  The last of them
+ * to end frees the pooled buffers, while others run they are kept.
+ */
+void hb_buffer_pool_retain( void )
+{
+    hb_lock(buffers.lock);
+    buffers.users++;
+    hb_unlock(buffers.lock);
+}
+
+void hb_buffer_pool_release( void )
+{
+    int last;
+
+    hb_lock(buffers.lock);
+    buffers.users = MAX(buffers.users - 1, 0);
+    last = buffers.users == 0;
+    hb_unlock(buffers.lock);
+    if (last)
+    {
+        hb_buffer_pool_free();
+    }
+}
+
+/*
+ * Returns the buffers cached by the calling thread to the shared pools.
+ * Long lived threads, such as the workers of the thread pool, call it
+ * before they exit so that their buffers are back in the pools before
+ * the thread is joined rather than whenever the thread-local storage
+ * destructor runs.
+ */
+void hb_buffer_cache_flush( void )
+{
+#if !defined(HB_NO_BUFFER_POOL)
+    hb_buffer_cache_t * c;
+    int                 i;
+
+    if ( buffers.cache_key == NULL )
+        return;
+
+    c = hb_tls_get( buffers.cache_key );
+    if ( c == NULL )
+        return;
+
+    for ( i = BUFFER_POOL_FIRST; i <= BUFFER_POOL_LAST; ++i )
+    {
+        buffer_cache_drain( c, i, c->count[i] );
+    }
+#endif
+}
+
 void hb_buffer_pool_free( void )
 {
     int i;
     int64_t freed = 0;
 
+    // Return the calling thread's cached buffers so they are freed below.
+    // Caches of pipeline threads were returned when those threads exited.
+    hb_buffer_cache_flush();
+
     hb_lock(buffers.lock);
+    buffer_cache_collect_allocated();
 
 #if defined(HB_BUFFER_DEBUG)
     hb_deep_log(2, "leaked %d buffers", hb_list_count(buffers.alloc_list));
@@ -286,24 +602,27 @@ void hb_buffer_pool_free( void )
 
 #if !defined(HB_NO_BUFFER_POOL)
     hb_buffer_t * b;
-    int           count;
+    int           count, n;
     for( i = BUFFER_POOL_FIRST; i <= BUFFER_POOL_LAST; ++i)
     {
         count = 0;
-        while( ( b = hb_fifo_get(buffers.pool[i]) ) )
+        for ( n = 0; n < buffers.nodes; ++n )
         {
-            if( b->data )
+            while( ( b = hb_fifo_get(buffers.pool[n][i]) ) )
             {
-                freed += b->alloc;
-                free(b->data);
+                if( b->data )
+                {
+                    freed += b->alloc;
+                    free(b->data);
+                }
+                free( b );
+                count++;
             }
-            free( b );
-            count++;
         }
         if ( count )
         {
             hb_deep_log( 2, "Freed %d buffers of size %d", count,
-                    buffers.pool[i]->buffer_size);
+                    buffers.pool[0][i]->buffer_size);
         }
     }
 #endif
@@ -325,7 +644,9 @@ void hb_buffer_pool_free( void )
     hb_unlock(buffers.lock);
 }
 
-static hb_fifo_t *size_to_pool( int size )
+// Returns the index of the buffer pool that 'size' bytes are allocated
+// from or -1 if such buffers are passed through to malloc.
+static int size_to_pool_index( int size )
 {
 #if !defined(HB_NO_BUFFER_POOL)
     int i;
@@ -333,9 +654,21 @@ static hb_fifo_t *size_to_pool( int size )
     {
         if ( size <= (1 << i) )
         {
-            return buffers.pool[i];
+            return i;
         }
     }
+#endif
+    return -1;
+}
+
+static hb_fifo_t *size_to_pool( int size )
+{
+#if !defined(HB_NO_BUFFER_POOL)
+    int i = size_to_pool_index( size );
+    if ( i >= 0 )
+    {
+        return buffers.pool[0][i];
+    }
 #endif
     return NULL;
 }
@@ -349,11 +682,38 @@ hb_buffer_t * hb_buffer_init_internal( int size )
     // sometimes we feed data to these libraries starting from arbitrary
     // points within the buffer.
     int alloc = size + 16;
+    int pool_index = size_to_pool_index( alloc );
     hb_fifo_t *buffer_pool = size_to_pool( alloc );
+    hb_buffer_cache_t *cache = buffer_cache_get();
+    int node = 0;
 
     if( buffer_pool )
     {
+        b = NULL;
+#if !defined(HB_NO_BUFFER_POOL)
+        node = buffer_current_node();
+        if ( cache != NULL )
+        {
+            if ( cache->count[pool_index] == 0 )
+            {
+                buffer_cache_refill( cache, pool_index,
+                                     (buffers.cache_depth[pool_index] + 1) / 2 );
+            }
+            b = cache->list[pool_index];
+            if ( b != NULL )
+            {
+                cache->list[pool_index] = b->next;
+                cache->count[pool_index]--;
+                b->next = NULL;
+            }
+        }
+        else
+        {
+            b = hb_fifo_get( buffers.pool[node][pool_index] );
+        }
+#else
         b = hb_fifo_get( buffer_pool );
+#endif
 
         if( b )
         {
@@ -362,11 +722,13 @@ hb_buffer_t * hb_buffer_init_internal( int size )
              * didn't have to do this.
              */
             uint8_t *data = b->data;
+            int      data_node = b->node;
 
             memset( b, 0, sizeof(hb_buffer_t) );
             b->alloc          = buffer_pool->buffer_size;
             b->size           = size;
             b->data           = data;
+            b->node           = data_node;
             b->s.start        = AV_NOPTS_VALUE;
             b->s.stop         = AV_NOPTS_VALUE;
             b->s.renderOffset = AV_NOPTS_VALUE;
@@ -392,6 +754,7 @@ hb_buffer_t * hb_buffer_init_internal( int size )
 
     b->size  = size;
     b->alloc  = buffer_pool ? buffer_pool->buffer_size : alloc;
+    b->node  = node;
 
     if (size)
     {
@@ -401,7 +764,9 @@ hb_buffer_t * hb_buffer_init_internal( int size )
         /* FIXME */
         b->data  = malloc( b->alloc + 17 );
 #else
-        b->data  = memalign( 16, b->alloc );
+        // 64 byte alignment allows libavcodec to decode directly
+        // into frame buffers (see hb_avcodec_get_buffer2)
+        b->data  = memalign( 64, b->alloc );
 #endif
 
         if( !b->data )
@@ -413,9 +778,7 @@ hb_buffer_t * hb_buffer_init_internal( int size )
 #if defined(HB_BUFFER_DEBUG)
         memset(b->data, 0, b->size);
 #endif
-        hb_lock(buffers.lock);
-        buffers.allocated += b->alloc;
-        hb_unlock(buffers.lock);
+        buffer_cache_account( cache, b->alloc );
     }
     b->s.start        = AV_NOPTS_VALUE;
     b->s.stop         = AV_NOPTS_VALUE;
@@ -441,8 +804,90 @@ hb_buffer_t * hb_buffer_eof_init(void)
     return buf;
 }
 
+// Gives 'b' private storage in place of the shared storage it references.
+// If 'copy' is set, the current contents are preserved.
+static void buffer_unshare( hb_buffer_t * b, int copy )
+{
+    hb_buffer_t * tmp;
+    uint8_t     * data = b->data;
+    int           p;
+
+    tmp = hb_buffer_init( b->size );
+    if ( tmp == NULL )
+    {
+        return;
+    }
+    if ( copy )
+    {
+        memcpy( tmp->data, b->data, b->size );
+    }
+    for ( p = 0; p < 4; p++ )
+    {
+        if ( b->plane[p].data != NULL )
+        {
+            b->plane[p].data = tmp->data + ( b->plane[p].data - data );
+        }
+    }
+    b->data  = tmp->data;
+    b->alloc = tmp->alloc;
+    b->node  = tmp->node;
+    av_buffer_unref( &b->storage );
+
+    tmp->data = NULL;
+    hb_buffer_close( &tmp );
+}
+
+// Creates a buffer that shares the data referenced by 'ref' instead of
+// copying it. 'layout' supplies the data pointer, size, planes and
+// settings of the new buffer and must describe memory owned by 'ref'.
+hb_buffer_t * hb_buffer_ref_init( const hb_buffer_t * layout, AVBufferRef * ref )
+{
+    hb_buffer_t * b;
+
+    if( !( b = calloc( sizeof( hb_buffer_t ), 1 ) ) )
+    {
+        hb_log( "out of memory" );
+        return NULL;
+    }
+    b->storage = av_buffer_ref( ref );
+    if ( b->storage == NULL )
+    {
+        free( b );
+        return NULL;
+    }
+#if defined(HB_BUFFER_DEBUG)
+    hb_lock(buffers.lock);
+    hb_list_add(buffers.alloc_list, b);
+    hb_unlock(buffers.lock);
+#endif
+    b->size = layout->size;
+    b->data = layout->data;
+    b->s    = layout->s;
+    b->f    = layout->f;
+    memcpy( b->plane, layout->plane, sizeof( b->plane ) );
+
+    return b;
+}
+
+// Makes the data of 'b' safe to modify. If the data is shared with
+// other references, it is copied first (copy-on-write).
+int hb_buffer_make_writable( hb_buffer_t * b )
+{
+    if ( b == NULL || b->storage == NULL ||
+         av_buffer_is_writable( b->storage ) )
+    {
+        return 0;
+    }
+    buffer_unshare( b, 1 );
+    return b->storage == NULL ? 0 : -1;
+}
+
 void hb_buffer_realloc( hb_buffer_t * b, int size )
 {
+    if ( b->storage != NULL )
+    {
+        buffer_unshare( b, 1 );
+    }
     if ( size > b->alloc || b->data == NULL )
     {
         uint32_t orig = b->data != NULL ? b->alloc : 0;
@@ -453,10 +898,11 @@ void hb_buffer_realloc( hb_buffer_t * b, int size )
         }
         b->data  = realloc( b->data, size );
         b->alloc = size;
+#if !defined(HB_NO_BUFFER_POOL)
+        b->node  = buffer_current_node();
+#endif
 
-        hb_lock(buffers.lock);
-        buffers.allocated += size - orig;
-        hb_unlock(buffers.lock);
+        buffer_cache_account( buffer_cache_get(), size - orig );
     }
 }
 
@@ -482,6 +928,12 @@ hb_buffer_t * hb_buffer_dup( const hb_buffer_t * src )
     if ( src == NULL )
         return NULL;
 
+    if ( src->storage != NULL )
+    {
+        // Share the data, writers unshare it with hb_buffer_make_writable
+        return hb_buffer_ref_init( src, src->storage );
+    }
+
     buf = hb_buffer_init( src->size );
     if ( buf )
     {
@@ -507,6 +959,10 @@ int hb_buffer_copy(hb_buffer_t * dst, const hb_buffer_t * src)
     if ( dst->size < src->size )
         return -1;
 
+    if ( dst->storage != NULL )
+    {
+        buffer_unshare( dst, 0 );
+    }
     memcpy( dst->data, src->data, src->size );
     dst->s = src->s;
     dst->f = src->f;
@@ -638,15 +1094,19 @@ void hb_video_buffer_realloc( hb_buffer_t * buf, int width, int height )
 // from src to dst.
 void hb_buffer_swap_copy( hb_buffer_t *src, hb_buffer_t *dst )
 {
-    uint8_t *data  = dst->data;
-    int      size  = dst->size;
-    int      alloc = dst->alloc;
+    uint8_t     *data    = dst->data;
+    int          size    = dst->size;
+    int          alloc   = dst->alloc;
+    int          node    = dst->node;
+    AVBufferRef *storage = dst->storage;
 
     *dst = *src;
 
-    src->data  = data;
-    src->size  = size;
-    src->alloc = alloc;
+    src->data    = data;
+    src->size    = size;
+    src->alloc   = alloc;
+    src->node    = node;
+    src->storage = storage;
 }
 
 // Frees the specified buffer list.
@@ -680,7 +1140,20 @@ void hb_buffer_close( hb_buffer_t ** _b )
 #endif
 
         hb_buffer_t * next = b->next;
-        hb_fifo_t *buffer_pool = size_to_pool( b->alloc );
+        hb_fifo_t *buffer_pool;
+
+        if ( b->spill.store != NULL )
+        {
+            hb_spill_drop( b );
+        }
+        if ( b->storage != NULL )
+        {
+            // Shared data is released with its last reference
+            av_buffer_unref( &b->storage );
+            b->data  = NULL;
+            b->alloc = 0;
+        }
+        buffer_pool = size_to_pool( b->alloc );
 
         b->next = NULL;
 
@@ -688,6 +1161,31 @@ void hb_buffer_close( hb_buffer_t ** _b )
         hb_lock(buffers.lock);
         hb_list_rem(buffers.alloc_list, b);
         hb_unlock(buffers.lock);
+#endif
+#if !defined(HB_NO_BUFFER_POOL)
+        if ( buffer_pool && b->data && b->alloc == buffer_pool->buffer_size )
+        {
+            int                 pool_index = size_to_pool_index( b->alloc );
+            hb_buffer_cache_t * cache = buffer_cache_get();
+
+            // The data goes back to the pools of the node it was allocated
+            // on.  Caches only keep buffers of the node they run on.
+            buffer_pool = buffers.pool[b->node][pool_index];
+            if ( cache != NULL && b->node == buffer_current_node() )
+            {
+                if ( cache->count[pool_index] >=
+                     buffers.cache_depth[pool_index] )
+                {
+                    buffer_cache_drain( cache, pool_index,
+                            (buffers.cache_depth[pool_index] + 1) / 2 );
+                }
+                b->next = cache->list[pool_index];
+                cache->list[pool_index] = b;
+                cache->count[pool_index]++;
+                b = next;
+                continue;
+            }
+        }
 #endif
         if( buffer_pool && b->data && !hb_fifo_is_full( buffer_pool ) )
         {
@@ -707,9 +1205,7 @@ void hb_buffer_close( hb_buffer_t ** _b )
         if( b->data )
         {
             free(b->data);
-            hb_lock(buffers.lock);
-            buffers.allocated -= b->alloc;
-            hb_unlock(buffers.lock);
+            buffer_cache_account( buffer_cache_get(), -(int64_t)b->alloc );
         }
         free( b );
         b = next;
@@ -837,33 +1333,482 @@ void hb_image_close(hb_image_t **_image)
     }
 }
 
-hb_fifo_t * hb_fifo_init( int capacity, int thresh )
+/* Waiters block on the fifo conditions without a timeout, so every
+ * operation that changes the fifo level must wake them.  Producers are
+ * woken once the fifo has drained to 'capacity - thresh' entries. */
+static void fifo_signal_full( hb_fifo_t * f )
 {
-    hb_fifo_t * f;
-    f             = calloc( sizeof( hb_fifo_t ), 1 );
-    f->lock       = hb_lock_init();
-    f->cond_full  = hb_cond_init();
-    f->cond_empty = hb_cond_init();
-    f->capacity   = capacity;
-    f->thresh     = thresh;
-    f->buffer_size = 0;
+    if( f->wait_full &&
+        ( f->size + f->thresh <= f->capacity || f->size == 0 ) )
+    {
+        f->wait_full = 0;
+        hb_cond_broadcast( f->cond_full );
+    }
+}
 
-#if defined(HB_FIFO_DEBUG)
-    // Add the fifo to the global fifo list
-    fifo_list_add( f );
-#endif
-    return f;
+static void fifo_signal_empty( hb_fifo_t * f )
+{
+    if( f->wait_empty && f->size >= 1 )
+    {
+        f->wait_empty = 0;
+        hb_cond_broadcast( f->cond_empty );
+    }
 }
 
-void hb_fifo_register_full_cond( hb_fifo_t * f, hb_cond_t * c )
+/* Lock-free single producer / single consumer mode.
+ *
+ * Fifos that connect exactly one producer thread to exactly one consumer
+ * thread can be switched to a bounded ring with hb_fifo_set_spsc().
+ * The producer owns ring_tail and the consumer owns ring_head, so a push
+ * or get that finds room (or data) in the ring takes no lock.
+ *
+ * hb_fifo_push does not enforce the capacity (work objects may output
+ * a list of buffers), so buffers that do not fit in the ring are
+ * appended to the locked first/last list.  Once that overflow list is
+ * in use the producer appends to it until the consumer has emptied both
+ * the ring and the overflow list, which preserves the buffer order.
+ * Buffers returned with hb_fifo_push_head and buffers taken from the
+ * overflow list are kept on a 'front' list that only the consumer
+ * touches.
+ *
+ * The lock and conditions are only used to sleep.  A thread that is
+ * about to sleep publishes wait_empty/wait_full and re-checks the fifo
+ * state.  The other side publishes its change and then checks the wait
+ * flag, and the full fences between these steps guarantee that at least
+ * one of them sees the other, so wakeups are never lost.
+ *
+ * In this mode hb_fifo_get, hb_fifo_see, hb_fifo_see2, hb_fifo_push_head
+ * and hb_fifo_flush must only be called by the consumer thread, and
+ * hb_fifo_push by the producer thread.  hb_fifo_size and
+ * hb_fifo_size_bytes may be called from anywhere. */
+#define FIFO_RING_MAX 256
+
+static void fifo_spsc_signal_empty( hb_fifo_t * f )
 {
-    f->cond_alert_full = c;
+    hb_atomic_fence();
+    if ( hb_atomic_load( &f->wait_empty ) )
+    {
+        hb_lock( f->lock );
+        f->wait_empty = 0;
+        hb_cond_broadcast( f->cond_empty );
+        hb_unlock( f->lock );
+    }
 }
 
-int hb_fifo_size_bytes( hb_fifo_t * f )
+static void fifo_spsc_signal_full( hb_fifo_t * f )
 {
-    int ret = 0;
-    hb_buffer_t * link;
+    uint32_t size;
+
+    hb_atomic_fence();
+    if ( hb_atomic_load( &f->wait_full ) )
+    {
+        size = hb_atomic_load( &f->size );
+        if ( size + hb_atomic_load_relaxed( &f->thresh ) <=
+                    hb_atomic_load_relaxed( &f->capacity ) || size == 0 )
+        {
+            hb_lock( f->lock );
+            f->wait_full = 0;
+            hb_cond_broadcast( f->cond_full );
+            hb_unlock( f->lock );
+        }
+    }
+}
+
+static void fifo_spsc_push( hb_fifo_t * f, hb_buffer_t * b )
+{
+    hb_buffer_t * next;
+    uint32_t      tail, count = 0;
+    int           bytes = 0;
+
+    for ( next = b; next != NULL; next = next->next )
+    {
+        count += 1;
+        bytes += next->size;
+    }
+    // Account before publishing so that the consumer never makes the
+    // counters go negative.
+    hb_atomic_add( &f->bytes, bytes );
+    if ( hb_atomic_add( &f->size, count ) >=
+                hb_atomic_load_relaxed( &f->capacity ) &&
+         f->cond_alert_full != NULL )
+    {
+        hb_lock( f->lock );
+        hb_cond_broadcast( f->cond_alert_full );
+        hb_unlock( f->lock );
+    }
+
+    tail = f->ring_tail;
+    while ( b != NULL && !hb_atomic_load( &f->overflow ) &&
+            tail - hb_atomic_load( &f->ring_head ) <= f->ring_mask )
+    {
+        next = b->next;
+        b->next = NULL;
+        f->ring[tail & f->ring_mask] = b;
+        tail += 1;
+        hb_atomic_store( &f->ring_tail, tail );
+        b = next;
+    }
+    if ( b != NULL )
+    {
+        hb_lock( f->lock );
+        if ( f->first == NULL )
+        {
+            f->first = b;
+        }
+        else
+        {
+            f->last->next = b;
+        }
+        f->last = b;
+        while ( f->last->next != NULL )
+        {
+            f->last = f->last->next;
+        }
+        hb_atomic_store( &f->overflow, 1 );
+        hb_unlock( f->lock );
+    }
+    fifo_spsc_signal_empty( f );
+}
+
+// Returns the idx'th buffer in the fifo without removing it
+static hb_buffer_t * fifo_spsc_see( hb_fifo_t * f, uint32_t idx )
+{
+    hb_buffer_t * b;
+    uint32_t      head, tail;
+
+    for ( b = f->front; b != NULL && idx > 0; b = b->next )
+    {
+        idx -= 1;
+    }
+    if ( b != NULL )
+    {
+        return b;
+    }
+
+    head = f->ring_head;
+    tail = hb_atomic_load( &f->ring_tail );
+    if ( tail - head > idx )
+    {
+        return f->ring[( head + idx ) & f->ring_mask];
+    }
+    if ( !hb_atomic_load( &f->overflow ) )
+    {
+        return NULL;
+    }
+
+    // The producer does not touch the ring while the overflow list is
+    // in use, re-read the tail now that everything before it is visible.
+    tail = hb_atomic_load( &f->ring_tail );
+    if ( tail - head > idx )
+    {
+        return f->ring[( head + idx ) & f->ring_mask];
+    }
+    idx -= tail - head;
+    hb_lock( f->lock );
+    for ( b = f->first; b != NULL && idx > 0; b = b->next )
+    {
+        idx -= 1;
+    }
+    hb_unlock( f->lock );
+
+    return b;
+}
+
+// Removes the first buffer without updating the counters
+static hb_buffer_t * fifo_spsc_take( hb_fifo_t * f )
+{
+    hb_buffer_t * b = f->front;
+    uint32_t      head, tail;
+
+    if ( b == NULL )
+    {
+        head = f->ring_head;
+        tail = hb_atomic_load( &f->ring_tail );
+        if ( tail == head && hb_atomic_load( &f->overflow ) )
+        {
+            // See fifo_spsc_see()
+            tail = hb_atomic_load( &f->ring_tail );
+            if ( tail == head )
+            {
+                hb_lock( f->lock );
+                b = f->first;
+                f->first = f->last = NULL;
+                hb_atomic_store( &f->overflow, 0 );
+                hb_unlock( f->lock );
+            }
+        }
+        if ( b == NULL )
+        {
+            if ( tail == head )
+            {
+                return NULL;
+            }
+            b = f->ring[head & f->ring_mask];
+            f->ring[head & f->ring_mask] = NULL;
+            hb_atomic_store( &f->ring_head, head + 1 );
+        }
+    }
+    f->front = b->next;
+    b->next  = NULL;
+
+    return b;
+}
+
+static hb_buffer_t * fifo_spsc_get( hb_fifo_t * f )
+{
+    hb_buffer_t * b = fifo_spsc_take( f );
+
+    if ( b != NULL )
+    {
+        hb_atomic_sub( &f->bytes, b->size );
+        hb_atomic_sub( &f->size, 1 );
+        fifo_spsc_signal_full( f );
+    }
+    return b;
+}
+
+static int fifo_spsc_get_list( hb_fifo_t * f, hb_buffer_list_t * list,
+                               int max )
+{
+    hb_buffer_t * b;
+    int           count = 0, bytes = 0;
+
+    while ( ( max <= 0 || count < max ) &&
+            ( b = fifo_spsc_take( f ) ) != NULL )
+    {
+        count += 1;
+        bytes += b->size;
+        hb_buffer_list_append( list, b );
+    }
+    if ( count > 0 )
+    {
+        hb_atomic_sub( &f->bytes, bytes );
+        hb_atomic_sub( &f->size, count );
+        fifo_spsc_signal_full( f );
+    }
+    return count;
+}
+
+static int fifo_spsc_empty( hb_fifo_t * f )
+{
+    return f->front == NULL &&
+           hb_atomic_load( &f->ring_tail ) == f->ring_head &&
+           !hb_atomic_load( &f->overflow );
+}
+
+static hb_buffer_t * fifo_spsc_see_wait( hb_fifo_t * f )
+{
+    hb_buffer_t * b = fifo_spsc_see( f, 0 );
+    uint64_t      t0;
+
+    if ( b != NULL )
+    {
+        return b;
+    }
+    t0 = hb_get_time_us();
+    hb_lock( f->lock );
+    for (;;)
+    {
+        hb_atomic_store( &f->wait_empty, 1 );
+        hb_atomic_fence();
+        if ( !fifo_spsc_empty( f ) || f->shutdown )
+        {
+            break;
+        }
+        hb_cond_wait( f->cond_empty, f->lock );
+    }
+    f->wait_empty = 0;
+    f->wait_empty_time += hb_get_time_us() - t0;
+    hb_unlock( f->lock );
+
+    return fifo_spsc_see( f, 0 );
+}
+
+static int fifo_spsc_full_wait( hb_fifo_t * f )
+{
+    uint64_t t0;
+
+    if ( hb_atomic_load( &f->size ) < hb_atomic_load_relaxed( &f->capacity ) )
+    {
+        return 1;
+    }
+    t0 = hb_get_time_us();
+    hb_lock( f->lock );
+    for (;;)
+    {
+        hb_atomic_store( &f->wait_full, 1 );
+        hb_atomic_fence();
+        if ( hb_atomic_load( &f->size ) < f->capacity || f->shutdown )
+        {
+            break;
+        }
+        hb_cond_wait( f->cond_full, f->lock );
+    }
+    f->wait_full = 0;
+    f->wait_full_time += hb_get_time_us() - t0;
+    hb_unlock( f->lock );
+
+    return 1;
+}
+
+static void fifo_spsc_push_head( hb_fifo_t * f, hb_buffer_t * b )
+{
+    hb_buffer_t * tmp;
+    uint32_t      count = 1;
+    int           bytes = b->size;
+
+    for ( tmp = b; tmp->next != NULL; tmp = tmp->next )
+    {
+        count += 1;
+        bytes += tmp->next->size;
+    }
+    tmp->next = f->front;
+    f->front  = b;
+    hb_atomic_add( &f->bytes, bytes );
+    hb_atomic_add( &f->size, count );
+}
+
+// Switches an empty fifo to the lock-free single producer / single
+// consumer mode described above.  Must be called before any thread
+// uses the fifo.  Fifos that are not empty are left as they are.
+void hb_fifo_set_spsc( hb_fifo_t * f )
+{
+    uint32_t ring_size = 1;
+
+    if ( f == NULL || f->spsc || f->spill != NULL || f->size > 0 )
+        return;
+
+    while ( ring_size < MAX( f->capacity, f->max_capacity ) &&
+            ring_size < FIFO_RING_MAX )
+    {
+        ring_size <<= 1;
+    }
+    f->ring = calloc( ring_size, sizeof( hb_buffer_t * ) );
+    if ( f->ring == NULL )
+        return;
+    f->ring_mask = ring_size - 1;
+    f->ring_head = f->ring_tail = 0;
+    f->spsc = 1;
+}
+
+// Lets the fifo write the data of its oldest buffers to disk when the
+// queued data of the job exceeds its memory limit, see spill.c.  For
+// unbounded fifos, must be called before any thread uses the fifo.
+// Does nothing for single producer / single consumer fifos.
+void hb_fifo_set_spill( hb_fifo_t * f, hb_spill_t * sp )
+{
+    if ( f == NULL || f->spsc )
+        return;
+
+    f->spill = sp;
+}
+
+// Registers the buffers from 'b' up to 'end', just added to the fifo,
+// with the spill store and spills the oldest buffers of the fifo while
+// the store is over its limit.  Called with the lock held.
+static void fifo_spill( hb_fifo_t * f, hb_buffer_t * b, hb_buffer_t * end )
+{
+    for ( ; b != end; b = b->next )
+    {
+        hb_spill_queue( f->spill, b );
+    }
+    while ( hb_spill_over( f->spill ) )
+    {
+        b = f->spill_last != NULL ? f->spill_last->next : f->first;
+        if ( b == NULL || hb_spill_out( b ) < 0 )
+            break;
+        f->spill_last = b;
+    }
+}
+
+hb_fifo_t * hb_fifo_init( int capacity, int thresh )
+{
+    hb_fifo_t * f;
+    f             = calloc( sizeof( hb_fifo_t ), 1 );
+    f->lock       = hb_lock_init();
+    f->cond_full  = hb_cond_init();
+    f->cond_empty = hb_cond_init();
+    f->capacity   = capacity;
+    f->thresh     = thresh;
+    f->buffer_size = 0;
+    f->init_capacity = capacity;
+    f->init_thresh   = thresh;
+
+#if defined(HB_FIFO_DEBUG)
+    // Add the fifo to the global fifo list
+    fifo_list_add( f );
+#endif
+    return f;
+}
+
+// Sets the largest capacity hb_fifo_set_capacity() may give the fifo.
+// Must be called before hb_fifo_set_spsc() so that the ring is sized
+// for it.
+void hb_fifo_set_max_capacity( hb_fifo_t * f, int max )
+{
+    f->max_capacity = max;
+}
+
+// Changes the capacity of a fifo that may be in use.  The wake up
+// threshold keeps its ratio to the capacity.  A producer waiting for
+// room is woken if the fifo is no longer full.
+void hb_fifo_set_capacity( hb_fifo_t * f, int capacity )
+{
+    uint32_t thresh;
+
+    if ( f->max_capacity > 0 && capacity > f->max_capacity )
+    {
+        capacity = f->max_capacity;
+    }
+    if ( capacity < 1 )
+    {
+        capacity = 1;
+    }
+    thresh = (uint64_t)f->init_thresh * capacity / f->init_capacity;
+    thresh = MAX( 1, MIN( thresh, (uint32_t)capacity ) );
+
+    hb_lock( f->lock );
+    hb_atomic_store( &f->thresh, thresh );
+    hb_atomic_store( &f->capacity, capacity );
+    if ( f->spsc )
+    {
+        hb_unlock( f->lock );
+        fifo_spsc_signal_full( f );
+        return;
+    }
+    fifo_signal_full( f );
+    hb_unlock( f->lock );
+}
+
+int hb_fifo_capacity( hb_fifo_t * f )
+{
+    return hb_atomic_load_relaxed( &f->capacity );
+}
+
+// Returns the total time in microseconds threads were blocked on the
+// fifo being empty (consumer) and full (producer).
+void hb_fifo_wait_times( hb_fifo_t * f, uint64_t * empty, uint64_t * full )
+{
+    hb_lock( f->lock );
+    *empty = f->wait_empty_time;
+    *full  = f->wait_full_time;
+    hb_unlock( f->lock );
+}
+
+void hb_fifo_register_full_cond( hb_fifo_t * f, hb_cond_t * c )
+{
+    f->cond_alert_full = c;
+}
+
+int hb_fifo_size_bytes( hb_fifo_t * f )
+{
+    int ret = 0;
+    hb_buffer_t * link;
+
+    if ( f->spsc )
+    {
+        return hb_atomic_load( &f->bytes );
+    }
 
     hb_lock( f->lock );
     link = f->first;
@@ -881,6 +1826,11 @@ int hb_fifo_size( hb_fifo_t * f )
 {
     int ret;
 
+    if ( f->spsc )
+    {
+        return hb_atomic_load( &f->size );
+    }
+
     hb_lock( f->lock );
     ret = f->size;
     hb_unlock( f->lock );
@@ -892,6 +1842,11 @@ int hb_fifo_is_full( hb_fifo_t * f )
 {
     int ret;
 
+    if ( f->spsc )
+    {
+        return hb_atomic_load( &f->size ) >= f->capacity;
+    }
+
     hb_lock( f->lock );
     ret = ( f->size >= f->capacity );
     hb_unlock( f->lock );
@@ -903,6 +1858,11 @@ float hb_fifo_percent_full( hb_fifo_t * f )
 {
     float ret;
 
+    if ( f->spsc )
+    {
+        return hb_atomic_load( &f->size ) / f->capacity;
+    }
+
     hb_lock( f->lock );
     ret = f->size / f->capacity;
     hb_unlock( f->lock );
@@ -911,41 +1871,62 @@ float hb_fifo_percent_full( hb_fifo_t * f )
 }
 
 // Pulls the first packet out of this FIFO, blocking until such a packet is available.
-// Returns NULL if this FIFO has been closed or flushed.
+// Returns NULL if this FIFO has been shut down.
 hb_buffer_t * hb_fifo_get_wait( hb_fifo_t * f )
 {
     hb_buffer_t * b;
+    uint64_t      t0 = 0;
 
-    hb_lock( f->lock );
-    if( f->size < 1 )
+    if ( f->spsc )
     {
-        f->wait_empty = 1;
-        hb_cond_timedwait( f->cond_empty, f->lock, FIFO_TIMEOUT );
-        if( f->size < 1 )
+        if ( fifo_spsc_see_wait( f ) == NULL )
         {
-            hb_unlock( f->lock );
             return NULL;
         }
+        return fifo_spsc_get( f );
+    }
+
+    hb_lock( f->lock );
+    while( f->size < 1 && !f->shutdown )
+    {
+        if ( t0 == 0 )
+            t0 = hb_get_time_us();
+        f->wait_empty = 1;
+        hb_cond_wait( f->cond_empty, f->lock );
+    }
+    if ( t0 != 0 )
+        f->wait_empty_time += hb_get_time_us() - t0;
+    if( f->size < 1 )
+    {
+        hb_unlock( f->lock );
+        return NULL;
     }
     b         = f->first;
     f->first  = b->next;
     b->next   = NULL;
     f->size  -= 1;
-    if( f->wait_full && f->size == f->capacity - f->thresh )
-    {
-        f->wait_full = 0;
-        hb_cond_signal( f->cond_full );
-    }
+    if ( b == f->spill_last )
+        f->spill_last = NULL;
+    fifo_signal_full( f );
     hb_unlock( f->lock );
 
+    if ( f->spill != NULL )
+        hb_spill_unqueue( b );
+
     return b;
 }
 
-// Pulls a packet out of this FIFO, or returns NULL if no packet is available.
-hb_buffer_t * hb_fifo_get( hb_fifo_t * f )
+// Takes the first packet out of this FIFO without reading back data
+// that was spilled to disk, or returns NULL if no packet is available.
+static hb_buffer_t * fifo_take( hb_fifo_t * f )
 {
     hb_buffer_t * b;
 
+    if ( f->spsc )
+    {
+        return fifo_spsc_get( f );
+    }
+
     hb_lock( f->lock );
     if( f->size < 1 )
     {
@@ -956,32 +1937,98 @@ hb_buffer_t * hb_fifo_get( hb_fifo_t * f )
     f->first  = b->next;
     b->next   = NULL;
     f->size  -= 1;
-    if( f->wait_full && f->size == f->capacity - f->thresh )
+    if ( b == f->spill_last )
+        f->spill_last = NULL;
+    fifo_signal_full( f );
+    hb_unlock( f->lock );
+
+    return b;
+}
+
+// Pulls a packet out of this FIFO, or returns NULL if no packet is available.
+hb_buffer_t * hb_fifo_get( hb_fifo_t * f )
+{
+    hb_buffer_t * b = fifo_take( f );
+
+    if ( b != NULL && f->spill != NULL )
+        hb_spill_unqueue( b );
+
+    return b;
+}
+
+// Moves up to 'max' buffers (all of them if max <= 0) from the start of
+// this FIFO to the end of 'list' under a single lock.
+// Returns the number of buffers moved, 0 if the FIFO is empty.
+int hb_fifo_get_list( hb_fifo_t * f, hb_buffer_list_t * list, int max )
+{
+    hb_buffer_t * first, * last;
+    int           count;
+
+    if ( f->spsc )
     {
-        f->wait_full = 0;
-        hb_cond_signal( f->cond_full );
+        return fifo_spsc_get_list( f, list, max );
     }
+
+    hb_lock( f->lock );
+    if( f->size < 1 )
+    {
+        hb_unlock( f->lock );
+        return 0;
+    }
+    first = last = f->first;
+    for ( count = 1; ( max <= 0 || count < max ) && last->next != NULL;
+          count++ )
+    {
+        if ( last == f->spill_last )
+            f->spill_last = NULL;
+        last = last->next;
+    }
+    if ( last == f->spill_last )
+        f->spill_last = NULL;
+    f->first   = last->next;
+    last->next = NULL;
+    f->size   -= count;
+    fifo_signal_full( f );
     hb_unlock( f->lock );
 
-    return b;
+    if ( f->spill != NULL )
+    {
+        for ( last = first; last != NULL; last = last->next )
+            hb_spill_unqueue( last );
+    }
+    hb_buffer_list_append( list, first );
+
+    return count;
 }
 
 hb_buffer_t * hb_fifo_see_wait( hb_fifo_t * f )
 {
     hb_buffer_t * b;
+    uint64_t      t0 = 0;
+
+    if ( f->spsc )
+    {
+        return fifo_spsc_see_wait( f );
+    }
 
     hb_lock( f->lock );
-    if( f->size < 1 )
+    while( f->size < 1 && !f->shutdown )
     {
+        if ( t0 == 0 )
+            t0 = hb_get_time_us();
         f->wait_empty = 1;
-        hb_cond_timedwait( f->cond_empty, f->lock, FIFO_TIMEOUT );
-        if( f->size < 1 )
-        {
-            hb_unlock( f->lock );
-            return NULL;
-        }
+        hb_cond_wait( f->cond_empty, f->lock );
+    }
+    if ( t0 != 0 )
+        f->wait_empty_time += hb_get_time_us() - t0;
+    if( f->size < 1 )
+    {
+        hb_unlock( f->lock );
+        return NULL;
     }
     b = f->first;
+    if ( f->spill != NULL )
+        hb_spill_in( b );
     hb_unlock( f->lock );
 
     return b;
@@ -993,6 +2040,11 @@ hb_buffer_t * hb_fifo_see( hb_fifo_t * f )
 {
     hb_buffer_t * b;
 
+    if ( f->spsc )
+    {
+        return fifo_spsc_see( f, 0 );
+    }
+
     hb_lock( f->lock );
     if( f->size < 1 )
     {
@@ -1000,6 +2052,8 @@ hb_buffer_t * hb_fifo_see( hb_fifo_t * f )
         return NULL;
     }
     b = f->first;
+    if ( f->spill != NULL )
+        hb_spill_in( b );
     hb_unlock( f->lock );
 
     return b;
@@ -1009,6 +2063,11 @@ hb_buffer_t * hb_fifo_see2( hb_fifo_t * f )
 {
     hb_buffer_t * b;
 
+    if ( f->spsc )
+    {
+        return fifo_spsc_see( f, 1 );
+    }
+
     hb_lock( f->lock );
     if( f->size < 2 )
     {
@@ -1016,24 +2075,36 @@ hb_buffer_t * hb_fifo_see2( hb_fifo_t * f )
         return NULL;
     }
     b = f->first->next;
+    if ( f->spill != NULL )
+        hb_spill_in( b );
     hb_unlock( f->lock );
 
     return b;
 }
 
-// Waits until the specified FIFO is no longer full or until FIFO_TIMEOUT milliseconds have elapsed.
-// Returns whether the FIFO is non-full upon return.
+// Waits until the specified FIFO is no longer full or has been shut down.
+// Returns whether the caller may push to the FIFO upon return.
 int hb_fifo_full_wait( hb_fifo_t * f )
 {
-    int result;
+    int      result;
+    uint64_t t0 = 0;
+
+    if ( f->spsc )
+    {
+        return fifo_spsc_full_wait( f );
+    }
 
     hb_lock( f->lock );
-    if( f->size >= f->capacity )
+    while( f->size >= f->capacity && !f->shutdown )
     {
+        if ( t0 == 0 )
+            t0 = hb_get_time_us();
         f->wait_full = 1;
-        hb_cond_timedwait( f->cond_full, f->lock, FIFO_TIMEOUT );
+        hb_cond_wait( f->cond_full, f->lock );
     }
-    result = ( f->size < f->capacity );
+    if ( t0 != 0 )
+        f->wait_full_time += hb_get_time_us() - t0;
+    result = ( f->size < f->capacity ) || f->shutdown;
     hb_unlock( f->lock );
     return result;
 }
@@ -1042,19 +2113,35 @@ int hb_fifo_full_wait( hb_fifo_t * f )
 // blocking until the FIFO has space available.
 void hb_fifo_push_wait( hb_fifo_t * f, hb_buffer_t * b )
 {
+    uint64_t t0 = 0;
+
     if( !b )
     {
         return;
     }
 
+    if ( f->spsc )
+    {
+        fifo_spsc_full_wait( f );
+        fifo_spsc_push( f, b );
+        return;
+    }
+
     hb_lock( f->lock );
-    if( f->size >= f->capacity )
+    if (f->size >= f->capacity &&
+        f->cond_alert_full != NULL)
+    {
+        hb_cond_broadcast( f->cond_alert_full );
+    }
+    while( f->size >= f->capacity && !f->shutdown )
     {
+        if ( t0 == 0 )
+            t0 = hb_get_time_us();
         f->wait_full = 1;
-        if (f->cond_alert_full != NULL)
-            hb_cond_broadcast( f->cond_alert_full );
-        hb_cond_timedwait( f->cond_full, f->lock, FIFO_TIMEOUT );
+        hb_cond_wait( f->cond_full, f->lock );
     }
+    if ( t0 != 0 )
+        f->wait_full_time += hb_get_time_us() - t0;
     if( f->size > 0 )
     {
         f->last->next = b;
@@ -1070,11 +2157,9 @@ void hb_fifo_push_wait( hb_fifo_t * f, hb_buffer_t * b )
         f->size += 1;
         f->last  = f->last->next;
     }
-    if( f->wait_empty && f->size >= 1 )
-    {
-        f->wait_empty = 0;
-        hb_cond_signal( f->cond_empty );
-    }
+    if ( f->spill != NULL )
+        fifo_spill( f, b, NULL );
+    fifo_signal_empty( f );
     hb_unlock( f->lock );
 }
 
@@ -1086,6 +2171,12 @@ void hb_fifo_push( hb_fifo_t * f, hb_buffer_t * b )
         return;
     }
 
+    if ( f->spsc )
+    {
+        fifo_spsc_push( f, b );
+        return;
+    }
+
     hb_lock( f->lock );
     if (f->size >= f->capacity &&
         f->cond_alert_full != NULL)
@@ -1107,14 +2198,19 @@ void hb_fifo_push( hb_fifo_t * f, hb_buffer_t * b )
         f->size += 1;
         f->last  = f->last->next;
     }
-    if( f->wait_empty && f->size >= 1 )
-    {
-        f->wait_empty = 0;
-        hb_cond_signal( f->cond_empty );
-    }
+    if ( f->spill != NULL )
+        fifo_spill( f, b, NULL );
+    fifo_signal_empty( f );
     hb_unlock( f->lock );
 }
 
+// Appends all buffers of the specified list to the end of the specified
+// FIFO under a single lock and empties the list.
+void hb_fifo_push_list( hb_fifo_t * f, hb_buffer_list_t * list )
+{
+    hb_fifo_push( f, hb_buffer_list_clear( list ) );
+}
+
 // Prepends the specified packet list to the start of the specified FIFO.
 void hb_fifo_push_head( hb_fifo_t * f, hb_buffer_t * b )
 {
@@ -1126,6 +2222,12 @@ void hb_fifo_push_head( hb_fifo_t * f, hb_buffer_t * b )
         return;
     }
 
+    if ( f->spsc )
+    {
+        fifo_spsc_push_head( f, b );
+        return;
+    }
+
     hb_lock( f->lock );
     if (f->size >= f->capacity &&
         f->cond_alert_full != NULL)
@@ -1154,7 +2256,32 @@ void hb_fifo_push_head( hb_fifo_t * f, hb_buffer_t * b )
 
     f->first = b;
     f->size += ( size + 1 );
+    if ( f->spill != NULL )
+        fifo_spill( f, b, tmp->next );
+    fifo_signal_empty( f );
+
+    hb_unlock( f->lock );
+}
+
+// Releases every thread blocked on the specified FIFO.  After shutdown,
+// hb_fifo_get_wait and hb_fifo_see_wait return NULL when the FIFO is
+// empty and hb_fifo_full_wait no longer blocks.  Used to stop pipeline
+// threads when a job finishes or is cancelled.
+void hb_fifo_shutdown( hb_fifo_t * f )
+{
+    if ( f == NULL )
+        return;
 
+    hb_lock( f->lock );
+    f->shutdown   = 1;
+    f->wait_empty = 0;
+    f->wait_full  = 0;
+    hb_cond_broadcast( f->cond_empty );
+    hb_cond_broadcast( f->cond_full );
+    if (f->cond_alert_full != NULL)
+    {
+        hb_cond_broadcast( f->cond_alert_full );
+    }
     hb_unlock( f->lock );
 }
 
@@ -1167,7 +2294,7 @@ void hb_fifo_close( hb_fifo_t ** _f )
         return;
 
     hb_deep_log( 2, "fifo_close: trashing %d buffer(s)", hb_fifo_size( f ) );
-    while( ( b = hb_fifo_get( f ) ) )
+    while( ( b = fifo_take( f ) ) )
     {
         hb_buffer_close( &b );
     }
@@ -1175,6 +2302,7 @@ void hb_fifo_close( hb_fifo_t ** _f )
     hb_lock_close( &f->lock );
     hb_cond_close( &f->cond_empty );
     hb_cond_close( &f->cond_full );
+    free( f->ring );
 
 #if defined(HB_FIFO_DEBUG)
     // Remove the fifo from the global fifo list
@@ -1190,13 +2318,12 @@ void hb_fifo_flush( hb_fifo_t * f )
 {
     hb_buffer_t * b;
 
-    while( ( b = hb_fifo_get( f ) ) )
+    while( ( b = fifo_take( f ) ) )
     {
         hb_buffer_close( &b );
     }
     hb_lock( f->lock );
-    hb_cond_signal( f->cond_empty );
-    hb_cond_signal( f->cond_full );
+    fifo_signal_full( f );
     hb_unlock( f->lock );
 
 }
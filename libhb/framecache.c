@@ -0,0 +1,611 @@
+/* framecache.c
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*
+ * Pass 1 to pass 2 frame cache.
+ *
+ * Both passes of a two-pass encode read, decode, synchronize and filter
+ * the whole title, only to produce the same pictures twice.  With
+ * job->frame_cache_budget set, the first pass stores what its video
+ * encoder and muxer are given in temporary files: the filtered
+ * pictures as raw planes and the packets of the audio and passthru
+ * subtitle tracks, which pass 1 would otherwise discard.  The second
+ * pass then has a cache reader per track in place of the reader,
+ * decoders, sync, audio encoders and filters.
+ *
+ * Buffer settings are stored as they are, so timestamps, flags and
+ * chapter marks are those the second pass would have computed itself.
+ * The cache is given up on when it grows past its budget or when the
+ * first pass does not run to the end, the second pass then processes
+ * the source as usual.
+ *
+ * Tracks are numbered like those of the muxer: the video is track 0,
+ * followed by the audio tracks and the passthru subtitle tracks.
+ */
+
+#include "hb.h"
+
+#define CACHE_IO_BUFFER (1024 * 1024)
+
+typedef struct
+{
+    hb_buffer_settings_t s;
+    hb_image_format_t    f;
+    int                  size;      // packet payload, 0 for pictures
+    int                  row[4];    // pictures: bytes stored per row
+    int                  rows[4];   //           and rows of each plane
+} cache_record_t;
+
+typedef struct
+{
+    char          * path;
+    FILE          * file;
+    int             eof;        // pass 1 wrote all of the track
+    uint64_t        count;      // records written
+
+    // Audio tracks: stream configuration set up by the decoder and
+    // encoder of pass 1, needed by the muxer of pass 2
+    hb_esconfig_t   config;
+    int             samples_per_frame;
+} cache_track_t;
+
+struct hb_frame_cache_s
+{
+    int             ntracks;
+    cache_track_t * tracks;
+    uint64_t        budget;     // bytes
+    uint64_t        used;
+    int             failed;
+    int             complete;
+
+    // Subtitle ids and destinations of pass 1, burned in subtitles
+    // change the cached pictures
+    int             nsubtitles;
+    int           * subtitles;
+};
+
+struct hb_work_private_s
+{
+    hb_job_t         * job;
+    hb_frame_cache_t * cache;
+    cache_track_t    * track;
+    int                index;
+    uint64_t           frames;
+    uint64_t           st_first;
+    uint64_t           st_last;
+};
+
+static int cache_track_count( hb_job_t * job )
+{
+    int ii, count;
+
+    count = 1 + hb_list_count(job->list_audio);
+    for (ii = 0; ii < hb_list_count(job->list_subtitle); ii++)
+    {
+        hb_subtitle_t * subtitle = hb_list_item(job->list_subtitle, ii);
+        if (subtitle->config.dest == PASSTHRUSUB)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+static void cache_fail( hb_frame_cache_t * cache, const char * reason )
+{
+    if (!hb_atomic_exchange(&cache->failed, 1))
+    {
+        hb_log("framecache: %s, the second pass will process the source",
+               reason);
+    }
+}
+
+/*
+ * Creates the cache files for the tracks of the first pass 'job'.
+ * Returns NULL if the cache can not be used.
+ */
+hb_frame_cache_t * hb_frame_cache_init( hb_job_t * job )
+{
+    hb_frame_cache_t * cache;
+    char               path[1024];
+    int                ii;
+
+    cache = calloc(1, sizeof(hb_frame_cache_t));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->budget  = (uint64_t)job->frame_cache_budget * 1024 * 1024;
+    cache->ntracks = cache_track_count(job);
+    cache->tracks  = calloc(cache->ntracks, sizeof(cache_track_t));
+    cache->nsubtitles = hb_list_count(job->list_subtitle);
+    cache->subtitles  = calloc(cache->nsubtitles + 1, 2 * sizeof(int));
+    if (cache->tracks == NULL || cache->subtitles == NULL)
+    {
+        hb_frame_cache_close(&cache);
+        return NULL;
+    }
+    for (ii = 0; ii < cache->nsubtitles; ii++)
+    {
+        hb_subtitle_t * subtitle = hb_list_item(job->list_subtitle, ii);
+        cache->subtitles[2 * ii]     = subtitle->id;
+        cache->subtitles[2 * ii + 1] = subtitle->config.dest;
+    }
+
+    for (ii = 0; ii < cache->ntracks; ii++)
+    {
+        cache_track_t * track = &cache->tracks[ii];
+
+        hb_get_tempory_filename(job->h, path, "cache.%d.%d",
+                                job->sequence_id, ii);
+        track->path = strdup(path);
+        track->file = hb_fopen(path, "w+b");
+        if (track->file == NULL)
+        {
+            hb_error("framecache: unable to create %s", path);
+            hb_frame_cache_close(&cache);
+            return NULL;
+        }
+        setvbuf(track->file, NULL, _IOFBF, CACHE_IO_BUFFER);
+    }
+    hb_log("framecache: caching the first pass, budget %d MiB",
+           job->frame_cache_budget);
+
+    return cache;
+}
+
+/*
+ * Appends 'buf' to 'track'.  An EOF buffer marks the track complete.
+ * Writes are dropped once the cache has failed.
+ */
+void hb_frame_cache_write( hb_frame_cache_t * cache, int index,
+                           const hb_buffer_t * buf )
+{
+    cache_track_t  * track;
+    cache_record_t   rec;
+    uint64_t         size;
+    int              pp, yy;
+
+    if (index < 0 || index >= cache->ntracks ||
+        hb_atomic_load_relaxed(&cache->failed))
+    {
+        return;
+    }
+    track = &cache->tracks[index];
+    if (buf->s.flags & HB_BUF_FLAG_EOF)
+    {
+        if (fflush(track->file) != 0)
+        {
+            cache_fail(cache, "write failed");
+            return;
+        }
+        hb_atomic_store(&track->eof, 1);
+        return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.s = buf->s;
+    rec.f = buf->f;
+    size  = sizeof(rec);
+    if (buf->s.type == FRAME_BUF)
+    {
+        for (pp = 0; pp < 4 && buf->plane[pp].data != NULL; pp++)
+        {
+            // Rows are stored without the padding of the source stride
+            rec.row[pp]  = MIN(buf->plane[pp].stride,
+                               hb_image_stride(buf->f.fmt, buf->f.width, pp));
+            rec.rows[pp] = buf->plane[pp].height;
+            size += (uint64_t)rec.row[pp] * rec.rows[pp];
+        }
+    }
+    else
+    {
+        rec.size = buf->size;
+        size += buf->size;
+    }
+
+    // The video is written by the cache writer, the other tracks by
+    // the track threads of the muxer
+    if (hb_atomic_add(&cache->used, size) > cache->budget)
+    {
+        cache_fail(cache, "budget exceeded");
+        return;
+    }
+
+    if (fwrite(&rec, sizeof(rec), 1, track->file) != 1)
+    {
+        cache_fail(cache, "write failed");
+        return;
+    }
+    if (buf->s.type == FRAME_BUF)
+    {
+        for (pp = 0; pp < 4 && rec.row[pp] > 0; pp++)
+        {
+            const uint8_t * src = buf->plane[pp].data;
+            for (yy = 0; yy < rec.rows[pp]; yy++)
+            {
+                if (fwrite(src, rec.row[pp], 1, track->file) != 1)
+                {
+                    cache_fail(cache, "write failed");
+                    return;
+                }
+                src += buf->plane[pp].stride;
+            }
+        }
+    }
+    else if (buf->size > 0 &&
+             fwrite(buf->data, buf->size, 1, track->file) != 1)
+    {
+        cache_fail(cache, "write failed");
+        return;
+    }
+    track->count++;
+}
+
+/*
+ * Called at the end of a first pass that ran to completion.  Keeps the
+ * audio configuration for the muxer of the second pass.
+ */
+void hb_frame_cache_finish( hb_frame_cache_t * cache, hb_job_t * job )
+{
+    int ii;
+
+    for (ii = 0; ii < cache->ntracks; ii++)
+    {
+        if (!hb_atomic_load(&cache->tracks[ii].eof))
+        {
+            cache_fail(cache, "first pass incomplete");
+        }
+    }
+    if (hb_atomic_load(&cache->failed))
+    {
+        return;
+    }
+    for (ii = 0; ii < hb_list_count(job->list_audio); ii++)
+    {
+        hb_audio_t * audio = hb_list_item(job->list_audio, ii);
+
+        cache->tracks[1 + ii].config = audio->priv.config;
+        cache->tracks[1 + ii].samples_per_frame =
+            audio->config.out.samples_per_frame;
+    }
+    cache->complete = 1;
+    hb_log("framecache: %"PRIu64" frames, %"PRIu64" MiB cached",
+           cache->tracks[0].count, cache->used >> 20);
+}
+
+/*
+ * Whether the second pass 'job' can take its input from the cache.
+ * Restores the audio configuration of the first pass if it can.
+ */
+int hb_frame_cache_usable( hb_frame_cache_t * cache, hb_job_t * job )
+{
+    int ii;
+
+    if (cache == NULL || !cache->complete)
+    {
+        return 0;
+    }
+    if (cache->ntracks != cache_track_count(job) ||
+        cache->nsubtitles != hb_list_count(job->list_subtitle))
+    {
+        hb_log("framecache: track count changed, not used");
+        return 0;
+    }
+    for (ii = 0; ii < cache->nsubtitles; ii++)
+    {
+        hb_subtitle_t * subtitle = hb_list_item(job->list_subtitle, ii);
+        if (cache->subtitles[2 * ii]     != subtitle->id ||
+            cache->subtitles[2 * ii + 1] != subtitle->config.dest)
+        {
+            hb_log("framecache: subtitle selection changed, not used");
+            return 0;
+        }
+    }
+    for (ii = 0; ii < cache->ntracks; ii++)
+    {
+        if (fseek(cache->tracks[ii].file, 0, SEEK_SET) != 0)
+        {
+            return 0;
+        }
+    }
+    for (ii = 0; ii < hb_list_count(job->list_audio); ii++)
+    {
+        hb_audio_t * audio = hb_list_item(job->list_audio, ii);
+
+        audio->priv.config = cache->tracks[1 + ii].config;
+        audio->config.out.samples_per_frame =
+            cache->tracks[1 + ii].samples_per_frame;
+        if (audio->config.out.codec == HB_ACODEC_VORBIS)
+        {
+            // Points into the audio of the first pass job
+            audio->priv.config.vorbis.language = audio->config.lang.simple;
+        }
+    }
+    return 1;
+}
+
+void hb_frame_cache_close( hb_frame_cache_t ** _cache )
+{
+    hb_frame_cache_t * cache = *_cache;
+    int                ii;
+
+    if (cache == NULL)
+    {
+        return;
+    }
+    *_cache = NULL;
+
+    for (ii = 0; ii < cache->ntracks && cache->tracks != NULL; ii++)
+    {
+        cache_track_t * track = &cache->tracks[ii];
+        if (track->file != NULL)
+        {
+            fclose(track->file);
+        }
+        if (track->path != NULL)
+        {
+            remove(track->path);
+            free(track->path);
+        }
+    }
+    free(cache->tracks);
+    free(cache->subtitles);
+    free(cache);
+}
+
+static hb_buffer_t * cache_read( cache_track_t * track )
+{
+    cache_record_t   rec;
+    hb_buffer_t    * buf;
+    int              pp, yy;
+
+    if (fread(&rec, sizeof(rec), 1, track->file) != 1)
+    {
+        return NULL;
+    }
+    if (rec.s.type == FRAME_BUF)
+    {
+        buf = hb_frame_buffer_init(rec.f.fmt, rec.f.width, rec.f.height);
+        if (buf == NULL)
+        {
+            return NULL;
+        }
+        for (pp = 0; pp < 4 && rec.row[pp] > 0; pp++)
+        {
+            uint8_t * dst = buf->plane[pp].data;
+            if (dst == NULL || rec.row[pp] > buf->plane[pp].stride ||
+                rec.rows[pp] > buf->plane[pp].height_stride)
+            {
+                hb_buffer_close(&buf);
+                return NULL;
+            }
+            for (yy = 0; yy < rec.rows[pp]; yy++)
+            {
+                if (fread(dst, rec.row[pp], 1, track->file) != 1)
+                {
+                    hb_buffer_close(&buf);
+                    return NULL;
+                }
+                dst += buf->plane[pp].stride;
+            }
+        }
+    }
+    else
+    {
+        buf = hb_buffer_init(rec.size);
+        if (buf == NULL ||
+            (rec.size > 0 && fread(buf->data, rec.size, 1, track->file) != 1))
+        {
+            hb_buffer_close(&buf);
+            return NULL;
+        }
+    }
+    buf->s = rec.s;
+    buf->f = rec.f;
+
+    return buf;
+}
+
+/*
+ * Cache writer, sits between the filters and the video encoder of the
+ * first pass
+ */
+static int cache_writer_init( hb_work_object_t * w, hb_job_t * job )
+{
+    hb_work_private_t * pv = calloc(1, sizeof(hb_work_private_t));
+
+    if (pv == NULL)
+    {
+        return -1;
+    }
+    w->private_data = pv;
+    pv->job   = job;
+    pv->cache = job->frame_cache;
+
+    return 0;
+}
+
+static int cache_writer_work( hb_work_object_t * w, hb_buffer_t ** buf_in,
+                              hb_buffer_t ** buf_out )
+{
+    hb_work_private_t * pv  = w->private_data;
+    hb_buffer_t       * in  = *buf_in;
+
+    hb_frame_cache_write(pv->cache, 0, in);
+
+    *buf_in  = NULL;
+    *buf_out = in;
+    if (in->s.flags & HB_BUF_FLAG_EOF)
+    {
+        return HB_WORK_DONE;
+    }
+    return HB_WORK_OK;
+}
+
+static void cache_writer_close( hb_work_object_t * w )
+{
+    free(w->private_data);
+    w->private_data = NULL;
+}
+
+hb_work_object_t hb_frame_cache_writer =
+{
+    WORK_CACHE_WRITE,
+    "Frame cache writer",
+    cache_writer_init,
+    cache_writer_work,
+    cache_writer_close
+};
+
+/*
+ * Cache reader, the source of one track of the second pass.  The video
+ * track reader also reports progress, which sync does otherwise.
+ */
+static int cache_reader_init( hb_work_object_t * w, hb_job_t * job )
+{
+    hb_work_private_t * pv = calloc(1, sizeof(hb_work_private_t));
+    int                 ii;
+
+    if (pv == NULL)
+    {
+        return -1;
+    }
+    w->private_data = pv;
+    pv->job   = job;
+    pv->cache = job->frame_cache;
+
+    if (w->audio != NULL)
+    {
+        for (ii = 0; ii < hb_list_count(job->list_audio); ii++)
+        {
+            if (hb_list_item(job->list_audio, ii) == w->audio)
+            {
+                pv->index = 1 + ii;
+                break;
+            }
+        }
+    }
+    else if (w->subtitle != NULL)
+    {
+        pv->index = 1 + hb_list_count(job->list_audio);
+        for (ii = 0; ii < hb_list_count(job->list_subtitle); ii++)
+        {
+            hb_subtitle_t * subtitle = hb_list_item(job->list_subtitle, ii);
+            if (subtitle == w->subtitle)
+            {
+                break;
+            }
+            if (subtitle->config.dest == PASSTHRUSUB)
+            {
+                pv->index++;
+            }
+        }
+    }
+    if (pv->index >= pv->cache->ntracks)
+    {
+        return -1;
+    }
+    pv->track = &pv->cache->tracks[pv->index];
+
+    return 0;
+}
+
+static void cache_update_state( hb_work_private_t * pv )
+{
+    hb_job_t   * job   = pv->job;
+    uint64_t     total = pv->track->count;
+    uint64_t     now   = hb_get_date();
+    hb_state_t   state;
+
+    if (pv->frames == 1)
+    {
+        pv->st_first = now;
+        job->st_pause_date = -1;
+        job->st_paused = 0;
+    }
+    if (now < pv->st_last + 250 && pv->frames < total)
+    {
+        return;
+    }
+    pv->st_last = now;
+
+    hb_get_job_state(job, &state);
+    state.state = HB_STATE_WORKING;
+
+#define p state.param.working
+    p.progress = total ? (float)pv->frames / total : 1.0;
+    if (now > pv->st_first + 4000)
+    {
+        int eta;
+        p.rate_avg = 1000.0 * pv->frames /
+                     (now - pv->st_first - job->st_paused);
+        p.rate_cur = p.rate_avg;
+        eta = (total - pv->frames) / p.rate_avg;
+        p.hours   = eta / 3600;
+        p.minutes = (eta % 3600) / 60;
+        p.seconds = eta % 60;
+    }
+    else
+    {
+        p.rate_avg = 0.0;
+        p.rate_cur = 0.0;
+        p.hours    = -1;
+        p.minutes  = -1;
+        p.seconds  = -1;
+    }
+#undef p
+
+    hb_set_job_state(job, &state);
+}
+
+static int cache_reader_work( hb_work_object_t * w, hb_buffer_t ** buf_in,
+                              hb_buffer_t ** buf_out )
+{
+    hb_work_private_t * pv = w->private_data;
+    hb_buffer_t       * buf;
+
+    if (pv->frames >= pv->track->count)
+    {
+        *buf_out = hb_buffer_eof_init();
+        return HB_WORK_DONE;
+    }
+
+    buf = cache_read(pv->track);
+    if (buf == NULL)
+    {
+        hb_error("framecache: track %d read failed", pv->index);
+        *pv->job->done_error = HB_ERROR_UNKNOWN;
+        *pv->job->die = 1;
+        return HB_WORK_DONE;
+    }
+    pv->frames++;
+    if (pv->index == 0)
+    {
+        cache_update_state(pv);
+    }
+    *buf_out = buf;
+
+    return HB_WORK_OK;
+}
+
+static void cache_reader_close( hb_work_object_t * w )
+{
+    free(w->private_data);
+    w->private_data = NULL;
+}
+
+hb_work_object_t hb_frame_cache_reader =
+{
+    WORK_CACHE_READ,
+    "Frame cache reader",
+    cache_reader_init,
+    cache_reader_work,
+    cache_reader_close
+};
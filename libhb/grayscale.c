@@ -24,7 +24,7 @@ struct hb_filter_private_s
 {
     int                    cpu_count;
 
-    taskset_t              grayscale_taskset;   // Threads - one per CPU
+    taskset_t              grayscale_taskset;   // Tasks - one per CPU
     grayscale_arguments_t *grayscale_arguments; // Arguments to thread for work
 };
 
@@ -58,13 +58,12 @@ typedef struct grayscale_thread_arg_s {
 } grayscale_thread_arg_t;
 
 /*
- * gray this segment of all three planes in a single thread.
+ * gray this segment of all three planes in a single task.
  */
 void grayscale_filter_thread( void *thread_args_v )
 {
     grayscale_arguments_t *grayscale_work = NULL;
     hb_filter_private_t * pv;
-    int run = 1;
     int plane;
     int segment, segment_start, segment_stop;
     grayscale_thread_arg_t *thread_args = thread_args_v;
@@ -73,60 +72,34 @@ void grayscale_filter_thread( void *thread_args_v )
     pv = thread_args->pv;
     segment = thread_args->segment;
 
-    hb_log("Grayscale thread started for segment %d", segment);
-
-    while( run )
+    grayscale_work = &pv->grayscale_arguments[segment];
+    if (grayscale_work->src == NULL)
     {
-        /*
-         * Wait here until there is work to do.
-         */
-        taskset_thread_wait4start( &pv->grayscale_taskset, segment );
+        hb_error( "Thread started when no work available" );
+        return;
+    }
 
-        if( taskset_thread_stop( &pv->grayscale_taskset, segment ) )
+    /*
+     * Process all three planes, but only this segment of it.
+     */
+    src_buf = grayscale_work->src;
+    for (plane = 1; plane < 3; plane++)
+    {
+        int src_stride = src_buf->plane[plane].stride;
+        int height     = src_buf->plane[plane].height;
+        segment_start = (height / pv->cpu_count) * segment;
+        if (segment == pv->cpu_count - 1)
         {
             /*
-             * No more work to do, exit this thread.
+             * Final segment
              */
-            run = 0;
-            goto report_completion;
-        }
-
-        grayscale_work = &pv->grayscale_arguments[segment];
-        if (grayscale_work->src == NULL)
-        {
-            hb_error( "Thread started when no work available" );
-            hb_snooze(500);
-            goto report_completion;
-        }
-
-        /*
-         * Process all three planes, but only this segment of it.
-         */
-        src_buf = grayscale_work->src;
-        for (plane = 1; plane < 3; plane++)
-        {
-            int src_stride = src_buf->plane[plane].stride;
-            int height     = src_buf->plane[plane].height;
-            segment_start = (height / pv->cpu_count) * segment;
-            if (segment == pv->cpu_count - 1)
-            {
-                /*
-                 * Final segment
-                 */
-                segment_stop = height;
-            } else {
-                segment_stop = (height / pv->cpu_count) * (segment + 1);
-            }
-
-            memset(&src_buf->plane[plane].data[segment_start * src_stride],
-                   0x80, (segment_stop - segment_start) * src_stride);
+            segment_stop = height;
+        } else {
+            segment_stop = (height / pv->cpu_count) * (segment + 1);
         }
 
-report_completion:
-        /*
-         * Finished this segment, let everyone know.
-         */
-        taskset_thread_complete( &pv->grayscale_taskset, segment );
+        memset(&src_buf->plane[plane].data[segment_start * src_stride],
+               0x80, (segment_stop - segment_start) * src_stride);
     }
 }
 
@@ -153,7 +126,7 @@ static void grayscale_filter( hb_filter_private_t * pv,
     }
 
     /*
-     * Allow the taskset threads to make one pass over the data.
+     * Run one task per segment on the shared pool.
      */
     taskset_cycle( &pv->grayscale_taskset );
 
@@ -169,7 +142,7 @@ static int hb_grayscale_init( hb_filter_object_t * filter,
     filter->private_data = calloc( 1, sizeof(struct hb_filter_private_s) );
     hb_filter_private_t * pv = filter->private_data;
 
-    pv->cpu_count = hb_get_cpu_count();
+    pv->cpu_count = hb_filter_thread_count( filter );
 
     /*
      * Create gray taskset.
@@ -245,7 +218,13 @@ static int hb_grayscale_work( hb_filter_object_t * filter,
         return HB_FILTER_DONE;
     }
 
-    // Grayscale!
+    // Grayscale!  The chroma planes are rewritten in place, so the
+    // frame must not be shared with the decoder.
+    if (hb_buffer_make_writable(in) < 0)
+    {
+        hb_buffer_close(&in);
+        return HB_FILTER_FAILED;
+    }
     grayscale_filter(pv, in);
 
     *buf_out = in;
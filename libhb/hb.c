@@ -10,6 +10,7 @@
 #include "hb.h"
 #include "hbffmpeg.h"
 #include "encx264.h"
+#include "threadpool.h"
 #include "libavfilter/avfilter.h"
 #include <stdio.h>
 #include <unistd.h>
@@ -45,12 +46,20 @@ struct hb_handle_s
     int            sequence_id;
     hb_list_t    * jobs;
     hb_job_t     * current_job;
+    int            max_jobs;    // jobs encoded concurrently
+    hb_list_t    * running;     // hb_running_job_t of jobs in do_job
     volatile int   work_die;
     hb_error_code  work_error;
     hb_thread_t  * work_thread;
 
+    /* Signaled when the state of the running job changes (done, die,
+       reader pts offset) so that pipeline threads need not poll */
+    hb_lock_t    * work_lock;
+    hb_cond_t    * work_cond;
+
     hb_lock_t    * state_lock;
     hb_state_t     state;
+    hb_dict_t    * profile;     // pipeline statistics of the last job
 
     int            paused;
     hb_lock_t    * pause_lock;
@@ -66,6 +75,13 @@ struct hb_handle_s
     void         * system_sleep_opaque;
 };
 
+/* Progress of one running job, protected by state_lock */
+typedef struct
+{
+    hb_job_t   * job;
+    hb_state_t   state;
+} hb_running_job_t;
+
 hb_work_object_t * hb_objects = NULL;
 int hb_instance_counter = 0;
 
@@ -242,12 +258,17 @@ hb_handle_t * hb_init( int verbose )
 
 	h->title_set.list_title = hb_list_init();
     h->jobs       = hb_list_init();
+    h->running    = hb_list_init();
+    h->max_jobs   = 1;
 
     h->state_lock  = hb_lock_init();
     h->state.state = HB_STATE_IDLE;
 
     h->pause_lock = hb_lock_init();
 
+    h->work_lock = hb_lock_init();
+    h->work_cond = hb_cond_init();
+
     h->interjob = calloc( sizeof( hb_interjob_t ), 1 );
 
     /* Start library thread */
@@ -1330,6 +1351,7 @@ static void hb_add_internal( hb_handle_t * h, hb_job_t * job, hb_list_t *list_pa
     job_copy->encoder_level   = NULL;
     job_copy->encoder_options = NULL;
     job_copy->file            = NULL;
+    job_copy->affinity        = NULL;
     job_copy->list_chapter    = NULL;
     job_copy->list_audio      = NULL;
     job_copy->list_subtitle   = NULL;
@@ -1385,8 +1407,34 @@ static void hb_add_internal( hb_handle_t * h, hb_job_t * job, hb_list_t *list_pa
             (count == 1 && !job_copy->select_subtitle_config.force))
         {
             hb_log("Skipping subtitle scan.  No suitable subtitle tracks.");
-            hb_job_close(&job_copy);
-            return;
+            if (job->pass_id == HB_PASS_SUBTITLE)
+            {
+                hb_job_close(&job_copy);
+                return;
+            }
+            while ((subtitle = hb_list_item(job_copy->list_subtitle, 0)))
+            {
+                hb_list_rem(job_copy->list_subtitle, subtitle);
+                hb_subtitle_close(&subtitle);
+            }
+        }
+        if (job->pass_id != HB_PASS_SUBTITLE)
+        {
+            /* The search is done by this encode pass.  The candidates are
+             * added to the job's subtitles, they are only counted and
+             * never output.  See analyze_subtitle_scan() in work.c. */
+            hb_list_t * search = job_copy->list_subtitle;
+
+            job_copy->list_subtitle = hb_subtitle_list_copy(job->list_subtitle);
+            while ((subtitle = hb_list_item(search, 0)))
+            {
+                hb_list_rem(search, subtitle);
+                subtitle->search      = 1;
+                subtitle->config.dest = PASSTHRUSUB;
+                hb_list_add(job_copy->list_subtitle, subtitle);
+            }
+            hb_list_close(&search);
+            job_copy->indepth_scan = 0;
         }
     }
     else
@@ -1412,12 +1460,17 @@ static void hb_add_internal( hb_handle_t * h, hb_job_t * job, hb_list_t *list_pa
         job_copy->encoder_level = strdup(job->encoder_level);
     if (job->file != NULL)
         job_copy->file = strdup(job->file);
+    if (job->affinity != NULL)
+        job_copy->affinity = strdup(job->affinity);
 
     job_copy->h     = h;
 
     /* Copy the job filter list */
     job_copy->list_filter = hb_filter_list_copy( job->list_filter );
 
+    /* All passes of a split job share its segments */
+    job_copy->segments = hb_segment_set_retain( job->segments );
+
     /* Add the job to the list */
     hb_list_add( list_pass, job_copy );
 }
@@ -1457,8 +1510,11 @@ hb_job_t* hb_job_copy(hb_job_t * job)
         job_copy->encoder_level = strdup(job->encoder_level);
     if (job->file != NULL)
         job_copy->file = strdup(job->file);
+    if (job->affinity != NULL)
+        job_copy->affinity = strdup(job->affinity);
 
     job_copy->list_filter = hb_filter_list_copy( job->list_filter );
+    job_copy->segments    = NULL;
 
     return job_copy;
 }
@@ -1473,13 +1529,163 @@ int hb_add( hb_handle_t * h, hb_job_t * job )
     return job_copy->sequence_id;
 }
 
+/*
+ * Split-and-stitch encoding.  The title is cut at chapter boundaries
+ * into job->segment_count ranges of about equal duration.  Each range
+ * gets a video only pass, these run at the same time as each other and
+ * as a final pass over the whole title.  The final pass processes audio
+ * and subtitles once and stitches the video of the segments together,
+ * see hb_stitch in muxcommon.c.
+ *
+ * Only DVD and BD chapter seeks start exactly at the chapter.  Streams
+ * seek to the keyframe before it, or not at all for transport and
+ * program streams, so the passes of a stream are cut at the chapter
+ * times with pts_to_start and pts_to_stop instead, which sync trims to.
+ * Returns 0 if the job can not be split.
+ */
+static int job_setup_segments( hb_handle_t * h, hb_job_t * job,
+                               hb_list_t * list_pass )
+{
+    hb_list_t     * list_audio, * list_subtitle;
+    hb_chapter_t  * chapter;
+    hb_subtitle_t * subtitle;
+    int64_t         total = 0, elapsed = 0, start = 0, position;
+    int             chapter_start, chapter_end, thread_budget, budget;
+    int             count, first, last, exact, to_end, ii;
+
+    chapter_start = job->chapter_start;
+    chapter_end   = job->chapter_end;
+    count         = MIN(job->segment_count, chapter_end - chapter_start + 1);
+    if (count < 2)
+    {
+        hb_log("Segmented encoding needs 2 or more chapters, disabled");
+        return 0;
+    }
+    if (!(job->vcodec & (HB_VCODEC_X264_MASK | HB_VCODEC_X265_MASK)))
+    {
+        hb_log("Segmented encoding needs x264 or x265, disabled");
+        return 0;
+    }
+    if (job->pts_to_start || job->pts_to_stop ||
+        job->frame_to_start || job->frame_to_stop || job->start_at_preview)
+    {
+        hb_log("Segmented encoding needs a chapter range, disabled");
+        return 0;
+    }
+    for (ii = 1; ii <= chapter_end; ii++)
+    {
+        chapter = hb_list_item(job->list_chapter, ii - 1);
+        if (chapter == NULL)
+        {
+            return 0;
+        }
+        if (ii < chapter_start)
+        {
+            start += chapter->duration;
+        }
+        else
+        {
+            total += chapter->duration;
+        }
+    }
+    exact  = job->title->type == HB_DVD_TYPE ||
+             job->title->type == HB_BD_TYPE;
+    to_end = chapter_end == hb_list_count(job->list_chapter);
+    if (!exact)
+    {
+        hb_log("Segmented encoding: cutting stream segments at chapter times");
+    }
+    job->segments = hb_segment_set_init(count);
+    if (job->segments == NULL)
+    {
+        return 0;
+    }
+    hb_deep_log(2, "Adding %d segment passes", count);
+
+    // The segments only encode video, and burn in subtitles
+    list_audio         = job->list_audio;
+    list_subtitle      = job->list_subtitle;
+    job->list_audio    = hb_list_init();
+    job->list_subtitle = hb_list_init();
+    for (ii = 0; ii < hb_list_count(list_subtitle); ii++)
+    {
+        subtitle = hb_list_item(list_subtitle, ii);
+        if (subtitle->config.dest == RENDERSUB)
+        {
+            hb_list_add(job->list_subtitle, subtitle);
+        }
+    }
+
+    thread_budget      = job->thread_budget;
+    budget             = thread_budget > 0 ? thread_budget :
+                                             hb_get_cpu_count();
+    job->thread_budget = MAX(1, budget / count);
+    job->pass_id       = HB_PASS_ENCODE;
+
+    first = chapter_start;
+    for (ii = 0; ii < count; ii++)
+    {
+        // Take chapters until the segment has its share of the
+        // duration, leaving at least one for each following segment
+        position = start + elapsed;
+        last     = first;
+        chapter  = hb_list_item(job->list_chapter, last - 1);
+        elapsed += chapter->duration;
+        while (last < chapter_end - (count - 1 - ii) &&
+               (ii == count - 1 || elapsed < total * (ii + 1) / count))
+        {
+            last++;
+            chapter  = hb_list_item(job->list_chapter, last - 1);
+            elapsed += chapter->duration;
+        }
+        hb_deep_log(2, "Segment %d: chapters %d to %d", ii + 1, first, last);
+        job->segment       = ii + 1;
+        job->chapter_start = first;
+        job->chapter_end   = last;
+        if (!exact)
+        {
+            job->pts_to_start = position;
+            job->pts_to_stop  = ii == count - 1 && to_end ? 0 :
+                                start + elapsed - position;
+        }
+        hb_add_internal(h, job, list_pass);
+        first = last + 1;
+    }
+
+    hb_list_close(&job->list_audio);
+    hb_list_close(&job->list_subtitle);
+    job->list_audio    = list_audio;
+    job->list_subtitle = list_subtitle;
+    job->chapter_start = chapter_start;
+    job->chapter_end   = chapter_end;
+    job->segment       = 0;
+    if (!exact)
+    {
+        // The final pass is cut the same way, the stitcher places each
+        // segment at the time of its first chapter in this range
+        job->pts_to_start = start;
+        job->pts_to_stop  = to_end ? 0 : total;
+    }
+    hb_add_internal(h, job, list_pass);
+    job->thread_budget = thread_budget;
+    job->pts_to_start  = 0;
+    job->pts_to_stop   = 0;
+
+    return 1;
+}
+
 void hb_job_setup_passes(hb_handle_t * h, hb_job_t * job, hb_list_t * list_pass)
 {
     if (job->vquality > HB_INVALID_VIDEO_QUALITY)
     {
         job->twopass = 0;
     }
-    if (job->indepth_scan)
+    if (job->indepth_scan && job->twopass && job->indepth_scan_first_pass)
+    {
+        // The first pass searches, see hb_add_internal()
+        hb_deep_log(2, "Adding subtitle scan to first pass");
+    }
+    else if (job->indepth_scan)
     {
         hb_deep_log(2, "Adding subtitle scan pass");
         job->pass_id = HB_PASS_SUBTITLE;
@@ -1491,10 +1697,12 @@ void hb_job_setup_passes(hb_handle_t * h, hb_job_t * job, hb_list_t * list_pass)
         hb_deep_log(2, "Adding two-pass encode");
         job->pass_id = HB_PASS_ENCODE_1ST;
         hb_add_internal(h, job, list_pass);
+        job->indepth_scan = 0;
         job->pass_id = HB_PASS_ENCODE_2ND;
         hb_add_internal(h, job, list_pass);
     }
-    else
+    else if (job->segment_count < 2 ||
+             !job_setup_segments(h, job, list_pass))
     {
         job->pass_id = HB_PASS_ENCODE;
         hb_add_internal(h, job, list_pass);
@@ -1538,7 +1746,24 @@ void hb_start( hb_handle_t * h )
 
     h->work_die    = 0;
     h->work_error  = HB_ERROR_NONE;
-    h->work_thread = hb_work_init( h->jobs, &h->work_die, &h->work_error, &h->current_job );
+    h->work_thread = hb_work_init( h->jobs, &h->work_die, &h->work_error,
+                                   h->max_jobs );
+}
+
+/**
+ * Sets how many queued jobs hb_start() may encode at the same time.
+ * Takes effect at the next hb_start().
+ * @param h Handle to hb_handle_t.
+ * @param count Maximum number of concurrent jobs, at least 1.
+ */
+void hb_set_max_concurrent_jobs( hb_handle_t * h, int count )
+{
+    h->max_jobs = MAX( count, 1 );
+}
+
+int hb_get_max_concurrent_jobs( hb_handle_t * h )
+{
+    return h->max_jobs;
 }
 
 /**
@@ -1549,12 +1774,19 @@ void hb_pause( hb_handle_t * h )
 {
     if( !h->paused )
     {
+        hb_running_job_t * running;
+        int                i;
+
         hb_lock( h->pause_lock );
         h->paused = 1;
 
-        hb_current_job( h )->st_pause_date = hb_get_date();
-
         hb_lock( h->state_lock );
+        for (i = 0; i < hb_list_count( h->running ); i++)
+        {
+            running = hb_list_item( h->running, i );
+            running->job->st_pause_date = hb_get_date();
+            running->state.state = HB_STATE_PAUSED;
+        }
         h->state.state = HB_STATE_PAUSED;
         hb_unlock( h->state_lock );
     }
@@ -1568,12 +1800,20 @@ void hb_resume( hb_handle_t * h )
 {
     if( h->paused )
     {
-#define job hb_current_job( h )
-        if( job->st_pause_date != -1 )
+        hb_running_job_t * running;
+        int                i;
+
+        hb_lock( h->state_lock );
+        for (i = 0; i < hb_list_count( h->running ); i++)
         {
-           job->st_paused += hb_get_date() - job->st_pause_date;
+            running = hb_list_item( h->running, i );
+            if( running->job->st_pause_date != -1 )
+            {
+               running->job->st_paused += hb_get_date() -
+                                          running->job->st_pause_date;
+            }
         }
-#undef job
+        hb_unlock( h->state_lock );
 
         hb_unlock( h->pause_lock );
         h->paused = 0;
@@ -1588,9 +1828,41 @@ void hb_stop( hb_handle_t * h )
 {
     h->work_error = HB_ERROR_CANCELED;
     h->work_die   = 1;
+    hb_work_signal( h );
     hb_resume( h );
 }
 
+/**
+ * Wakes all threads blocked in hb_work_wait().
+ * Must be called after changing job state that another thread of the
+ * running job may be waiting for.
+ * @param h Handle to hb_handle_t.
+ */
+void hb_work_signal( hb_handle_t * h )
+{
+    hb_lock( h->work_lock );
+    hb_cond_broadcast( h->work_cond );
+    hb_unlock( h->work_lock );
+}
+
+/**
+ * Blocks until ready() returns non-zero.
+ * ready() is evaluated with the work lock held, so a state change made
+ * before the matching hb_work_signal() can not be missed.
+ * @param h Handle to hb_handle_t.
+ * @param ready Condition to wait for.
+ * @param opaque Argument passed to ready().
+ */
+void hb_work_wait( hb_handle_t * h, int (*ready)( void * ), void * opaque )
+{
+    hb_lock( h->work_lock );
+    while ( !ready( opaque ) )
+    {
+        hb_cond_wait( h->work_cond, h->work_lock );
+    }
+    hb_unlock( h->work_lock );
+}
+
 /**
  * Stops the conversion process.
  * @param h Handle to hb_handle_t.
@@ -1647,8 +1919,12 @@ void hb_close( hb_handle_t ** _h )
     hb_list_close( &h->title_set.list_title );
 
     hb_list_close( &h->jobs );
+    hb_list_close( &h->running );
+    hb_value_free( &h->profile );
     hb_lock_close( &h->state_lock );
     hb_lock_close( &h->pause_lock );
+    hb_lock_close( &h->work_lock );
+    hb_cond_close( &h->work_cond );
 
     hb_system_sleep_opaque_close(&h->system_sleep_opaque);
 
@@ -1684,6 +1960,9 @@ int hb_global_init()
 
     /* HB work objects */
     hb_register(&hb_muxer);
+    hb_register(&hb_stitch);
+    hb_register(&hb_frame_cache_writer);
+    hb_register(&hb_frame_cache_reader);
     hb_register(&hb_reader);
     hb_register(&hb_sync_video);
     hb_register(&hb_sync_audio);
@@ -1723,6 +2002,16 @@ int hb_global_init()
      */
     hb_buffer_pool_init();
 
+    /*
+     * Shared worker threads for multithreaded filters
+     */
+    hb_thread_pool_init();
+
+    /*
+     * Pipeline timeline tracing, enabled per job by HB_TRACE
+     */
+    hb_trace_init();
+
     // Initialize the builtin presets hb_dict_t
     hb_presets_builtin_init();
 
@@ -1739,6 +2028,8 @@ void hb_global_close()
     struct dirent * entry;
 
     hb_presets_free();
+    hb_thread_pool_close();
+    hb_trace_close();
 
     /* Find and remove temp folder */
     memset( dirname, 0, 1024 );
@@ -1916,6 +2207,180 @@ void hb_set_work_error( hb_handle_t * h, hb_error_code err )
     h->work_error = err;
 }
 
+static hb_running_job_t * find_running_job( hb_handle_t * h, hb_job_t * job )
+{
+    hb_running_job_t * running;
+    int                i;
+
+    for (i = 0; i < hb_list_count( h->running ); i++)
+    {
+        running = hb_list_item( h->running, i );
+        if (running->job == job)
+        {
+            return running;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Registers a job whose pipeline is starting.  Its progress is tracked
+ * separately from other running jobs until hb_job_finished().
+ * @param h Handle to hb_handle_t
+ * @param job Handle to hb_job_t
+ */
+void hb_job_started( hb_handle_t * h, hb_job_t * job )
+{
+    hb_running_job_t * running = calloc( 1, sizeof( hb_running_job_t ) );
+
+    if (running == NULL)
+    {
+        return;
+    }
+    running->job = job;
+    hb_lock( h->state_lock );
+    running->state = h->state;
+    hb_list_add( h->running, running );
+    h->current_job = job;
+    hb_unlock( h->state_lock );
+}
+
+/**
+ * Unregisters a job.  'job' may already have been freed, it is only
+ * compared against the registered jobs.
+ * @param h Handle to hb_handle_t
+ * @param job Handle to hb_job_t
+ */
+void hb_job_finished( hb_handle_t * h, hb_job_t * job )
+{
+    hb_running_job_t * running;
+    int                count;
+
+    hb_lock( h->state_lock );
+    running = find_running_job( h, job );
+    if (running != NULL)
+    {
+        hb_list_rem( h->running, running );
+        free( running );
+    }
+    count = hb_list_count( h->running );
+    if (h->current_job == job)
+    {
+        running = hb_list_item( h->running, count - 1 );
+        h->current_job = running != NULL ? running->job : NULL;
+    }
+    hb_unlock( h->state_lock );
+}
+
+/**
+ * Sets the state of a running job.  The handle state, as returned by
+ * hb_get_state(), follows the job that updated last.  Blocks while
+ * paused like hb_set_state().
+ * @param job Handle to hb_job_t
+ * @param s Handle to new hb_state_t
+ */
+void hb_set_job_state( hb_job_t * job, hb_state_t * s )
+{
+    hb_handle_t      * h = job->h;
+    hb_running_job_t * running;
+
+    hb_lock( h->pause_lock );
+    hb_lock( h->state_lock );
+    running = find_running_job( h, job );
+    if (running != NULL)
+    {
+        memcpy( &running->state, s, sizeof( hb_state_t ) );
+        if( s->state == HB_STATE_WORKING ||
+            s->state == HB_STATE_SEARCHING )
+        {
+            running->state.param.working.sequence_id = job->sequence_id;
+        }
+    }
+    // The scan for the next concurrent job waits for the handle state
+    // to leave HB_STATE_SCANNING, do not overwrite it.  The segment
+    // passes of a split job only update their own state, the handle
+    // follows the pass that stitches them.
+    if (job->segment == 0 &&
+        (h->state.state != HB_STATE_SCANNING || running == NULL))
+    {
+        memcpy( &h->state, s, sizeof( hb_state_t ) );
+        if( h->state.state == HB_STATE_WORKING ||
+            h->state.state == HB_STATE_SEARCHING )
+        {
+            h->state.param.working.sequence_id = job->sequence_id;
+        }
+    }
+    hb_unlock( h->state_lock );
+    hb_unlock( h->pause_lock );
+}
+
+void hb_get_job_state( hb_job_t * job, hb_state_t * s )
+{
+    hb_handle_t      * h = job->h;
+    hb_running_job_t * running;
+
+    hb_lock( h->state_lock );
+    running = find_running_job( h, job );
+    memcpy( s, running != NULL ? &running->state : &h->state,
+            sizeof( hb_state_t ) );
+    hb_unlock( h->state_lock );
+}
+
+/**
+ * Copies the states of the running jobs.
+ * @param h Handle to hb_handle_t
+ * @param states Array receiving up to count states
+ * @param count Size of states
+ * @returns The number of running jobs
+ */
+int hb_get_job_states( hb_handle_t * h, hb_state_t * states, int count )
+{
+    hb_running_job_t * running;
+    int                i, running_count;
+
+    hb_lock( h->state_lock );
+    running_count = hb_list_count( h->running );
+    for (i = 0; i < running_count && i < count; i++)
+    {
+        running = hb_list_item( h->running, i );
+        memcpy( &states[i], &running->state, sizeof( hb_state_t ) );
+    }
+    hb_unlock( h->state_lock );
+
+    return running_count;
+}
+
+/**
+ * Stores the pipeline profile of the job that just finished.
+ * @param h Handle to hb_handle_t
+ * @param profile Report from hb_profile_report(), ownership is taken
+ */
+void hb_set_profile( hb_handle_t * h, hb_dict_t * profile )
+{
+    hb_lock( h->state_lock );
+    hb_value_free( &h->profile );
+    h->profile = profile;
+    hb_unlock( h->state_lock );
+}
+
+/**
+ * Returns a copy of the last job's pipeline profile, or NULL.
+ * @param h Handle to hb_handle_t
+ */
+hb_dict_t * hb_get_profile( hb_handle_t * h )
+{
+    hb_dict_t * profile = NULL;
+
+    hb_lock( h->state_lock );
+    if (h->profile != NULL)
+    {
+        profile = hb_value_dup(h->profile);
+    }
+    hb_unlock( h->state_lock );
+
+    return profile;
+}
+
 void hb_system_sleep_allow(hb_handle_t *h)
 {
     hb_system_sleep_private_enable(h->system_sleep_opaque);
@@ -104,6 +104,11 @@ void          hb_pause( hb_handle_t * );
 void          hb_resume( hb_handle_t * );
 void          hb_stop( hb_handle_t * );
 
+/* Number of queued jobs hb_start() may encode at the same time.
+   The default of 1 encodes them one after the other. */
+void          hb_set_max_concurrent_jobs( hb_handle_t *, int );
+int           hb_get_max_concurrent_jobs( hb_handle_t * );
+
 void          hb_system_sleep_allow(hb_handle_t*);
 void          hb_system_sleep_prevent(hb_handle_t*);
 
@@ -117,6 +122,7 @@ typedef struct hb_interjob_s
     hb_rational_t vrate;     /* measured output vrate              */
 
     hb_subtitle_t *select_subtitle; /* foreign language scan subtitle */
+    struct hb_frame_cache_s *frame_cache; /* pass 1 output, framecache.c */
 } hb_interjob_t;
 
 hb_interjob_t * hb_interjob_get( hb_handle_t * ); 
@@ -127,6 +133,12 @@ hb_interjob_t * hb_interjob_get( hb_handle_t * );
 void hb_get_state( hb_handle_t *, hb_state_t * );
 void hb_get_state2( hb_handle_t *, hb_state_t * );
 
+/* hb_get_job_states()
+   Copies the state of up to 'count' running jobs, each identified by
+   param.working.sequence_id, and returns the number of running jobs.
+   hb_get_state() reports whichever job updated its state last. */
+int  hb_get_job_states( hb_handle_t *, hb_state_t * states, int count );
+
 /* hb_close()
    Aborts all current jobs if any, frees memory. */
 void          hb_close( hb_handle_t ** );
@@ -156,12 +156,50 @@ char* hb_get_state_json( hb_handle_t * h )
     hb_get_state(h, &state);
     hb_dict_t *dict = hb_state_to_dict(&state);
 
+    // With concurrent jobs, report the progress of each running job
+    int max_jobs = hb_get_max_concurrent_jobs(h);
+    if (dict != NULL && max_jobs > 1)
+    {
+        hb_state_t       * states = calloc(max_jobs, sizeof(hb_state_t));
+        hb_value_array_t * jobs   = hb_value_array_init();
+        int                count, ii;
+
+        count = states ? hb_get_job_states(h, states, max_jobs) : 0;
+        for (ii = 0; ii < count && ii < max_jobs; ii++)
+        {
+            hb_dict_t *job_dict = hb_state_to_dict(&states[ii]);
+            if (job_dict != NULL)
+            {
+                hb_value_array_append(jobs, job_dict);
+            }
+        }
+        hb_dict_set(dict, "Jobs", jobs);
+        free(states);
+    }
+
     char *json_state = hb_value_get_json(dict);
     hb_value_free(&dict);
 
     return json_state;
 }
 
+/* Per-stage statistics of the most recently finished job, see
+ * hb_profile_report() for the layout.  Returns NULL if no job has
+ * finished yet. */
+char* hb_get_profile_json( hb_handle_t * h )
+{
+    hb_dict_t *dict = hb_get_profile(h);
+
+    if (dict == NULL)
+    {
+        return NULL;
+    }
+    char *json_profile = hb_value_get_json(dict);
+    hb_value_free(&dict);
+
+    return json_profile;
+}
+
 hb_dict_t * hb_audio_attributes_to_dict(uint32_t attributes)
 {
     json_error_t error;
@@ -536,8 +574,9 @@ hb_dict_t* hb_job_to_dict( const hb_job_t * job )
     "s:{s:o, s:{s:o, s:o}},"
     // Audio {CopyMask, FallbackEncoder, AudioList []}
     "s:{s:[], s:o, s:[]},"
-    // Subtitles {Search {Enable, Forced, Default, Burn}, SubtitleList []}
-    "s:{s:{s:o, s:o, s:o, s:o}, s:[]},"
+    // Subtitles {Search {Enable, Forced, Default, Burn, FirstPass},
+    //            SubtitleList []}
+    "s:{s:{s:o, s:o, s:o, s:o, s:o}, s:[]},"
     // Metadata
     "s:{},"
     // Filters {FilterList []}
@@ -572,6 +611,7 @@ hb_dict_t* hb_job_to_dict( const hb_job_t * job )
                 "Forced",       hb_value_bool(job->select_subtitle_config.force),
                 "Default",      hb_value_bool(job->select_subtitle_config.default_track),
                 "Burn",         hb_value_bool(subtitle_search_burn),
+                "FirstPass",    hb_value_bool(job->indepth_scan_first_pass),
             "SubtitleList",
         "Metadata",
         "Filters",
@@ -582,6 +622,34 @@ hb_dict_t* hb_job_to_dict( const hb_job_t * job )
         hb_error("json pack failure: %s", error.text);
         return NULL;
     }
+    if (job->thread_budget > 0)
+    {
+        hb_dict_set(dict, "ThreadBudget", hb_value_int(job->thread_budget));
+    }
+    if (job->segment_count > 1)
+    {
+        hb_dict_set(dict, "SegmentCount", hb_value_int(job->segment_count));
+    }
+    if (job->frame_cache_budget > 0)
+    {
+        hb_dict_set(dict, "FrameCache", hb_value_int(job->frame_cache_budget));
+    }
+    if (job->fifo_budget > 0)
+    {
+        hb_dict_set(dict, "FifoBudget", hb_value_int(job->fifo_budget));
+    }
+    if (job->affinity != NULL)
+    {
+        hb_dict_set(dict, "Affinity", hb_value_string(job->affinity));
+    }
+    if (job->memory_limit > 0)
+    {
+        hb_dict_set(dict, "MemoryLimit", hb_value_int(job->memory_limit));
+    }
+    if (job->decode_skip)
+    {
+        hb_dict_set(dict, "DecodeSkip", hb_value_bool(job->decode_skip));
+    }
     hb_dict_t *dest_dict = hb_dict_get(dict, "Destination");
     if (job->file != NULL)
     {
@@ -659,6 +727,11 @@ hb_dict_t* hb_job_to_dict( const hb_job_t * job )
         hb_dict_set(video_dict, "TwoPass", hb_value_bool(job->twopass));
         hb_dict_set(video_dict, "Turbo",
                             hb_value_bool(job->fastfirstpass));
+        if (job->fastfirstpass > 1)
+        {
+            hb_dict_set(video_dict, "TurboLevel",
+                                hb_value_int(job->fastfirstpass));
+        }
     }
     if (job->encoder_preset != NULL)
     {
@@ -966,6 +1039,7 @@ hb_job_t* hb_dict_to_job( hb_handle_t * h, hb_dict_t *dict )
     hb_value_t       * mux = NULL, * vcodec = NULL;
     hb_value_t       * acodec_copy_mask = NULL, * acodec_fallback = NULL;
     const char       * destfile = NULL;
+    const char       * affinity = NULL;
     const char       * range_type = NULL;
     const char       * video_preset = NULL, * video_tune = NULL;
     const char       * video_profile = NULL, * video_level = NULL;
@@ -978,12 +1052,16 @@ hb_job_t* hb_dict_to_job( hb_handle_t * h, hb_dict_t *dict )
     const char       * meta_long_desc = NULL;
     json_int_t         range_start = -1, range_end = -1, range_seek_points = -1;
     int                vbitrate = -1;
+    int                turbo_level = 0;
     double             vquality = HB_INVALID_VIDEO_QUALITY;
 
     result = json_unpack_ex(dict, &error, 0,
     "{"
     // SequenceID
     "s:i,"
+    // ThreadBudget, SegmentCount, FrameCache, FifoBudget, Affinity,
+    // MemoryLimit, DecodeSkip
+    "s?i, s?i, s?i, s?i, s?s, s?i, s?b,"
     // Destination {File, Mux, InlineParameterSets, AlignAVStart,
     //              ChapterMarkers, ChapterList,
     //              Mp4Options {Mp4Optimize, IpodAtom}}
@@ -993,15 +1071,16 @@ hb_job_t* hb_dict_to_job( hb_handle_t * h, hb_dict_t *dict )
     // PAR {Num, Den}
     "s?{s:i, s:i},"
     // Video {Codec, Quality, Bitrate, Preset, Tune, Profile, Level, Options
-    //        TwoPass, Turbo, ColorMatrixCode,
+    //        TwoPass, Turbo, TurboLevel, ColorMatrixCode,
     //        QSV {Decode, AsyncDepth}}
     "s:{s:o, s?f, s?i, s?s, s?s, s?s, s?s, s?s,"
-    "   s?b, s?b, s?i,"
+    "   s?b, s?b, s?i, s?i,"
     "   s?{s?b, s?i}},"
     // Audio {CopyMask, FallbackEncoder, AudioList}
     "s?{s?o, s?o, s?o},"
-    // Subtitle {Search {Enable, Forced, Default, Burn}, SubtitleList}
-    "s?{s?{s:b, s?b, s?b, s?b}, s?o},"
+    // Subtitle {Search {Enable, Forced, Default, Burn, FirstPass},
+    //           SubtitleList}
+    "s?{s?{s:b, s?b, s?b, s?b, s?b}, s?o},"
     // Metadata {Name, Artist, Composer, AlbumArtist, ReleaseDate,
     //           Comment, Genre, Description, LongDescription}
     "s?{s?s, s?s, s?s, s?s, s?s, s?s, s?s, s?s, s?s},"
@@ -1009,6 +1088,13 @@ hb_job_t* hb_dict_to_job( hb_handle_t * h, hb_dict_t *dict )
     "s?{s?o}"
     "}",
         "SequenceID",               unpack_i(&job->sequence_id),
+        "ThreadBudget",             unpack_i(&job->thread_budget),
+        "SegmentCount",             unpack_i(&job->segment_count),
+        "FrameCache",               unpack_i(&job->frame_cache_budget),
+        "FifoBudget",               unpack_i(&job->fifo_budget),
+        "Affinity",                 unpack_s(&affinity),
+        "MemoryLimit",              unpack_i(&job->memory_limit),
+        "DecodeSkip",               unpack_b(&job->decode_skip),
         "Destination",
             "File",                 unpack_s(&destfile),
             "Mux",                  unpack_o(&mux),
@@ -1040,6 +1126,7 @@ hb_job_t* hb_dict_to_job( hb_handle_t * h, hb_dict_t *dict )
             "Options",              unpack_s(&video_options),
             "TwoPass",              unpack_b(&job->twopass),
             "Turbo",                unpack_b(&job->fastfirstpass),
+            "TurboLevel",           unpack_i(&turbo_level),
             "ColorMatrixCode",      unpack_i(&job->color_matrix_code),
             "QSV",
                 "Decode",           unpack_b(&job->qsv.decode),
@@ -1054,6 +1141,7 @@ hb_job_t* hb_dict_to_job( hb_handle_t * h, hb_dict_t *dict )
                 "Forced",           unpack_b(&job->select_subtitle_config.force),
                 "Default",          unpack_b(&job->select_subtitle_config.default_track),
                 "Burn",             unpack_b(&subtitle_search_burn),
+                "FirstPass",        unpack_b(&job->indepth_scan_first_pass),
             "SubtitleList",         unpack_o(&subtitle_list),
         "Metadata",
             "Name",                 unpack_s(&meta_name),
@@ -1139,6 +1227,7 @@ hb_job_t* hb_dict_to_job( hb_handle_t * h, hb_dict_t *dict )
     {
         hb_job_set_file(job, destfile);
     }
+    hb_job_set_affinity(job, affinity);
 
     hb_job_set_encoder_preset(job, video_preset);
     hb_job_set_encoder_tune(job, video_tune);
@@ -1163,6 +1252,12 @@ hb_job_t* hb_dict_to_job( hb_handle_t * h, hb_dict_t *dict )
     }
     // If neither were specified, defaults are used (set in job_setup())
 
+    // TurboLevel selects a faster first pass than Turbo alone
+    if (job->fastfirstpass && turbo_level > 1)
+    {
+        job->fastfirstpass = turbo_level;
+    }
+
     job->select_subtitle_config.dest = subtitle_search_burn ?
                                             RENDERSUB : PASSTHRUSUB;
     if (meta_name != NULL)
@@ -30,6 +30,7 @@ hb_job_t   * hb_json_to_job(hb_handle_t * h, const char * json_job);
 int          hb_add_json(hb_handle_t *h, const char * json_job);
 char       * hb_set_anamorphic_size_json(const char * json_param);
 char       * hb_get_state_json(hb_handle_t * h);
+char       * hb_get_profile_json(hb_handle_t * h);
 hb_image_t * hb_json_to_image(char *json_image);
 char       * hb_get_preview_params_json(int title_idx, int preview_idx,
                             int deinterlace, hb_geometry_settings_t *settings);
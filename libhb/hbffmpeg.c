@@ -55,10 +55,128 @@ void hb_avframe_set_video_buffer_flags(hb_buffer_t * buf, AVFrame *frame,
     buf->s.frametype = get_frame_type(frame->pict_type);
 }
 
+static void avbuffer_free(void *opaque, uint8_t *data)
+{
+    hb_buffer_t * buf = opaque;
+
+    hb_buffer_close(&buf);
+}
+
+/*
+ * AVCodecContext.get_buffer2 callback that lets libavcodec decode directly
+ * into an hb_buffer_t frame buffer.  The buffer is returned to the buffer
+ * pool when libavcodec and every hb_buffer_t referencing the frame have
+ * released it.  Frames that do not fit the hb_buffer_t layout are
+ * allocated by libavcodec's default allocator.
+ */
+int hb_avcodec_get_buffer2(AVCodecContext *context, AVFrame *frame, int flags)
+{
+    const AVPixFmtDescriptor * desc = av_pix_fmt_desc_get(frame->format);
+    hb_buffer_t              * buf;
+    int                        linesize_align[AV_NUM_DATA_POINTERS];
+    int                        width, height, pp;
+    uint8_t                    has_plane[4] = {0,};
+
+    frame->opaque = NULL;
+    if (desc == NULL || context->codec_type != AVMEDIA_TYPE_VIDEO ||
+        !(context->codec->capabilities & AV_CODEC_CAP_DR1) ||
+        (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) ||
+        context->width <= 0 || context->height <= 0)
+    {
+        return avcodec_default_get_buffer2(context, frame, flags);
+    }
+
+    // Allocate for the output dimensions so that the layout of the
+    // decoded picture is exactly what hb_frame_buffer_init() produces,
+    // then verify there is room for the decoder's aligned dimensions.
+    buf = hb_frame_buffer_init(frame->format, context->width, context->height);
+    if (buf == NULL)
+    {
+        return avcodec_default_get_buffer2(context, frame, flags);
+    }
+
+    width  = frame->width;
+    height = frame->height;
+    avcodec_align_dimensions2(context, &width, &height, linesize_align);
+
+    for (pp = 0; pp < 4; pp++)
+    {
+        has_plane[desc->comp[pp].plane] = 1;
+    }
+    for (pp = 0; pp < 4; pp++)
+    {
+        if (!has_plane[pp])
+        {
+            continue;
+        }
+        int plane_height = (pp == 1 || pp == 2) ?
+                           AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+        if (buf->plane[pp].stride < av_image_get_linesize(frame->format,
+                                                          width, pp) ||
+            buf->plane[pp].stride % linesize_align[pp] ||
+            (uintptr_t)buf->plane[pp].data % linesize_align[pp] ||
+            buf->plane[pp].height_stride < plane_height)
+        {
+            hb_buffer_close(&buf);
+            return avcodec_default_get_buffer2(context, frame, flags);
+        }
+    }
+
+    frame->buf[0] = av_buffer_create(buf->data, buf->alloc,
+                                     avbuffer_free, buf, 0);
+    if (frame->buf[0] == NULL)
+    {
+        hb_buffer_close(&buf);
+        return AVERROR(ENOMEM);
+    }
+    for (pp = 0; pp < 4; pp++)
+    {
+        frame->data[pp]     = buf->plane[pp].data;
+        frame->linesize[pp] = has_plane[pp] ? buf->plane[pp].stride : 0;
+    }
+    frame->extended_data = frame->data;
+    frame->opaque        = buf;
+
+    return 0;
+}
+
+// Returns a buffer that shares the picture of 'frame' if it was
+// allocated by hb_avcodec_get_buffer2 and is not cropped.
+static hb_buffer_t * avframe_ref_video_buffer(AVFrame *frame)
+{
+    hb_buffer_t * owner = frame->opaque;
+    int           pp;
+
+    if (owner == NULL || frame->buf[0] == NULL || frame->buf[1] != NULL ||
+        av_buffer_get_opaque(frame->buf[0]) != owner ||
+        frame->format != owner->f.fmt ||
+        frame->width  != owner->f.width || frame->height != owner->f.height)
+    {
+        return NULL;
+    }
+    for (pp = 0; pp < 4; pp++)
+    {
+        if (owner->plane[pp].data != NULL &&
+            (frame->data[pp]     != owner->plane[pp].data ||
+             frame->linesize[pp] != owner->plane[pp].stride))
+        {
+            return NULL;
+        }
+    }
+    return hb_buffer_ref_init(owner, frame->buf[0]);
+}
+
 hb_buffer_t * hb_avframe_to_video_buffer(AVFrame *frame, AVRational time_base)
 {
     hb_buffer_t * buf;
 
+    buf = avframe_ref_video_buffer(frame);
+    if (buf != NULL)
+    {
+        hb_avframe_set_video_buffer_flags(buf, frame, time_base);
+        return buf;
+    }
+
     buf = hb_frame_buffer_init(frame->format, frame->width, frame->height);
     if (buf == NULL)
     {
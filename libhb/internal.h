@@ -44,6 +44,14 @@ void         hb_title_close( hb_title_t ** );
 int  hb_get_pid( hb_handle_t * );
 void hb_set_state( hb_handle_t *, hb_state_t * );
 void hb_set_work_error( hb_handle_t * h, hb_error_code err );
+void hb_job_started( hb_handle_t * h, hb_job_t * job );
+void hb_job_finished( hb_handle_t * h, hb_job_t * job );
+void hb_set_job_state( hb_job_t * job, hb_state_t * s );
+void hb_get_job_state( hb_job_t * job, hb_state_t * s );
+void hb_set_profile( hb_handle_t * h, hb_dict_t * profile );
+hb_dict_t * hb_get_profile( hb_handle_t * h );
+void hb_work_signal( hb_handle_t * h );
+void hb_work_wait( hb_handle_t * h, int (*ready)( void * ), void * opaque );
 void hb_job_setup_passes(hb_handle_t *h, hb_job_t *job, hb_list_t *list_pass);
 
 /***********************************************************************
@@ -117,10 +125,13 @@ struct hb_image_format_s
     int           window_height;
 };
 
+typedef struct hb_spill_s hb_spill_t;
+
 struct hb_buffer_s
 {
     int           size;     // size of this packet
     int           alloc;    // used internally by the packet allocator (hb_buffer_init)
+    int           node;     // NUMA node pools 'data' returns to, see fifo.c
     uint8_t *     data;     // packet data
     int           offset;   // used internally by packet lists (hb_list_t)
 
@@ -150,13 +161,32 @@ struct hb_buffer_s
     // Store this data here when read and pass to decoder.
     hb_buffer_t * palette;
 
+    // When non-NULL, 'data' is not owned by this buffer but is shared
+    // storage (e.g. a libavcodec reference frame) kept alive by this
+    // reference. Call hb_buffer_make_writable() before modifying 'data'.
+    AVBufferRef * storage;
+
+    // Set while the buffer is held by a queue that may write its data
+    // to disk, see spill.c.  While 'spilled', 'data' and the plane
+    // pointers are NULL.
+    struct buffer_spill
+    {
+        hb_spill_t  * store;
+        int           spilled;
+        int64_t       pos;
+        int           plane[4];     // offsets of the planes in 'data'
+    } spill;
+
     // Packets in a list:
     //   the next packet in the list
     hb_buffer_t * next;
 };
 
 void hb_buffer_pool_init( void );
+void hb_buffer_pool_retain( void );
+void hb_buffer_pool_release( void );
 void hb_buffer_pool_free( void );
+void hb_buffer_cache_flush( void );
 
 hb_buffer_t * hb_buffer_init( int size );
 hb_buffer_t * hb_buffer_eof_init( void );
@@ -167,6 +197,8 @@ void          hb_video_buffer_realloc( hb_buffer_t * b, int w, int h );
 void          hb_buffer_reduce( hb_buffer_t * b, int size );
 void          hb_buffer_close( hb_buffer_t ** );
 hb_buffer_t * hb_buffer_dup( const hb_buffer_t * src );
+hb_buffer_t * hb_buffer_ref_init( const hb_buffer_t * layout, AVBufferRef * ref );
+int           hb_buffer_make_writable( hb_buffer_t * b );
 int           hb_buffer_copy( hb_buffer_t * dst, const hb_buffer_t * src );
 void          hb_buffer_swap_copy( hb_buffer_t *src, hb_buffer_t *dst );
 hb_image_t  * hb_image_init(int pix_fmt, int width, int height);
@@ -176,6 +208,13 @@ int           hb_picture_crop(uint8_t *data[], int stride[], hb_buffer_t *b,
                               int top, int left);
 
 hb_fifo_t   * hb_fifo_init( int capacity, int thresh );
+void          hb_fifo_set_spsc( hb_fifo_t * f );
+void          hb_fifo_set_spill( hb_fifo_t * f, hb_spill_t * sp );
+void          hb_fifo_set_max_capacity( hb_fifo_t * f, int max );
+void          hb_fifo_set_capacity( hb_fifo_t * f, int capacity );
+int           hb_fifo_capacity( hb_fifo_t * f );
+void          hb_fifo_wait_times( hb_fifo_t * f, uint64_t * empty,
+                                  uint64_t * full );
 void          hb_fifo_register_full_cond( hb_fifo_t * f, hb_cond_t * c );
 int           hb_fifo_size( hb_fifo_t * );
 int           hb_fifo_size_bytes( hb_fifo_t * );
@@ -183,13 +222,16 @@ int           hb_fifo_is_full( hb_fifo_t * );
 float         hb_fifo_percent_full( hb_fifo_t * f );
 hb_buffer_t * hb_fifo_get( hb_fifo_t * );
 hb_buffer_t * hb_fifo_get_wait( hb_fifo_t * );
+int           hb_fifo_get_list( hb_fifo_t *, hb_buffer_list_t *, int max );
 hb_buffer_t * hb_fifo_see( hb_fifo_t * );
 hb_buffer_t * hb_fifo_see_wait( hb_fifo_t * );
 hb_buffer_t * hb_fifo_see2( hb_fifo_t * );
 void          hb_fifo_push( hb_fifo_t *, hb_buffer_t * );
+void          hb_fifo_push_list( hb_fifo_t *, hb_buffer_list_t * );
 void          hb_fifo_push_wait( hb_fifo_t *, hb_buffer_t * );
 int           hb_fifo_full_wait( hb_fifo_t * f );
 void          hb_fifo_push_head( hb_fifo_t *, hb_buffer_t * );
+void          hb_fifo_shutdown( hb_fifo_t * f );
 void          hb_fifo_close( hb_fifo_t ** );
 void          hb_fifo_flush( hb_fifo_t * f );
 
@@ -259,7 +301,8 @@ hb_thread_t * hb_scan_init( hb_handle_t *, volatile int * die,
                             hb_title_set_t * title_set, int preview_count, 
                             int store_previews, uint64_t min_duration );
 hb_thread_t * hb_work_init( hb_list_t * jobs,
-                            volatile int * die, hb_error_code * error, hb_job_t ** job );
+                            volatile int * die, hb_error_code * error,
+                            int max_jobs );
 void ReadLoop( void * _w );
 void hb_work_loop( void * );
 hb_work_object_t * hb_muxer_init( hb_job_t * );
@@ -274,6 +317,89 @@ hb_work_object_t * hb_video_encoder( hb_handle_t *, int );
  **********************************************************************/
 hb_work_object_t * hb_sync_init( hb_job_t * job );
 
+/***********************************************************************
+ * profile.c
+ **********************************************************************/
+typedef struct hb_profile_s hb_profile_t;
+
+/*
+ * Per-stage pipeline statistics, filled in by the work and filter
+ * thread loops.  Times are in microseconds.
+ */
+typedef struct hb_stage_stats_s
+{
+    uint64_t start;         // thread entry
+    uint64_t stop;          // thread exit
+    uint64_t work;          // inside work()
+    uint64_t wait_in;       // blocked on an empty input fifo
+    uint64_t wait_out;      // blocked on a full output fifo
+    uint64_t buffers;       // input buffers consumed
+    uint64_t bytes;         // input bytes consumed
+    uint64_t fifo_samples;  // input fifo occupancy, see profile.c
+    uint64_t fifo_sum;
+    int      fifo_max;
+    int      thread_id;     // see hb_thread_self_id(), 0 = not started
+} hb_stage_stats_t;
+
+hb_profile_t     * hb_profile_init( void );
+hb_stage_stats_t * hb_profile_add( hb_profile_t * p, const char * name,
+                                   const char * type, hb_fifo_t * fifo_in );
+void               hb_profile_adapt_fifo( hb_profile_t * p, const char * name,
+                                          hb_fifo_t * fifo, int min, int max );
+void               hb_profile_set_fifo_budget( hb_profile_t * p, int64_t bytes );
+void               hb_profile_start( hb_profile_t * p );
+void               hb_profile_stop( hb_profile_t * p );
+hb_dict_t        * hb_profile_report( hb_profile_t * p );
+void               hb_profile_close( hb_profile_t ** p );
+
+/***********************************************************************
+ * trace.c
+ **********************************************************************/
+void     hb_trace_init( void );
+void     hb_trace_close( void );
+void     hb_trace_start( void );
+void     hb_trace_stop( void );
+void     hb_trace_thread_name( const char * name );
+uint64_t hb_trace_begin( void );
+void     hb_trace_end( const char * name, uint64_t start );
+
+/***********************************************************************
+ * muxcommon.c, split-and-stitch encoding
+ **********************************************************************/
+typedef struct hb_segment_set_s hb_segment_set_t;
+
+hb_segment_set_t * hb_segment_set_init( int count );
+hb_segment_set_t * hb_segment_set_retain( hb_segment_set_t * set );
+void               hb_segment_set_cancel( hb_segment_set_t * set );
+void               hb_segment_set_ended( hb_segment_set_t * set, int segment );
+void               hb_segment_set_close( hb_segment_set_t ** set );
+
+/***********************************************************************
+ * framecache.c
+ **********************************************************************/
+typedef struct hb_frame_cache_s hb_frame_cache_t;
+
+hb_frame_cache_t * hb_frame_cache_init( hb_job_t * job );
+void               hb_frame_cache_write( hb_frame_cache_t * cache, int track,
+                                         const hb_buffer_t * buf );
+void               hb_frame_cache_finish( hb_frame_cache_t * cache,
+                                          hb_job_t * job );
+int                hb_frame_cache_usable( hb_frame_cache_t * cache,
+                                          hb_job_t * job );
+void               hb_frame_cache_close( hb_frame_cache_t ** cache );
+
+/***********************************************************************
+ * spill.c
+ **********************************************************************/
+hb_spill_t * hb_spill_init( hb_job_t * job );
+void         hb_spill_close( hb_spill_t ** sp );
+void         hb_spill_queue( hb_spill_t * sp, hb_buffer_t * b );
+int          hb_spill_over( hb_spill_t * sp );
+int          hb_spill_out( hb_buffer_t * b );
+void         hb_spill_in( hb_buffer_t * b );
+void         hb_spill_unqueue( hb_buffer_t * b );
+void         hb_spill_drop( hb_buffer_t * b );
+
 /***********************************************************************
  * mpegdemux.c
  **********************************************************************/
@@ -441,7 +567,10 @@ enum
     WORK_ENCAVCODEC_AUDIO,
     WORK_MUX,
     WORK_READER,
-    WORK_DECPGSSUB
+    WORK_DECPGSSUB,
+    WORK_STITCH,
+    WORK_CACHE_WRITE,
+    WORK_CACHE_READ
 };
 
 extern hb_filter_object_t hb_filter_detelecine;
@@ -462,6 +591,8 @@ extern hb_filter_object_t hb_filter_unsharp;
 extern hb_filter_object_t hb_filter_avfilter;
 extern hb_filter_object_t hb_filter_mt_frame;
 
+int hb_filter_thread_count( hb_filter_object_t * filter );
+
 #ifdef USE_QSV
 extern hb_filter_object_t hb_filter_qsv;
 extern hb_filter_object_t hb_filter_qsv_pre;
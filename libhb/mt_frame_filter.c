@@ -10,26 +10,35 @@
 /* This is a psuedo-filter that wraps other filters to provide frame
  * based multi-threading of the wrapped filter. The sub-filter must
  * operate on each frame independently with no context carried over
- * from one frame to the next. */
+ * from one frame to the next.
+ *
+ * Each input frame is queued on the shared thread pool as soon as it
+ * arrives.  Up to thread_count frames are in flight, held in a ring of
+ * slots in input order, and finished frames are emitted from the head
+ * of the ring so output order is preserved without waiting for a
+ * whole batch. */
 
 #include "hb.h"
-#include "taskset.h"
+#include "threadpool.h"
 
 typedef struct
 {
     hb_filter_private_t *pv;
     int segment;
+    hb_buffer_t *in;
     hb_buffer_t *out;
+    int done;
+    hb_task_t task;
+    hb_task_group_t *group;
 } mt_frame_thread_arg_t;
 
 struct hb_filter_private_s
 {
     hb_filter_object_t     * sub_filter;
-    hb_buffer_t           ** buf;
-    int                      frame_count;
-    taskset_t                taskset;
     int                      thread_count;
-    mt_frame_thread_arg_t ** thread_data;
+    mt_frame_thread_arg_t  * thread_data;
+    int                      head;   // oldest frame in flight
+    int                      count;  // frames in flight
 };
 
 static int mt_frame_init(hb_filter_object_t *filter, hb_filter_init_t *init);
@@ -54,6 +63,21 @@ hb_filter_object_t hb_filter_mt_frame =
     .settings_template = mt_frame_template,
 };
 
+static void mt_frame_free(hb_filter_private_t *pv)
+{
+    if (pv->thread_data != NULL)
+    {
+        for (int ii = 0; ii < pv->thread_count; ii++)
+        {
+            hb_task_group_close(&pv->thread_data[ii].group);
+            hb_buffer_close(&pv->thread_data[ii].in);
+            hb_buffer_close(&pv->thread_data[ii].out);
+        }
+    }
+    free(pv->thread_data);
+    free(pv);
+}
+
 static int mt_frame_init(hb_filter_object_t * filter,
                          hb_filter_init_t   * init)
 {
@@ -63,33 +87,29 @@ static int mt_frame_init(hb_filter_object_t * filter,
     pv->sub_filter = filter->sub_filter;
     pv->sub_filter->init(pv->sub_filter, init);
 
-    pv->thread_count = hb_get_cpu_count();
-    pv->buf = calloc(pv->thread_count, sizeof(hb_buffer_t*));
-
-    pv->thread_data = malloc(pv->thread_count * sizeof(mt_frame_thread_arg_t*));
-    if (taskset_init(&pv->taskset, pv->thread_count,
-                     sizeof(mt_frame_thread_arg_t)) == 0)
+    pv->thread_count = hb_filter_thread_count(filter);
+    pv->thread_data = calloc(pv->thread_count, sizeof(mt_frame_thread_arg_t));
+    if (pv->thread_data == NULL)
     {
-        hb_error("MTFrame could not initialize taskset");
+        hb_error("MTFrame could not create thread args");
         goto fail;
     }
 
     for (int ii = 0; ii < pv->thread_count; ii++)
     {
-        pv->thread_data[ii] = taskset_thread_args(&pv->taskset, ii);
-        if (pv->thread_data[ii] == NULL)
-        {
-            hb_error("MTFrame could not create thread args");
-            goto fail;
-        }
-        pv->thread_data[ii]->pv = pv;
-        pv->thread_data[ii]->segment = ii;
-        if (taskset_thread_spawn(&pv->taskset, ii, "mt_frame_filter",
-                             mt_frame_filter_thread, HB_NORMAL_PRIORITY) == 0)
+        mt_frame_thread_arg_t *thread_data = &pv->thread_data[ii];
+
+        thread_data->pv = pv;
+        thread_data->segment = ii;
+        thread_data->group = hb_task_group_init();
+        if (thread_data->group == NULL)
         {
-            hb_error("MTFrame could not spawn thread");
+            hb_error("MTFrame could not initialize task group");
             goto fail;
         }
+        thread_data->task.function = mt_frame_filter_thread;
+        thread_data->task.arg      = thread_data;
+        thread_data->task.group    = thread_data->group;
     }
 
     if (pv->sub_filter->init_thread != NULL)
@@ -103,9 +123,8 @@ static int mt_frame_init(hb_filter_object_t * filter,
     return 0;
 
 fail:
-    taskset_fini(&pv->taskset);
-    free(pv->thread_data);
-    free(pv);
+    mt_frame_free(pv);
+    filter->private_data = NULL;
     return -1;
 }
 
@@ -118,11 +137,13 @@ static void mt_frame_close(hb_filter_object_t *filter)
         return;
     }
 
+    // Frames may still be in flight if the job was cancelled
+    for (int ii = 0; ii < pv->thread_count; ii++)
+    {
+        hb_task_group_wait(pv->thread_data[ii].group);
+    }
     pv->sub_filter->close(pv->sub_filter);
-    taskset_fini(&pv->taskset);
-    free(pv->thread_data);
-    free(pv->buf);
-    free(pv);
+    mt_frame_free(pv);
     filter->private_data = NULL;
 }
 
@@ -132,77 +153,50 @@ static void mt_frame_filter_thread(void *thread_args_v)
     hb_filter_private_t *pv = thread_data->pv;
     int segment = thread_data->segment;
 
-    hb_log("MTFrame thread started for segment %d", segment);
-
-    while (1)
+    if (pv->sub_filter->work_thread != NULL)
     {
-        // Wait until there is work to do.
-        taskset_thread_wait4start(&pv->taskset, segment);
-
-        if (taskset_thread_stop(&pv->taskset, segment))
-        {
-            break;
-        }
-
-        if (pv->sub_filter->work_thread != NULL)
-        {
-            pv->sub_filter->work_thread(pv->sub_filter,
-                                 &pv->buf[segment], &thread_data->out, segment);
-        }
-        else
-        {
-            pv->sub_filter->work(pv->sub_filter,
-                                 &pv->buf[segment], &thread_data->out);
-        }
-        if (pv->buf[segment] != NULL)
-        {
-            hb_buffer_close(&pv->buf[segment]);
-        }
-
-        // Finished this segment, notify.
-        taskset_thread_complete(&pv->taskset, segment);
+        pv->sub_filter->work_thread(pv->sub_filter,
+                             &thread_data->in, &thread_data->out, segment);
     }
-    taskset_thread_complete(&pv->taskset, segment);
-}
-
-static hb_buffer_t * mt_frame_filter(hb_filter_private_t *pv)
-{
-    if (pv->frame_count < pv->thread_count)
+    else
     {
-        return NULL;
+        pv->sub_filter->work(pv->sub_filter,
+                             &thread_data->in, &thread_data->out);
     }
-
-    taskset_cycle(&pv->taskset);
-    pv->frame_count = 0;
-
-    // Collect results from taskset
-    hb_buffer_list_t list;
-    hb_buffer_list_clear(&list);
-    for (int t = 0; t < pv->thread_count; t++)
+    if (thread_data->in != NULL)
     {
-        hb_buffer_list_append(&list, pv->thread_data[t]->out);
+        hb_buffer_close(&thread_data->in);
     }
-    return hb_buffer_list_clear(&list);
+
+    // Finished this frame, the reorder ring may emit it now.
+    hb_atomic_store(&thread_data->done, 1);
 }
 
-static hb_buffer_t * mt_frame_filter_flush(hb_filter_private_t *pv)
+/*
+ * Move finished frames from the head of the ring to 'list', in input
+ * order.  Blocks on the oldest frame while more than 'max_busy' frames
+ * are in flight.
+ */
+static void mt_frame_collect(hb_filter_private_t *pv, hb_buffer_list_t *list,
+                             int max_busy)
 {
-    hb_buffer_list_t list;
-
-    hb_buffer_list_clear(&list);
-    for (int f = 0; f < pv->frame_count; f++)
+    while (pv->count > 0)
     {
-        hb_buffer_t * out;
-        pv->sub_filter->work(pv->sub_filter, &pv->buf[f], &out);
+        mt_frame_thread_arg_t *thread_data = &pv->thread_data[pv->head];
 
-        if (pv->buf[f] != NULL)
+        if (!hb_atomic_load(&thread_data->done))
         {
-            hb_buffer_close(&pv->buf[f]);
+            if (pv->count <= max_busy)
+            {
+                break;
+            }
+            hb_task_group_wait(thread_data->group);
         }
-        hb_buffer_list_append(&list, out);
+        hb_buffer_list_append(list, thread_data->out);
+        thread_data->out = NULL;
+        pv->head = (pv->head + 1) % pv->thread_count;
+        pv->count--;
     }
-    pv->frame_count = 0;
-    return hb_buffer_list_clear(&list);
 }
 
 static int mt_frame_work(hb_filter_object_t  * filter,
@@ -211,16 +205,14 @@ static int mt_frame_work(hb_filter_object_t  * filter,
 {
     hb_filter_private_t *pv = filter->private_data;
     hb_buffer_t *in = *buf_in;
+    hb_buffer_list_t list;
 
     *buf_in  = NULL;
+    hb_buffer_list_clear(&list);
     if (in->s.flags & HB_BUF_FLAG_EOF)
     {
-        hb_buffer_list_t list;
-        hb_buffer_t *buf;
-
-        // Flush buffered frames
-        buf = mt_frame_filter_flush(pv);
-        hb_buffer_list_set(&list, buf);
+        // Flush frames in flight
+        mt_frame_collect(pv, &list, 0);
 
         // And terminate the buffer list with a EOF buffer
         hb_buffer_list_append(&list, in);
@@ -229,8 +221,19 @@ static int mt_frame_work(hb_filter_object_t  * filter,
         return HB_FILTER_DONE;
     }
 
-    pv->buf[pv->frame_count++] = in;
-    *buf_out = mt_frame_filter(pv);
+    // Make room for this frame, then hand it to the pool
+    mt_frame_collect(pv, &list, pv->thread_count - 1);
+
+    mt_frame_thread_arg_t *thread_data;
+    thread_data = &pv->thread_data[(pv->head + pv->count) % pv->thread_count];
+    thread_data->in = in;
+    hb_atomic_store(&thread_data->done, 0);
+    pv->count++;
+    hb_thread_pool_submit(&thread_data->task, 1);
+
+    // Pick up anything else that finished meanwhile
+    mt_frame_collect(pv, &list, pv->thread_count);
+    *buf_out = hb_buffer_list_clear(&list);
 
     return HB_FILTER_OK;
 }
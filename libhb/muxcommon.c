@@ -29,6 +29,7 @@ typedef struct
     uint32_t    in;     // number of bufs put into fifo
     uint32_t    out;    // number of bufs taken out of fifo
     uint32_t    flen;   // fifo length (must be power of two)
+    uint32_t    spill;  // next buf to consider for spilling to disk
 } mux_fifo_t;
 
 typedef struct
@@ -55,16 +56,71 @@ typedef struct
     hb_bitvec_t     * allRdy;     // valid bits in rdy (audio & video tracks)
     hb_track_t     ** track;      // tracks to mux 'max_tracks' elements
     int               buffered_size;
+    hb_spill_t      * spill;      // job->spill, see spill.c
 } hb_mux_t;
 
+#define SEGMENT_PENDING 0
+#define SEGMENT_DONE    1
+#define SEGMENT_FAILED  2
+
+// One chapter range of a split job, see hb_stitch
+typedef struct
+{
+    char          * path;
+    FILE          * file;       // written by the segment's muxer
+    FILE          * read;       // read back by the stitcher
+    int64_t         written;    // bytes of complete packets in the file
+    int64_t         consumed;   // bytes read back by the stitcher
+    int             state;
+    int             configured; // config is valid
+    int             chapter;    // first chapter of the segment
+    int             areBframes;
+    hb_esconfig_t   config;
+} hb_segment_t;
+
+// Header of a packet in a segment file
+typedef struct
+{
+    hb_buffer_settings_t s;
+    int                  size;
+} segment_packet_t;
+
+struct hb_segment_set_s
+{
+    hb_lock_t    * lock;
+    hb_cond_t    * cond;
+    int            ref;
+    int            cancel;
+    int            count;
+    hb_segment_t * segments;
+};
+
 struct hb_work_private_s
 {
     hb_job_t  * job;
     int         track;
     hb_mux_t  * mux;
     hb_list_t * list_work;
+
+    // Split-and-stitch encoding
+    hb_segment_t * segment;     // muxer of a segment pass: its segment
+    int            index;       // hb_stitch: segment being read
+    int64_t        offset;      // added to the timestamps of its packets
+    hb_buffer_t  * next;        // packet read but not returned yet
 };
 
+static int  segment_open( hb_work_private_t * pv, hb_job_t * job );
+static int  segment_write( hb_work_object_t * w, hb_buffer_t * buf );
+static void segment_close( hb_work_private_t * pv );
+
+// The output file is written by the final pass only
+static int mux_output( hb_job_t * job )
+{
+    return job->segment == 0 &&
+           (job->pass_id == HB_PASS_ENCODE ||
+            job->pass_id == HB_PASS_ENCODE_2ND);
+}
+
 
 static int hb_bitvec_add_bits(hb_bitvec_t *bv, int bits)
 {
@@ -296,6 +352,22 @@ static void mf_push( hb_mux_t * mux, int tk, hb_buffer_t *buf )
     track->mf.in = in + 1;
     track->buffered_size += buf->size;
     mux->buffered_size += buf->size;
+
+    // A starving track makes the others grow without bound, write the
+    // oldest bufs of this one to disk while over the job's memory limit
+    hb_spill_queue( mux->spill, buf );
+    if ( (int32_t)( track->mf.spill - track->mf.out ) < 0 )
+    {
+        track->mf.spill = track->mf.out;
+    }
+    while ( track->mf.spill != track->mf.in && hb_spill_over( mux->spill ) )
+    {
+        if ( hb_spill_out( track->mf.fifo[track->mf.spill & mask] ) < 0 )
+        {
+            break;
+        }
+        ++track->mf.spill;
+    }
 }
 
 static hb_buffer_t *mf_pull( hb_mux_t * mux, int tk )
@@ -310,6 +382,7 @@ static hb_buffer_t *mf_pull( hb_mux_t * mux, int tk )
 
         track->buffered_size -= b->size;
         mux->buffered_size -= b->size;
+        hb_spill_unqueue( b );
     }
     return b;
 }
@@ -339,6 +412,8 @@ static void OutputTrackChunk( hb_mux_t *mux, int tk, hb_mux_object_t *m )
 {
     hb_track_t *track = mux->track[tk];
     hb_buffer_t *buf;
+    uint64_t trace = hb_trace_begin();
+    int count = 0;
 
     while ( ( buf = mf_peek( track ) ) != NULL && buf->s.start < mux->pts )
     {
@@ -346,6 +421,11 @@ static void OutputTrackChunk( hb_mux_t *mux, int tk, hb_mux_object_t *m )
         track->frames += 1;
         track->bytes  += buf->size;
         m->mux( m, track->mux_data, buf );
+        count++;
+    }
+    if (count > 0)
+    {
+        hb_trace_end("mux write", trace);
     }
 }
 
@@ -358,14 +438,30 @@ static int muxWork( hb_work_object_t * w, hb_buffer_t ** buf_in,
     hb_track_t  * track;
     int           i;
     hb_buffer_t * buf = *buf_in;
+    uint64_t      trace;
 
+    if (pv->segment != NULL)
+    {
+        return segment_write(w, buf);
+    }
+
+    trace = hb_trace_begin();
     hb_lock( mux->mutex );
+    hb_trace_end("mux lock wait", trace);
     if ( mux->done )
     {
         hb_unlock( mux->mutex );
         return HB_WORK_DONE;
     }
 
+    // The first pass hands its audio and subtitles to the frame cache,
+    // its video is cached before the encoder
+    if (pv->track > 0 && job->frame_cache != NULL &&
+        job->pass_id == HB_PASS_ENCODE_1ST)
+    {
+        hb_frame_cache_write(job->frame_cache, pv->track, buf);
+    }
+
     if (buf->s.flags & HB_BUF_FLAG_EOF)
     {
         // EOF - mark this track as done
@@ -373,9 +469,7 @@ static int muxWork( hb_work_object_t * w, hb_buffer_t ** buf_in,
         hb_bitvec_set(mux->eof, pv->track);
         hb_bitvec_set(mux->rdy, pv->track);
     }
-    else if ((job->pass_id != HB_PASS_ENCODE &&
-              job->pass_id != HB_PASS_ENCODE_2ND) ||
-             hb_bitvec_bit(mux->eof, pv->track))
+    else if (!mux_output(job) || hb_bitvec_bit(mux->eof, pv->track))
     {
         hb_buffer_close( &buf );
     }
@@ -500,14 +594,13 @@ static void muxClose( hb_work_object_t * muxer )
     // may initiate optimization which can take a while and
     // we want the muxing state to be visible while this is
     // happening.
-    if( job->pass_id == HB_PASS_ENCODE ||
-        job->pass_id == HB_PASS_ENCODE_2ND )
+    if (mux_output(job))
     {
         /* Update the UI */
         hb_state_t state;
         state.state = HB_STATE_MUXING;
         state.param.muxing.progress = 0;
-        hb_set_state( job->h, &state );
+        hb_set_job_state( job, &state );
     }
 
     if( mux->m )
@@ -516,9 +609,13 @@ static void muxClose( hb_work_object_t * muxer )
         free( mux->m );
     }
 
+    if (pv->segment != NULL)
+    {
+        segment_close(pv);
+    }
+
     // we're all done muxing -- print final stats and cleanup.
-    if( job->pass_id == HB_PASS_ENCODE ||
-        job->pass_id == HB_PASS_ENCODE_2ND )
+    if (mux_output(job))
     {
         hb_stat_t sb;
         uint64_t bytes_total, frames_total;
@@ -559,8 +656,10 @@ static void muxClose( hb_work_object_t * muxer )
     {
         hb_buffer_t * b;
         track = mux->track[i];
-        while ( (b = mf_pull( mux, i )) != NULL )
+        // Closing drops spilled data without reading it back
+        while ( track->mf.out != track->mf.in )
         {
+            b = track->mf.fifo[track->mf.out++ & (track->mf.flen - 1)];
             hb_buffer_close( &b );
         }
         if( track->mux_data )
@@ -605,7 +704,7 @@ static int muxInit( hb_work_object_t * muxer, hb_job_t * job )
     hb_work_object_t * w;
 
     /* Get a real muxer */
-    if( job->pass_id == HB_PASS_ENCODE || job->pass_id == HB_PASS_ENCODE_2ND )
+    if (mux_output(job))
     {
         switch( job->mux )
         {
@@ -634,6 +733,7 @@ static int muxInit( hb_work_object_t * muxer, hb_job_t * job )
     mux->allEof = hb_bitvec_new(bit_vec_size);
 
     mux->mutex = hb_lock_init();
+    mux->spill = job->spill;
 
     // set up to interleave track data in blocks of 1 video frame time.
     // (the best case for buffering and playout latency). The container-
@@ -641,7 +741,7 @@ static int muxInit( hb_work_object_t * muxer, hb_job_t * job )
     mux->interleave = 90000. * (double)job->vrate.den / job->vrate.num;
     mux->pts = mux->interleave;
 
-    if( job->pass_id == HB_PASS_ENCODE || job->pass_id == HB_PASS_ENCODE_2ND )
+    if (mux_output(job))
     {
         /* Create file, write headers */
         if( mux->m )
@@ -657,6 +757,15 @@ static int muxInit( hb_work_object_t * muxer, hb_job_t * job )
     muxer->fifo_in = job->fifo_mpeg4;
     add_mux_track( mux, job->mux_data, 1 );
 
+    // A segment pass writes its video to the segment file
+    if (job->segments != NULL && job->segment > 0 &&
+        segment_open(pv, job) < 0)
+    {
+        *job->done_error = HB_ERROR_INIT;
+        *job->die = 1;
+        return -1;
+    }
+
     for (i = 0; i < hb_list_count(job->list_audio); i++)
     {
         hb_audio_t  *audio = hb_list_item( job->list_audio, i );
@@ -693,6 +802,8 @@ static int muxInit( hb_work_object_t * muxer, hb_job_t * job )
     {
         w = hb_list_item(pv->list_work, i);
         w->done = muxer->done;
+        w->die  = muxer->die;
+        w->stats = hb_profile_add(job->profile, w->name, "work", w->fifo_in);
         w->thread = hb_thread_init(w->name, hb_work_loop, w, HB_LOW_PRIORITY);
     }
     return 0;
@@ -707,6 +818,472 @@ hb_work_object_t hb_muxer =
     muxClose
 };
 
+/*
+ * Split-and-stitch encoding
+ *
+ * A split job (see hb_job_setup_passes) has a segment pass for each of
+ * its chapter ranges.  The muxer of a segment pass writes the encoded
+ * video to a temporary file of the segment instead of the output file.
+ * Each segment has its own encoder, so it starts with an IDR picture
+ * and none of its pictures reference another segment.
+ *
+ * The final pass processes the whole title.  hb_stitch takes the place
+ * of its video encoder: it drops the pictures it is given and returns
+ * the packets of the segments in order instead, each segment shifted to
+ * the time of its first chapter in the pass.  Segments and the final
+ * pass are cut at the same chapter times (see job_setup_segments), so
+ * the video stays on the timeline of the audio at every seam.  The stitcher returns packets up to the time
+ * of each picture it drops, so the video keeps pace with the audio and
+ * subtitles of the pass and they interleave as usual.
+ */
+hb_segment_set_t * hb_segment_set_init( int count )
+{
+    hb_segment_set_t * set = calloc(1, sizeof(hb_segment_set_t));
+
+    if (set == NULL)
+    {
+        return NULL;
+    }
+    set->segments = calloc(count, sizeof(hb_segment_t));
+    if (set->segments == NULL)
+    {
+        free(set);
+        return NULL;
+    }
+    set->lock  = hb_lock_init();
+    set->cond  = hb_cond_init();
+    set->ref   = 1;
+    set->count = count;
+
+    return set;
+}
+
+hb_segment_set_t * hb_segment_set_retain( hb_segment_set_t * set )
+{
+    if (set != NULL)
+    {
+        hb_lock(set->lock);
+        set->ref++;
+        hb_unlock(set->lock);
+    }
+    return set;
+}
+
+/*
+ * Stop the segment passes that are still running and release a
+ * stitcher waiting for them.
+ */
+void hb_segment_set_cancel( hb_segment_set_t * set )
+{
+    if (set != NULL)
+    {
+        hb_lock(set->lock);
+        hb_atomic_store(&set->cancel, 1);
+        hb_cond_broadcast(set->cond);
+        hb_unlock(set->lock);
+    }
+}
+
+/*
+ * Called when segment pass 'segment' has ended, however it ended.  A
+ * segment that was not written to the end is marked failed, so that a
+ * stitcher waiting for it does not wait any longer.
+ */
+void hb_segment_set_ended( hb_segment_set_t * set, int segment )
+{
+    hb_segment_t * seg;
+
+    if (set == NULL || segment < 1 || segment > set->count)
+    {
+        return;
+    }
+    seg = &set->segments[segment - 1];
+    hb_lock(set->lock);
+    if (seg->state != SEGMENT_DONE)
+    {
+        seg->state = SEGMENT_FAILED;
+    }
+    hb_cond_broadcast(set->cond);
+    hb_unlock(set->lock);
+}
+
+void hb_segment_set_close( hb_segment_set_t ** _set )
+{
+    hb_segment_set_t * set = *_set;
+    hb_segment_t     * seg;
+    int                ref, ii;
+
+    if (set == NULL)
+    {
+        return;
+    }
+    *_set = NULL;
+
+    hb_lock(set->lock);
+    ref = --set->ref;
+    hb_unlock(set->lock);
+    if (ref > 0)
+    {
+        return;
+    }
+
+    for (ii = 0; ii < set->count; ii++)
+    {
+        seg = &set->segments[ii];
+        if (seg->file != NULL)
+        {
+            fclose(seg->file);
+        }
+        if (seg->read != NULL)
+        {
+            fclose(seg->read);
+        }
+        if (seg->path != NULL)
+        {
+            remove(seg->path);
+            free(seg->path);
+        }
+    }
+    free(set->segments);
+    hb_cond_close(&set->cond);
+    hb_lock_close(&set->lock);
+    free(set);
+}
+
+static int segment_open( hb_work_private_t * pv, hb_job_t * job )
+{
+    hb_segment_set_t * set = job->segments;
+    hb_segment_t     * seg = &set->segments[job->segment - 1];
+    char               path[1024];
+    FILE             * file;
+
+    hb_get_tempory_filename(job->h, path, "segment.%d.%d",
+                            job->sequence_id, job->segment);
+    file = hb_fopen(path, "wb");
+    if (file == NULL)
+    {
+        hb_error("mux: unable to create segment file %s", path);
+    }
+
+    // The encoder has been initialized, publish its stream headers
+    // for the stitching pass
+    hb_lock(set->lock);
+    seg->path       = strdup(path);
+    seg->file       = file;
+    seg->chapter    = job->chapter_start;
+    seg->areBframes = job->areBframes;
+    seg->config     = job->config;
+    seg->configured = 1;
+    seg->state      = file != NULL ? SEGMENT_PENDING : SEGMENT_FAILED;
+    hb_cond_broadcast(set->cond);
+    hb_unlock(set->lock);
+
+    pv->segment = seg;
+    return file != NULL ? 0 : -1;
+}
+
+static int segment_write( hb_work_object_t * w, hb_buffer_t * buf )
+{
+    hb_work_private_t * pv  = w->private_data;
+    hb_job_t          * job = pv->job;
+    hb_segment_set_t  * set = job->segments;
+    hb_segment_t      * seg = pv->segment;
+    segment_packet_t    pkt;
+
+    if (hb_atomic_load(&set->cancel))
+    {
+        *w->done = 1;
+        return HB_WORK_DONE;
+    }
+    if (buf->s.flags & HB_BUF_FLAG_EOF)
+    {
+        hb_lock(set->lock);
+        seg->state = SEGMENT_DONE;
+        hb_cond_broadcast(set->cond);
+        hb_unlock(set->lock);
+        *w->done = 1;
+        return HB_WORK_DONE;
+    }
+
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.s    = buf->s;
+    pkt.size = buf->size;
+    if (fwrite(&pkt, sizeof(pkt), 1, seg->file) != 1 ||
+        (buf->size > 0 && fwrite(buf->data, buf->size, 1, seg->file) != 1) ||
+        fflush(seg->file) != 0)
+    {
+        hb_error("mux: segment %d write failed", job->segment);
+        *job->done_error = HB_ERROR_UNKNOWN;
+        *job->die = 1;
+        return HB_WORK_DONE;
+    }
+
+    hb_lock(set->lock);
+    seg->written += sizeof(pkt) + buf->size;
+    hb_cond_broadcast(set->cond);
+    hb_unlock(set->lock);
+
+    return HB_WORK_OK;
+}
+
+static void segment_close( hb_work_private_t * pv )
+{
+    hb_segment_set_t * set = pv->job->segments;
+    hb_segment_t     * seg = pv->segment;
+
+    hb_lock(set->lock);
+    if (seg->state != SEGMENT_DONE)
+    {
+        seg->state = SEGMENT_FAILED;
+    }
+    if (seg->file != NULL)
+    {
+        fclose(seg->file);
+        seg->file = NULL;
+    }
+    hb_cond_broadcast(set->cond);
+    hb_unlock(set->lock);
+}
+
+static int stitch_init( hb_work_object_t * w, hb_job_t * job )
+{
+    hb_work_private_t * pv  = calloc(1, sizeof(hb_work_private_t));
+    hb_segment_set_t  * set = job->segments;
+    hb_segment_t      * seg;
+    int                 ok;
+
+    if (pv == NULL || set == NULL)
+    {
+        free(pv);
+        return 1;
+    }
+    w->private_data = pv;
+    pv->job         = job;
+
+    // The muxer needs the stream headers now, take them from the
+    // encoder of the first segment once it has been set up.  Segment
+    // passes signal every change of their state, including their end
+    // when the job is stopped, see hb_segment_set_ended().
+    seg = &set->segments[0];
+    hb_lock(set->lock);
+    while (!seg->configured && seg->state == SEGMENT_PENDING &&
+           !set->cancel)
+    {
+        hb_cond_wait(set->cond, set->lock);
+    }
+    ok = seg->configured && seg->state != SEGMENT_FAILED;
+    if (ok)
+    {
+        *w->config      = seg->config;
+        job->areBframes = seg->areBframes;
+    }
+    hb_unlock(set->lock);
+
+    if (!ok)
+    {
+        hb_error("stitch: first segment failed to start");
+        return 1;
+    }
+    hb_log("stitch: stitching %d segments", set->count);
+
+    return 0;
+}
+
+/*
+ * Returns the nominal start of chapter 'chapter' in the timeline of the
+ * stitching pass, which starts at its first chapter.
+ */
+static int64_t stitch_chapter_start( hb_job_t * job, int chapter )
+{
+    hb_chapter_t * c;
+    int64_t        start = 0;
+    int            ii;
+
+    for (ii = job->chapter_start; ii < chapter; ii++)
+    {
+        c = hb_list_item(job->list_chapter, ii - 1);
+        if (c != NULL)
+        {
+            start += c->duration;
+        }
+    }
+    return start;
+}
+
+/*
+ * Returns the next packet of the segments, or NULL when they have all
+ * been read or one of them failed.
+ */
+static hb_buffer_t * stitch_read( hb_work_object_t * w )
+{
+    hb_work_private_t * pv  = w->private_data;
+    hb_job_t          * job = pv->job;
+    hb_segment_set_t  * set = job->segments;
+    hb_segment_t      * seg;
+    segment_packet_t    pkt;
+    hb_buffer_t       * buf;
+    int64_t             available;
+    int                 state;
+
+    while (pv->index < set->count)
+    {
+        seg = &set->segments[pv->index];
+
+        hb_lock(set->lock);
+        while (seg->written == seg->consumed &&
+               seg->state == SEGMENT_PENDING && !set->cancel)
+        {
+            hb_cond_wait(set->cond, set->lock);
+        }
+        available = seg->written - seg->consumed;
+        state     = seg->state;
+        hb_unlock(set->lock);
+
+        if (available == 0)
+        {
+            if (state != SEGMENT_DONE)
+            {
+                if (state == SEGMENT_FAILED)
+                {
+                    hb_error("stitch: segment %d failed", pv->index + 1);
+                }
+                return NULL;
+            }
+            if (seg->read != NULL)
+            {
+                fclose(seg->read);
+                seg->read = NULL;
+            }
+            pv->index++;
+            continue;
+        }
+
+        if (seg->read == NULL)
+        {
+            // The segment starts at the time of its first chapter
+            pv->offset = stitch_chapter_start(job, seg->chapter);
+            seg->read = hb_fopen(seg->path, "rb");
+            if (seg->read == NULL)
+            {
+                hb_error("stitch: unable to open segment file %s",
+                         seg->path);
+                return NULL;
+            }
+        }
+        if (fread(&pkt, sizeof(pkt), 1, seg->read) != 1)
+        {
+            hb_error("stitch: segment %d read failed", pv->index + 1);
+            return NULL;
+        }
+        buf = hb_buffer_init(pkt.size);
+        if (pkt.size > 0 && fread(buf->data, pkt.size, 1, seg->read) != 1)
+        {
+            hb_error("stitch: segment %d read failed", pv->index + 1);
+            hb_buffer_close(&buf);
+            return NULL;
+        }
+
+        buf->s               = pkt.s;
+        buf->s.start        += pv->offset;
+        buf->s.stop         += pv->offset;
+        buf->s.renderOffset += pv->offset;
+        if (seg->consumed == 0 && pv->index > 0 && buf->s.new_chap <= 0)
+        {
+            // The segment encoder did not see its first chapter start
+            buf->s.new_chap = seg->chapter;
+        }
+        seg->consumed += sizeof(pkt) + pkt.size;
+        return buf;
+    }
+    return NULL;
+}
+
+static int stitch_work( hb_work_object_t * w, hb_buffer_t ** buf_in,
+                        hb_buffer_t ** buf_out )
+{
+    hb_work_private_t * pv  = w->private_data;
+    hb_job_t          * job = pv->job;
+    hb_buffer_t       * in  = *buf_in;
+    hb_buffer_list_t    list;
+    int64_t             until;
+    int                 eof;
+
+    // Return the packets that decode before the end of this picture,
+    // the picture itself is not needed.
+    eof   = in->s.flags & HB_BUF_FLAG_EOF;
+    until = eof ? INT64_MAX : in->s.stop;
+    hb_buffer_close(buf_in);
+
+    hb_buffer_list_clear(&list);
+    while (1)
+    {
+        if (pv->next == NULL)
+        {
+            pv->next = stitch_read(w);
+        }
+        if (pv->next == NULL || pv->next->s.renderOffset >= until)
+        {
+            break;
+        }
+        hb_buffer_list_append(&list, pv->next);
+        pv->next = NULL;
+    }
+
+    if (pv->next == NULL && pv->index < job->segments->count)
+    {
+        // A segment failed or the job was cancelled
+        hb_buffer_list_close(&list);
+        if (!*job->die)
+        {
+            *job->done_error = HB_ERROR_UNKNOWN;
+            *job->die = 1;
+        }
+        return HB_WORK_DONE;
+    }
+    if (eof)
+    {
+        hb_buffer_list_append(&list, hb_buffer_eof_init());
+        *buf_out = hb_buffer_list_clear(&list);
+        return HB_WORK_DONE;
+    }
+    *buf_out = hb_buffer_list_clear(&list);
+
+    return HB_WORK_OK;
+}
+
+static void stitch_close( hb_work_object_t * w )
+{
+    hb_work_private_t * pv = w->private_data;
+    hb_segment_t      * seg;
+    int                 ii;
+
+    if (pv == NULL)
+    {
+        return;
+    }
+    hb_buffer_close(&pv->next);
+    for (ii = 0; ii < pv->job->segments->count; ii++)
+    {
+        seg = &pv->job->segments->segments[ii];
+        if (seg->read != NULL)
+        {
+            fclose(seg->read);
+            seg->read = NULL;
+        }
+    }
+    free(pv);
+    w->private_data = NULL;
+}
+
+hb_work_object_t hb_stitch =
+{
+    WORK_STITCH,
+    "Segment stitcher",
+    stitch_init,
+    stitch_work,
+    stitch_close
+};
+
 #define TX3G_STYLES (HB_STYLE_FLAG_BOLD   |   \
                      HB_STYLE_FLAG_ITALIC |   \
                      HB_STYLE_FLAG_UNDERLINE)
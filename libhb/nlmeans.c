@@ -48,6 +48,13 @@
  *        etc...
  *  3329: Mean 3x3 reduced by 25% plus edge boost, passthru
  *        etc...
+ *
+ * Threading:
+ *     threads: number of frames processed in parallel
+ *     slices:  number of horizontal bands each frame is split into
+ * By default a few frames are processed in parallel and the remaining
+ * CPUs work on bands of these frames, so that the number of frames in
+ * flight does not grow with the CPU count.
  */
 
 #include "hb.h"
@@ -85,8 +92,14 @@
 #define NLMEANS_SWAP(a,b) { a = (a ^ b); b = (a ^ b); a = (b ^ a); }
 
 #define NLMEANS_FRAMES_MAX  32
+#define NLMEANS_THREADS_DEFAULT 4
 #define NLMEANS_EXPSIZE     128
 
+// Patches per tile, sized so that the tile's pixel sums and integral
+// image stay in the L2 cache
+#define NLMEANS_TILE_WIDTH  256
+#define NLMEANS_TILE_HEIGHT 64
+
 typedef struct
 {
     uint8_t *mem;
@@ -109,16 +122,17 @@ typedef struct
     hb_buffer_settings_t s;
 } Frame;
 
-struct PixelSum
+typedef struct
 {
-    float weight_sum;
-    float pixel_sum;
-};
+    struct PixelSum *sums;
+    uint32_t        *integral;
+} TileScratch;
 
 typedef struct
 {
     hb_filter_private_t *pv;
     int segment;
+    int slice;
     hb_buffer_t *out;
 } nlmeans_thread_arg_t;
 
@@ -131,6 +145,7 @@ struct hb_filter_private_s
     int    nframes[3];     // temporal search depth in frames
     int    prefilter[3];   // prefilter mode, can improve weight analysis
     int    threads;        // number of frame threads to use, 0 == auto
+    int    slices;         // number of bands per frame, 0 == auto
 
     float  exptable[3][NLMEANS_EXPSIZE];
     float  weight_fact_table[3];
@@ -138,6 +153,8 @@ struct hb_filter_private_s
 
     NLMeansFunctions functions;
 
+    TileScratch *scratch;  // one per task
+
     Frame      *frame;
     int         next_frame;
     int         max_frames;
@@ -164,7 +181,7 @@ static const char nlmeans_template[] =
     "cr-strength=^"HB_FLOAT_REG"$:cr-origin-tune=^"HB_FLOAT_REG"$:"
     "cr-patch-size=^"HB_INT_REG"$:cr-range=^"HB_INT_REG"$:"
     "cr-frame-count=^"HB_INT_REG"$:cr-prefilter=^"HB_INT_REG"$:"
-    "threads=^"HB_INT_REG"$";
+    "threads=^"HB_INT_REG"$:slices=^"HB_INT_REG"$";
 
 hb_filter_object_t hb_filter_nlmeans =
 {
@@ -745,7 +762,40 @@ static void build_integral_scalar(uint32_t *integral,
     }
 }
 
+static void accumulate_scalar(struct PixelSum *sums,
+                        const uint32_t        *integral_top,
+                        const uint32_t        *integral_bottom,
+                              int              n,
+                        const uint8_t         *compare,
+                              int              count,
+                        const float           *exptable,
+                              float            weight_fact_table,
+                              int              diff_max)
+{
+    for (int x = 0; x < count; x++)
+    {
+        // Difference between patches
+        const int diff = (uint32_t)(integral_bottom[x+n] - integral_bottom[x] -
+                                    integral_top[x+n]    + integral_top[x]);
+
+        // Sum pixel with weight
+        if (diff < diff_max)
+        {
+            const int diffidx = diff * weight_fact_table;
+
+            //float weight = exp(-diff*weightFact);
+            const float weight = exptable[diffidx];
+
+            sums[x].weight_sum += weight;
+            sums[x].pixel_sum  += weight * compare[x];
+        }
+    }
+}
+
 static void nlmeans_plane(NLMeansFunctions *functions,
+                          TileScratch *scratch,
+                          int slice,
+                          int slices,
                           Frame *frame,
                           int prefilter,
                           int plane,
@@ -765,6 +815,11 @@ static void nlmeans_plane(NLMeansFunctions *functions,
     const int n_half = (n-1) /2;
     const int r_half = (r-1) /2;
 
+    for (int f = 0; f < nframes; f++)
+    {
+        nlmeans_prefilter(&frame[f].plane[plane], prefilter);
+    }
+
     // Source image
     const uint8_t *src     = frame[0].plane[plane].image;
     const uint8_t *src_pre = frame[0].plane[plane].image_pre;
@@ -772,93 +827,122 @@ static void nlmeans_plane(NLMeansFunctions *functions,
     const int border = frame[0].plane[plane].border;
     const int bw     = w + 2 * border;
 
-    // Allocate temporary pixel sums
-    struct PixelSum *tmp_data = calloc(dst_w * dst_h, sizeof(struct PixelSum));
+    // Patch positions, patch (x,y) is centered on pixel (x+n_half,y+n_half)
+    const int patches_w = dst_w - n + 1;
+    const int patches_h = dst_h - n + 1;
 
-    // Allocate integral image
-    const int integral_stride    = ((dst_w + 15) / 16 * 16) + 2 * 16;
-    uint32_t* const integral_mem = calloc(integral_stride * (dst_h+1), sizeof(uint32_t));
-    uint32_t* const integral     = integral_mem + integral_stride + 16;
+    // Rows of patches of this slice
+    const int slice_start = (int64_t)patches_h *  slice      / slices;
+    const int slice_end   = (int64_t)patches_h * (slice + 1) / slices;
 
-    // Iterate through available frames
-    for (int f = 0; f < nframes; f++)
+    // Integral image of a tile plus the n-1 pixels its patches reach
+    // past the tile.  Row -1 and column -1 must read as zero.
+    const int integral_stride = ((NLMEANS_TILE_WIDTH + n - 1 + 15) / 16 * 16) + 2 * 16;
+    uint32_t* const integral  = scratch->integral + integral_stride + 16;
+
+    memset(scratch->integral, 0, (integral_stride + 16) * sizeof(uint32_t));
+    for (int y = 0; y < NLMEANS_TILE_HEIGHT + n - 1; y++)
     {
-        nlmeans_prefilter(&frame[f].plane[plane], prefilter);
+        integral[y*integral_stride - 1] = 0;
+    }
 
-        // Compare image
-        const uint8_t *compare     = frame[f].plane[plane].image;
-        const uint8_t *compare_pre = frame[f].plane[plane].image_pre;
+    // Run each tile through all frames and displacements while its
+    // pixel sums and integral image stay in cache
+    for (int ty = slice_start; ty < slice_end; ty += NLMEANS_TILE_HEIGHT)
+    {
+        const int tile_h = MIN(NLMEANS_TILE_HEIGHT, slice_end - ty);
 
-        // Iterate through all displacements
-        for (int dy = -r_half; dy <= r_half; dy++)
+        for (int tx = 0; tx < patches_w; tx += NLMEANS_TILE_WIDTH)
         {
-            for (int dx = -r_half; dx <= r_half; dx++)
+            const int tile_w = MIN(NLMEANS_TILE_WIDTH, patches_w - tx);
+            struct PixelSum *tmp_data = scratch->sums;
+
+            memset(tmp_data, 0, NLMEANS_TILE_WIDTH * tile_h * sizeof(struct PixelSum));
+
+            // Iterate through available frames
+            for (int f = 0; f < nframes; f++)
             {
+                // Compare image
+                const uint8_t *compare     = frame[f].plane[plane].image;
+                const uint8_t *compare_pre = frame[f].plane[plane].image_pre;
 
-                // Apply special weight tuning to origin patch
-                if (dx == 0 && dy == 0 && f == 0)
+                // Iterate through all displacements
+                for (int dy = -r_half; dy <= r_half; dy++)
                 {
-                    // TODO: Parallelize this
-                    for (int y = n_half; y < dst_h-n + n_half; y++)
+                    for (int dx = -r_half; dx <= r_half; dx++)
                     {
-                        for (int x = n_half; x < dst_w-n + n_half; x++)
+
+                        // Apply special weight tuning to origin patch
+                        if (dx == 0 && dy == 0 && f == 0)
                         {
-                            tmp_data[y*dst_w + x].weight_sum += origin_tune;
-                            tmp_data[y*dst_w + x].pixel_sum  += origin_tune * src[y*bw + x];
+                            for (int y = 0; y < tile_h && ty + y < patches_h - 1; y++)
+                            {
+                                const uint8_t *s = src + (ty+y+n_half)*bw + tx + n_half;
+                                for (int x = 0; x < tile_w && tx + x < patches_w - 1; x++)
+                                {
+                                    tmp_data[y*NLMEANS_TILE_WIDTH + x].weight_sum += origin_tune;
+                                    tmp_data[y*NLMEANS_TILE_WIDTH + x].pixel_sum  += origin_tune * s[x];
+                                }
+                            }
+                            continue;
                         }
-                    }
-                    continue;
-                }
-
-                // Build integral
-                functions->build_integral(integral,
-                                          integral_stride,
-                                          src,
-                                          src_pre,
-                                          compare,
-                                          compare_pre,
-                                          w,
-                                          border,
-                                          dst_w,
-                                          dst_h,
-                                          dx,
-                                          dy);
-
-                // Average displacement
-                // TODO: Parallelize this
-                for (int y = 0; y <= dst_h-n; y++)
-                {
-                    const uint32_t *integral_ptr1 = integral + (y  -1)*integral_stride - 1;
-                    const uint32_t *integral_ptr2 = integral + (y+n-1)*integral_stride - 1;
 
-                    for (int x = 0; x <= dst_w-n; x++)
-                    {
-                        const int xc = x + n_half;
-                        const int yc = y + n_half;
-
-                        // Difference between patches
-                        const int diff = (uint32_t)(integral_ptr2[n] - integral_ptr2[0] - integral_ptr1[n] + integral_ptr1[0]);
-
-                        // Sum pixel with weight
-                        if (diff < diff_max)
+                        // Build integral
+                        functions->build_integral(integral,
+                                                  integral_stride,
+                                                  src     + ty*bw + tx,
+                                                  src_pre + ty*bw + tx,
+                                                  compare     + ty*bw + tx,
+                                                  compare_pre + ty*bw + tx,
+                                                  w,
+                                                  border,
+                                                  tile_w + n - 1,
+                                                  tile_h + n - 1,
+                                                  dx,
+                                                  dy);
+
+                        // Average displacement
+                        for (int y = 0; y < tile_h; y++)
                         {
-                            const int diffidx = diff * weight_fact_table;
+                            const int yc = ty + y + n_half;
+
+                            functions->accumulate(tmp_data + y*NLMEANS_TILE_WIDTH,
+                                                  integral + (y  -1)*integral_stride - 1,
+                                                  integral + (y+n-1)*integral_stride - 1,
+                                                  n,
+                                                  compare + (yc+dy)*bw + tx + n_half + dx,
+                                                  tile_w,
+                                                  exptable,
+                                                  weight_fact_table,
+                                                  diff_max);
+                        }
+                    }
+                }
+            }
 
-                            //float weight = exp(-diff*weightFact);
-                            const float weight = exptable[diffidx];
+            // Copy tile
+            uint8_t result;
+            for (int y = 0; y < tile_h; y++)
+            {
+                const int yc = ty + y + n_half;
+                const struct PixelSum *sum = tmp_data + y*NLMEANS_TILE_WIDTH;
 
-                            tmp_data[yc*dst_w + xc].weight_sum += weight;
-                            tmp_data[yc*dst_w + xc].pixel_sum  += weight * compare[(yc+dy)*bw + xc + dx];
-                        }
+                for (int x = 0; x < tile_w; x++)
+                {
+                    const int xc = tx + x + n_half;
 
-                        integral_ptr1++;
-                        integral_ptr2++;
-                    }
+                    result = (uint8_t)(sum[x].pixel_sum / sum[x].weight_sum);
+                    *(dst + yc*dst_s + xc) = result ? result : *(src + yc*bw + xc);
                 }
             }
         }
     }
 
+    if (slice > 0)
+    {
+        return;
+    }
+
     // Copy edges
     for (int y = 0; y < dst_h; y++)
     {
@@ -873,21 +957,21 @@ static void nlmeans_plane(NLMeansFunctions *functions,
         memcpy(dst +           y*dst_s, src -     (y+1)*bw, dst_w);
         memcpy(dst + (dst_h-y-1)*dst_s, src + (y+dst_h)*bw, dst_w);
     }
+}
 
-    // Copy main image
-    uint8_t result;
-    for (int y = n_half; y < dst_h-n_half; y++)
+static void nlmeans_free_scratch(hb_filter_private_t *pv)
+{
+    if (pv->scratch == NULL)
     {
-        for (int x = n_half; x < dst_w-n_half; x++)
-        {
-            result = (uint8_t)(tmp_data[y*dst_w + x].pixel_sum / tmp_data[y*dst_w + x].weight_sum);
-            *(dst + y*dst_s + x) = result ? result : *(src + y*bw + x);
-        }
+        return;
     }
-
-    free(tmp_data);
-    free(integral_mem);
-
+    for (int ii = 0; ii < pv->threads * pv->slices; ii++)
+    {
+        free(pv->scratch[ii].sums);
+        free(pv->scratch[ii].integral);
+    }
+    free(pv->scratch);
+    pv->scratch = NULL;
 }
 
 static int nlmeans_init(hb_filter_object_t *filter,
@@ -898,6 +982,7 @@ static int nlmeans_init(hb_filter_object_t *filter,
     NLMeansFunctions *functions = &pv->functions;
 
     functions->build_integral = build_integral_scalar;
+    functions->accumulate     = accumulate_scalar;
 #if defined(ARCH_X86)
     nlmeans_init_x86(functions);
 #endif
@@ -913,6 +998,7 @@ static int nlmeans_init(hb_filter_object_t *filter,
         pv->prefilter[c]   = -1;
     }
     pv->threads = -1;
+    pv->slices  = -1;
 
     // Read user parameters
     if (filter->settings != NULL)
@@ -940,6 +1026,7 @@ static int nlmeans_init(hb_filter_object_t *filter,
         hb_dict_extract_int(&pv->prefilter[2],      dict, "cr-prefilter");
 
         hb_dict_extract_int(&pv->threads,           dict, "threads");
+        hb_dict_extract_int(&pv->slices,            dict, "slices");
     }
 
     // Cascade values
@@ -994,8 +1081,20 @@ static int nlmeans_init(hb_filter_object_t *filter,
         exptable[NLMEANS_EXPSIZE-1] = 0;
     }
 
-    // Sanitize
-    if (pv->threads < 1) { pv->threads = hb_get_cpu_count(); }
+    // Sanitize, split the CPUs between frames and bands of frames
+    const int cpu_count = hb_filter_thread_count(filter);
+    if (pv->threads < 1)
+    {
+        pv->threads = pv->slices < 1 ? MIN(cpu_count, NLMEANS_THREADS_DEFAULT) :
+                                       MAX(1, cpu_count / pv->slices);
+    }
+    if (pv->slices < 1)
+    {
+        pv->slices = (cpu_count + pv->threads - 1) / pv->threads;
+    }
+    const int tasks = pv->threads * pv->slices;
+    hb_log("NLMeans using %d frame threads with %d slices each",
+           pv->threads, pv->slices);
 
     pv->frame = calloc(pv->threads + pv->max_frames, sizeof(Frame));
     for (int ii = 0; ii < pv->threads + pv->max_frames; ii++)
@@ -1006,15 +1105,42 @@ static int nlmeans_init(hb_filter_object_t *filter,
         }
     }
 
-    pv->thread_data = malloc(pv->threads * sizeof(nlmeans_thread_arg_t*));
-    if (taskset_init(&pv->taskset, pv->threads,
+    // Allocate tile scratch memory for each task
+    int max_patch_size = 1;
+    for (int c = 0; c < 3; c++)
+    {
+        if (max_patch_size < pv->patch_size[c]) max_patch_size = pv->patch_size[c];
+    }
+    const int integral_stride = ((NLMEANS_TILE_WIDTH + max_patch_size - 1 + 15) / 16 * 16) + 2 * 16;
+    pv->scratch = calloc(tasks, sizeof(TileScratch));
+    if (pv->scratch == NULL)
+    {
+        hb_error("NLMeans could not allocate scratch memory");
+        goto fail;
+    }
+    for (int ii = 0; ii < tasks; ii++)
+    {
+        pv->scratch[ii].sums     = malloc(NLMEANS_TILE_WIDTH * NLMEANS_TILE_HEIGHT *
+                                          sizeof(struct PixelSum));
+        pv->scratch[ii].integral = malloc(integral_stride *
+                                          (NLMEANS_TILE_HEIGHT + max_patch_size + 1) *
+                                          sizeof(uint32_t));
+        if (pv->scratch[ii].sums == NULL || pv->scratch[ii].integral == NULL)
+        {
+            hb_error("NLMeans could not allocate scratch memory");
+            goto fail;
+        }
+    }
+
+    pv->thread_data = malloc(tasks * sizeof(nlmeans_thread_arg_t*));
+    if (taskset_init(&pv->taskset, tasks,
                      sizeof(nlmeans_thread_arg_t)) == 0)
     {
         hb_error("NLMeans could not initialize taskset");
         goto fail;
     }
 
-    for (int ii = 0; ii < pv->threads; ii++)
+    for (int ii = 0; ii < tasks; ii++)
     {
         pv->thread_data[ii] = taskset_thread_args(&pv->taskset, ii);
         if (pv->thread_data[ii] == NULL)
@@ -1023,7 +1149,8 @@ static int nlmeans_init(hb_filter_object_t *filter,
             goto fail;
         }
         pv->thread_data[ii]->pv = pv;
-        pv->thread_data[ii]->segment = ii;
+        pv->thread_data[ii]->segment = ii / pv->slices;
+        pv->thread_data[ii]->slice   = ii % pv->slices;
         if (taskset_thread_spawn(&pv->taskset, ii, "nlmeans_filter",
                                  nlmeans_filter_thread, HB_NORMAL_PRIORITY) == 0)
         {
@@ -1036,6 +1163,7 @@ static int nlmeans_init(hb_filter_object_t *filter,
 
 fail:
     taskset_fini(&pv->taskset);
+    nlmeans_free_scratch(pv);
     free(pv->thread_data);
     free(pv);
     return -1;
@@ -1077,6 +1205,7 @@ static void nlmeans_close(hb_filter_object_t *filter)
         }
     }
 
+    nlmeans_free_scratch(pv);
     free(pv->frame);
     free(pv->thread_data);
     free(pv);
@@ -1088,68 +1217,59 @@ static void nlmeans_filter_thread(void *thread_args_v)
     nlmeans_thread_arg_t *thread_data = thread_args_v;
     hb_filter_private_t *pv = thread_data->pv;
     int segment = thread_data->segment;
+    int slice = thread_data->slice;
 
-    hb_log("NLMeans thread started for segment %d", segment);
+    Frame *frame = &pv->frame[segment];
+    hb_buffer_t *buf = thread_data->out;
 
-    while (1)
-    {
-        // Wait until there is work to do.
-        taskset_thread_wait4start(&pv->taskset, segment);
+    NLMeansFunctions *functions = &pv->functions;
 
-        if (taskset_thread_stop(&pv->taskset, segment))
+    for (int c = 0; c < 3; c++)
+    {
+        if (slice > 0 &&
+            (pv->prefilter[c] & NLMEANS_PREFILTER_MODE_PASSTHRU ||
+             pv->strength[c] == 0))
         {
-            break;
+            // Copied whole by the first slice
+            continue;
         }
-
-        Frame *frame = &pv->frame[segment];
-        hb_buffer_t *buf;
-        buf = hb_frame_buffer_init(frame->fmt, frame->width, frame->height);
-
-        NLMeansFunctions *functions = &pv->functions;
-
-        for (int c = 0; c < 3; c++)
+        if (pv->prefilter[c] & NLMEANS_PREFILTER_MODE_PASSTHRU)
         {
-            if (pv->prefilter[c] & NLMEANS_PREFILTER_MODE_PASSTHRU)
-            {
-                nlmeans_prefilter(&frame->plane[c], pv->prefilter[c]);
-                nlmeans_deborder(&frame->plane[c], buf->plane[c].data,
-                                 buf->plane[c].width, buf->plane[c].stride,
-                                 buf->plane[c].height);
-                continue;
-            }
-            if (pv->strength[c] == 0)
-            {
-                nlmeans_deborder(&frame->plane[c], buf->plane[c].data,
-                                 buf->plane[c].width, buf->plane[c].stride,
-                                 buf->plane[c].height);
-                continue;
-            }
-
-            // Process current plane
-            nlmeans_plane(functions,
-                          frame,
-                          pv->prefilter[c],
-                          c,
-                          pv->nframes[c],
-                          buf->plane[c].data,
-                          buf->plane[c].width,
-                          buf->plane[c].stride,
-                          buf->plane[c].height,
-                          pv->strength[c],
-                          pv->origin_tune[c],
-                          pv->patch_size[c],
-                          pv->range[c],
-                          pv->exptable[c],
-                          pv->weight_fact_table[c],
-                          pv->diff_max[c]);
+            nlmeans_prefilter(&frame->plane[c], pv->prefilter[c]);
+            nlmeans_deborder(&frame->plane[c], buf->plane[c].data,
+                             buf->plane[c].width, buf->plane[c].stride,
+                             buf->plane[c].height);
+            continue;
+        }
+        if (pv->strength[c] == 0)
+        {
+            nlmeans_deborder(&frame->plane[c], buf->plane[c].data,
+                             buf->plane[c].width, buf->plane[c].stride,
+                             buf->plane[c].height);
+            continue;
         }
-        buf->s = pv->frame[segment].s;
-        thread_data->out = buf;
 
-        // Finished this segment, notify.
-        taskset_thread_complete(&pv->taskset, segment);
+        // Process current plane
+        nlmeans_plane(functions,
+                      &pv->scratch[segment * pv->slices + slice],
+                      slice,
+                      pv->slices,
+                      frame,
+                      pv->prefilter[c],
+                      c,
+                      pv->nframes[c],
+                      buf->plane[c].data,
+                      buf->plane[c].width,
+                      buf->plane[c].stride,
+                      buf->plane[c].height,
+                      pv->strength[c],
+                      pv->origin_tune[c],
+                      pv->patch_size[c],
+                      pv->range[c],
+                      pv->exptable[c],
+                      pv->weight_fact_table[c],
+                      pv->diff_max[c]);
     }
-    taskset_thread_complete(&pv->taskset, segment);
 }
 
 static void nlmeans_add_frame(hb_filter_private_t *pv, hb_buffer_t *buf)
@@ -1179,6 +1299,19 @@ static hb_buffer_t * nlmeans_filter(hb_filter_private_t *pv)
         return NULL;
     }
 
+    // Every slice of a frame writes to the same output buffer
+    for (int t = 0; t < pv->threads; t++)
+    {
+        Frame *frame = &pv->frame[t];
+        hb_buffer_t *buf;
+        buf = hb_frame_buffer_init(frame->fmt, frame->width, frame->height);
+        buf->s = frame->s;
+        for (int s = 0; s < pv->slices; s++)
+        {
+            pv->thread_data[t * pv->slices + s]->out = buf;
+        }
+    }
+
     taskset_cycle(&pv->taskset);
 
     // Free buffers that are not needed for next taskset cycle
@@ -1220,7 +1353,7 @@ static hb_buffer_t * nlmeans_filter(hb_filter_private_t *pv)
     hb_buffer_list_clear(&list);
     for (int t = 0; t < pv->threads; t++)
     {
-        hb_buffer_list_append(&list, pv->thread_data[t]->out);
+        hb_buffer_list_append(&list, pv->thread_data[t * pv->slices]->out);
     }
     return hb_buffer_list_clear(&list);
 }
@@ -1263,6 +1396,9 @@ static hb_buffer_t * nlmeans_filter_flush(hb_filter_private_t *pv)
             }
             // Process current plane
             nlmeans_plane(functions,
+                          &pv->scratch[0],
+                          0,
+                          1,
                           frame,
                           pv->prefilter[c],
                           c,
@@ -8,6 +8,12 @@
    For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
  */
 
+struct PixelSum
+{
+    float weight_sum;
+    float pixel_sum;
+};
+
 typedef struct
 {
     void (*build_integral)(uint32_t *integral,
@@ -22,6 +28,19 @@ typedef struct
                            int       dst_h,
                            int       dx,
                            int       dy);
+    // Weights 'count' patches of one row by the distance read from the
+    // integral image and adds them to 'sums'.  'integral_top' and
+    // 'integral_bottom' point one element left of the first patch in
+    // the integral rows above and at the bottom of the patches.
+    void (*accumulate)(struct PixelSum *sums,
+                 const uint32_t        *integral_top,
+                 const uint32_t        *integral_bottom,
+                       int              n,
+                 const uint8_t         *compare,
+                       int              count,
+                 const float           *exptable,
+                       float            weight_fact_table,
+                       int              diff_max);
 } NLMeansFunctions;
 
 void nlmeans_init_x86(NLMeansFunctions *functions);
@@ -17,6 +17,18 @@
 #include "libavutil/cpu.h"
 #include "nlmeans.h"
 
+// The AVX2 and AVX-512 kernels are compiled for their instruction set
+// with function attributes and only run on CPUs that have it.  FMA is
+// left out of the targets so that the floating point results are the
+// same as those of the scalar code.  Our libav does not report AVX-512,
+// hb_get_cpu_flags() does.
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define NLMEANS_HAVE_AVX2   1
+#define NLMEANS_HAVE_AVX512 1
+#include <immintrin.h>
+#define NLMEANS_TARGET(isa) __attribute__((target(isa)))
+#endif
+
 static void build_integral_sse2(uint32_t *integral,
                                 int       integral_stride,
                           const uint8_t  *src,
@@ -143,12 +155,307 @@ static void build_integral_sse2(uint32_t *integral,
     }
 }
 
+// Same as accumulate_scalar(), for the patches left over by the
+// vector loops
+static void accumulate_tail(struct PixelSum *sums,
+                      const uint32_t        *integral_top,
+                      const uint32_t        *integral_bottom,
+                            int              n,
+                      const uint8_t         *compare,
+                            int              x,
+                            int              count,
+                      const float           *exptable,
+                            float            weight_fact_table,
+                            int              diff_max)
+{
+    for (; x < count; x++)
+    {
+        const int diff = (uint32_t)(integral_bottom[x+n] - integral_bottom[x] -
+                                    integral_top[x+n]    + integral_top[x]);
+
+        if (diff < diff_max)
+        {
+            const int diffidx = diff * weight_fact_table;
+            const float weight = exptable[diffidx];
+
+            sums[x].weight_sum += weight;
+            sums[x].pixel_sum  += weight * compare[x];
+        }
+    }
+}
+
+#if defined(NLMEANS_HAVE_AVX2)
+
+// Inclusive prefix sum of the 8 dwords of 'v', plus 'carry' which holds
+// the running total of the row in every element and is updated
+NLMEANS_TARGET("avx2")
+static inline __m256i prefix_sum_avx2(__m256i v, __m256i *carry)
+{
+    __m256i low;
+
+    v   = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+    v   = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+    // Add the total of the low 128 bit lane to the high lane
+    low = _mm256_shuffle_epi32(v, 0xff);
+    low = _mm256_permute2x128_si256(low, low, 0x08);
+    v   = _mm256_add_epi32(v, low);
+    v   = _mm256_add_epi32(v, *carry);
+    *carry = _mm256_permutevar8x32_epi32(v, _mm256_set1_epi32(7));
+    return v;
+}
+
+NLMEANS_TARGET("avx2")
+static void build_integral_avx2(uint32_t *integral,
+                                int       integral_stride,
+                          const uint8_t  *src,
+                          const uint8_t  *src_pre,
+                          const uint8_t  *compare,
+                          const uint8_t  *compare_pre,
+                                int       w,
+                                int       border,
+                                int       dst_w,
+                                int       dst_h,
+                                int       dx,
+                                int       dy)
+{
+    const int bw = w + 2 * border;
+
+    for (int y = 0; y < dst_h; y++)
+    {
+        __m256i prevadd = _mm256_setzero_si256();
+
+        const uint8_t *p1 = src_pre + y*bw;
+        const uint8_t *p2 = compare_pre + (y+dy)*bw + dx;
+        uint32_t *out = integral + (y*integral_stride);
+
+        // Row prefix sums of the squared differences plus the row above,
+        // which is all zeros for the first row
+        for (int x = 0; x < dst_w; x += 16)
+        {
+            __m256i pa, pb, diff, lo, hi;
+
+            pa   = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p1));
+            pb   = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p2));
+            diff = _mm256_sub_epi16(pa, pb);
+            diff = _mm256_mullo_epi16(diff, diff);  // fits in 16 bits unsigned
+
+            lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(diff));
+            hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(diff, 1));
+            lo = prefix_sum_avx2(lo, &prevadd);
+            hi = prefix_sum_avx2(hi, &prevadd);
+
+            lo = _mm256_add_epi32(lo, _mm256_loadu_si256(
+                                    (const __m256i*)(out - integral_stride)));
+            hi = _mm256_add_epi32(hi, _mm256_loadu_si256(
+                                    (const __m256i*)(out + 8 - integral_stride)));
+            _mm256_storeu_si256((__m256i*)out,       lo);
+            _mm256_storeu_si256((__m256i*)(out + 8), hi);
+
+            out += 16;
+            p1  += 16;
+            p2  += 16;
+        }
+    }
+}
+
+NLMEANS_TARGET("avx2")
+static void accumulate_avx2(struct PixelSum *sums,
+                      const uint32_t        *integral_top,
+                      const uint32_t        *integral_bottom,
+                            int              n,
+                      const uint8_t         *compare,
+                            int              count,
+                      const float           *exptable,
+                            float            weight_fact_table,
+                            int              diff_max)
+{
+    const __m256i dmax = _mm256_set1_epi32(diff_max);
+    const __m256  fact = _mm256_set1_ps(weight_fact_table);
+    int x;
+
+    for (x = 0; x + 8 <= count; x += 8)
+    {
+        __m256i diff, mask, idx;
+        __m256  weight, pixel, wp, lo, hi;
+        float  *sum = &sums[x].weight_sum;
+
+        // Difference between patches
+        diff = _mm256_sub_epi32(
+                    _mm256_loadu_si256((const __m256i*)(integral_bottom + x + n)),
+                    _mm256_loadu_si256((const __m256i*)(integral_bottom + x)));
+        diff = _mm256_sub_epi32(diff,
+                    _mm256_loadu_si256((const __m256i*)(integral_top + x + n)));
+        diff = _mm256_add_epi32(diff,
+                    _mm256_loadu_si256((const __m256i*)(integral_top + x)));
+        mask = _mm256_cmpgt_epi32(dmax, diff);
+        if (_mm256_testz_si256(mask, mask))
+        {
+            continue;
+        }
+
+        // Weights of the patches past diff_max are 0, adding them leaves
+        // the sums unchanged
+        idx    = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(diff), fact));
+        weight = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), exptable, idx,
+                                          _mm256_castsi256_ps(mask), 4);
+        pixel  = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+                    _mm_loadl_epi64((const __m128i*)(compare + x))));
+        wp     = _mm256_mul_ps(weight, pixel);
+
+        // Interleave to the weight_sum, pixel_sum layout of PixelSum
+        lo = _mm256_unpacklo_ps(weight, wp);
+        hi = _mm256_unpackhi_ps(weight, wp);
+        _mm256_storeu_ps(sum,     _mm256_add_ps(_mm256_loadu_ps(sum),
+                                     _mm256_permute2f128_ps(lo, hi, 0x20)));
+        _mm256_storeu_ps(sum + 8, _mm256_add_ps(_mm256_loadu_ps(sum + 8),
+                                     _mm256_permute2f128_ps(lo, hi, 0x31)));
+    }
+    accumulate_tail(sums, integral_top, integral_bottom, n, compare, x, count,
+                    exptable, weight_fact_table, diff_max);
+}
+
+#endif // NLMEANS_HAVE_AVX2
+
+#if defined(NLMEANS_HAVE_AVX512)
+
+NLMEANS_TARGET("avx512f")
+static void build_integral_avx512(uint32_t *integral,
+                                  int       integral_stride,
+                            const uint8_t  *src,
+                            const uint8_t  *src_pre,
+                            const uint8_t  *compare,
+                            const uint8_t  *compare_pre,
+                                  int       w,
+                                  int       border,
+                                  int       dst_w,
+                                  int       dst_h,
+                                  int       dx,
+                                  int       dy)
+{
+    const int     bw   = w + 2 * border;
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i last = _mm512_set1_epi32(15);
+
+    for (int y = 0; y < dst_h; y++)
+    {
+        __m512i prevadd = zero;
+
+        const uint8_t *p1 = src_pre + y*bw;
+        const uint8_t *p2 = compare_pre + (y+dy)*bw + dx;
+        uint32_t *out = integral + (y*integral_stride);
+
+        for (int x = 0; x < dst_w; x += 16)
+        {
+            __m512i pa, pb, v;
+
+            pa = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)p1));
+            pb = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)p2));
+            v  = _mm512_sub_epi32(pa, pb);
+            v  = _mm512_mullo_epi32(v, v);
+
+            // Prefix sum, shifting in zeros by 1, 2, 4 and 8 dwords
+            v = _mm512_add_epi32(v, _mm512_alignr_epi32(v, zero, 15));
+            v = _mm512_add_epi32(v, _mm512_alignr_epi32(v, zero, 14));
+            v = _mm512_add_epi32(v, _mm512_alignr_epi32(v, zero, 12));
+            v = _mm512_add_epi32(v, _mm512_alignr_epi32(v, zero, 8));
+            v = _mm512_add_epi32(v, prevadd);
+            prevadd = _mm512_permutexvar_epi32(last, v);
+
+            v = _mm512_add_epi32(v, _mm512_loadu_si512(out - integral_stride));
+            _mm512_storeu_si512(out, v);
+
+            out += 16;
+            p1  += 16;
+            p2  += 16;
+        }
+    }
+}
+
+NLMEANS_TARGET("avx512f")
+static void accumulate_avx512(struct PixelSum *sums,
+                        const uint32_t        *integral_top,
+                        const uint32_t        *integral_bottom,
+                              int              n,
+                        const uint8_t         *compare,
+                              int              count,
+                        const float           *exptable,
+                              float            weight_fact_table,
+                              int              diff_max)
+{
+    const __m512i dmax = _mm512_set1_epi32(diff_max);
+    const __m512  fact = _mm512_set1_ps(weight_fact_table);
+    const __m512i idx0 = _mm512_setr_epi32(0,  1,  2,  3, 16, 17, 18, 19,
+                                           4,  5,  6,  7, 20, 21, 22, 23);
+    const __m512i idx1 = _mm512_setr_epi32(8,  9, 10, 11, 24, 25, 26, 27,
+                                          12, 13, 14, 15, 28, 29, 30, 31);
+    int x;
+
+    for (x = 0; x + 16 <= count; x += 16)
+    {
+        __m512i   diff, idx;
+        __m512    weight, pixel, wp, lo, hi;
+        __mmask16 mask;
+        float    *sum = &sums[x].weight_sum;
+
+        diff = _mm512_sub_epi32(_mm512_loadu_si512(integral_bottom + x + n),
+                                _mm512_loadu_si512(integral_bottom + x));
+        diff = _mm512_sub_epi32(diff, _mm512_loadu_si512(integral_top + x + n));
+        diff = _mm512_add_epi32(diff, _mm512_loadu_si512(integral_top + x));
+        mask = _mm512_cmplt_epi32_mask(diff, dmax);
+        if (mask == 0)
+        {
+            continue;
+        }
+
+        idx    = _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_cvtepi32_ps(diff), fact));
+        weight = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, idx,
+                                          exptable, 4);
+        pixel  = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(
+                    _mm_loadu_si128((const __m128i*)(compare + x))));
+        wp     = _mm512_mul_ps(weight, pixel);
+
+        lo = _mm512_unpacklo_ps(weight, wp);
+        hi = _mm512_unpackhi_ps(weight, wp);
+        _mm512_storeu_ps(sum,      _mm512_add_ps(_mm512_loadu_ps(sum),
+                                      _mm512_permutex2var_ps(lo, idx0, hi)));
+        _mm512_storeu_ps(sum + 16, _mm512_add_ps(_mm512_loadu_ps(sum + 16),
+                                      _mm512_permutex2var_ps(lo, idx1, hi)));
+    }
+    accumulate_tail(sums, integral_top, integral_bottom, n, compare, x, count,
+                    exptable, weight_fact_table, diff_max);
+}
+
+#endif // NLMEANS_HAVE_AVX512
+
 void nlmeans_init_x86(NLMeansFunctions *functions)
 {
-    if (av_get_cpu_flags() & AV_CPU_FLAG_SSE2)
+    const int   flags = av_get_cpu_flags();
+    const char *isa   = NULL;
+
+    if (flags & AV_CPU_FLAG_SSE2)
     {
         functions->build_integral = build_integral_sse2;
-        hb_log("NLMeans using SSE2 optimizations");
+        isa = "SSE2";
+    }
+#if defined(NLMEANS_HAVE_AVX2)
+    if (flags & AV_CPU_FLAG_AVX2)
+    {
+        functions->build_integral = build_integral_avx2;
+        functions->accumulate     = accumulate_avx2;
+        isa = "AVX2";
+    }
+#endif
+#if defined(NLMEANS_HAVE_AVX512)
+    if ((flags & AV_CPU_FLAG_AVX2) && (hb_get_cpu_flags() & HB_CPU_FLAG_AVX512))
+    {
+        functions->build_integral = build_integral_avx512;
+        functions->accumulate     = accumulate_avx512;
+        isa = "AVX-512";
+    }
+#endif
+    if (isa != NULL)
+    {
+        hb_log("NLMeans using %s optimizations", isa);
     }
 }
 
@@ -65,11 +65,15 @@
 #include <time.h>
 #include <sys/time.h>
 #include <ctype.h>
+#include <errno.h>
 
 #if defined( SYS_LINUX )
 #include <linux/cdrom.h>
+#include <linux/mempolicy.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #elif defined( SYS_OPENBSD )
 #include <sys/dvdio.h>
 #include <fcntl.h>
@@ -225,6 +229,7 @@ void hb_snooze( int delay )
  ************************************************************************/
 static void init_cpu_info();
 static int  init_cpu_count();
+static void init_numa_info();
 struct
 {
     enum hb_cpu_platform platform;
@@ -235,6 +240,8 @@ struct
         uint32_t buf4[12];
     };
     int count;
+    int flags;
+    int flags_mask;
 } hb_cpu_info;
 
 int hb_get_cpu_count()
@@ -247,6 +254,26 @@ int hb_get_cpu_platform()
     return hb_cpu_info.platform;
 }
 
+/*
+ * Returns the HB_CPU_FLAG_* features of the CPU, limited by the mask set
+ * with hb_set_cpu_flags_mask().  These are the features that
+ * av_get_cpu_flags() of our libav does not report.
+ */
+int hb_get_cpu_flags()
+{
+    return hb_cpu_info.flags & hb_cpu_info.flags_mask;
+}
+
+/*
+ * Like av_set_cpu_flags_mask(), lets the caller turn off features that the
+ * CPU has.  Kernels are picked when a filter is initialized, so this only
+ * affects filters initialized after it.
+ */
+void hb_set_cpu_flags_mask(int mask)
+{
+    hb_cpu_info.flags_mask = mask;
+}
+
 const char* hb_get_cpu_name()
 {
     return hb_cpu_info.name;
@@ -297,6 +324,22 @@ const char* hb_get_cpu_platform_name()
         "xchg   %%"REG_b", %%"REG_S                             \
         : "=a" (*eax), "=S" (*ebx), "=c" (*ecx), "=d" (*edx)    \
         : "0" (index))
+
+// For the leaves that have subleaves, selected by 'count'
+#define cpuid_count(index, count, eax, ebx, ecx, edx)           \
+    __asm__ volatile (                                          \
+        "mov    %%"REG_b", %%"REG_S" \n\t"                      \
+        "cpuid                       \n\t"                      \
+        "xchg   %%"REG_b", %%"REG_S                             \
+        : "=a" (*eax), "=S" (*ebx), "=c" (*ecx), "=d" (*edx)    \
+        : "0" (index), "2" (count))
+
+// Reads extended control register 'index', XCR0 for the state the OS saves
+#define xgetbv(index, eax, edx)                                 \
+    __asm__ volatile (                                          \
+        ".byte 0x0f, 0x01, 0xd0"                                \
+        : "=a" (*eax), "=d" (*edx)                              \
+        : "c" (index))
 #endif // ARCH_X86_64 || ARCH_X86_32
 
 static void init_cpu_info()
@@ -304,13 +347,33 @@ static void init_cpu_info()
     hb_cpu_info.name     = NULL;
     hb_cpu_info.count    = init_cpu_count();
     hb_cpu_info.platform = HB_CPU_PLATFORM_UNSPECIFIED;
+    hb_cpu_info.flags      = 0;
+    hb_cpu_info.flags_mask = ~0;
 
     if (av_get_cpu_flags() & AV_CPU_FLAG_SSE)
     {
 #if ARCH_X86_64 || ARCH_X86_32
-        int eax, ebx, ecx, edx, family, model;
+        int eax, ebx, ecx, edx, family, model, max_leaf;
 
+        cpuid(0, &max_leaf, &ebx, &ecx, &edx);
         cpuid(1, &eax, &ebx, &ecx, &edx);
+
+        // Intel 64 and IA-32 Architectures Software Developer's Manual, Vol. 1
+        // 15.2: Detection of AVX-512 Foundation Instructions
+        // AVX-512F needs CPUID.(EAX=07H,ECX=0):EBX[16] and an OS that saves
+        // the opmask and ZMM registers, XCR0[7:5], along with XMM and YMM.
+        if ((ecx & (1 << 27)) && max_leaf >= 7)
+        {
+            int xcr0_lo, xcr0_hi, leaf7_eax, leaf7_ebx, leaf7_ecx, leaf7_edx;
+
+            xgetbv(0, &xcr0_lo, &xcr0_hi);
+            cpuid_count(7, 0, &leaf7_eax, &leaf7_ebx, &leaf7_ecx, &leaf7_edx);
+            if ((xcr0_lo & 0xe6) == 0xe6 && (leaf7_ebx & (1 << 16)))
+            {
+                hb_cpu_info.flags |= HB_CPU_FLAG_AVX512;
+            }
+        }
+
         family = ((eax >> 8) & 0xf) + ((eax >> 20) & 0xff);
         model  = ((eax >> 4) & 0xf) + ((eax >> 12) & 0xf0);
 
@@ -472,6 +535,396 @@ static int init_cpu_count()
     return cpu_count;
 }
 
+/************************************************************************
+ * CPU affinity and NUMA nodes
+ ************************************************************************
+ * Only implemented on Linux.  The node of each CPU is read from sysfs
+ * so that libnuma is not needed.
+ ***********************************************************************/
+#define HB_MAX_NUMA_NODES 64
+
+#if defined(SYS_LINUX)
+static cpu_set_t hb_process_affinity;
+static int       hb_cpu_node[CPU_SETSIZE];          // node id of each CPU
+static int       hb_cpu_node_index[CPU_SETSIZE];    // 0..node count - 1
+
+// The different CPU sets threads are pinned to, see hb_thread_affinity_id()
+static hb_lock_t * hb_affinity_lock;
+static cpu_set_t   hb_affinity_set[HB_MAX_AFFINITY_SETS];
+static int         hb_affinity_set_count;
+#endif
+static int       hb_numa_node_count = 1;
+
+#if defined(SYS_LINUX)
+/*
+ * Parses a list such as "0-3,8,10-11" into 'set'.
+ * Returns 0 on success, -1 if the list is invalid or empty.
+ */
+static int parse_cpu_list( const char * list, cpu_set_t * set )
+{
+    const char * p = list;
+    char       * end;
+    long         first, last;
+
+    CPU_ZERO( set );
+    while ( *p != 0 && *p != '\n' )
+    {
+        first = strtol( p, &end, 10 );
+        if ( end == p || first < 0 )
+        {
+            return -1;
+        }
+        last = first;
+        p    = end;
+        if ( *p == '-' )
+        {
+            last = strtol( p + 1, &end, 10 );
+            if ( end == p + 1 || last < first )
+            {
+                return -1;
+            }
+            p = end;
+        }
+        if ( last >= CPU_SETSIZE )
+        {
+            return -1;
+        }
+        for ( ; first <= last; first++ )
+        {
+            CPU_SET( first, set );
+        }
+        if ( *p == ',' )
+        {
+            p++;
+        }
+        else if ( *p != 0 && *p != '\n' )
+        {
+            return -1;
+        }
+    }
+    return CPU_COUNT( set ) > 0 ? 0 : -1;
+}
+
+/*
+ * Makes memory allocated by the calling thread, and by the threads
+ * it starts afterwards, come from 'node' when possible.  A negative
+ * node restores the default (local allocation).
+ */
+static void set_preferred_node( int node )
+{
+#if defined(SYS_set_mempolicy)
+    unsigned long mask = 0;
+
+    if ( node >= 0 && node < (int)(8 * sizeof(mask)) )
+    {
+        mask = 1UL << node;
+        syscall( SYS_set_mempolicy, MPOL_PREFERRED, &mask, 8 * sizeof(mask) );
+    }
+    else
+    {
+        syscall( SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0 );
+    }
+#endif
+}
+
+/*
+ * Restricts the calling thread to 'set'.  With 'prefer_node' memory
+ * is preferably allocated on the node of the CPUs when they are all on
+ * one node, otherwise the default policy is restored.
+ */
+static int apply_affinity( cpu_set_t * set, int prefer_node )
+{
+    int cpu, node = -1;
+
+    if ( CPU_COUNT( set ) == 0 ||
+         sched_setaffinity( 0, sizeof(*set), set ) )
+    {
+        return -1;
+    }
+
+    if ( prefer_node && hb_numa_node_count > 1 )
+    {
+        for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+        {
+            if ( !CPU_ISSET( cpu, set ) )
+            {
+                continue;
+            }
+            if ( node < 0 )
+            {
+                node = hb_cpu_node[cpu];
+            }
+            else if ( node != hb_cpu_node[cpu] )
+            {
+                node = -1;
+                break;
+            }
+        }
+    }
+    set_preferred_node( node );
+
+    return CPU_COUNT( set );
+}
+#endif
+
+static void init_numa_info()
+{
+#if defined(SYS_LINUX)
+    char      path[64], line[4096];
+    FILE    * file;
+    cpu_set_t set;
+    int       node, cpu, count = 0;
+
+    CPU_ZERO( &hb_process_affinity );
+    sched_getaffinity( 0, sizeof(hb_process_affinity), &hb_process_affinity );
+    hb_affinity_lock = hb_lock_init();
+
+    // Node ids need not be contiguous (e.g. offline or hot-plugged
+    // nodes), count the nodes that are present
+    for ( node = 0; node < HB_MAX_NUMA_NODES; node++ )
+    {
+        snprintf( path, sizeof(path),
+                  "/sys/devices/system/node/node%d/cpulist", node );
+        file = fopen( path, "r" );
+        if ( file == NULL )
+        {
+            continue;
+        }
+        if ( fgets( line, sizeof(line), file ) != NULL &&
+             parse_cpu_list( line, &set ) == 0 )
+        {
+            for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+            {
+                if ( CPU_ISSET( cpu, &set ) )
+                {
+                    hb_cpu_node[cpu]       = node;
+                    hb_cpu_node_index[cpu] = count;
+                }
+            }
+            count++;
+        }
+        fclose( file );
+    }
+    hb_numa_node_count = MAX( 1, count );
+#endif
+}
+
+int hb_get_numa_node_count()
+{
+    return hb_numa_node_count;
+}
+
+/*
+ * Returns the NUMA node of the CPU the calling thread runs on, as an
+ * index from 0 to hb_get_numa_node_count() - 1, 0 if unknown.
+ */
+int hb_get_numa_node()
+{
+#if defined(SYS_LINUX)
+    int cpu;
+
+    if ( hb_numa_node_count > 1 )
+    {
+        cpu = sched_getcpu();
+        if ( cpu >= 0 && cpu < CPU_SETSIZE )
+        {
+            return hb_cpu_node_index[cpu];
+        }
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Restricts the calling thread, and the threads it starts afterwards,
+ * to the CPUs described by 'spec': either a CPU list such as
+ * "0-7,16-23" or "node:" followed by a list of NUMA nodes.  When all
+ * of these CPUs are on one node, memory is preferably allocated on it.
+ * A NULL spec restores the affinity the process had at startup.
+ *
+ * Returns the number of CPUs the thread may now run on or -1 if 'spec'
+ * is invalid or thread affinity is not supported.
+ */
+int hb_thread_set_affinity( const char * spec )
+{
+#if defined(SYS_LINUX)
+    cpu_set_t set, nodes;
+    int       cpu;
+
+    if ( spec == NULL )
+    {
+        set = hb_process_affinity;
+    }
+    else if ( !strncmp( spec, "node:", 5 ) )
+    {
+        if ( parse_cpu_list( spec + 5, &nodes ) )
+        {
+            return -1;
+        }
+        CPU_ZERO( &set );
+        for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+        {
+            if ( CPU_ISSET( hb_cpu_node[cpu], &nodes ) )
+            {
+                CPU_SET( cpu, &set );
+            }
+        }
+        CPU_AND( &set, &set, &hb_process_affinity );
+    }
+    else
+    {
+        if ( parse_cpu_list( spec, &set ) )
+        {
+            return -1;
+        }
+        CPU_AND( &set, &set, &hb_process_affinity );
+    }
+    return apply_affinity( &set, spec != NULL );
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Returns an id for the CPUs the calling thread may run on: 0 when it
+ * may run on all CPUs of the process, else a number from 1 to
+ * HB_MAX_AFFINITY_SETS that is the same for every thread pinned to the
+ * same CPUs.  Also 0 if affinity is not supported or too many different
+ * sets are in use.  'cpus', if not NULL, gets the number of these CPUs.
+ */
+int hb_thread_affinity_id( int * cpus )
+{
+#if defined(SYS_LINUX)
+    cpu_set_t set;
+    int       ii, id = 0;
+
+    if ( hb_affinity_lock == NULL ||
+         sched_getaffinity( 0, sizeof(set), &set ) ||
+         CPU_EQUAL( &set, &hb_process_affinity ) )
+    {
+        return 0;
+    }
+    hb_lock( hb_affinity_lock );
+    for ( ii = 0; ii < hb_affinity_set_count && id == 0; ii++ )
+    {
+        if ( CPU_EQUAL( &set, &hb_affinity_set[ii] ) )
+        {
+            id = ii + 1;
+        }
+    }
+    if ( id == 0 && hb_affinity_set_count < HB_MAX_AFFINITY_SETS )
+    {
+        hb_affinity_set[hb_affinity_set_count++] = set;
+        id = hb_affinity_set_count;
+    }
+    hb_unlock( hb_affinity_lock );
+
+    if ( id > 0 && cpus != NULL )
+    {
+        *cpus = CPU_COUNT( &set );
+    }
+    return id;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Restricts the calling thread to the CPUs of 'id', as returned by
+ * hb_thread_affinity_id(), with the same memory policy as
+ * hb_thread_set_affinity().  Id 0 restores the affinity the process
+ * had at startup.
+ *
+ * Returns the number of CPUs the thread may now run on or -1.
+ */
+int hb_thread_set_affinity_id( int id )
+{
+#if defined(SYS_LINUX)
+    cpu_set_t set;
+
+    if ( id <= 0 )
+    {
+        return apply_affinity( &hb_process_affinity, 0 );
+    }
+    hb_lock( hb_affinity_lock );
+    if ( id > hb_affinity_set_count )
+    {
+        hb_unlock( hb_affinity_lock );
+        return -1;
+    }
+    set = hb_affinity_set[id - 1];
+    hb_unlock( hb_affinity_lock );
+
+    return apply_affinity( &set, 1 );
+#else
+    return -1;
+#endif
+}
+
+/************************************************************************
+ * Thread scheduling
+ ************************************************************************
+ * Lets the pipeline favor its slowest stage, see profile.c.  Threads
+ * are identified by the id hb_thread_self_id() returns in the thread.
+ ***********************************************************************/
+
+/* Returns the id of the calling thread for the functions below, or 0
+ * if per thread scheduling is not supported. */
+int hb_thread_self_id( void )
+{
+#if defined(SYS_LINUX)
+    return syscall( SYS_gettid );
+#else
+    return 0;
+#endif
+}
+
+/* Returns the nice value of thread 'id', 0 if unsupported. */
+int hb_thread_get_nice( int id )
+{
+#if defined(SYS_LINUX)
+    int nice;
+
+    errno = 0;
+    nice = getpriority( PRIO_PROCESS, id );
+    return errno ? 0 : nice;
+#else
+    return 0;
+#endif
+}
+
+/* Sets the nice value of thread 'id'.  Lowering it usually requires
+ * privileges.  Returns 0 on success, -1 otherwise. */
+int hb_thread_set_nice( int id, int nice )
+{
+#if defined(SYS_LINUX)
+    if ( id <= 0 )
+        return -1;
+    return setpriority( PRIO_PROCESS, id, nice ) ? -1 : 0;
+#else
+    return -1;
+#endif
+}
+
+/* Switches thread 'id' between the batch and the normal time sharing
+ * policy.  Batch threads are not favored on wake up, so they yield to
+ * the other stages when the CPUs are busy.  Either way is permitted
+ * without privileges.  Returns 0 on success, -1 otherwise. */
+int hb_thread_set_batch( int id, int batch )
+{
+#if defined(SYS_LINUX) && defined(SCHED_BATCH)
+    struct sched_param param;
+
+    if ( id <= 0 )
+        return -1;
+    memset( &param, 0, sizeof( param ) );
+    return sched_setscheduler( id, batch ? SCHED_BATCH : SCHED_OTHER,
+                               &param ) ? -1 : 0;
+#else
+    return -1;
+#endif
+}
+
 int hb_platform_init()
 {
     int result = 0;
@@ -505,6 +958,7 @@ int hb_platform_init()
 #endif
 
     init_cpu_info();
+    init_numa_info();
 
     return result;
 }
@@ -1180,6 +1634,75 @@ void hb_cond_broadcast( hb_cond_t * c )
 #endif
 }
 
+/************************************************************************
+ * Portable thread local storage implementation
+ ***********************************************************************/
+struct hb_tls_s
+{
+#if USE_PTHREAD
+    pthread_key_t key;
+#endif
+};
+
+/************************************************************************
+ * hb_tls_init()
+ * hb_tls_close()
+ * hb_tls_get()
+ * hb_tls_set()
+ ************************************************************************
+ * destructor is called with the thread's value when a thread that set
+ * a non-NULL value exits.
+ ***********************************************************************/
+hb_tls_t * hb_tls_init( void (*destructor)(void *) )
+{
+    hb_tls_t * t = calloc( sizeof( hb_tls_t ), 1 );
+
+    if( t == NULL )
+        return NULL;
+
+#if USE_PTHREAD
+    if( pthread_key_create( &t->key, destructor ) )
+    {
+        free( t );
+        return NULL;
+    }
+#endif
+
+    return t;
+}
+
+void hb_tls_close( hb_tls_t ** _t )
+{
+    hb_tls_t * t = *_t;
+
+    if (t == NULL)
+    {
+        return;
+    }
+#if USE_PTHREAD
+    pthread_key_delete( t->key );
+#endif
+    free( t );
+
+    *_t = NULL;
+}
+
+void * hb_tls_get( hb_tls_t * t )
+{
+#if USE_PTHREAD
+    return pthread_getspecific( t->key );
+#else
+    return NULL;
+#endif
+}
+
+void hb_tls_set( hb_tls_t * t, void * value )
+{
+#if USE_PTHREAD
+    pthread_setspecific( t->key, value );
+#endif
+}
+
 /************************************************************************
  * Network
  ***********************************************************************/
@@ -42,10 +42,24 @@ enum hb_cpu_platform
     HB_CPU_PLATFORM_INTEL_SKL,
     HB_CPU_PLATFORM_INTEL_KBL,
 };
+// CPU features that av_get_cpu_flags() does not report
+#define     HB_CPU_FLAG_AVX512 0x0001 // AVX-512F, enabled by the OS
 int         hb_get_cpu_count(void);
+int         hb_get_cpu_flags(void);
+void        hb_set_cpu_flags_mask(int mask);
 int         hb_get_cpu_platform(void);
 const char* hb_get_cpu_name(void);
 const char* hb_get_cpu_platform_name(void);
+int         hb_get_numa_node_count(void);
+int         hb_get_numa_node(void);
+int         hb_thread_set_affinity(const char * spec);
+#define     HB_MAX_AFFINITY_SETS 16
+int         hb_thread_affinity_id(int * cpus);
+int         hb_thread_set_affinity_id(int id);
+int         hb_thread_self_id(void);
+int         hb_thread_get_nice(int id);
+int         hb_thread_set_nice(int id, int nice);
+int         hb_thread_set_batch(int id, int batch);
 
 /************************************************************************
  * Utils
@@ -163,6 +177,29 @@ void        hb_cond_signal( hb_cond_t * );
 void        hb_cond_broadcast( hb_cond_t * c );
 void        hb_cond_close( hb_cond_t ** );
 
+/************************************************************************
+ * Thread local storage
+ ***********************************************************************/
+typedef struct hb_tls_s hb_tls_t;
+
+hb_tls_t * hb_tls_init( void (*destructor)(void *) );
+void       hb_tls_close( hb_tls_t ** );
+void     * hb_tls_get( hb_tls_t * );
+void       hb_tls_set( hb_tls_t *, void * );
+
+/************************************************************************
+ * Atomics
+ ***********************************************************************/
+#define hb_atomic_load(p)         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define hb_atomic_load_relaxed(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define hb_atomic_store(p, v)     __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define hb_atomic_add(p, v)       __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#define hb_atomic_sub(p, v)       __atomic_sub_fetch((p), (v), __ATOMIC_RELAXED)
+#define hb_atomic_exchange(p, v)  __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define hb_atomic_cas(p, e, v)    __atomic_compare_exchange_n((p), (e), (v), 0, \
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define hb_atomic_fence()         __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
 /************************************************************************
  * Network
  ***********************************************************************/
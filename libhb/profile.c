@@ -0,0 +1,624 @@
+/* profile.c
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*
+ * Per-stage pipeline profiler.
+ *
+ * Every work object and filter thread of a job gets a hb_stage_stats_t
+ * that its loop in work.c fills in: time spent in work(), time blocked
+ * on an empty input fifo and time blocked on a full output fifo.  A
+ * sampler thread records the depth of each stage's input fifo.  At the
+ * end of the job the stage that was busy for the largest share of its
+ * lifetime is reported as the critical stage.
+ *
+ * The sampler also sizes the video fifos that were handed to
+ * hb_profile_adapt_fifo(), see profile_adapt(), and favors the stage
+ * that limits the pipeline while the job runs, see profile_schedule().
+ */
+
+#include "hb.h"
+
+#define PROFILE_SAMPLE_MS 100
+#define PROFILE_ADAPT_MS  1000
+#define PROFILE_BOOST     5     // nice value decrease of the critical stage
+
+typedef struct
+{
+    char             * name;
+    const char       * type;
+    hb_fifo_t        * fifo;
+    hb_stage_stats_t   stats;
+
+    // Scheduling, see profile_schedule()
+    uint64_t           last_work;   // stats at the last adjustment
+    uint64_t           last_wait_out;
+    double             fill_sum;    // input fifo fill since then
+    int                fill_samples;
+    int                thread_id;
+    int                base_nice;
+    int                boosted;
+    int                throttled;
+    uint64_t           boost_time;  // for the report
+    uint64_t           throttle_time;
+} profile_stage_t;
+
+typedef struct
+{
+    char             * name;
+    hb_fifo_t        * fifo;
+    int                min;
+    int                max;
+    int                capacity;
+    uint64_t           wait_empty;  // fifo wait times at the last adjustment
+    uint64_t           wait_full;
+    uint64_t           bytes_sum;   // sampled contents, for the average
+    uint64_t           size_sum;    // buffer size
+    int64_t            buffer_size;
+    int                samples;     // occupancy since the last adjustment
+    int                occupancy;
+} profile_fifo_t;
+
+struct hb_profile_s
+{
+    hb_lock_t        * lock;
+    hb_cond_t        * cond;
+    hb_thread_t      * thread;
+    int                stop;
+    uint64_t           start;
+    hb_list_t        * stages;
+    hb_list_t        * fifos;
+    int64_t            fifo_budget;
+    uint64_t           last_adapt;
+    profile_stage_t  * critical;    // boosted stage
+    profile_stage_t  * candidate;   // critical at the last adjustment
+    int                nice_denied;
+};
+
+hb_profile_t * hb_profile_init( void )
+{
+    hb_profile_t * p = calloc(1, sizeof(hb_profile_t));
+
+    if (p == NULL)
+    {
+        return NULL;
+    }
+    p->lock   = hb_lock_init();
+    p->cond   = hb_cond_init();
+    p->stages = hb_list_init();
+    p->fifos  = hb_list_init();
+    p->start  = hb_get_time_us();
+    return p;
+}
+
+/*
+ * Register a pipeline stage.  Returns the stats the stage's thread
+ * should update, or NULL when profiling is off (p == NULL).
+ */
+hb_stage_stats_t * hb_profile_add( hb_profile_t * p, const char * name,
+                                   const char * type, hb_fifo_t * fifo_in )
+{
+    profile_stage_t * stage;
+
+    if (p == NULL)
+    {
+        return NULL;
+    }
+    stage = calloc(1, sizeof(profile_stage_t));
+    if (stage == NULL)
+    {
+        return NULL;
+    }
+    stage->name = strdup(name != NULL ? name : "unknown");
+    stage->type = type;
+    stage->fifo = fifo_in;
+
+    hb_lock(p->lock);
+    hb_list_add(p->stages, stage);
+    hb_unlock(p->lock);
+
+    return &stage->stats;
+}
+
+/*
+ * Let the sampler adjust the capacity of 'fifo' between 'min' and 'max'
+ * buffers.  The capacities of all such fifos are kept within the byte
+ * budget set with hb_profile_set_fifo_budget().
+ */
+void hb_profile_adapt_fifo( hb_profile_t * p, const char * name,
+                            hb_fifo_t * fifo, int min, int max )
+{
+    profile_fifo_t * pf;
+
+    if (p == NULL || fifo == NULL)
+    {
+        return;
+    }
+    pf = calloc(1, sizeof(profile_fifo_t));
+    if (pf == NULL)
+    {
+        return;
+    }
+    pf->name     = strdup(name != NULL ? name : "unknown");
+    pf->fifo     = fifo;
+    pf->min      = min;
+    pf->max      = max;
+    pf->capacity = hb_fifo_capacity(fifo);
+    hb_fifo_set_max_capacity(fifo, max);
+
+    hb_lock(p->lock);
+    hb_list_add(p->fifos, pf);
+    hb_unlock(p->lock);
+}
+
+void hb_profile_set_fifo_budget( hb_profile_t * p, int64_t bytes )
+{
+    if (p != NULL)
+    {
+        p->fifo_budget = bytes;
+    }
+}
+
+static void profile_fifo_sample( profile_fifo_t * pf )
+{
+    int size = hb_fifo_size(pf->fifo);
+
+    pf->samples++;
+    pf->occupancy += size;
+    if (size > 0)
+    {
+        pf->bytes_sum += hb_fifo_size_bytes(pf->fifo);
+        pf->size_sum  += size;
+        pf->buffer_size = pf->bytes_sum / pf->size_sum;
+    }
+}
+
+/*
+ * Adjust the capacities of the adaptive fifos from how long their
+ * producer and consumer were blocked since the last adjustment:
+ *
+ * - both blocked: the stages run at the same average rate but in
+ *   bursts (e.g. an encoder with a deep lookahead), more buffering
+ *   absorbs the bursts, double the capacity.
+ * - the consumer never waited: the fifo never ran dry, so the buffers
+ *   waiting in it only take memory, shrink by a quarter.
+ * - the fifo stayed less than half full on average: shrink by a quarter.
+ *
+ * Growth is limited by the byte budget of all adaptive fifos, and the
+ * fifos are shrunk proportionally when they are over budget because
+ * the buffers turned out to be larger than estimated.
+ */
+static void profile_adapt( hb_profile_t * p, uint64_t elapsed )
+{
+    int64_t total = 0;
+    int     ii;
+
+    for (ii = 0; ii < hb_list_count(p->fifos); ii++)
+    {
+        profile_fifo_t * pf = hb_list_item(p->fifos, ii);
+        total += (int64_t)pf->capacity * pf->buffer_size;
+    }
+
+    for (ii = 0; ii < hb_list_count(p->fifos); ii++)
+    {
+        profile_fifo_t * pf = hb_list_item(p->fifos, ii);
+        uint64_t         wait_empty, wait_full;
+        int              full, empty, capacity = pf->capacity;
+
+        hb_fifo_wait_times(pf->fifo, &wait_empty, &wait_full);
+        full  = wait_full  - pf->wait_full  > elapsed / 20;
+        empty = wait_empty - pf->wait_empty > elapsed / 20;
+
+        if (full && empty)
+        {
+            capacity = MIN(capacity * 2, pf->max);
+            if (p->fifo_budget > 0 && pf->buffer_size > 0)
+            {
+                int64_t room = p->fifo_budget - total;
+                capacity = MIN(capacity, pf->capacity +
+                               MAX(0, room / pf->buffer_size));
+            }
+        }
+        else if (wait_empty == pf->wait_empty ||
+                 (!full && pf->occupancy * 2 < pf->samples * pf->capacity))
+        {
+            capacity = MAX(capacity - capacity / 4, pf->min);
+        }
+        if (p->fifo_budget > 0 && total > p->fifo_budget)
+        {
+            capacity = MAX(pf->min,
+                           MIN(capacity, pf->capacity * p->fifo_budget / total));
+        }
+        if (capacity != pf->capacity)
+        {
+            hb_deep_log(2, "profile: %s fifo capacity %d -> %d",
+                        pf->name, pf->capacity, capacity);
+            total += (int64_t)(capacity - pf->capacity) * pf->buffer_size;
+            pf->capacity = capacity;
+            hb_fifo_set_capacity(pf->fifo, capacity);
+        }
+        pf->wait_empty = wait_empty;
+        pf->wait_full  = wait_full;
+        pf->samples    = 0;
+        pf->occupancy  = 0;
+    }
+}
+
+// Looks up the running thread of 'stage'.  Returns 0 when it has not
+// started yet, has exited or can not be scheduled.
+static int stage_thread( profile_stage_t * stage )
+{
+    int id = hb_atomic_load_relaxed(&stage->stats.thread_id);
+
+    if (id == 0 || hb_atomic_load_relaxed(&stage->stats.stop) != 0)
+    {
+        return 0;
+    }
+    if (stage->thread_id != id)
+    {
+        stage->thread_id = id;
+        stage->base_nice = hb_thread_get_nice(id);
+    }
+    return id;
+}
+
+static void profile_boost( hb_profile_t * p, profile_stage_t * stage,
+                           int boost )
+{
+    int id = stage_thread(stage);
+
+    if (id == 0 || stage->boosted == boost)
+    {
+        return;
+    }
+    if (boost && stage->throttled && !hb_thread_set_batch(id, 0))
+    {
+        stage->throttled = 0;
+    }
+    if (boost && p->nice_denied)
+    {
+        return;
+    }
+    if (!hb_thread_set_nice(id, boost ? stage->base_nice - PROFILE_BOOST :
+                                        stage->base_nice))
+    {
+        stage->boosted = boost;
+    }
+    else if (boost)
+    {
+        // Lowering nice values takes privileges.  Throttling the stages
+        // that are ahead still favors the critical one.
+        hb_log("profile: not permitted to raise thread priorities");
+        p->nice_denied = 1;
+    }
+}
+
+/*
+ * Favor the stage that limits the pipeline:
+ *
+ * - The critical stage is the one with the fullest input fifo among
+ *   the stages that were not held up by their output: work piles up in
+ *   front of it.  When no input fifo is at least half full, it is the
+ *   busiest such stage.  A new critical stage must be found by two
+ *   adjustments in a row before it replaces the current one.
+ * - The critical stage's thread has its nice value lowered by
+ *   PROFILE_BOOST, when the process is permitted to.
+ * - Stages that spent more than half of the interval blocked on a full
+ *   output fifo are ahead of the pipeline.  They run with the batch
+ *   policy, so that they yield to the others when the CPUs are busy,
+ *   until they are no longer ahead.
+ */
+static void profile_schedule( hb_profile_t * p, uint64_t elapsed )
+{
+    profile_stage_t * best = NULL;
+    double            best_fill = 0., best_busy = 0.;
+    int               ii;
+
+    for (ii = 0; ii < hb_list_count(p->stages); ii++)
+    {
+        profile_stage_t * stage = hb_list_item(p->stages, ii);
+        uint64_t          work, wait_out;
+        double            busy, out, fill;
+        int               id, ahead;
+
+        work     = hb_atomic_load_relaxed(&stage->stats.work);
+        wait_out = hb_atomic_load_relaxed(&stage->stats.wait_out);
+        busy = (double)(work - stage->last_work) / elapsed;
+        out  = (double)(wait_out - stage->last_wait_out) / elapsed;
+        fill = stage->fill_samples ?
+               stage->fill_sum / stage->fill_samples : 0.;
+        stage->last_work     = work;
+        stage->last_wait_out = wait_out;
+        stage->fill_sum      = 0.;
+        stage->fill_samples  = 0;
+
+        id = stage_thread(stage);
+        if (id == 0)
+        {
+            continue;
+        }
+        if (stage->boosted)
+        {
+            stage->boost_time += elapsed;
+        }
+        if (stage->throttled)
+        {
+            stage->throttle_time += elapsed;
+        }
+
+        ahead = out > 0.5 && stage != p->critical;
+        if (ahead != stage->throttled && !hb_thread_set_batch(id, ahead))
+        {
+            hb_deep_log(2, "profile: %s %s", stage->name,
+                        ahead ? "is ahead, throttled" : "no longer throttled");
+            stage->throttled = ahead;
+        }
+
+        if (out >= 0.05)
+        {
+            continue;
+        }
+        if (fill >= 0.5 ? fill > best_fill :
+                          best_fill == 0. && busy > best_busy)
+        {
+            best      = stage;
+            best_fill = fill >= 0.5 ? fill : 0.;
+            best_busy = busy;
+        }
+    }
+
+    if (best == p->critical || best == NULL || best_busy < 0.1)
+    {
+        p->candidate = p->critical;
+        return;
+    }
+    if (best != p->candidate)
+    {
+        p->candidate = best;
+        return;
+    }
+    hb_deep_log(2, "profile: critical stage is now %s", best->name);
+    if (p->critical != NULL)
+    {
+        profile_boost(p, p->critical, 0);
+    }
+    p->critical = best;
+    profile_boost(p, best, 1);
+}
+
+static void profile_sample( hb_profile_t * p )
+{
+    uint64_t now = hb_get_time_us();
+    int      ii;
+
+    for (ii = 0; ii < hb_list_count(p->fifos); ii++)
+    {
+        profile_fifo_sample(hb_list_item(p->fifos, ii));
+    }
+    if (p->last_adapt == 0)
+    {
+        p->last_adapt = now;
+    }
+    else if (now - p->last_adapt >= PROFILE_ADAPT_MS * 1000)
+    {
+        profile_adapt(p, now - p->last_adapt);
+        profile_schedule(p, now - p->last_adapt);
+        p->last_adapt = now;
+    }
+
+    for (ii = 0; ii < hb_list_count(p->stages); ii++)
+    {
+        profile_stage_t * stage = hb_list_item(p->stages, ii);
+        int               size, capacity;
+
+        if (stage->fifo == NULL)
+        {
+            continue;
+        }
+        size     = hb_fifo_size(stage->fifo);
+        capacity = hb_fifo_capacity(stage->fifo);
+        if (capacity > 0)
+        {
+            stage->fill_sum += MIN(1., (double)size / capacity);
+        }
+        stage->fill_samples++;
+        stage->stats.fifo_samples++;
+        stage->stats.fifo_sum += size;
+        if (size > stage->stats.fifo_max)
+        {
+            stage->stats.fifo_max = size;
+        }
+    }
+}
+
+static void profile_thread( void * _p )
+{
+    hb_profile_t * p = _p;
+
+    hb_lock(p->lock);
+    while (!p->stop)
+    {
+        hb_cond_timedwait(p->cond, p->lock, PROFILE_SAMPLE_MS);
+        if (!p->stop)
+        {
+            profile_sample(p);
+        }
+    }
+    hb_unlock(p->lock);
+}
+
+/*
+ * Start sampling fifo occupancy.  All stages must have been added.
+ */
+void hb_profile_start( hb_profile_t * p )
+{
+    if (p == NULL || p->thread != NULL)
+    {
+        return;
+    }
+    p->thread = hb_thread_init("profile", profile_thread, p,
+                               HB_LOW_PRIORITY);
+}
+
+/*
+ * Stop sampling.  Must be called before the stages' fifos are closed.
+ */
+void hb_profile_stop( hb_profile_t * p )
+{
+    if (p == NULL || p->thread == NULL)
+    {
+        return;
+    }
+    hb_lock(p->lock);
+    p->stop = 1;
+    hb_cond_signal(p->cond);
+    hb_unlock(p->lock);
+    hb_thread_close(&p->thread);
+}
+
+static double stage_utilization( const hb_stage_stats_t * stats )
+{
+    uint64_t elapsed = stats->stop - stats->start;
+
+    if (stats->start == 0 || stats->stop <= stats->start)
+    {
+        return 0.;
+    }
+    return (double)stats->work / elapsed;
+}
+
+/*
+ * Log the collected statistics and return them as a dict:
+ *
+ * { Elapsed, CriticalStage, CriticalUtilization,
+ *   Stages [ { Name, Type, Utilization, Work, WaitInput, WaitOutput,
+ *              Buffers, Bytes, FifoAverage, FifoMax, Boosted,
+ *              Throttled } ] }
+ *
+ * Times are in seconds.  Call after all stage threads have exited.
+ */
+hb_dict_t * hb_profile_report( hb_profile_t * p )
+{
+    hb_dict_t        * dict;
+    hb_value_array_t * stages;
+    profile_stage_t  * critical = NULL;
+    double             critical_util = 0.;
+    int                ii;
+
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    dict   = hb_dict_init();
+    stages = hb_value_array_init();
+    hb_log("profile: %-28s %6s %9s %9s %9s %9s %6s",
+           "stage", "busy", "work", "wait in", "wait out", "buffers", "fifo");
+    for (ii = 0; ii < hb_list_count(p->stages); ii++)
+    {
+        profile_stage_t  * stage = hb_list_item(p->stages, ii);
+        hb_stage_stats_t * stats = &stage->stats;
+        hb_dict_t        * stage_dict;
+        double             util, fifo_avg;
+
+        if (stats->start == 0)
+        {
+            // Thread never ran
+            continue;
+        }
+        util     = stage_utilization(stats);
+        fifo_avg = stats->fifo_samples ?
+                   (double)stats->fifo_sum / stats->fifo_samples : 0.;
+        if (critical == NULL || util > critical_util)
+        {
+            critical      = stage;
+            critical_util = util;
+        }
+
+        hb_log("profile: %-28s %5.1f%% %8.2fs %8.2fs %8.2fs %9"PRIu64" %6.1f",
+               stage->name, util * 100.,
+               stats->work / 1000000., stats->wait_in / 1000000.,
+               stats->wait_out / 1000000., stats->buffers, fifo_avg);
+
+        stage_dict = hb_dict_init();
+        hb_dict_set(stage_dict, "Name", hb_value_string(stage->name));
+        hb_dict_set(stage_dict, "Type", hb_value_string(stage->type));
+        hb_dict_set(stage_dict, "Utilization", hb_value_double(util));
+        hb_dict_set(stage_dict, "Work",
+                    hb_value_double(stats->work / 1000000.));
+        hb_dict_set(stage_dict, "WaitInput",
+                    hb_value_double(stats->wait_in / 1000000.));
+        hb_dict_set(stage_dict, "WaitOutput",
+                    hb_value_double(stats->wait_out / 1000000.));
+        hb_dict_set(stage_dict, "Buffers", hb_value_int(stats->buffers));
+        hb_dict_set(stage_dict, "Bytes", hb_value_int(stats->bytes));
+        hb_dict_set(stage_dict, "FifoAverage", hb_value_double(fifo_avg));
+        hb_dict_set(stage_dict, "FifoMax", hb_value_int(stats->fifo_max));
+        hb_dict_set(stage_dict, "Boosted",
+                    hb_value_double(stage->boost_time / 1000000.));
+        hb_dict_set(stage_dict, "Throttled",
+                    hb_value_double(stage->throttle_time / 1000000.));
+        hb_value_array_append(stages, stage_dict);
+    }
+
+    hb_dict_set(dict, "Elapsed",
+                hb_value_double((hb_get_time_us() - p->start) / 1000000.));
+    if (critical != NULL)
+    {
+        hb_log("profile: critical stage is %s, busy %.1f%% of the time",
+               critical->name, critical_util * 100.);
+        hb_dict_set(dict, "CriticalStage", hb_value_string(critical->name));
+        hb_dict_set(dict, "CriticalUtilization",
+                    hb_value_double(critical_util));
+    }
+    for (ii = 0; ii < hb_list_count(p->stages); ii++)
+    {
+        profile_stage_t * stage = hb_list_item(p->stages, ii);
+
+        if (stage->boost_time > 0 || stage->throttle_time > 0)
+        {
+            hb_log("profile: %s boosted %.1fs, throttled %.1fs",
+                   stage->name, stage->boost_time / 1000000.,
+                   stage->throttle_time / 1000000.);
+        }
+    }
+    hb_dict_set(dict, "Stages", stages);
+
+    return dict;
+}
+
+void hb_profile_close( hb_profile_t ** _p )
+{
+    hb_profile_t    * p = *_p;
+    profile_stage_t * stage;
+    profile_fifo_t  * pf;
+
+    if (p == NULL)
+    {
+        return;
+    }
+    hb_profile_stop(p);
+    while ((pf = hb_list_item(p->fifos, 0)) != NULL)
+    {
+        hb_list_rem(p->fifos, pf);
+        free(pf->name);
+        free(pf);
+    }
+    hb_list_close(&p->fifos);
+    while ((stage = hb_list_item(p->stages, 0)) != NULL)
+    {
+        hb_list_rem(p->stages, stage);
+        free(stage->name);
+        free(stage);
+    }
+    hb_list_close(&p->stages);
+    hb_lock_close(&p->lock);
+    hb_cond_close(&p->cond);
+    free(p);
+    *_p = NULL;
+}
@@ -31,6 +31,17 @@ typedef struct
     hb_buffer_list_t list;
 } buffer_splice_list_t;
 
+// Audio packets are small and frequent.  They are collected per fifo and
+// pushed READER_BATCH_MAX at a time so that each packet does not cost a
+// fifo lock and wakeup.
+#define READER_BATCH_MAX 8
+
+typedef struct
+{
+    hb_fifo_t      * fifo;
+    hb_buffer_list_t list;
+} fifo_batch_t;
+
 struct hb_work_private_s
 {
     hb_handle_t  * h;
@@ -58,6 +69,11 @@ struct hb_work_private_s
 
     buffer_splice_list_t * splice_list;
     int                    splice_list_size;
+
+    fifo_batch_t         * batch;
+    int                    batch_count;
+
+    hb_stage_stats_t     * stats;   // NULL when not profiled
 };
 
 /***********************************************************************
@@ -248,6 +264,7 @@ static int reader_init( hb_work_object_t * w, hb_job_t * job )
     r->job   = job;
     r->title = job->title;
     r->die   = job->die;
+    r->stats = w->stats;
 
     r->demux.last_scr = AV_NOPTS_VALUE;
     r->last_pts       = AV_NOPTS_VALUE;
@@ -315,6 +332,17 @@ static int reader_init( hb_work_object_t * w, hb_job_t * job )
     // fifos that will be needed (+1 for null terminator)
     r->fifos = calloc(count + 1, sizeof(hb_fifo_t*));
 
+    // Audio packet batches
+    r->batch = calloc(hb_list_count(job->list_audio) + 1, sizeof(fifo_batch_t));
+    for (ii = 0; ii < hb_list_count(job->list_audio); ii++)
+    {
+        hb_audio_t * audio = hb_list_item(job->list_audio, ii);
+        if (audio->priv.fifo_in != NULL)
+        {
+            r->batch[r->batch_count++].fifo = audio->priv.fifo_in;
+        }
+    }
+
     // The stream needs to be open before starting the reader thead
     // to prevent a race with decoders that may share information
     // with the reader. Specifically avcodec needs this.
@@ -354,7 +382,12 @@ static void reader_close( hb_work_object_t * w )
     {
         hb_buffer_list_close(&r->splice_list[ii].list);
     }
+    for (ii = 0; ii < r->batch_count; ii++)
+    {
+        hb_buffer_list_close(&r->batch[ii].list);
+    }
 
+    free(r->batch);
     free(r->fifos);
     free(r->splice_list);
     free(r);
@@ -398,8 +431,51 @@ static hb_buffer_t * splice_discontinuity( hb_work_private_t *r, hb_buffer_t *bu
     return buf;
 }
 
+// The reader has no input fifo, count what it sends instead.
+static void count_buf( hb_work_private_t *r, hb_buffer_t *buf )
+{
+    if (r->stats != NULL)
+    {
+        for (; buf != NULL; buf = buf->next)
+        {
+            r->stats->buffers++;
+            r->stats->bytes += buf->size;
+        }
+    }
+}
+
+// Pushes all batched packets without waiting for room in their fifos
+static void flush_batches( hb_work_private_t *r )
+{
+    int ii;
+
+    for (ii = 0; ii < r->batch_count; ii++)
+    {
+        if (hb_buffer_list_count(&r->batch[ii].list) > 0)
+        {
+            count_buf(r, hb_buffer_list_head(&r->batch[ii].list));
+            hb_fifo_push_list(r->batch[ii].fifo, &r->batch[ii].list);
+        }
+    }
+}
+
 static void push_buf( hb_work_private_t *r, hb_fifo_t *fifo, hb_buffer_t *buf )
 {
+    uint64_t t0 = 0, trace;
+
+    if (hb_fifo_is_full(fifo))
+    {
+        // We are about to block.  Downstream may need the packets
+        // held back in the batches to drain this fifo, send them first.
+        flush_batches(r);
+    }
+    count_buf(r, buf);
+    if (r->stats != NULL)
+    {
+        // Time blocked here is back-pressure, not reading
+        t0 = hb_get_time_us();
+    }
+    trace = hb_trace_begin();
     while ( !*r->die && !r->job->done )
     {
         if ( hb_fifo_full_wait( fifo ) )
@@ -409,16 +485,42 @@ static void push_buf( hb_work_private_t *r, hb_fifo_t *fifo, hb_buffer_t *buf )
             break;
         }
     }
+    hb_trace_end("output wait", trace);
+    if (r->stats != NULL)
+    {
+        r->stats->wait_out += hb_get_time_us() - t0;
+    }
     if ( buf )
     {
         hb_buffer_close( &buf );
     }
 }
 
+static void queue_buf( hb_work_private_t *r, hb_fifo_t *fifo, hb_buffer_t *buf )
+{
+    int ii;
+
+    for (ii = 0; ii < r->batch_count; ii++)
+    {
+        if (r->batch[ii].fifo == fifo)
+        {
+            hb_buffer_list_append(&r->batch[ii].list, buf);
+            if (hb_buffer_list_count(&r->batch[ii].list) >= READER_BATCH_MAX)
+            {
+                push_buf(r, fifo, hb_buffer_list_clear(&r->batch[ii].list));
+            }
+            return;
+        }
+    }
+    push_buf(r, fifo, buf);
+}
+
 static void reader_send_eof( hb_work_private_t * r )
 {
     int ii;
 
+    flush_batches(r);
+
     // send eof buffers downstream to decoders to signal we're done.
     push_buf(r, r->job->fifo_mpeg2, hb_buffer_eof_init());
 
@@ -523,6 +625,8 @@ static int reader_work( hb_work_object_t * w, hb_buffer_t ** buf_in,
             // want to start at.
             r->job->reader_pts_offset = buf->s.start;
             r->start_found = 1;
+            // Wake up decsrtsub, it waits for the offset
+            hb_work_signal(r->job->h);
         }
 
         if (buf->s.start   != AV_NOPTS_VALUE &&
@@ -581,9 +685,9 @@ static int reader_work( hb_work_object_t * w, hb_buffer_t ** buf_in,
                 hb_buffer_t *buf_copy = hb_buffer_init(buf->size);
                 buf_copy->s = buf->s;
                 memcpy(buf_copy->data, buf->data, buf->size);
-                push_buf(r, fifos[ii], buf_copy);
+                queue_buf(r, fifos[ii], buf_copy);
             }
-            push_buf(r, fifos[0], buf);
+            queue_buf(r, fifos[0], buf);
             buf = NULL;
         }
         else
@@ -614,7 +718,7 @@ static void UpdateState( hb_work_private_t  * r )
         r->st_first = now;
     }
 
-    hb_get_state2(r->job->h, &state);
+    hb_get_job_state(r->job, &state);
 #define p state.param.working
     state.state = HB_STATE_WORKING;
     p.progress  = (float) r->last_pts / (float) r->duration;
@@ -646,7 +750,7 @@ static void UpdateState( hb_work_private_t  * r )
     }
 #undef p
 
-    hb_set_state( r->job->h, &state );
+    hb_set_job_state( r->job, &state );
 }
 
 /***********************************************************************
@@ -187,6 +187,12 @@ static void blend( hb_buffer_t *dst, hb_buffer_t *src, int left, int top )
 // as the original title diminsions
 static void ApplySub( hb_filter_private_t * pv, hb_buffer_t * buf, hb_buffer_t * sub )
 {
+    // Subtitles are blended in place.  Take a private copy of the
+    // frame first if it still references decoder owned storage.
+    if (hb_buffer_make_writable(buf) < 0)
+    {
+        return;
+    }
     blend( buf, sub, sub->f.x, sub->f.y );
 }
 
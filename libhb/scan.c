@@ -98,6 +98,7 @@ static void ScanFunc( void * _data )
     data->bd = NULL;
     data->dvd = NULL;
     data->stream = NULL;
+    hb_buffer_pool_retain();
 
     /* Try to open the path as a DVD. If it fails, try as a file */
     if( ( data->bd = hb_bd_init( data->h, data->path ) ) )
@@ -324,7 +325,7 @@ finish:
     free( data->path );
     free( data );
     _data = NULL;
-    hb_buffer_pool_free();
+    hb_buffer_pool_release();
 }
 
 // -----------------------------------------------
@@ -0,0 +1,371 @@
+/* spill.c
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*
+ * Spilling of queued buffers to disk.
+ *
+ * A few queues of the pipeline are unbounded by design: the raw subtitle
+ * fifos, the subtitle queues of sync and the track fifos of the muxer,
+ * which grow while another track starves.  On broken sources they can
+ * grow until the process runs out of memory.
+ *
+ * With job->memory_limit set, these queues register the buffers they
+ * hold with the job's spill store (hb_spill_queue).  While the data of
+ * the registered buffers that is in memory exceeds the limit, a queue
+ * writes the data of its oldest buffers to a temporary file and frees it
+ * (hb_spill_out).  The buffer itself stays in the queue with its size,
+ * settings and format, only 'data' and the plane pointers are NULL.  The
+ * data is read back when the buffer leaves the queue (hb_spill_unqueue)
+ * or is looked at in place (hb_spill_in).
+ *
+ * Spilling never makes a producer wait, so it can not deadlock a reader
+ * that feeds several queues.  If the temporary file can not be written
+ * the store stops spilling and the queues grow as they did before.
+ */
+
+#include "hb.h"
+
+#define SPILL_IO_BUFFER (256 * 1024)
+
+struct hb_spill_s
+{
+    hb_lock_t * lock;
+    char      * path;
+    FILE      * file;       // created by the first spill
+    int64_t     end;        // where the next spill is written
+    int64_t     limit;      // bytes of queued data kept in memory
+    int64_t     resident;   // bytes of queued data in memory
+    int         queued;     // buffers registered with the store
+    int         spilled;    // of which the data is on disk
+    int64_t     written;    // bytes written, for the log
+    int         failed;
+    int         closed;
+};
+
+static void spill_free( hb_spill_t * sp )
+{
+    if (sp->written > 0)
+    {
+        hb_log("spill: %"PRId64" MiB of queued data written to disk",
+               sp->written / (1024 * 1024));
+    }
+    if (sp->file != NULL)
+    {
+        fclose(sp->file);
+        remove(sp->path);
+    }
+    free(sp->path);
+    hb_lock_close(&sp->lock);
+    free(sp);
+}
+
+static void spill_fail( hb_spill_t * sp, const char * reason )
+{
+    if (!sp->failed)
+    {
+        hb_error("spill: %s, queued data stays in memory", reason);
+        hb_atomic_store(&sp->failed, 1);
+    }
+}
+
+/*
+ * Creates the spill store of 'job'.  Returns NULL if the job has no
+ * memory limit.
+ */
+hb_spill_t * hb_spill_init( hb_job_t * job )
+{
+    hb_spill_t * sp;
+    char         path[1024];
+
+    if (job->memory_limit <= 0)
+    {
+        return NULL;
+    }
+    sp = calloc(1, sizeof(hb_spill_t));
+    if (sp == NULL)
+    {
+        return NULL;
+    }
+    hb_get_tempory_filename(job->h, path, "spill.%d", job->sequence_id);
+    sp->path  = strdup(path);
+    sp->lock  = hb_lock_init();
+    sp->limit = (int64_t)job->memory_limit * 1024 * 1024;
+    if (sp->path == NULL || sp->lock == NULL)
+    {
+        spill_free(sp);
+        return NULL;
+    }
+    hb_log("spill: queued data limited to %d MiB", job->memory_limit);
+
+    return sp;
+}
+
+/*
+ * Releases the store.  Buffers that are still registered keep it alive
+ * until they are unqueued or closed.
+ */
+void hb_spill_close( hb_spill_t ** _sp )
+{
+    hb_spill_t * sp = *_sp;
+    int          done;
+
+    if (sp == NULL)
+    {
+        return;
+    }
+    *_sp = NULL;
+
+    hb_lock(sp->lock);
+    sp->closed = 1;
+    done = sp->queued == 0;
+    hb_unlock(sp->lock);
+    if (done)
+    {
+        spill_free(sp);
+    }
+}
+
+/*
+ * Registers 'b', just added to a queue, with the store.  Does nothing
+ * when there is no store or 'b' is already registered.
+ */
+void hb_spill_queue( hb_spill_t * sp, hb_buffer_t * b )
+{
+    if (sp == NULL || b->spill.store != NULL ||
+        b->data == NULL || b->size <= 0)
+    {
+        return;
+    }
+    hb_lock(sp->lock);
+    sp->queued++;
+    sp->resident += b->size;
+    hb_unlock(sp->lock);
+
+    b->spill.store   = sp;
+    b->spill.spilled = 0;
+}
+
+/*
+ * Returns whether the queued data in memory exceeds the limit and the
+ * queues should spill their oldest buffers.
+ */
+int hb_spill_over( hb_spill_t * sp )
+{
+    return sp != NULL && !hb_atomic_load_relaxed(&sp->failed) &&
+           hb_atomic_load_relaxed(&sp->resident) > sp->limit;
+}
+
+/*
+ * Writes the data of the registered buffer 'b' to disk and frees it.
+ * Buffers that are not registered, already on disk, or that share their
+ * data with other references are left as they are.
+ * Returns -1 if the store can not spill any more, 0 otherwise.
+ */
+int hb_spill_out( hb_buffer_t * b )
+{
+    hb_spill_t  * sp = b->spill.store;
+    hb_buffer_t * tmp;
+    int           p;
+
+    if (sp == NULL || b->spill.spilled)
+    {
+        return 0;
+    }
+    if (b->storage != NULL && !av_buffer_is_writable(b->storage))
+    {
+        // Writing it out would not free the data
+        return 0;
+    }
+    // The data is handed to the buffer pools through an empty buffer
+    tmp = calloc(1, sizeof(hb_buffer_t));
+    if (tmp == NULL)
+    {
+        return 0;
+    }
+
+    hb_lock(sp->lock);
+    if (sp->failed)
+    {
+        hb_unlock(sp->lock);
+        free(tmp);
+        return -1;
+    }
+    if (sp->file == NULL)
+    {
+        sp->file = hb_fopen(sp->path, "w+b");
+        if (sp->file == NULL)
+        {
+            spill_fail(sp, "unable to create the temporary file");
+            hb_unlock(sp->lock);
+            free(tmp);
+            return -1;
+        }
+        setvbuf(sp->file, NULL, _IOFBF, SPILL_IO_BUFFER);
+    }
+    if (fseeko(sp->file, sp->end, SEEK_SET) != 0 ||
+        fwrite(b->data, 1, b->size, sp->file) != (size_t)b->size)
+    {
+        spill_fail(sp, "write failed");
+        hb_unlock(sp->lock);
+        free(tmp);
+        return -1;
+    }
+    b->spill.pos  = sp->end;
+    sp->end      += b->size;
+    sp->written  += b->size;
+    sp->resident -= b->size;
+    sp->spilled++;
+    hb_unlock(sp->lock);
+
+    for (p = 0; p < 4; p++)
+    {
+        b->spill.plane[p] = b->plane[p].data != NULL ?
+                            b->plane[p].data - b->data : -1;
+        b->plane[p].data  = NULL;
+    }
+    tmp->data    = b->data;
+    tmp->alloc   = b->alloc;
+    tmp->node    = b->node;
+    tmp->storage = b->storage;
+    b->data      = NULL;
+    b->alloc     = 0;
+    b->storage   = NULL;
+    b->spill.spilled = 1;
+    hb_buffer_close(&tmp);
+
+    return 0;
+}
+
+// Reads the data of the spilled buffer 'b' back into memory.
+// 'resident' tells whether it still counts against the limit.
+static void spill_load( hb_buffer_t * b, int resident )
+{
+    hb_spill_t  * sp = b->spill.store;
+    hb_buffer_t * tmp;
+    int           p, ok;
+
+    tmp = hb_buffer_init(b->size);
+    if (tmp == NULL)
+    {
+        return;
+    }
+
+    hb_lock(sp->lock);
+    ok = fseeko(sp->file, b->spill.pos, SEEK_SET) == 0 &&
+         fread(tmp->data, 1, b->size, sp->file) == (size_t)b->size;
+    sp->spilled--;
+    if (sp->spilled == 0)
+    {
+        // Nothing on disk is needed any more, start over
+        sp->end = 0;
+    }
+    if (resident)
+    {
+        sp->resident += b->size;
+    }
+    hb_unlock(sp->lock);
+    if (!ok)
+    {
+        hb_error("spill: read failed, buffer data lost");
+        memset(tmp->data, 0, b->size);
+    }
+
+    b->data  = tmp->data;
+    b->alloc = tmp->alloc;
+    b->node  = tmp->node;
+    for (p = 0; p < 4; p++)
+    {
+        if (b->spill.plane[p] >= 0)
+        {
+            b->plane[p].data = b->data + b->spill.plane[p];
+        }
+    }
+    b->spill.spilled = 0;
+
+    tmp->data = NULL;
+    hb_buffer_close(&tmp);
+}
+
+// Unregisters 'b' from its store, freeing the store if it was closed
+static void spill_release( hb_buffer_t * b )
+{
+    hb_spill_t * sp = b->spill.store;
+    int          done;
+
+    hb_lock(sp->lock);
+    if (b->spill.spilled)
+    {
+        sp->spilled--;
+        if (sp->spilled == 0)
+        {
+            sp->end = 0;
+        }
+    }
+    else
+    {
+        sp->resident -= b->size;
+    }
+    sp->queued--;
+    done = sp->closed && sp->queued == 0;
+    hb_unlock(sp->lock);
+
+    b->spill.store   = NULL;
+    b->spill.spilled = 0;
+    if (done)
+    {
+        spill_free(sp);
+    }
+}
+
+/*
+ * Makes the data of the queued buffer 'b' available in place.  'b' stays
+ * registered and may be spilled again.
+ */
+void hb_spill_in( hb_buffer_t * b )
+{
+    if (b != NULL && b->spill.store != NULL && b->spill.spilled)
+    {
+        spill_load(b, 1);
+    }
+}
+
+/*
+ * Called when 'b' leaves its queue, reads its data back if needed and
+ * unregisters it.
+ */
+void hb_spill_unqueue( hb_buffer_t * b )
+{
+    if (b == NULL || b->spill.store == NULL)
+    {
+        return;
+    }
+    if (b->spill.spilled)
+    {
+        // Counted as resident again, spill_release() takes it off
+        spill_load(b, 1);
+        if (b->spill.spilled)
+        {
+            // Out of memory, the data can not be restored
+            b->size = 0;
+        }
+    }
+    spill_release(b);
+}
+
+/*
+ * Unregisters 'b' without reading its data back, for buffers that are
+ * closed while queued.
+ */
+void hb_spill_drop( hb_buffer_t * b )
+{
+    if (b->spill.store != NULL)
+    {
+        spill_release(b);
+    }
+}
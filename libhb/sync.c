@@ -1182,6 +1182,7 @@ static void streamFlush( sync_stream_t * stream )
         if (buf != NULL)
         {
             hb_list_rem(stream->in_queue, buf);
+            hb_spill_unqueue(buf);
             if (!stream->first_frame)
             {
                 if (buf->s.start >= 0)
@@ -1488,6 +1489,7 @@ static void OutputBuffer( sync_common_t * common )
     int64_t         pts;
     sync_stream_t * out_stream;
     hb_buffer_t   * buf;
+    uint64_t        trace = hb_trace_begin();
 
     do
     {
@@ -1678,6 +1680,7 @@ static void OutputBuffer( sync_common_t * common )
 
         // Out the buffer goes...
         hb_list_rem(out_stream->in_queue, buf);
+        hb_spill_unqueue(buf);
         if (out_stream->type == SYNC_TYPE_VIDEO)
         {
             UpdateState(common, out_stream->frame_count);
@@ -1793,6 +1796,7 @@ static void OutputBuffer( sync_common_t * common )
         restoreChap(out_stream, buf);
         fifo_push(out_stream->fifo_out, buf);
     } while (full);
+    hb_trace_end("sync output", trace);
 }
 
 static void FlushBuffer( sync_common_t * common )
@@ -2039,6 +2043,24 @@ static int UpdateSCR( sync_stream_t * stream, hb_buffer_t * buf )
     return 1;
 }
 
+// Subtitle queues are unbounded.  Write the data of the oldest queued
+// subtitles to disk while the job is over its memory limit, see spill.c
+static void spillSubtitles( sync_stream_t * stream, hb_buffer_t * buf )
+{
+    hb_spill_t * spill = stream->common->job->spill;
+    int          ii, count;
+
+    hb_spill_queue(spill, buf);
+    count = hb_list_count(stream->in_queue);
+    for (ii = 0; ii < count && hb_spill_over(spill); ii++)
+    {
+        if (hb_spill_out(hb_list_item(stream->in_queue, ii)) < 0)
+        {
+            break;
+        }
+    }
+}
+
 // Handle broken timestamps that are out of order
 // These are usually due to a broken decoder (e.g. QSV and libav AVI packed
 // b-frame support).  But sometimes can come from a severely broken or
@@ -2065,6 +2087,10 @@ static void SortedQueueBuffer( sync_stream_t * stream, hb_buffer_t * buf )
 
     start = buf->s.start;
     hb_list_add(stream->in_queue, buf);
+    if (stream->type == SYNC_TYPE_SUBTITLE)
+    {
+        spillSubtitles(stream, buf);
+    }
 
     // Search for the first earlier timestamp that is < this one.
     // Under normal circumstances where the timestamps are not broken,
@@ -2413,7 +2439,7 @@ static int syncVideoInit( hb_work_object_t * w, hb_job_t * job)
     if (job->pass_id == HB_PASS_ENCODE_2ND)
     {
         /* We already have an accurate frame count from pass 1 */
-        hb_interjob_t * interjob = hb_interjob_get(job->h);
+        hb_interjob_t * interjob = job->interjob;
         pv->common->est_frame_count = interjob->frame_count;
     }
     else
@@ -2487,6 +2513,9 @@ static int syncVideoInit( hb_work_object_t * w, hb_job_t * job)
         hb_work_object_t * work;
         work         = hb_list_item(pv->common->list_work, ii);
         work->done   = w->done;
+        work->die    = w->die;
+        work->stats  = hb_profile_add(job->profile, work->name, "work",
+                                      work->fifo_in);
         work->thread = hb_thread_init(work->name, hb_work_loop,
                                       work, HB_LOW_PRIORITY);
     }
@@ -2574,7 +2603,7 @@ static void syncVideoClose( hb_work_object_t * w )
     if( job->pass_id == HB_PASS_ENCODE_1ST )
     {
         /* Preserve frame count for better accuracy in pass 2 */
-        hb_interjob_t * interjob = hb_interjob_get( job->h );
+        hb_interjob_t * interjob = job->interjob;
         interjob->frame_count = pv->stream->frame_count;
     }
     sync_delta_t * delta;
@@ -3236,7 +3265,7 @@ static void UpdateState( sync_common_t * common, int frame_count )
         common->st_counts[3] = frame_count;
     }
 
-    hb_get_state2(job->h, &state);
+    hb_get_job_state(job, &state);
     state.state = HB_STATE_WORKING;
 
 #define p state.param.working
@@ -3266,7 +3295,7 @@ static void UpdateState( sync_common_t * common, int frame_count )
     }
 #undef p
 
-    hb_set_state(job->h, &state);
+    hb_set_job_state(job, &state);
 }
 
 static void UpdateSearchState( sync_common_t * common, int64_t start,
@@ -3293,7 +3322,7 @@ static void UpdateSearchState( sync_common_t * common, int64_t start,
         job->st_paused = 0;
     }
 
-    hb_get_state2(job->h, &state);
+    hb_get_job_state(job, &state);
     state.state = HB_STATE_SEARCHING;
 
 #define p state.param.working
@@ -3334,7 +3363,7 @@ static void UpdateSearchState( sync_common_t * common, int64_t start,
     }
 #undef p
 
-    hb_set_state(job->h, &state);
+    hb_set_job_state(job, &state);
 }
 
 static int syncSubtitleInit( hb_work_object_t * w, hb_job_t * job )
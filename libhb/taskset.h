@@ -10,22 +10,22 @@
 #ifndef HB_TASKSET_H
 #define HB_TASKSET_H
 
-#define TASKSET_POSIX_COMPLIANT 1
-
-#include "bits.h"
-
+#include "threadpool.h"
+
+/*
+ * A taskset is a fixed set of tasks (typically one per frame segment)
+ * that are run together on the shared thread pool by taskset_cycle().
+ *
+ * The function registered for each index with taskset_thread_spawn()
+ * is called once per cycle with that index's args and must return when
+ * its share of the work is done.
+ */
 typedef struct hb_taskset_s {
     int                thread_count;
     int                arg_size;
-    int                bitmap_elements;
-    hb_thread_t     ** task_threads;
     uint8_t          * task_threads_args;
-    uint32_t         * task_begin_bitmap;    // Threads can begin
-    uint32_t         * task_complete_bitmap; // Threads have completed
-    uint32_t         * task_stop_bitmap;     // Threads should exit
-    hb_lock_t        * task_cond_lock;       // Held during condition tests
-    hb_cond_t        * task_begin;           // Threads can begin work
-    hb_cond_t        * task_complete;        // Threads have finished work.
+    hb_task_t        * tasks;
+    hb_task_group_t  * group;
 } taskset_t;
 
 int taskset_init( taskset_t *, int /*thread_count*/, size_t /*user_arg_size*/ );
@@ -34,11 +34,8 @@ void taskset_fini( taskset_t * );
 
 int  taskset_thread_spawn( taskset_t *, int /*thr_idx*/, const char * /*descr*/,
                            thread_func_t *, int /*priority*/ );
-void taskset_thread_wait4start( taskset_t *, int );
-void taskset_thread_complete( taskset_t *, int );
 
 static inline void *taskset_thread_args( taskset_t *, int );
-static inline int   taskset_thread_stop( taskset_t *, int );
 
 static inline void *
 taskset_thread_args( taskset_t *ts, int thr_idx )
@@ -46,10 +43,4 @@ taskset_thread_args( taskset_t *ts, int thr_idx )
     return( ts->task_threads_args + ( ts->arg_size * thr_idx ) );
 }
 
-static inline int
-taskset_thread_stop( taskset_t *ts, int thr_idx )
-{
-    return bit_is_set( ts->task_stop_bitmap, thr_idx );
-}
-
 #endif /* HB_TASKSET_H */
@@ -0,0 +1,523 @@
+/* threadpool.c
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "hb.h"
+#include "ports.h"
+#include "threadpool.h"
+
+#define POOL_DEQUE_INIT 64
+#define POOL_MAX_SETS   (HB_MAX_AFFINITY_SETS + 1)
+
+struct hb_task_group_s
+{
+    hb_lock_t * lock;
+    hb_cond_t * cond;
+    int         remaining;
+};
+
+/*
+ * Per worker task deque.  The owner pushes and pops at the tail,
+ * thieves take from the head so they get the oldest work.
+ */
+typedef struct
+{
+    hb_lock_t  * lock;
+    hb_task_t ** tasks;
+    int          size;      // allocated slots, always a power of 2
+    int          head;
+    int          count;
+} pool_deque_t;
+
+/*
+ * Workers that run on the same CPUs.  Set 0 runs on all CPUs of the
+ * process.  The others each run on the CPUs of one affinity id, see
+ * hb_thread_affinity_id(), and take the tasks of threads pinned to
+ * these CPUs, so that the filters of a pinned job stay on its CPUs and
+ * NUMA node.  Workers only take tasks of their own set.
+ */
+typedef struct
+{
+    hb_cond_t    * cond;
+    int            pending; // tasks queued and not yet taken
+    unsigned       next;    // round robin submit and steal position
+    int            thread_count;
+    hb_thread_t ** threads;
+    pool_deque_t * deques;
+} pool_set_t;
+
+typedef struct
+{
+    hb_lock_t    * lock;    // held for startup, shutdown and sleeping
+    int            stop;
+    pool_set_t   * sets[POOL_MAX_SETS];
+} hb_thread_pool_t;
+
+static hb_thread_pool_t pool;
+
+static int deque_push( pool_deque_t * d, hb_task_t * task )
+{
+    hb_lock( d->lock );
+    if (d->count == d->size)
+    {
+        hb_task_t ** tasks;
+        int          size, ii;
+
+        size  = d->size ? d->size * 2 : POOL_DEQUE_INIT;
+        tasks = malloc(size * sizeof(hb_task_t*));
+        if (tasks == NULL)
+        {
+            hb_unlock( d->lock );
+            return 0;
+        }
+        for (ii = 0; ii < d->count; ii++)
+        {
+            tasks[ii] = d->tasks[(d->head + ii) & (d->size - 1)];
+        }
+        free(d->tasks);
+        d->tasks = tasks;
+        d->size  = size;
+        d->head  = 0;
+    }
+    d->tasks[(d->head + d->count) & (d->size - 1)] = task;
+    hb_atomic_store(&d->count, d->count + 1);
+    hb_unlock( d->lock );
+
+    return 1;
+}
+
+static hb_task_t * deque_pop( pool_deque_t * d )
+{
+    hb_task_t * task = NULL;
+
+    if (hb_atomic_load_relaxed(&d->count) == 0)
+    {
+        return NULL;
+    }
+    hb_lock( d->lock );
+    if (d->count > 0)
+    {
+        task = d->tasks[(d->head + d->count - 1) & (d->size - 1)];
+        hb_atomic_store(&d->count, d->count - 1);
+    }
+    hb_unlock( d->lock );
+
+    return task;
+}
+
+static hb_task_t * deque_steal( pool_deque_t * d )
+{
+    hb_task_t * task = NULL;
+
+    if (hb_atomic_load_relaxed(&d->count) == 0)
+    {
+        return NULL;
+    }
+    hb_lock( d->lock );
+    if (d->count > 0)
+    {
+        task    = d->tasks[d->head];
+        d->head = (d->head + 1) & (d->size - 1);
+        hb_atomic_store(&d->count, d->count - 1);
+    }
+    hb_unlock( d->lock );
+
+    return task;
+}
+
+/*
+ * Take one task of 'set', preferring the newest work of worker 'self'.
+ * Threads outside the pool pass -1 and only steal.
+ */
+static hb_task_t * pool_take( pool_set_t * set, int self )
+{
+    hb_task_t * task = NULL;
+    int         start, ii;
+
+    if (self >= 0)
+    {
+        task  = deque_pop(&set->deques[self]);
+        start = self + 1;
+    }
+    else
+    {
+        start = hb_atomic_add(&set->next, 1);
+    }
+    for (ii = 0; task == NULL && ii < set->thread_count; ii++)
+    {
+        task = deque_steal(&set->deques[(unsigned)(start + ii) %
+                                        set->thread_count]);
+    }
+    if (task != NULL)
+    {
+        hb_atomic_sub(&set->pending, 1);
+    }
+    return task;
+}
+
+static void task_group_complete( hb_task_group_t * group )
+{
+    hb_lock( group->lock );
+    if (--group->remaining == 0)
+    {
+        hb_cond_broadcast( group->cond );
+    }
+    hb_unlock( group->lock );
+}
+
+static void task_run( hb_task_t * task )
+{
+    // The task may be reused as soon as its group completes
+    hb_task_group_t * group = task->group;
+    uint64_t          trace = hb_trace_begin();
+
+    task->function(task->arg);
+    hb_trace_end("task", trace);
+    if (group != NULL)
+    {
+        task_group_complete(group);
+    }
+}
+
+// Worker threads get their set and index packed in their argument
+#define POOL_WORKER_ARG(id, self) ((void*)(intptr_t)((id) << 16 | (self)))
+
+static void pool_thread( void * arg )
+{
+    int          id   = (intptr_t)arg >> 16;
+    int          self = (intptr_t)arg & 0xffff;
+    pool_set_t * set  = hb_atomic_load(&pool.sets[id]);
+    int          stop = 0;
+
+    // Workers are started by whichever thread first needs them, run on
+    // the CPUs of the set and with its NUMA memory policy instead
+    hb_thread_set_affinity_id(id);
+    hb_trace_thread_name("hb_thread_pool");
+    while (!stop)
+    {
+        hb_task_t * task = pool_take(set, self);
+        if (task != NULL)
+        {
+            task_run(task);
+            continue;
+        }
+
+        hb_lock( pool.lock );
+        while (!pool.stop && hb_atomic_load(&set->pending) <= 0)
+        {
+            hb_cond_wait( set->cond, pool.lock );
+        }
+        stop = pool.stop;
+        hb_unlock( pool.lock );
+    }
+    hb_buffer_cache_flush();
+}
+
+static void pool_set_free( pool_set_t * set )
+{
+    int ii;
+
+    for (ii = 0; set->deques != NULL && ii < set->thread_count; ii++)
+    {
+        if (set->deques[ii].lock != NULL)
+        {
+            hb_lock_close(&set->deques[ii].lock);
+        }
+        free(set->deques[ii].tasks);
+    }
+    if (set->cond != NULL)
+    {
+        hb_cond_close(&set->cond);
+    }
+    free(set->deques);
+    free(set->threads);
+    free(set);
+}
+
+/*
+ * Returns the worker set of the CPUs the calling thread runs on.  With
+ * 'start' the set's workers are started if they are not running yet,
+ * one for each of its CPUs.  Workers are started on first use so that
+ * processes which never run a threaded filter (e.g. a scan only) do not
+ * carry idle threads.  Returns NULL if tasks have to run inline.
+ */
+static pool_set_t * pool_current_set( int start )
+{
+    pool_set_t * set;
+    int          id, ii, count = 0;
+
+    if (pool.lock == NULL)
+    {
+        return NULL;
+    }
+    id = hb_thread_affinity_id(&count);
+    if (id <= 0 || id >= POOL_MAX_SETS)
+    {
+        id    = 0;
+        count = hb_get_cpu_count();
+    }
+    set = hb_atomic_load(&pool.sets[id]);
+    if (set != NULL || !start)
+    {
+        return set;
+    }
+
+    hb_lock( pool.lock );
+    set = pool.sets[id];
+    if (set != NULL || pool.stop)
+    {
+        hb_unlock( pool.lock );
+        return set;
+    }
+
+    count        = MAX(count, 1);
+    set          = calloc(1, sizeof(pool_set_t));
+    if (set == NULL)
+    {
+        goto fail;
+    }
+    set->cond    = hb_cond_init();
+    set->deques  = calloc(count, sizeof(pool_deque_t));
+    set->threads = calloc(count, sizeof(hb_thread_t*));
+    set->thread_count = count;
+    if (set->cond == NULL || set->deques == NULL || set->threads == NULL)
+    {
+        goto fail;
+    }
+    for (ii = 0; ii < count; ii++)
+    {
+        set->deques[ii].lock = hb_lock_init();
+        if (set->deques[ii].lock == NULL)
+        {
+            goto fail;
+        }
+    }
+    hb_atomic_store(&pool.sets[id], set);
+
+    for (ii = 0; ii < count; ii++)
+    {
+        set->threads[ii] = hb_thread_init("hb_thread_pool", pool_thread,
+                                          POOL_WORKER_ARG(id, ii),
+                                          HB_NORMAL_PRIORITY);
+    }
+    hb_unlock( pool.lock );
+
+    if (id > 0)
+    {
+        hb_log("thread pool: started %d workers for pinned threads", count);
+    }
+    else
+    {
+        hb_log("thread pool: started %d workers", count);
+    }
+    return set;
+
+fail:
+    hb_error("thread pool: initialization failed, running tasks inline");
+    if (set != NULL)
+    {
+        pool_set_free(set);
+    }
+    pool.stop = 1;
+    hb_unlock( pool.lock );
+    return NULL;
+}
+
+void hb_thread_pool_init( void )
+{
+    memset(&pool, 0, sizeof(pool));
+    pool.lock = hb_lock_init();
+}
+
+void hb_thread_pool_close( void )
+{
+    pool_set_t * set;
+    int          id, ii;
+
+    if (pool.lock == NULL)
+    {
+        return;
+    }
+
+    hb_lock( pool.lock );
+    pool.stop = 1;
+    for (id = 0; id < POOL_MAX_SETS; id++)
+    {
+        if (pool.sets[id] != NULL)
+        {
+            hb_cond_broadcast( pool.sets[id]->cond );
+        }
+    }
+    hb_unlock( pool.lock );
+
+    for (id = 0; id < POOL_MAX_SETS; id++)
+    {
+        set = pool.sets[id];
+        if (set == NULL)
+        {
+            continue;
+        }
+        for (ii = 0; ii < set->thread_count; ii++)
+        {
+            if (set->threads[ii] != NULL)
+            {
+                hb_thread_close(&set->threads[ii]);
+            }
+        }
+        pool_set_free(set);
+    }
+    hb_lock_close(&pool.lock);
+    memset(&pool, 0, sizeof(pool));
+}
+
+int hb_thread_pool_thread_count( void )
+{
+    pool_set_t * set = pool_current_set(1);
+
+    if (set != NULL)
+    {
+        return set->thread_count;
+    }
+    return 1;
+}
+
+void hb_thread_pool_submit( hb_task_t * tasks, int count )
+{
+    pool_set_t * set;
+    unsigned     start;
+    int          ii;
+
+    if (count <= 0)
+    {
+        return;
+    }
+    for (ii = 0; ii < count; ii++)
+    {
+        if (tasks[ii].group != NULL)
+        {
+            hb_lock( tasks[ii].group->lock );
+            tasks[ii].group->remaining++;
+            hb_unlock( tasks[ii].group->lock );
+        }
+    }
+
+    set = pool_current_set(1);
+    if (set == NULL)
+    {
+        for (ii = 0; ii < count; ii++)
+        {
+            task_run(&tasks[ii]);
+        }
+        return;
+    }
+
+    // Count the tasks before they become visible so that a worker which
+    // takes one never sees pending drop below zero.
+    hb_atomic_add(&set->pending, count);
+    start = hb_atomic_add(&set->next, count) - count;
+    for (ii = 0; ii < count; ii++)
+    {
+        if (!deque_push(&set->deques[(start + ii) % set->thread_count],
+                        &tasks[ii]))
+        {
+            hb_atomic_sub(&set->pending, 1);
+            task_run(&tasks[ii]);
+        }
+    }
+
+    hb_lock( pool.lock );
+    if (count >= set->thread_count)
+    {
+        hb_cond_broadcast( set->cond );
+    }
+    else
+    {
+        for (ii = 0; ii < count; ii++)
+        {
+            hb_cond_signal( set->cond );
+        }
+    }
+    hb_unlock( pool.lock );
+}
+
+hb_task_group_t * hb_task_group_init( void )
+{
+    hb_task_group_t * group = calloc(1, sizeof(hb_task_group_t));
+
+    if (group == NULL)
+    {
+        return NULL;
+    }
+    group->lock = hb_lock_init();
+    group->cond = hb_cond_init();
+    if (group->lock == NULL || group->cond == NULL)
+    {
+        hb_task_group_close(&group);
+    }
+    return group;
+}
+
+void hb_task_group_close( hb_task_group_t ** _group )
+{
+    hb_task_group_t * group = *_group;
+
+    if (group == NULL)
+    {
+        return;
+    }
+    if (group->lock != NULL)
+    {
+        hb_lock_close(&group->lock);
+    }
+    if (group->cond != NULL)
+    {
+        hb_cond_close(&group->cond);
+    }
+    free(group);
+    *_group = NULL;
+}
+
+/*
+ * Block until every task submitted on 'group' has run.  Rather than
+ * sleeping right away the caller works through queued tasks of any
+ * group, which also makes it safe for a task to wait on a group.
+ */
+void hb_task_group_wait( hb_task_group_t * group )
+{
+    pool_set_t * set = pool_current_set(0);
+    hb_task_t  * task;
+    int          remaining;
+
+    while (1)
+    {
+        hb_lock( group->lock );
+        remaining = group->remaining;
+        hb_unlock( group->lock );
+        if (remaining == 0)
+        {
+            return;
+        }
+        if (set == NULL)
+        {
+            break;
+        }
+        task = pool_take(set, -1);
+        if (task == NULL)
+        {
+            break;
+        }
+        task_run(task);
+    }
+
+    hb_lock( group->lock );
+    while (group->remaining > 0)
+    {
+        hb_cond_wait( group->cond, group->lock );
+    }
+    hb_unlock( group->lock );
+}
@@ -0,0 +1,50 @@
+/* threadpool.h
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef HB_THREADPOOL_H
+#define HB_THREADPOOL_H
+
+/*
+ * Process-wide work-stealing thread pool.
+ *
+ * All multithreaded filters schedule their slices and frames as tasks on
+ * this one pool instead of each spawning hb_get_cpu_count() threads of
+ * their own.  Every worker owns a task deque; it pops its own work LIFO
+ * and steals FIFO from the other workers when it runs dry.  A thread
+ * waiting on a task group runs queued tasks itself until the group is
+ * complete, so blocked filter threads help whichever stage is busy.
+ *
+ * Threads pinned to some CPUs (see hb_thread_set_affinity) have their
+ * tasks run by workers of their own that are pinned to the same CPUs.
+ *
+ * Tasks must not block on anything but another task group.
+ */
+
+typedef struct hb_task_group_s hb_task_group_t;
+
+typedef struct hb_task_s
+{
+    thread_func_t   * function;
+    void            * arg;
+    hb_task_group_t * group;
+} hb_task_t;
+
+void hb_thread_pool_init( void );
+void hb_thread_pool_close( void );
+int  hb_thread_pool_thread_count( void );
+
+/* Queue count tasks.  The tasks must stay valid until their group
+ * has been waited on. */
+void hb_thread_pool_submit( hb_task_t * tasks, int count );
+
+hb_task_group_t * hb_task_group_init( void );
+void              hb_task_group_close( hb_task_group_t ** );
+void              hb_task_group_wait( hb_task_group_t * );
+
+#endif /* HB_THREADPOOL_H */
@@ -0,0 +1,325 @@
+/* trace.c
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*
+ * Timeline tracing of the encode pipeline.
+ *
+ * When the HB_TRACE environment variable is set each job records what
+ * its threads are doing and writes it at the end of the job as a
+ * Chrome trace-event JSON file (chrome://tracing, ui.perfetto.dev).
+ * HB_TRACE is the file name prefix, every job writes
+ * <prefix>.<n>.json.  Jobs that run at the same time share one trace,
+ * it is written when the last of them ends.
+ *
+ * Spans are recorded as complete ("X") events into a ring owned by the
+ * recording thread, so recording takes no lock.  The oldest events are
+ * overwritten when a ring fills.  Rings outlive their threads and are
+ * collected when the trace is written.
+ */
+
+#include "hb.h"
+
+#define TRACE_RING_SIZE 16384   // events per thread, a power of 2
+
+typedef struct
+{
+    const char * name;
+    uint64_t     ts;
+    uint64_t     dur;
+} trace_event_t;
+
+typedef struct
+{
+    const char    * name;       // thread name
+    int             tid;
+    int             exited;
+    uint64_t        head;       // events ever recorded
+    uint64_t        base;       // first event of the current trace
+    trace_event_t   events[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static struct
+{
+    hb_lock_t * lock;
+    hb_tls_t  * ring_key;
+    hb_tls_t  * name_key;
+    hb_list_t * rings;
+    int         enabled;
+    int         users;      // jobs between hb_trace_start and _stop
+    int         next_tid;
+    int         file_count;
+    uint64_t    start;
+    char      * prefix;
+} trace;
+
+static void trace_ring_exit( void * _ring )
+{
+    trace_ring_t * ring = _ring;
+    hb_atomic_store(&ring->exited, 1);
+}
+
+void hb_trace_init( void )
+{
+    memset(&trace, 0, sizeof(trace));
+    trace.lock     = hb_lock_init();
+    trace.ring_key = hb_tls_init(trace_ring_exit);
+    trace.name_key = hb_tls_init(NULL);
+    trace.rings    = hb_list_init();
+}
+
+void hb_trace_close( void )
+{
+    trace_ring_t * ring;
+
+    if (trace.lock == NULL)
+    {
+        return;
+    }
+    while ((ring = hb_list_item(trace.rings, 0)) != NULL)
+    {
+        hb_list_rem(trace.rings, ring);
+        free(ring);
+    }
+    hb_list_close(&trace.rings);
+    hb_tls_close(&trace.ring_key);
+    hb_tls_close(&trace.name_key);
+    hb_lock_close(&trace.lock);
+    free(trace.prefix);
+    memset(&trace, 0, sizeof(trace));
+}
+
+/*
+ * Name the calling thread in the trace.  'name' must stay valid for
+ * the life of the process or of the job being traced.
+ */
+void hb_trace_thread_name( const char * name )
+{
+    trace_ring_t * ring;
+
+    if (trace.lock == NULL)
+    {
+        return;
+    }
+    hb_tls_set(trace.name_key, (void*)name);
+    ring = hb_tls_get(trace.ring_key);
+    if (ring != NULL)
+    {
+        ring->name = name;
+    }
+}
+
+static trace_ring_t * trace_get_ring( void )
+{
+    trace_ring_t * ring = hb_tls_get(trace.ring_key);
+
+    if (ring != NULL)
+    {
+        return ring;
+    }
+    ring = calloc(1, sizeof(trace_ring_t));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    ring->name = hb_tls_get(trace.name_key);
+    hb_lock(trace.lock);
+    ring->tid = ++trace.next_tid;
+    hb_list_add(trace.rings, ring);
+    hb_unlock(trace.lock);
+    hb_tls_set(trace.ring_key, ring);
+
+    return ring;
+}
+
+/*
+ * Returns the start time of a span, or 0 when tracing is off.
+ */
+uint64_t hb_trace_begin( void )
+{
+    if (!hb_atomic_load_relaxed(&trace.enabled))
+    {
+        return 0;
+    }
+    return hb_get_time_us();
+}
+
+/*
+ * Record the span 'name' that began at 'start'.  'name' must stay
+ * valid until the job ends.
+ */
+void hb_trace_end( const char * name, uint64_t start )
+{
+    trace_ring_t  * ring;
+    trace_event_t * ev;
+
+    if (start == 0 || !hb_atomic_load_relaxed(&trace.enabled))
+    {
+        return;
+    }
+    ring = trace_get_ring();
+    if (ring == NULL)
+    {
+        return;
+    }
+    ev       = &ring->events[ring->head & (TRACE_RING_SIZE - 1)];
+    ev->name = name;
+    ev->ts   = start;
+    ev->dur  = hb_get_time_us() - start;
+    hb_atomic_store(&ring->head, ring->head + 1);
+}
+
+/*
+ * Begin tracing a job if HB_TRACE is set.  Called by the work thread
+ * before the pipeline starts.  Tracing is shared by the jobs that run
+ * at the same time, the first of them starts it.
+ */
+void hb_trace_start( void )
+{
+    const char   * prefix = getenv("HB_TRACE");
+    trace_ring_t * ring;
+    int            ii;
+
+    if (trace.lock == NULL)
+    {
+        return;
+    }
+    hb_lock(trace.lock);
+    if (trace.users++ > 0 || prefix == NULL || prefix[0] == 0)
+    {
+        hb_unlock(trace.lock);
+        return;
+    }
+    free(trace.prefix);
+    trace.prefix = strdup(prefix);
+    trace.start  = hb_get_time_us();
+    // Forget what idle threads recorded between jobs
+    for (ii = 0; ii < hb_list_count(trace.rings); ii++)
+    {
+        ring = hb_list_item(trace.rings, ii);
+        ring->base = hb_atomic_load(&ring->head);
+    }
+    hb_atomic_store(&trace.enabled, 1);
+    hb_unlock(trace.lock);
+}
+
+static void trace_write_string( FILE * file, const char * str )
+{
+    fputc('"', file);
+    for (; str != NULL && *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+        {
+            fputc('\\', file);
+        }
+        if ((unsigned char)*str >= 0x20)
+        {
+            fputc(*str, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static void trace_write_ring( FILE * file, trace_ring_t * ring, int * first )
+{
+    uint64_t head = hb_atomic_load(&ring->head);
+    uint64_t ii   = ring->base;
+
+    if (head == ii)
+    {
+        return;
+    }
+    if (head - ii > TRACE_RING_SIZE)
+    {
+        ii = head - TRACE_RING_SIZE;
+    }
+
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                  "\"tid\":%d,\"args\":{\"name\":", *first ? "" : ",",
+            ring->tid);
+    trace_write_string(file, ring->name != NULL ? ring->name : "thread");
+    fprintf(file, "}}");
+    *first = 0;
+
+    for (; ii < head; ii++)
+    {
+        trace_event_t * ev = &ring->events[ii & (TRACE_RING_SIZE - 1)];
+
+        if (ev->ts < trace.start)
+        {
+            continue;
+        }
+        fprintf(file, ",\n{\"name\":");
+        trace_write_string(file, ev->name);
+        fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                      "\"ts\":%"PRIu64",\"dur\":%"PRIu64"}",
+                ring->tid, ev->ts - trace.start, ev->dur);
+    }
+}
+
+/*
+ * Stop tracing and write the trace file.  Called by the work thread
+ * once all pipeline threads of the job have exited.  Does nothing until
+ * the last job that called hb_trace_start() ends.
+ */
+void hb_trace_stop( void )
+{
+    trace_ring_t * ring;
+    FILE         * file;
+    char         * path;
+    int            ii, first = 1;
+
+    if (trace.lock == NULL)
+    {
+        return;
+    }
+    hb_lock(trace.lock);
+    if (--trace.users > 0 || !trace.enabled)
+    {
+        trace.users = MAX(trace.users, 0);
+        hb_unlock(trace.lock);
+        return;
+    }
+    hb_atomic_store(&trace.enabled, 0);
+
+    path = hb_strdup_printf("%s.%d.json", trace.prefix, ++trace.file_count);
+    file = path != NULL ? hb_fopen(path, "w") : NULL;
+    if (file == NULL)
+    {
+        hb_error("trace: unable to write %s", path ? path : trace.prefix);
+    }
+    else
+    {
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+        for (ii = 0; ii < hb_list_count(trace.rings); ii++)
+        {
+            trace_write_ring(file, hb_list_item(trace.rings, ii), &first);
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        hb_log("trace: wrote %s", path);
+    }
+    free(path);
+
+    // Rings of threads that have exited will never be written again
+    for (ii = 0; ii < hb_list_count(trace.rings); )
+    {
+        ring = hb_list_item(trace.rings, ii);
+        if (hb_atomic_load(&ring->exited))
+        {
+            hb_list_rem(trace.rings, ring);
+            free(ring);
+        }
+        else
+        {
+            ring->base = hb_atomic_load(&ring->head);
+            ii++;
+        }
+    }
+    hb_unlock(trace.lock);
+}
@@ -503,7 +503,7 @@ static void hb_vfr_close( hb_filter_object_t * filter )
 
     if( pv->job )
     {
-        hb_interjob_t * interjob = hb_interjob_get( pv->job->h );
+        hb_interjob_t * interjob = pv->job->interjob;
 
         /* Preserve dropped frame count for more accurate
          * framerates in 2nd passes.
@@ -19,13 +19,31 @@
 typedef struct
 {
     hb_list_t * jobs;
-    hb_job_t  ** current_job;
     hb_error_code * error;
     volatile int * die;
+    int max_jobs;
 
+    // Job sequences running on threads of their own, see work_func()
+    hb_lock_t * lock;
+    hb_cond_t * cond;
+    hb_list_t * runners;
 } hb_work_t;
 
+// One job sequence (all passes of a queued job) running concurrently
+// with others.  It owns its title and the data carried between passes,
+// so it does not depend on the handle's title set or interjob.
+typedef struct
+{
+    hb_work_t     * work;
+    hb_list_t     * passes;
+    hb_title_t    * title;
+    hb_interjob_t   interjob;
+    hb_thread_t   * thread;
+    int             done;
+} work_runner_t;
+
 static void work_func();
+static void job_setup_interjob( hb_job_t * job );
 static void do_job( hb_job_t *);
 static void filter_loop( void * );
 
@@ -38,25 +56,43 @@ static void filter_loop( void * );
 #define FIFO_MINI 4
 #define FIFO_MINI_WAKE 3
 
+// Capacity limits of the raw video fifos, which the profiler adjusts
+// at run time within the job's fifo_budget (MiB, FIFO_BUDGET by default)
+#define FIFO_ADAPT_MIN 2
+#define FIFO_ADAPT_MAX 64
+#define FIFO_BUDGET 256
+
+// hb_work_loop takes up to WORK_BATCH_MAX input buffers smaller than
+// WORK_BATCH_SMALL from its fifo at once and holds back at most
+// WORK_BATCH_BYTES of output while processing them.
+#define WORK_BATCH_MAX   16
+#define WORK_BATCH_SMALL (16 * 1024)
+#define WORK_BATCH_BYTES (256 * 1024)
+
 /**
  * Allocates work object and launches work thread with work_func.
  * @param jobs Handle to hb_list_t.
  * @param die Handle to user inititated exit indicator.
  * @param error Handle to error indicator.
+ * @param max_jobs Number of jobs that may run at the same time.
  */
-hb_thread_t * hb_work_init( hb_list_t * jobs, volatile int * die, hb_error_code * error, hb_job_t ** job )
+hb_thread_t * hb_work_init( hb_list_t * jobs, volatile int * die,
+                            hb_error_code * error, int max_jobs )
 {
     hb_work_t * work = calloc( sizeof( hb_work_t ), 1 );
 
     work->jobs      = jobs;
-    work->current_job = job;
     work->die       = die;
     work->error     = error;
+    work->max_jobs  = MAX( max_jobs, 1 );
+    work->lock      = hb_lock_init();
+    work->cond      = hb_cond_init();
+    work->runners   = hb_list_init();
 
     return hb_thread_init( "work", work_func, work, HB_LOW_PRIORITY );
 }
 
-static void InitWorkState(hb_handle_t *h, int pass_id, int pass, int pass_count)
+static void InitWorkState(hb_job_t *job, int pass_id, int pass, int pass_count)
 {
     hb_state_t state;
 
@@ -73,12 +109,257 @@ static void InitWorkState(hb_handle_t *h, int pass_id, int pass, int pass_count)
     p.seconds    = -1;
 #undef p
 
-    hb_set_state( h, &state );
+    hb_set_job_state( job, &state );
 
 }
 
+/**
+ * Expands a queued job into the list of jobs for its passes.
+ * Returns NULL if the job can not be set up.
+ */
+static hb_list_t * setup_passes( hb_job_t * job )
+{
+    hb_list_t * passes = hb_list_init();
+
+    // JSON jobs get special treatment.  We want to perform the title
+    // scan for the JSON job automatically.  This requires that we delay
+    // filling the job struct till we have performed the title scan
+    // because the default values for the job come from the title.
+    if (job->json != NULL)
+    {
+        hb_deep_log(1, "json job:\n%s", job->json);
+
+        // Perform title scan for json job
+        hb_json_job_scan(job->h, job->json);
+
+        // Expand json string to full job struct
+        hb_job_t *new_job = hb_json_to_job(job->h, job->json);
+        if (new_job == NULL)
+        {
+            hb_job_close(&job);
+            hb_list_close(&passes);
+            return NULL;
+        }
+        new_job->h = job->h;
+        new_job->sequence_id = job->sequence_id;
+        hb_job_close(&job);
+        job = new_job;
+    }
+    hb_job_setup_passes(job->h, job, passes);
+    hb_job_close(&job);
+
+    return passes;
+}
+
+static void segment_thread( void * _job )
+{
+    hb_job_t         * job      = _job;
+    hb_handle_t      * h        = job->h;
+    hb_segment_set_t * segments = hb_segment_set_retain(job->segments);
+    int                segment  = job->segment;
+
+    do_job(job);
+    hb_job_finished(h, job);
+
+    // Release the stitching pass if it waits for this segment
+    hb_segment_set_ended(segments, segment);
+    hb_segment_set_close(&segments);
+}
+
+/**
+ * Runs the passes of one job sequence and frees them.  The segment
+ * passes of a split job are started on threads of their own, the
+ * stitching pass that follows them runs here.
+ */
+static void run_passes( hb_work_t * work, hb_list_t * passes,
+                        hb_interjob_t * interjob )
+{
+    hb_job_t * job;
+    hb_segment_set_t * segments = NULL;
+    hb_list_t * segment_threads = hb_list_init();
+    hb_thread_t * thread;
+    int pass_count, pass, cpus = -1;
+
+    pass_count = hb_list_count(passes);
+
+    // The pipeline threads of the passes are started from this thread
+    // or from segment threads started by it, so they inherit its CPU
+    // affinity and NUMA memory policy.  The tasks of their filters run
+    // on pool workers pinned to the same CPUs, see pool_current_set()
+    // in threadpool.c.
+    job = hb_list_item(passes, 0);
+    if (job != NULL && job->affinity != NULL)
+    {
+        cpus = hb_thread_set_affinity(job->affinity);
+        if (cpus < 0)
+        {
+            hb_log("work: invalid or unsupported affinity \"%s\", ignored",
+                   job->affinity);
+        }
+        else
+        {
+            hb_log("work: job runs on CPUs \"%s\" (%d CPUs)",
+                   job->affinity, cpus);
+            for (pass = 0; pass < pass_count; pass++)
+            {
+                job = hb_list_item(passes, pass);
+                if (job->thread_budget <= 0 || job->thread_budget > cpus)
+                {
+                    job->thread_budget = cpus;
+                }
+            }
+        }
+    }
+
+    for (pass = 0; pass < pass_count && !*work->die; pass++)
+    {
+        hb_handle_t * h;
+
+        job = hb_list_item(passes, pass);
+        job->die = work->die;
+        job->done_error = work->error;
+        job->interjob = interjob;
+        job_setup_interjob(job);
+        h = job->h;
+        hb_job_started(h, job);
+        InitWorkState(job, job->pass_id, pass + 1, pass_count);
+        if (job->segment > 0)
+        {
+            if (segments == NULL)
+            {
+                segments = hb_segment_set_retain(job->segments);
+            }
+            thread = hb_thread_init("segment", segment_thread, job,
+                                    HB_LOW_PRIORITY);
+            hb_list_add(segment_threads, thread);
+            continue;
+        }
+        do_job( job );
+        hb_job_finished(h, job);
+
+        // Once the stitching pass has ended, segments that are
+        // still running are of no use
+        hb_segment_set_cancel(segments);
+    }
+    // Clean up any incomplete jobs
+    for (; pass < pass_count; pass++)
+    {
+        job = hb_list_item(passes, pass);
+        hb_job_close(&job);
+    }
+    hb_segment_set_cancel(segments);
+    while ((thread = hb_list_item(segment_threads, 0)) != NULL)
+    {
+        hb_list_rem(segment_threads, thread);
+        hb_thread_close(&thread);
+    }
+    hb_list_close(&segment_threads);
+    hb_segment_set_close(&segments);
+    hb_frame_cache_close(&interjob->frame_cache);
+    if (cpus > 0)
+    {
+        hb_thread_set_affinity(NULL);
+    }
+}
+
+static void work_runner( void * _runner )
+{
+    work_runner_t * runner = _runner;
+    hb_work_t     * work   = runner->work;
+
+    run_passes(work, runner->passes, &runner->interjob);
+    hb_list_close(&runner->passes);
+    hb_subtitle_close(&runner->interjob.select_subtitle);
+    hb_title_close(&runner->title);
+
+    hb_lock(work->lock);
+    runner->done = 1;
+    hb_cond_broadcast(work->cond);
+    hb_unlock(work->lock);
+}
+
+/**
+ * Joins finished job sequences and waits until at most max_running
+ * are left.
+ */
+static void wait_runners( hb_work_t * work, int max_running )
+{
+    work_runner_t * runner;
+    int ii;
+
+    hb_lock(work->lock);
+    while (1)
+    {
+        for (ii = 0; ii < hb_list_count(work->runners); )
+        {
+            runner = hb_list_item(work->runners, ii);
+            if (runner->done)
+            {
+                hb_list_rem(work->runners, runner);
+                hb_unlock(work->lock);
+                hb_thread_close(&runner->thread);
+                free(runner);
+                hb_lock(work->lock);
+            }
+            else
+            {
+                ii++;
+            }
+        }
+        if (hb_list_count(work->runners) <= max_running)
+        {
+            break;
+        }
+        hb_cond_wait(work->cond, work->lock);
+    }
+    hb_unlock(work->lock);
+}
+
+/**
+ * Starts a job sequence on a thread of its own.  Its title is taken
+ * out of the handle's title set so that scans for the following jobs
+ * can not free it.
+ */
+static void launch_runner( hb_work_t * work, hb_list_t * passes )
+{
+    work_runner_t * runner = calloc(1, sizeof(work_runner_t));
+    hb_job_t      * job    = hb_list_item(passes, 0);
+    int             ii;
+
+    runner->work   = work;
+    runner->passes = passes;
+    if (job != NULL)
+    {
+        hb_handle_t * h = job->h;
+
+        runner->title = job->title;
+        hb_list_rem(hb_get_titles(h), runner->title);
+        hb_force_rescan(h);
+    }
+
+    // Without an explicit budget, running jobs share the CPUs
+    for (ii = 0; ii < hb_list_count(passes); ii++)
+    {
+        job = hb_list_item(passes, ii);
+        if (job->thread_budget <= 0)
+        {
+            job->thread_budget = MAX(1, hb_get_cpu_count() / work->max_jobs);
+        }
+    }
+
+    hb_lock(work->lock);
+    hb_list_add(work->runners, runner);
+    hb_unlock(work->lock);
+    runner->thread = hb_thread_init("work job", work_runner, runner,
+                                    HB_LOW_PRIORITY);
+}
+
 /**
  * Iterates through job list and calls do_job for each job.
+ * With max_jobs > 1, up to max_jobs JSON jobs run at the same time,
+ * each on a thread of its own.  Their title scans and setup still
+ * happen here one at a time.  Jobs added with hb_add() share the
+ * handle's title set and always run alone.
  * @param _work Handle work object.
  */
 static void work_func( void * _work )
@@ -87,68 +368,51 @@ static void work_func( void * _work )
     hb_job_t   * job;
 
     hb_log( "%d job(s) to process", hb_list_count( work->jobs ) );
+    if (work->max_jobs > 1)
+    {
+        hb_log( "work: running up to %d jobs concurrently", work->max_jobs );
+    }
 
     while( !*work->die && ( job = hb_list_item( work->jobs, 0 ) ) )
     {
         hb_handle_t * h = job->h;
+        hb_list_t * passes;
+        int concurrent = work->max_jobs > 1 && job->json != NULL;
 
-        hb_list_rem( work->jobs, job );
-        hb_list_t * passes = hb_list_init();
-
-        // JSON jobs get special treatment.  We want to perform the title
-        // scan for the JSON job automatically.  This requires that we delay
-        // filling the job struct till we have performed the title scan
-        // because the default values for the job come from the title.
-        if (job->json != NULL)
+        // Wait for a free slot before scanning the next source
+        wait_runners(work, concurrent ? work->max_jobs - 1 : 0);
+        if (*work->die)
         {
-            hb_deep_log(1, "json job:\n%s", job->json);
-
-            // Perform title scan for json job
-            hb_json_job_scan(job->h, job->json);
-
-            // Expand json string to full job struct
-            hb_job_t *new_job = hb_json_to_job(job->h, job->json);
-            if (new_job == NULL)
-            {
-                hb_job_close(&job);
-                hb_list_close(&passes);
-                *work->error = HB_ERROR_INIT;
-                *work->die = 1;
-                break;
-            }
-            new_job->h = job->h;
-            new_job->sequence_id = job->sequence_id;
-            hb_job_close(&job);
-            job = new_job;
+            break;
         }
-        hb_job_setup_passes(job->h, job, passes);
-        hb_job_close(&job);
 
-        int pass_count, pass;
-        pass_count = hb_list_count(passes);
-        for (pass = 0; pass < pass_count && !*work->die; pass++)
+        hb_list_rem( work->jobs, job );
+        passes = setup_passes(job);
+        if (passes == NULL)
         {
-            job = hb_list_item(passes, pass);
-            job->die = work->die;
-            job->done_error = work->error;
-            *(work->current_job) = job;
-            InitWorkState(job->h, job->pass_id, pass + 1, pass_count);
-            do_job( job );
-            *(work->current_job) = NULL;
+            *work->error = HB_ERROR_INIT;
+            *work->die = 1;
+            break;
         }
-        // Clean up any incomplete jobs
-        for (; pass < pass_count; pass++)
+
+        if (concurrent)
         {
-            job = hb_list_item(passes, pass);
-            hb_job_close(&job);
+            launch_runner(work, passes);
+            continue;
         }
+
+        run_passes(work, passes, hb_interjob_get(h));
         hb_list_close(&passes);
 
         // Force rescan of next source processed by this hb_handle_t
         // TODO: Fix this ugly hack!
         hb_force_rescan(h);
     }
+    wait_runners(work, 0);
 
+    hb_list_close(&work->runners);
+    hb_lock_close(&work->lock);
+    hb_cond_close(&work->cond);
     free( work );
 }
 
@@ -502,16 +766,29 @@ void hb_display_job_info(hb_job_t *job)
         else
         {
             hb_log( "     + bitrate: %d kbps, pass: %d", job->vbitrate, job->pass_id );
-            if(job->pass_id == HB_PASS_ENCODE_1ST && job->fastfirstpass == 1 &&
+            if(job->pass_id == HB_PASS_ENCODE_1ST && job->fastfirstpass >= 1 &&
                ((job->vcodec & HB_VCODEC_X264_MASK) ||
                 (job->vcodec & HB_VCODEC_X265_MASK)))
             {
-                hb_log( "     + fast first pass" );
+                hb_log( "     + %s first pass",
+                        job->fastfirstpass >= 2 ? "fastest" : "fast" );
                 if (job->vcodec & HB_VCODEC_X264_MASK)
                 {
                     hb_log( "     + options: ref=1:8x8dct=0:me=dia:trellis=0" );
                     hb_log( "                analyse=i4x4 (if originally enabled, else analyse=none)" );
-                    hb_log( "                subq=2 (if originally greater than 2, else subq unchanged)" );
+                    if (job->fastfirstpass >= 2)
+                    {
+                        hb_log( "                subq=1:b-adapt=1 (if originally 2, else b-adapt unchanged)" );
+                        hb_log( "                fast-pskip=1:mixed-refs=0:psy-rd=0,0:merange=16" );
+                    }
+                    else
+                    {
+                        hb_log( "                subq=2 (if originally greater than 2, else subq unchanged)" );
+                    }
+                }
+                else if (job->fastfirstpass >= 2)
+                {
+                    hb_log( "     + options: rd=1:b-intra=0:early-skip=1" );
                 }
             }
         }
@@ -691,6 +968,22 @@ void correct_framerate( hb_interjob_t * interjob, hb_job_t * job )
     }
 }
 
+// Whether this pass does the Foreign Audio Search, see hb_add_internal()
+static int job_searches_subtitles( hb_job_t * job )
+{
+    int i;
+
+    for (i = 0; i < hb_list_count(job->list_subtitle); i++)
+    {
+        hb_subtitle_t * subtitle = hb_list_item(job->list_subtitle, i);
+        if (subtitle->search)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 static void analyze_subtitle_scan( hb_job_t * job )
 {
     hb_subtitle_t *subtitle;
@@ -703,10 +996,15 @@ static void analyze_subtitle_scan( hb_job_t * job )
     int i;
 
     // Before closing the title print out our subtitle stats if we need to
-    // find the highest and lowest.
+    // find the highest and lowest.  When the search is done by an encode
+    // pass only the candidates count.
     for (i = 0; i < hb_list_count(job->list_subtitle); i++)
     {
         subtitle = hb_list_item(job->list_subtitle, i);
+        if (!job->indepth_scan && !subtitle->search)
+        {
+            continue;
+        }
 
         hb_log("Subtitle track %d (id 0x%x) '%s': %d hits (%d forced)",
                subtitle->track, subtitle->id, subtitle->lang,
@@ -763,11 +1061,13 @@ static void analyze_subtitle_scan( hb_job_t * job )
     for (i = 0; i < hb_list_count( job->list_subtitle ); i++)
     {
         subtitle = hb_list_item( job->list_subtitle, i );
-        if (subtitle->id == subtitle_hit)
+        if (subtitle->id == subtitle_hit &&
+            (job->indepth_scan || subtitle->search))
         {
-            hb_interjob_t *interjob = hb_interjob_get(job->h);
+            hb_interjob_t *interjob = job->interjob;
 
             subtitle->config = job->select_subtitle_config;
+            subtitle->search = 0;
             // Remove from list since we are taking ownership
             // of the subtitle.
             hb_list_rem(job->list_subtitle, subtitle);
@@ -777,17 +1077,31 @@ static void analyze_subtitle_scan( hb_job_t * job )
     }
 }
 
-static int sanitize_subtitles( hb_job_t * job )
+/*
+ * Resets the interjob data when 'job' starts a new sequence and adds the
+ * subtitle found by the subtitle scan pass to the job's subtitle list.
+ * Called by run_passes() before the pass starts, the segment passes of a
+ * split job run at the same time and must not touch the interjob.
+ */
+static void job_setup_interjob( hb_job_t * job )
 {
     int             i;
-    uint8_t         one_burned = 0;
-    hb_interjob_t * interjob = hb_interjob_get(job->h);
+    hb_interjob_t * interjob = job->interjob;
     hb_subtitle_t * subtitle;
 
+    if (job->sequence_id != interjob->sequence_id)
+    {
+        // New job sequence, clear interjob
+        hb_subtitle_close(&interjob->select_subtitle);
+        hb_frame_cache_close(&interjob->frame_cache);
+        memset(interjob, 0, sizeof(*interjob));
+        interjob->sequence_id = job->sequence_id;
+    }
+
     if (job->indepth_scan)
     {
         // Subtitles are set by hb_add() during subtitle scan
-        return 0;
+        return;
     }
 
     /* Look for the scanned subtitle in the existing subtitle list
@@ -834,10 +1148,12 @@ static int sanitize_subtitles( hb_job_t * job )
          * first burned subtitle (explicitly or after sanitizing) - which should
          * ensure that it doesn't get dropped. */
         interjob->select_subtitle->out_track = 1;
-        if (job->pass_id == HB_PASS_ENCODE ||
-            job->pass_id == HB_PASS_ENCODE_2ND)
+        if ((job->pass_id == HB_PASS_ENCODE ||
+             job->pass_id == HB_PASS_ENCODE_2ND) && job->segments == NULL)
         {
-            // final pass, interjob->select_subtitle is no longer needed
+            // final pass, interjob->select_subtitle is no longer needed.
+            // The passes of a split job run at the same time, they
+            // all take a copy.
             hb_list_insert(job->list_subtitle, 0, interjob->select_subtitle);
             interjob->select_subtitle = NULL;
         }
@@ -847,10 +1163,29 @@ static int sanitize_subtitles( hb_job_t * job )
             hb_list_insert(job->list_subtitle, 0, hb_subtitle_copy(interjob->select_subtitle));
         }
     }
+}
+
+static int sanitize_subtitles( hb_job_t * job )
+{
+    int             i;
+    uint8_t         one_burned = 0;
+    hb_subtitle_t * subtitle;
+
+    if (job->indepth_scan)
+    {
+        // Subtitles are set by hb_add() during subtitle scan
+        return 0;
+    }
 
     for (i = 0; i < hb_list_count(job->list_subtitle);)
     {
         subtitle = hb_list_item(job->list_subtitle, i);
+        if (subtitle->search)
+        {
+            // Search candidate, never output
+            subtitle->out_track = ++i;
+            continue;
+        }
         if (subtitle->config.dest == RENDERSUB)
         {
             if (one_burned)
@@ -1339,6 +1674,358 @@ static void sanitize_filter_list(hb_list_t *list)
     hb_avfilter_combine(list);
 }
 
+/**
+ * Releases all threads of the job that are blocked on one of its fifos
+ * or in hb_work_wait().  Must be called after job->done or *job->die has
+ * been set so that the released threads exit instead of waiting again.
+ */
+static void job_wake_threads( hb_job_t * job )
+{
+    int i;
+
+    hb_fifo_shutdown( job->fifo_mpeg2 );
+    hb_fifo_shutdown( job->fifo_raw );
+    hb_fifo_shutdown( job->fifo_sync );
+    hb_fifo_shutdown( job->fifo_render );
+    hb_fifo_shutdown( job->fifo_mpeg4 );
+
+    for (i = 0; i < hb_list_count( job->list_audio ); i++)
+    {
+        hb_audio_t * audio = hb_list_item( job->list_audio, i );
+        hb_fifo_shutdown( audio->priv.fifo_in );
+        hb_fifo_shutdown( audio->priv.fifo_raw );
+        hb_fifo_shutdown( audio->priv.fifo_sync );
+        hb_fifo_shutdown( audio->priv.fifo_out );
+    }
+    for (i = 0; i < hb_list_count( job->list_subtitle ); i++)
+    {
+        hb_subtitle_t * subtitle = hb_list_item( job->list_subtitle, i );
+        if (subtitle != NULL)
+        {
+            hb_fifo_shutdown( subtitle->fifo_in );
+            hb_fifo_shutdown( subtitle->fifo_raw );
+            hb_fifo_shutdown( subtitle->fifo_out );
+        }
+    }
+    for (i = 0; i < hb_list_count( job->list_work ); i++)
+    {
+        hb_work_object_t * w = hb_list_item( job->list_work, i );
+        hb_fifo_shutdown( w->fifo_in );
+        hb_fifo_shutdown( w->fifo_out );
+    }
+    if (job->list_filter)
+    {
+        for (i = 0; i < hb_list_count( job->list_filter ); i++)
+        {
+            hb_filter_object_t * filter = hb_list_item( job->list_filter, i );
+            hb_fifo_shutdown( filter->fifo_in );
+            hb_fifo_shutdown( filter->fifo_out );
+        }
+    }
+    hb_work_signal( job->h );
+}
+
+static void job_adapt_fifo( hb_job_t * job, const char * name,
+                            hb_fifo_t * fifo, int64_t capacity )
+{
+    if (fifo == NULL)
+    {
+        return;
+    }
+    capacity = MAX(FIFO_ADAPT_MIN, MIN(capacity, hb_fifo_capacity(fifo)));
+    hb_fifo_set_capacity(fifo, capacity);
+    hb_profile_adapt_fifo(job->profile, name, fifo,
+                          FIFO_ADAPT_MIN, FIFO_ADAPT_MAX);
+}
+
+/**
+ * Hands the fifos that carry raw video to the profiler, which adjusts
+ * their capacities to the measured behavior of the stages they connect
+ * while keeping the memory they may hold within job->fifo_budget.
+ * Their initial capacities are the usual ones, reduced so that frames
+ * of the job's size fit in the budget.
+ */
+static void job_setup_adaptive_fifos( hb_job_t * job )
+{
+    hb_title_t * title = job->title;
+    int64_t      budget, frame_size, capacity;
+    int          i, count;
+
+    budget = (int64_t)(job->fifo_budget > 0 ? job->fifo_budget :
+                                              FIFO_BUDGET) << 20;
+    frame_size = (int64_t)MAX(title->geometry.width * title->geometry.height,
+                              job->width * job->height) * 3 / 2;
+    count = 2 + hb_list_count(job->list_filter);
+    capacity = budget / count / MAX(1, frame_size);
+
+    hb_log("work: raw video fifos hold up to %d MiB", (int)(budget >> 20));
+
+    hb_profile_set_fifo_budget(job->profile, budget);
+    job_adapt_fifo(job, "decoder", job->fifo_raw, capacity);
+    job_adapt_fifo(job, "sync", job->fifo_sync, capacity);
+    if (job->list_filter && !job->indepth_scan)
+    {
+        for (i = 0; i < hb_list_count(job->list_filter); i++)
+        {
+            hb_filter_object_t * filter = hb_list_item(job->list_filter, i);
+            job_adapt_fifo(job, filter->name, filter->fifo_out, capacity);
+        }
+    }
+}
+
+/**
+ * Switches the fifos that connect exactly one producer thread to exactly
+ * one consumer thread to the lock-free ring implementation.
+ * Fifos written by sync are left locked since any of the sync threads
+ * may output buffers for any stream, as are the subtitle fifos which
+ * also receive buffers from the video decoder (closed captions) and
+ * the reader (eof).
+ */
+static void job_setup_spsc_fifos( hb_job_t * job )
+{
+    int i;
+
+    // reader -> video decoder -> sync
+    hb_fifo_set_spsc( job->fifo_mpeg2 );
+    hb_fifo_set_spsc( job->fifo_raw );
+
+    // filter -> filter ... -> video encoder -> muxer
+    if (job->list_filter)
+    {
+        for (i = 0; i < hb_list_count( job->list_filter ); i++)
+        {
+            hb_filter_object_t * filter = hb_list_item( job->list_filter, i );
+            hb_fifo_set_spsc( filter->fifo_out );
+        }
+    }
+    hb_fifo_set_spsc( job->fifo_mpeg4 );
+
+    for (i = 0; i < hb_list_count( job->list_audio ); i++)
+    {
+        hb_audio_t * audio = hb_list_item( job->list_audio, i );
+
+        // reader -> audio decoder -> sync
+        hb_fifo_set_spsc( audio->priv.fifo_in );
+        hb_fifo_set_spsc( audio->priv.fifo_raw );
+        if (!(audio->config.out.codec & HB_ACODEC_PASS_FLAG))
+        {
+            // audio encoder -> muxer
+            hb_fifo_set_spsc( audio->priv.fifo_out );
+        }
+    }
+}
+
+/*
+ * Rough relative per-frame CPU cost of the stages, used to divide
+ * the job's thread budget.  Filters that are not internally threaded
+ * get no share, they run on their own filter thread only.
+ */
+static int filter_thread_weight( int filter_id )
+{
+    switch (filter_id)
+    {
+        case HB_FILTER_NLMEANS:
+            return 8;
+        case HB_FILTER_DECOMB:
+        case HB_FILTER_DEBLOCK:
+            return 3;
+        case HB_FILTER_COMB_DETECT:
+        case HB_FILTER_DENOISE:
+        case HB_FILTER_UNSHARP:
+        case HB_FILTER_LAPSHARP:
+            return 2;
+        case HB_FILTER_GRAYSCALE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int encoder_thread_weight( int vcodec )
+{
+    if (vcodec & HB_VCODEC_X265_MASK)
+        return 16;
+    if (vcodec & HB_VCODEC_X264_MASK)
+        return 8;
+    if (vcodec & HB_VCODEC_QSV_MASK)
+        return 1;
+    if (vcodec == HB_VCODEC_FFMPEG_VP8 || vcodec == HB_VCODEC_FFMPEG_VP9)
+        return 6;
+    return 2;
+}
+
+/**
+ * Divides job->thread_budget between the video decoder, each threaded
+ * filter and the video encoder in proportion to their estimated cost.
+ * Every stage gets at least one thread, the encoder gets what is left.
+ * When the minimums take the total over the budget, the stages with the
+ * most threads give up the excess.  With more stages than threads in
+ * the budget each stage still gets one thread, so the budget is
+ * exceeded.  Must run before the filters are initialized.
+ */
+static void job_setup_threads( hb_job_t * job )
+{
+    hb_title_t * title = job->title;
+    int          i, budget, weight, decode_weight, used;
+
+    job->threads_decode = 0;
+    job->threads_encode = 0;
+    for (i = 0; i < hb_list_count( job->list_filter ); i++)
+    {
+        hb_filter_object_t * filter = hb_list_item( job->list_filter, i );
+        filter->thread_count = 0;
+    }
+    if (job->thread_budget <= 0)
+    {
+        return;
+    }
+
+    budget        = job->thread_budget;
+    decode_weight = title->geometry.width * title->geometry.height >
+                    1920 * 1088 ? 4 : 2;
+    weight        = decode_weight + encoder_thread_weight( job->vcodec );
+    for (i = 0; i < hb_list_count( job->list_filter ); i++)
+    {
+        hb_filter_object_t * filter = hb_list_item( job->list_filter, i );
+        weight += filter_thread_weight( filter->id );
+    }
+
+    job->threads_decode = MAX( 1, budget * decode_weight / weight );
+    used = job->threads_decode;
+
+    for (i = 0; i < hb_list_count( job->list_filter ); i++)
+    {
+        hb_filter_object_t * filter = hb_list_item( job->list_filter, i );
+        int                  w      = filter_thread_weight( filter->id );
+
+        if (w > 0)
+        {
+            filter->thread_count = MAX( 1, budget * w / weight );
+            used += filter->thread_count;
+        }
+    }
+
+    job->threads_encode = MAX( 1, budget - used );
+    used += job->threads_encode;
+
+    // Take the threads given by the minimums from the largest stages
+    while (used > budget)
+    {
+        int * largest = &job->threads_decode;
+
+        for (i = 0; i < hb_list_count( job->list_filter ); i++)
+        {
+            hb_filter_object_t * filter = hb_list_item( job->list_filter, i );
+
+            if (filter->thread_count > *largest)
+            {
+                largest = &filter->thread_count;
+            }
+        }
+        if (*largest <= 1)
+        {
+            break;
+        }
+        (*largest)--;
+        used--;
+    }
+
+    hb_log( "job thread budget: %d threads", budget );
+    if (used > budget)
+    {
+        hb_log( "     more threaded stages than threads, using %d", used );
+    }
+    hb_log( "     + decoder: %d", job->threads_decode );
+    for (i = 0; i < hb_list_count( job->list_filter ); i++)
+    {
+        hb_filter_object_t * filter = hb_list_item( job->list_filter, i );
+
+        if (filter->thread_count > 0)
+        {
+            hb_log( "     + %s: %d", filter->name, filter->thread_count );
+        }
+    }
+    hb_log( "     + encoder: %d", job->threads_encode );
+}
+
+/*
+ * The job is finished when the last work object (normally the muxer)
+ * stops or when the job is done or cancelled.  Work threads signal the
+ * handle when they exit, hb_stop() signals it when cancelling.
+ */
+static int job_finished( void * opaque )
+{
+    hb_work_object_t * w = opaque;
+
+    return *w->done || *w->die || w->status == HB_WORK_DONE;
+}
+
+/*
+ * Predict the frames the vfr filter will drop when it reduces the frame
+ * rate, so that the video decoder can skip them (and avoid decoding
+ * them at all if they are not reference frames) and the filters before
+ * vfr never see them.  A source frame is kept if an output frame
+ * interval starts within half a source frame of its start, see
+ * decavcodec.c.  The vfr filter still produces the exact output rate,
+ * it just has fewer frames left to drop.
+ *
+ * The prediction only holds when the source frames really arrive on the
+ * grid of the title's frame rate, so it is opt-in (job->decode_skip) and
+ * limited to reductions by a whole number, where vfr keeps every n-th
+ * frame.  For other ratios (e.g. inverse telecine 29.97 -> 23.976) the
+ * vfr filter drops the frames that repeat the previous one, which a
+ * fixed pattern would not.  Detelecine and deinterlace filters look at
+ * neighbouring frames and come before vfr.
+ */
+static void job_setup_frame_skip( hb_job_t * job )
+{
+    hb_title_t * title = job->title;
+    double       in_duration, out_duration, ratio;
+
+    job->skip_in_duration  = 0;
+    job->skip_out_duration = 0;
+    if (!job->decode_skip || job->cfr == 0 || job->indepth_scan ||
+        title->vrate.num <= 0 || title->vrate.den <= 0 ||
+        job->vrate.num <= 0 || job->vrate.den <= 0 ||
+        hb_filter_find(job->list_filter, HB_FILTER_DETELECINE) != NULL ||
+        hb_filter_find(job->list_filter, HB_FILTER_DECOMB) != NULL ||
+        hb_filter_find(job->list_filter, HB_FILTER_DEINTERLACE) != NULL)
+    {
+        return;
+    }
+
+    in_duration  = 90000. * title->vrate.den / title->vrate.num;
+    out_duration = 90000. * job->vrate.den / job->vrate.num;
+    ratio        = out_duration / in_duration;
+    if (ratio < 1.5 || fabs(ratio - floor(ratio + .5)) > 0.001)
+    {
+        hb_log("work: decoder frame skip needs a reduction of the frame "
+               "rate by a whole number, not %.6g -> %.6g fps",
+               90000. / in_duration, 90000. / out_duration);
+        return;
+    }
+    job->skip_in_duration  = in_duration;
+    job->skip_out_duration = out_duration;
+    hb_log("work: decoder skips frames for %.6g -> %.6g fps",
+           90000. / in_duration, 90000. / out_duration);
+}
+
+/*
+ * Closes the filters of a job whose pictures do not come from them.
+ * Their initialization has already set up the job's output geometry.
+ */
+static void job_drop_filters( hb_job_t * job )
+{
+    hb_filter_object_t * filter;
+
+    while ((filter = hb_list_item(job->list_filter, 0)) != NULL)
+    {
+        hb_list_rem(job->list_filter, filter);
+        filter->close(filter);
+        hb_filter_close(&filter);
+    }
+}
+
 /**
  * Job initialization rountine.
  *
@@ -1358,21 +2045,18 @@ static void do_job(hb_job_t *job)
     hb_work_object_t * w;
     hb_audio_t       * audio;
     hb_subtitle_t    * subtitle;
+    int                from_cache = 0;
 
     title = job->title;
 
-    interjob = hb_interjob_get(job->h);
-    if (job->sequence_id != interjob->sequence_id)
-    {
-        // New job sequence, clear interjob
-        hb_subtitle_close(&interjob->select_subtitle);
-        memset(interjob, 0, sizeof(*interjob));
-        interjob->sequence_id = job->sequence_id;
-    }
+    // The interjob was set up for this pass by job_setup_interjob()
+    interjob = job->interjob;
 
     job->list_work = hb_list_init();
-    w = hb_get_work(job->h, WORK_READER);
-    hb_list_add(job->list_work, w);
+    job->profile   = hb_profile_init();
+    job->spill     = hb_spill_init(job);
+    hb_buffer_pool_retain();
+    hb_trace_start();
 
     hb_log( "starting job" );
 
@@ -1403,6 +2087,7 @@ static void do_job(hb_job_t *job)
         hb_filter_init_t init;
 
         sanitize_filter_list(job->list_filter);
+        job_setup_threads(job);
 
         memset(&init, 0, sizeof(init));
         init.job = job;
@@ -1436,6 +2121,7 @@ static void do_job(hb_job_t *job)
         job->vrate = init.vrate;
         job->cfr = init.cfr;
         job->grayscale = init.grayscale;
+        job_setup_frame_skip(job);
 
         // Perform filter post_init which informs filters of final
         // job configuration. e.g. rendersub filter needs to know the
@@ -1453,9 +2139,17 @@ static void do_job(hb_job_t *job)
             }
             i++;
         }
+
+        // The stitching pass of a split job discards its video, the
+        // filters were only needed to work out the output geometry
+        if (job->segments != NULL && job->segment == 0)
+        {
+            job_drop_filters(job);
+        }
     }
     else
     {
+        job_setup_threads(job);
         job->width = title->geometry.width;
         job->height = title->geometry.height;
         job->par = title->geometry.par;
@@ -1516,6 +2210,40 @@ static void do_job(hb_job_t *job)
         goto cleanup;
     }
 
+    // The first pass of a two-pass encode can store its pictures and
+    // packets for the second, see framecache.c.  The second pass then
+    // needs neither the source nor the filters.
+    if (job->pass_id == HB_PASS_ENCODE_2ND &&
+        hb_frame_cache_usable(interjob->frame_cache, job))
+    {
+        hb_log("work: taking the second pass input from the frame cache");
+        from_cache = 1;
+        job_drop_filters(job);
+    }
+    else if (job->pass_id == HB_PASS_ENCODE_1ST &&
+             job->frame_cache_budget > 0 && job->segments == NULL)
+    {
+        hb_frame_cache_close(&interjob->frame_cache);
+        // The search candidates of this pass are not subtitles of the
+        // second, and the track it selects is not in the cache, so the
+        // second pass could never take its input from the cache
+        if (job_searches_subtitles(job))
+        {
+            hb_log("work: no frame cache, the Foreign Audio Search of this"
+                   " pass changes the subtitles of the second");
+        }
+        else
+        {
+            interjob->frame_cache = hb_frame_cache_init(job);
+        }
+    }
+
+    if (!from_cache)
+    {
+        w = hb_get_work(job->h, WORK_READER);
+        hb_list_add(job->list_work, w);
+    }
+
     if (!job->indepth_scan)
     {
         // Set up audio decoder work objects
@@ -1524,6 +2252,16 @@ static void do_job(hb_job_t *job)
         {
             audio = hb_list_item(job->list_audio, i);
 
+            if (from_cache)
+            {
+                audio->priv.fifo_out = hb_fifo_init(FIFO_LARGE, FIFO_LARGE_WAKE);
+                w = hb_get_work(job->h, WORK_CACHE_READ);
+                w->fifo_out = audio->priv.fifo_out;
+                w->audio    = audio;
+                hb_list_add(job->list_work, w);
+                continue;
+            }
+
             /* set up the audio work fifos */
             audio->priv.fifo_in   = hb_fifo_init(FIFO_LARGE, FIFO_LARGE_WAKE);
             audio->priv.fifo_raw  = hb_fifo_init(FIFO_SMALL, FIFO_SMALL_WAKE);
@@ -1553,6 +2291,19 @@ static void do_job(hb_job_t *job)
     for (i = 0; i < hb_list_count( job->list_subtitle ); i++)
     {
         subtitle = hb_list_item( job->list_subtitle, i );
+        if (from_cache)
+        {
+            // Only the tracks that are muxed were cached
+            if (subtitle->config.dest == PASSTHRUSUB)
+            {
+                subtitle->fifo_out = hb_fifo_init(FIFO_SMALL, FIFO_SMALL_WAKE);
+                w = hb_get_work(job->h, WORK_CACHE_READ);
+                w->fifo_out = subtitle->fifo_out;
+                w->subtitle = subtitle;
+                hb_list_add(job->list_work, w);
+            }
+            continue;
+        }
         w = hb_get_work( job->h, subtitle->codec );
         // Must set capacity of the raw-FIFO to be set >= the maximum
         // number of subtitle lines that could be decoded prior to a
@@ -1569,6 +2320,8 @@ static void do_job(hb_job_t *job)
         // Since that number is unbounded, the FIFO must be made
         // (effectively) unbounded in capacity.
         subtitle->fifo_raw  = hb_fifo_init( FIFO_UNBOUNDED, FIFO_UNBOUNDED_WAKE );
+        // Keep what it holds within job->memory_limit
+        hb_fifo_set_spill(subtitle->fifo_raw, job->spill);
         if (w->id != WORK_DECSRTSUB)
         {
             // decsrtsub is a buffer source like reader.  It's input comes
@@ -1587,21 +2340,33 @@ static void do_job(hb_job_t *job)
         hb_list_add( job->list_work, w );
     }
 
-    // Video decoder
-    w = hb_video_decoder(job->h, title->video_codec, title->video_codec_param);
-    if (w == NULL)
+    if (from_cache)
     {
-        *job->done_error = HB_ERROR_WRONG_INPUT;
-        *job->die = 1;
-        goto cleanup;
+        w = hb_get_work(job->h, WORK_CACHE_READ);
+        job->fifo_render = hb_fifo_init(FIFO_MINI, FIFO_MINI_WAKE);
+        job->frame_cache = interjob->frame_cache;
+        w->fifo_out = job->fifo_render;
+        hb_list_add(job->list_work, w);
     }
-    w->fifo_in  = job->fifo_mpeg2;
-    w->fifo_out = job->fifo_raw;
-    hb_list_add(job->list_work, w);
+    else
+    {
+        // Video decoder
+        w = hb_video_decoder(job->h, title->video_codec,
+                             title->video_codec_param);
+        if (w == NULL)
+        {
+            *job->done_error = HB_ERROR_WRONG_INPUT;
+            *job->die = 1;
+            goto cleanup;
+        }
+        w->fifo_in  = job->fifo_mpeg2;
+        w->fifo_out = job->fifo_raw;
+        hb_list_add(job->list_work, w);
 
-    // Synchronization
-    w = hb_get_work(job->h, WORK_SYNC_VIDEO);
-    hb_list_add(job->list_work, w);
+        // Synchronization
+        w = hb_get_work(job->h, WORK_SYNC_VIDEO);
+        hb_list_add(job->list_work, w);
+    }
 
     if (!job->indepth_scan)
     {
@@ -1612,7 +2377,8 @@ static void do_job(hb_job_t *job)
             /*
             * Audio Encoder Thread
             */
-            if ( !(audio->config.out.codec & HB_ACODEC_PASS_FLAG ) )
+            if (!from_cache &&
+                !(audio->config.out.codec & HB_ACODEC_PASS_FLAG))
             {
                 /*
                 * Add the encoder thread if not doing pass through
@@ -1636,7 +2402,11 @@ static void do_job(hb_job_t *job)
         }
 
         /* Set up the video filter fifo pipeline */
-        if ( job->list_filter )
+        if (from_cache)
+        {
+            // The cache reader feeds the encoder
+        }
+        else if ( job->list_filter )
         {
             hb_fifo_t * fifo_in = job->fifo_sync;
             for (i = 0; i < hb_list_count(job->list_filter); i++)
@@ -1654,8 +2424,28 @@ static void do_job(hb_job_t *job)
             job->fifo_render = NULL;
         }
 
-        // Video encoder
-        w = hb_video_encoder(job->h, job->vcodec);
+        // The first pass stores the filtered pictures for the second
+        if (!from_cache && interjob->frame_cache != NULL &&
+            job->pass_id == HB_PASS_ENCODE_1ST && job->fifo_render != NULL)
+        {
+            w = hb_get_work(job->h, WORK_CACHE_WRITE);
+            w->fifo_in       = job->fifo_render;
+            w->fifo_out      = hb_fifo_init(FIFO_MINI, FIFO_MINI_WAKE);
+            job->fifo_render = w->fifo_out;
+            job->frame_cache = interjob->frame_cache;
+            hb_list_add(job->list_work, w);
+        }
+
+        // Video encoder, the stitching pass of a split job takes
+        // the encoded video from its segments
+        if (job->segments != NULL && job->segment == 0)
+        {
+            w = hb_get_work(job->h, WORK_STITCH);
+        }
+        else
+        {
+            w = hb_video_encoder(job->h, job->vcodec);
+        }
         if (w == NULL)
         {
             *job->done_error = HB_ERROR_INIT;
@@ -1695,12 +2485,33 @@ static void do_job(hb_job_t *job)
     /* Display settings */
     hb_display_job_info( job );
 
+    job_setup_adaptive_fifos( job );
+    job_setup_spsc_fifos( job );
+
+    // Register the pipeline stages with the profiler.  Work objects
+    // that run threads of their own (sync, mux) add those in init.
+    for (i = 0; i < hb_list_count( job->list_work ); i++)
+    {
+        w = hb_list_item( job->list_work, i );
+        w->stats = hb_profile_add(job->profile, w->name, "work", w->fifo_in);
+    }
+    if (job->list_filter && !job->indepth_scan)
+    {
+        for (i = 0; i < hb_list_count(job->list_filter); i++)
+        {
+            hb_filter_object_t * filter = hb_list_item(job->list_filter, i);
+            filter->stats = hb_profile_add(job->profile, filter->name,
+                                           "filter", filter->fifo_in);
+        }
+    }
+
     // Initialize all work objects
     job->done = 0;
     for (i = 0; i < hb_list_count( job->list_work ); i++)
     {
         w = hb_list_item( job->list_work, i );
         w->done = &job->done;
+        w->die  = job->die;
         if (w->init( w, job ))
         {
             hb_error( "Failure to initialise thread '%s'", w->name );
@@ -1728,24 +2539,33 @@ static void do_job(hb_job_t *job)
                                              HB_LOW_PRIORITY );
         }
     }
+    hb_profile_start(job->profile);
 
     // Wait for the thread of the last work object to complete
     // Note that other threads may still be running even though the
     // last thread has exited. So we must be careful with the sequence
     // of closing threads below.
     w = hb_list_item(job->list_work, hb_list_count(job->list_work) - 1);
-    w->die = job->die;
+    hb_work_wait(job->h, job_finished, w);
+
+    // Pipeline threads block on their fifos without timeouts.
+    // Release the ones that are still waiting so that they can exit.
+    job->done = 1;
+    job_wake_threads(job);
     hb_thread_close(&w->thread);
 
-    hb_handle_t * h = job->h;
     hb_state_t state;
-    hb_get_state2( h, &state );
+    hb_get_job_state( job, &state );
 
     hb_log("work: average encoding speed for job is %f fps",
            state.param.working.rate_avg);
 
 cleanup:
     job->done = 1;
+    job_wake_threads(job);
+
+    // The sampler reads the fifos, stop it before they go away
+    hb_profile_stop(job->profile);
 
     // Close render filter pipeline
     if (job->list_filter)
@@ -1786,6 +2606,11 @@ cleanup:
     hb_fifo_close( &job->fifo_raw );
     hb_fifo_close( &job->fifo_sync );
     hb_fifo_close( &job->fifo_mpeg4 );
+    if (job->frame_cache != NULL)
+    {
+        // Created for the frame cache stage, not by the filter chain
+        hb_fifo_close( &job->fifo_render );
+    }
 
     for (i = 0; i < hb_list_count( job->list_subtitle ); i++)
     {
@@ -1823,8 +2648,36 @@ cleanup:
     {
         analyze_subtitle_scan(job);
     }
+    else if (job->pass_id == HB_PASS_ENCODE_1ST && !*job->die)
+    {
+        if (job->frame_cache != NULL)
+        {
+            hb_frame_cache_finish(job->frame_cache, job);
+        }
 
-    hb_buffer_pool_free();
+        if (job_searches_subtitles(job))
+        {
+            analyze_subtitle_scan(job);
+        }
+    }
+
+    if (job->pass_id == HB_PASS_ENCODE_2ND)
+    {
+        hb_frame_cache_close(&interjob->frame_cache);
+    }
+
+    // All stage threads have exited, including those owned by sync
+    // and mux, so the statistics are final.
+    if (job->profile != NULL)
+    {
+        hb_set_profile(job->h, hb_profile_report(job->profile));
+        hb_profile_close(&job->profile);
+    }
+    hb_trace_stop();
+
+    // Buffers that are still queued keep the store until they are closed
+    hb_spill_close(&job->spill);
+    hb_buffer_pool_release();
 
     hb_job_close(&job);
 }
@@ -1854,16 +2707,44 @@ void hb_work_loop( void * _w )
 {
     hb_work_object_t * w = _w;
     hb_buffer_t      * buf_in = NULL, * buf_out = NULL;
+    hb_buffer_list_t   list_in, list_out;
+    hb_stage_stats_t   local_stats, * stats = w->stats;
+    uint64_t           t0, wait_out, trace;
 
+    // Unprofiled stages keep their statistics on the stack
+    if (stats == NULL)
+    {
+        memset(&local_stats, 0, sizeof(local_stats));
+        stats = &local_stats;
+    }
+    stats->start = hb_get_time_us();
+    hb_atomic_store(&stats->thread_id, hb_thread_self_id());
+    hb_trace_thread_name(w->name);
+
+    hb_buffer_list_clear(&list_in);
+    hb_buffer_list_clear(&list_out);
     while ((w->die == NULL || !*w->die) && !*w->done &&
            w->status != HB_WORK_DONE)
     {
         // fifo_in == NULL means this is a data source (e.g. reader)
         if (w->fifo_in != NULL)
         {
-            buf_in = hb_fifo_get_wait( w->fifo_in );
-            if ( buf_in == NULL )
-                continue;
+            buf_in = hb_buffer_list_rem_head(&list_in);
+            if (buf_in == NULL)
+            {
+                t0 = hb_get_time_us();
+                buf_in = hb_fifo_get_wait( w->fifo_in );
+                stats->wait_in += hb_get_time_us() - t0;
+                if ( buf_in == NULL )
+                    continue;
+                // Small packets (audio, subtitles) are fed to the work
+                // function in batches of everything that is ready, taken
+                // from the fifo with one operation.
+                if (buf_in->size < WORK_BATCH_SMALL)
+                {
+                    hb_fifo_get_list(w->fifo_in, &list_in, WORK_BATCH_MAX - 1);
+                }
+            }
             if ( *w->done )
             {
                 if( buf_in )
@@ -1873,10 +2754,23 @@ void hb_work_loop( void * _w )
                 break;
             }
         }
+        if (buf_in != NULL)
+        {
+            stats->buffers++;
+            stats->bytes += buf_in->size;
+        }
+
         // Invalidate buf_out so that if there is no output
         // we don't try to pass along junk.
         buf_out = NULL;
+        // Sources (e.g. reader) block on their output inside work()
+        // and charge that to wait_out themselves.
+        wait_out = stats->wait_out;
+        t0 = hb_get_time_us();
+        trace = hb_trace_begin();
         w->status = w->work( w, &buf_in, &buf_out );
+        hb_trace_end(w->name, trace);
+        stats->work += hb_get_time_us() - t0 - (stats->wait_out - wait_out);
 
         copy_chapter( buf_out, buf_in );
 
@@ -1888,35 +2782,43 @@ void hb_work_loop( void * _w )
         {
             hb_buffer_close( &buf_out );
         }
-        if( buf_out )
+        hb_buffer_list_append(&list_out, buf_out);
+        buf_out = NULL;
+
+        // Pass the output of a batch downstream in one fifo operation.
+        // Large buffers (e.g. video frames) are not held back.
+        if (hb_buffer_list_count(&list_out) > 0 &&
+            (hb_buffer_list_count(&list_in) == 0 ||
+             hb_buffer_list_size(&list_out) >= WORK_BATCH_BYTES ||
+             w->status == HB_WORK_DONE))
         {
+            t0 = hb_get_time_us();
+            trace = hb_trace_begin();
             while ( !*w->done )
             {
                 if ( hb_fifo_full_wait( w->fifo_out ) )
                 {
-                    hb_fifo_push( w->fifo_out, buf_out );
-                    buf_out = NULL;
+                    hb_fifo_push_list( w->fifo_out, &list_out );
                     break;
                 }
             }
-        }
-        else if (w->fifo_in == NULL)
-        {
-            // If this work object is a generator (no input fifo) and it
-            // generated no output, it may be waiting for status from
-            // another thread. Yield so that we don't spin doing nothing.
-            hb_yield();
+            hb_trace_end("output wait", trace);
+            stats->wait_out += hb_get_time_us() - t0;
         }
     }
-    if ( buf_out )
-    {
-        hb_buffer_close( &buf_out );
-    }
+    hb_buffer_list_close(&list_in);
+    hb_buffer_list_close(&list_out);
+    stats->stop = hb_get_time_us();
 
     // Consume data in incoming fifo till job completes so that
     // residual data does not stall the pipeline. There can be
     // residual data during point-to-point encoding.
     hb_deep_log(3, "worker %s waiting to die", w->name);
+    if (w->h != NULL)
+    {
+        // Let do_job know that this worker has stopped
+        hb_work_signal(w->h);
+    }
     while ((w->die == NULL || !*w->die) &&
            !*w->done && w->fifo_in != NULL)
     {
@@ -1938,12 +2840,27 @@ static void filter_loop( void * _f )
 {
     hb_filter_object_t * f = _f;
     hb_buffer_t      * buf_in, * buf_out = NULL;
+    hb_stage_stats_t   local_stats, * stats = f->stats;
+    uint64_t           t0, trace;
+
+    if (stats == NULL)
+    {
+        memset(&local_stats, 0, sizeof(local_stats));
+        stats = &local_stats;
+    }
+    stats->start = hb_get_time_us();
+    hb_atomic_store(&stats->thread_id, hb_thread_self_id());
+    hb_trace_thread_name(f->name);
 
     while( !*f->done && f->status != HB_FILTER_DONE )
     {
+        t0 = hb_get_time_us();
         buf_in = hb_fifo_get_wait( f->fifo_in );
+        stats->wait_in += hb_get_time_us() - t0;
         if ( buf_in == NULL )
             continue;
+        stats->buffers++;
+        stats->bytes += buf_in->size;
 
         // Filters can drop buffers.  Remember chapter information
         // so that it can be propagated to the next buffer
@@ -1969,7 +2886,11 @@ static void filter_loop( void * _f )
         hb_buffer_t *last_buf_in = buf_in;
 #endif
 
+        t0 = hb_get_time_us();
+        trace = hb_trace_begin();
         f->status = f->work( f, &buf_in, &buf_out );
+        hb_trace_end(f->name, trace);
+        stats->work += hb_get_time_us() - t0;
 
 #ifdef USE_QSV
         if (f->status == HB_FILTER_DELAY &&
@@ -2001,6 +2922,8 @@ static void filter_loop( void * _f )
         }
         if( buf_out )
         {
+            t0 = hb_get_time_us();
+            trace = hb_trace_begin();
             while ( !*f->done )
             {
                 if ( hb_fifo_full_wait( f->fifo_out ) )
@@ -2010,12 +2933,15 @@ static void filter_loop( void * _f )
                     break;
                 }
             }
+            hb_trace_end("output wait", trace);
+            stats->wait_out += hb_get_time_us() - t0;
         }
     }
     if ( buf_out )
     {
         hb_buffer_close( &buf_out );
     }
+    stats->stop = hb_get_time_us();
 
     // Consume data in incoming fifo till job complete so that
     // residual data does not stall the pipeline
@@ -128,6 +128,7 @@ static int     subtitle_all              = -1;
 static int     subburn                   = -1;
 static int     subburn_native            = -1;
 static int     subdefault                = 0;
+static int     subscan_first_pass        = 0;
 static char ** srtfile                   = NULL;
 static char ** srtcodeset                = NULL;
 static char ** srtoffset                 = NULL;
@@ -179,6 +180,14 @@ static int      start_at_frame = 0;
 static int64_t  stop_at_pts    = 0;
 static int      stop_at_frame = 0;
 static uint64_t min_title_duration = 10;
+static int      thread_budget      = 0;
+static int      max_jobs           = 1;
+static int      segment_count      = 0;
+static int      frame_cache        = 0;
+static int      fifo_budget        = 0;
+static char *   affinity           = NULL;
+static int      memory_limit       = 0;
+static int      decode_skip        = 0;
 #ifdef USE_QSV
 static int      qsv_async_depth    = -1;
 static int      qsv_decode         = -1;
@@ -403,12 +412,40 @@ void EventLoop(hb_handle_t *h, hb_dict_t *preset_dict)
     job_running = 0;
 }
 
-int RunQueueJob(hb_handle_t *h, hb_dict_t *job_dict)
+static int AddQueueJob(hb_handle_t *h, hb_dict_t *job_dict)
 {
     if (job_dict == NULL)
     {
         return -1;
     }
+    if (thread_budget > 0)
+    {
+        hb_dict_set(job_dict, "ThreadBudget", hb_value_int(thread_budget));
+    }
+    if (segment_count > 1)
+    {
+        hb_dict_set(job_dict, "SegmentCount", hb_value_int(segment_count));
+    }
+    if (frame_cache > 0)
+    {
+        hb_dict_set(job_dict, "FrameCache", hb_value_int(frame_cache));
+    }
+    if (fifo_budget > 0)
+    {
+        hb_dict_set(job_dict, "FifoBudget", hb_value_int(fifo_budget));
+    }
+    if (affinity != NULL)
+    {
+        hb_dict_set(job_dict, "Affinity", hb_value_string(affinity));
+    }
+    if (memory_limit > 0)
+    {
+        hb_dict_set(job_dict, "MemoryLimit", hb_value_int(memory_limit));
+    }
+    if (decode_skip)
+    {
+        hb_dict_set(job_dict, "DecodeSkip", hb_value_bool(decode_skip));
+    }
 
     char * json_job;
     json_job = hb_value_get_json(job_dict);
@@ -421,6 +458,15 @@ int RunQueueJob(hb_handle_t *h, hb_dict_t *job_dict)
 
     hb_add_json(h, json_job);
     free(json_job);
+    return 0;
+}
+
+int RunQueueJob(hb_handle_t *h, hb_dict_t *job_dict)
+{
+    if (AddQueueJob(h, job_dict) < 0)
+    {
+        return -1;
+    }
     job_running = 1;
     hb_start( h );
 
@@ -442,6 +488,23 @@ int RunQueue(hb_handle_t *h, const char *queue_import_name)
         int ii, count, result = 0;
 
         count = hb_value_array_len(queue);
+        if (max_jobs > 1)
+        {
+            // Queue everything and let libhb run max_jobs at a time
+            for (ii = 0; ii < count; ii++)
+            {
+                hb_dict_t * entry = hb_value_array_get(queue, ii);
+                if (AddQueueJob(h, hb_dict_get(entry, "Job")) < 0)
+                {
+                    result = -1;
+                }
+            }
+            hb_set_max_concurrent_jobs(h, max_jobs);
+            job_running = 1;
+            hb_start(h);
+            EventLoop(h, NULL);
+            return result;
+        }
         for (ii = 0; ii < count; ii++)
         {
             hb_dict_t * entry = hb_value_array_get(queue, ii);
@@ -599,6 +662,7 @@ cleanup:
     free(input);
     free(output);
     free(preset_name);
+    free(affinity);
     free(encoder_preset);
     free(encoder_tune);
     free(advanced_opts);
@@ -1301,6 +1365,41 @@ static void ShowHelp()
 "                           '--preset-export'\n"
 "   --queue-import-file <filename>\n"
 "                           Import an encode queue file created by the GUI\n"
+"   --thread-budget <number>\n"
+"                           Limit the number of CPU threads each job may use.\n"
+"                           They are divided between the video decoder,\n"
+"                           filters and video encoder (default: no limit)\n"
+"   --max-jobs <number>\n"
+"                           Encode up to this many jobs of a queue imported\n"
+"                           with --queue-import-file at the same time\n"
+"                           (default: 1)\n"
+"   --segments <number>\n"
+"                           Split the video into this many chapter ranges\n"
+"                           that are encoded at the same time and joined.\n"
+"                           Single pass x264 and x265 only (default: off)\n"
+"   --frame-cache <MiB>\n"
+"                           Keep the filtered video of the first pass of a\n"
+"                           two-pass encode in temporary files of up to this\n"
+"                           size and encode the second pass from them\n"
+"                           (default: off)\n"
+"   --fifo-budget <MiB>\n"
+"                           Limit the memory the raw video fifos of each\n"
+"                           job may hold. Their sizes adapt to the speed of\n"
+"                           the stages they connect (default: 256)\n"
+"   --affinity <string>     Run the threads of each job on these CPUs, e.g.\n"
+"                           '0-7,16-23', or on the CPUs of these NUMA nodes,\n"
+"                           e.g. 'node:1'. Frame buffers are then allocated\n"
+"                           on the node. Linux only (default: any CPU)\n"
+"   --memory-limit <MiB>\n"
+"                           Write the oldest data of queues that can grow\n"
+"                           without bound (subtitles, muxer) to a temporary\n"
+"                           file when they hold more than this\n"
+"                           (default: no limit)\n"
+"   --decode-skip           With a constant frame rate source and --cfr or\n"
+"                           --pfr at the source's rate divided by a whole\n"
+"                           number (e.g. 59.94 -> 29.97), drop the frames\n"
+"                           that are not kept in the video decoder, which\n"
+"                           saves decoding and filtering them\n"
 "       --no-dvdnav         Do not use dvdnav for reading DVDs\n"
 "\n"
 "\n"
@@ -1402,6 +1501,9 @@ static void ShowHelp()
 "   -T, --turbo             When using 2-pass use \"turbo\" options on the\n"
 "                           first pass to improve speed\n"
 "                           (works with x264 and x265)\n"
+"       --turbo-fastest     Like --turbo, with the fastest first pass analysis\n"
+"                           the second pass can use. Faster still, at the\n"
+"                           cost of some accuracy of the average bitrate\n"
 "       --no-turbo          Disable 2-pass mode's \"turbo\" first pass\n"
 "   -r, --rate <float>      Set video framerate\n"
 "                           (" );
@@ -1785,6 +1887,10 @@ static void ShowHelp()
 "                           or less is selected. This should locate subtitles\n"
 "                           for short foreign language segments. Best used in\n"
 "                           conjunction with --subtitle-forced.\n"
+"      --subtitle-scan-first-pass\n"
+"                           With --two-pass, scan the subtitles during the\n"
+"                           first pass of the encode instead of adding an\n"
+"                           extra pass.\n"
 "  -F, --subtitle-forced[=string]\n"
 "                           Only display subtitles from the selected stream\n"
 "                           if the subtitle has the forced flag set. The\n"
@@ -2094,6 +2200,15 @@ static int ParseOptions( int argc, char ** argv )
     #define FILTER_LAPSHARP      314
     #define FILTER_LAPSHARP_TUNE 315
     #define JSON_LOGGING         316
+    #define THREAD_BUDGET        317
+    #define MAX_JOBS             318
+    #define SEGMENTS             319
+    #define FRAME_CACHE          320
+    #define TURBO_FASTEST        321
+    #define AFFINITY             322
+    #define FIFO_BUDGET          323
+    #define MEMORY_LIMIT         324
+    #define DECODE_SKIP          325
 
     for( ;; )
     {
@@ -2149,6 +2264,7 @@ static int ParseOptions( int argc, char ** argv )
             { "subtitle-forced", optional_argument,   NULL,    'F' },
             { "subtitle-burned", optional_argument,   NULL,    SUB_BURNED },
             { "subtitle-default", optional_argument,   NULL,    SUB_DEFAULT },
+            { "subtitle-scan-first-pass", no_argument, &subscan_first_pass, 1 },
             { "srt-file",    required_argument, NULL, SRT_FILE },
             { "srt-codeset", required_argument, NULL, SRT_CODESET },
             { "srt-offset",  required_argument, NULL, SRT_OFFSET },
@@ -2236,6 +2352,7 @@ static int ParseOptions( int argc, char ** argv )
             { "arate",       required_argument, NULL,    'R' },
             { "turbo",       no_argument,       NULL,    'T' },
             { "no-turbo",    no_argument,       &fastfirstpass,    0 },
+            { "turbo-fastest", no_argument,     NULL,    TURBO_FASTEST },
             { "maxHeight",   required_argument, NULL,    'Y' },
             { "maxWidth",    required_argument, NULL,    'X' },
             { "preset",      required_argument, NULL,    'Z' },
@@ -2246,6 +2363,14 @@ static int ParseOptions( int argc, char ** argv )
             { "preset-export-file", required_argument, NULL, PRESET_EXPORT_FILE },
             { "preset-export-description", required_argument, NULL, PRESET_EXPORT_DESC },
             { "queue-import-file",  required_argument, NULL, QUEUE_IMPORT },
+            { "thread-budget",      required_argument, NULL, THREAD_BUDGET },
+            { "max-jobs",           required_argument, NULL, MAX_JOBS },
+            { "segments",           required_argument, NULL, SEGMENTS },
+            { "frame-cache",        required_argument, NULL, FRAME_CACHE },
+            { "affinity",           required_argument, NULL, AFFINITY },
+            { "fifo-budget",        required_argument, NULL, FIFO_BUDGET },
+            { "memory-limit",       required_argument, NULL, MEMORY_LIMIT },
+            { "decode-skip",        no_argument,       NULL, DECODE_SKIP },
 
             { "aname",       required_argument, NULL,    'A' },
             { "color-matrix",required_argument, NULL,    'M' },
@@ -2347,6 +2472,31 @@ static int ParseOptions( int argc, char ** argv )
             case QUEUE_IMPORT:
                 queue_import_name = strdup(optarg);
                 break;
+            case THREAD_BUDGET:
+                thread_budget = atoi(optarg);
+                break;
+            case MAX_JOBS:
+                max_jobs = atoi(optarg);
+                break;
+            case SEGMENTS:
+                segment_count = atoi(optarg);
+                break;
+            case FRAME_CACHE:
+                frame_cache = atoi(optarg);
+                break;
+            case FIFO_BUDGET:
+                fifo_budget = atoi(optarg);
+                break;
+            case MEMORY_LIMIT:
+                memory_limit = atoi(optarg);
+                break;
+            case DECODE_SKIP:
+                decode_skip = 1;
+                break;
+            case AFFINITY:
+                free(affinity);
+                affinity = strdup(optarg);
+                break;
             case DVDNAV:
                 dvdnav = 0;
                 break;
@@ -2840,6 +2990,9 @@ static int ParseOptions( int argc, char ** argv )
             case 'T':
                 fastfirstpass = 1;
                 break;
+            case TURBO_FASTEST:
+                fastfirstpass = 2;
+                break;
             case 'Y':
                 maxHeight = atoi( optarg );
                 break;
@@ -3863,7 +4016,7 @@ static hb_dict_t * PreparePreset(const char *preset_name)
         {
             hb_dict_set(preset, "VideoTwoPass", hb_value_bool(0));
         }
-        if (fastfirstpass == 1)
+        if (fastfirstpass >= 1)
         {
             hb_dict_set(preset, "VideoTurboTwoPass", hb_value_bool(1));
         }
@@ -4292,6 +4445,40 @@ PrepareJob(hb_handle_t *h, hb_title_t *title, hb_dict_t *preset_dict)
         return NULL;
     }
 
+    if (thread_budget > 0)
+    {
+        hb_dict_set(job_dict, "ThreadBudget", hb_value_int(thread_budget));
+    }
+    if (segment_count > 1)
+    {
+        hb_dict_set(job_dict, "SegmentCount", hb_value_int(segment_count));
+    }
+    if (frame_cache > 0)
+    {
+        hb_dict_set(job_dict, "FrameCache", hb_value_int(frame_cache));
+    }
+    if (fifo_budget > 0)
+    {
+        hb_dict_set(job_dict, "FifoBudget", hb_value_int(fifo_budget));
+    }
+    if (affinity != NULL)
+    {
+        hb_dict_set(job_dict, "Affinity", hb_value_string(affinity));
+    }
+    if (memory_limit > 0)
+    {
+        hb_dict_set(job_dict, "MemoryLimit", hb_value_int(memory_limit));
+    }
+    if (decode_skip)
+    {
+        hb_dict_set(job_dict, "DecodeSkip", hb_value_bool(decode_skip));
+    }
+    if (fastfirstpass > 1)
+    {
+        hb_dict_set(hb_dict_get(job_dict, "Video"), "TurboLevel",
+                    hb_value_int(fastfirstpass));
+    }
+
     hb_dict_t *dest_dict = hb_dict_get(job_dict, "Destination");
     if (hb_value_get_bool(hb_dict_get(dest_dict, "ChapterMarkers")))
     {
@@ -4373,6 +4560,10 @@ PrepareJob(hb_handle_t *h, hb_title_t *title, hb_dict_t *preset_dict)
     hb_dict_t        * subtitle_search;
     subtitle_array  = hb_dict_get(subtitles_dict, "SubtitleList");
     subtitle_search = hb_dict_get(subtitles_dict, "Search");
+    if (subscan_first_pass)
+    {
+        hb_dict_set(subtitle_search, "FirstPass", hb_value_bool(1));
+    }
 
     hb_dict_t *audios_dict = hb_dict_get(job_dict, "Audio");
     hb_value_array_t * audio_array = hb_dict_get(audios_dict, "AudioList");
@@ -0,0 +1,188 @@
+/* hqdn3d.c
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*
+ * Checks that the x86 row kernels of hqdn3d give the same rows as the C
+ * ones, and prints how long each takes per row.  The filter runs its rows
+ * over whole strides, which are multiples of 32, so the row functions are
+ * called here directly with widths that leave a tail after the vectors.
+ */
+
+#include "hb.h"
+#include "denoise.h"
+
+#define ROWS      16
+#define MAX_WIDTH 1920
+#define RUNS      2000
+
+static const int widths[] = { 1, 7, 8, 9, 15, 17, 31, 33, 639, 1918, 1920 };
+
+#define WIDTHS (sizeof(widths) / sizeof(widths[0]))
+
+static short coef[2][HQDN3D_COEF_SIZE];
+static int   failures;
+
+typedef struct
+{
+    unsigned char  src[ROWS][MAX_WIDTH];
+    unsigned int   pixel[ROWS][MAX_WIDTH];
+    unsigned char  dst[ROWS][MAX_WIDTH];
+    unsigned short line[MAX_WIDTH];
+    unsigned short frame[MAX_WIDTH];
+} rows_t;
+
+static rows_t input, ref, out;
+
+// Noisy rows, with the previous frame and line state near them
+static void make_rows( rows_t * rows )
+{
+    unsigned int seed = 0x12345678;
+    int          x, y;
+
+    for (y = 0; y < ROWS; y++)
+    {
+        for (x = 0; x < MAX_WIDTH; x++)
+        {
+            seed = seed * 1103515245 + 12345;
+            rows->src[y][x]   = (x + y * 2 + ((seed >> 16) & 0x1f)) & 0xff;
+            rows->pixel[y][x] = (rows->src[y][x] << 8) +
+                                ((seed >> 8) & 0x3ff) - 0x200;
+            if (rows->pixel[y][x] > 0xff00)
+            {
+                rows->pixel[y][x] = rows->src[y][x] << 8;
+            }
+        }
+    }
+    for (x = 0; x < MAX_WIDTH; x++)
+    {
+        rows->line[x]  = rows->pixel[ROWS - 1][x];
+        rows->frame[x] = (rows->src[ROWS - 1][MAX_WIDTH - 1 - x] << 8) | x;
+    }
+}
+
+// Filters ROWS rows of width 'w' into 'rows', carrying the line and frame
+// state from row to row like the filter does
+static void run_rows( const hqdn3d_functions_t * functions, rows_t * rows,
+                      int w, int spatial )
+{
+    int y;
+
+    memcpy(rows->line,  input.line,  sizeof(rows->line));
+    memcpy(rows->frame, input.frame, sizeof(rows->frame));
+    memset(rows->dst, 0, sizeof(rows->dst));
+    for (y = 0; y < ROWS; y++)
+    {
+        if (spatial)
+        {
+            functions->spatial_row(input.pixel[y], rows->dst[y],
+                                   rows->line, rows->frame, w,
+                                   coef[0] + 0x1000, coef[1] + 0x1000);
+        }
+        else
+        {
+            functions->temporal_row(input.src[y], rows->dst[y],
+                                    rows->frame, w, coef[1] + 0x1000);
+        }
+    }
+}
+
+static int same_rows( const rows_t * a, const rows_t * b, int w )
+{
+    int y;
+
+    for (y = 0; y < ROWS; y++)
+    {
+        if (memcmp(a->dst[y], b->dst[y], w))
+        {
+            return 0;
+        }
+    }
+    return !memcmp(a->line,  b->line,  w * sizeof(a->line[0])) &&
+           !memcmp(a->frame, b->frame, w * sizeof(a->frame[0]));
+}
+
+static int64_t time_rows( const hqdn3d_functions_t * functions, int spatial )
+{
+    int64_t start;
+    int     ii;
+
+    // Once untimed, to warm up the caches
+    run_rows(functions, &out, MAX_WIDTH, spatial);
+    start = hb_get_time_us();
+    for (ii = 0; ii < RUNS; ii++)
+    {
+        run_rows(functions, &out, MAX_WIDTH, spatial);
+    }
+    return hb_get_time_us() - start;
+}
+
+static void check_rows( const char * name, int spatial,
+                        const hqdn3d_functions_t * c,
+                        const hqdn3d_functions_t * simd )
+{
+    int64_t c_us, simd_us;
+    int     ii;
+
+    for (ii = 0; ii < WIDTHS; ii++)
+    {
+        run_rows(c,    &ref, widths[ii], spatial);
+        run_rows(simd, &out, widths[ii], spatial);
+        if (!same_rows(&ref, &out, widths[ii]))
+        {
+            fprintf(stderr, "hqdn3d: FAILED: %s AVX2 differs from C "
+                    "at width %d\n", name, widths[ii]);
+            failures++;
+        }
+    }
+
+    c_us    = time_rows(c,    spatial);
+    simd_us = time_rows(simd, spatial);
+    fprintf(stderr, "hqdn3d: %-8s C %6.3f us/row, AVX2 %6.3f us/row, %.2fx\n",
+            name, (double)c_us / RUNS / ROWS, (double)simd_us / RUNS / ROWS,
+            simd_us > 0 ? (double)c_us / simd_us : 0.);
+}
+
+int main( int argc, char ** argv )
+{
+    hqdn3d_functions_t c, simd;
+
+    if (hb_global_init() < 0)
+    {
+        return 1;
+    }
+
+    hqdn3d_precalc_coef(coef[0], 4.0);
+    hqdn3d_precalc_coef(coef[1], 6.0);
+    make_rows(&input);
+
+    hqdn3d_init_c(&c);
+    simd = c;
+#if defined(ARCH_X86)
+    hqdn3d_init_x86(&simd);
+#endif
+    if (simd.temporal_row == c.temporal_row &&
+        simd.spatial_row  == c.spatial_row)
+    {
+        fprintf(stderr, "hqdn3d: no x86 kernels for this CPU, skipped\n");
+        hb_global_close();
+        return 0;
+    }
+
+    check_rows("temporal", 0, &c, &simd);
+    check_rows("spatial",  1, &c, &simd);
+
+    hb_global_close();
+
+    if (failures)
+    {
+        return 1;
+    }
+    fprintf(stderr, "hqdn3d: all checks passed\n");
+    return 0;
+}
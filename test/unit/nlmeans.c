@@ -0,0 +1,294 @@
+/* nlmeans.c
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*
+ * Checks that the x86 kernels of nlmeans give the same frames as its C
+ * versions, and prints how long each takes per frame.  The filter picks
+ * its kernels from av_get_cpu_flags() and hb_get_cpu_flags() when it is
+ * initialized, so it is run once with the CPU flags masked down to nothing
+ * and once for each instruction set the CPU has.  nlmeans works on the
+ * plane widths, 1278 and 639 here, so the last tile of each row ends off
+ * the vector width and the tails get checked too.
+ */
+
+#include "hb.h"
+#include "libavutil/cpu.h"
+
+#define FRAMES 6
+
+typedef struct
+{
+    int          id;
+    const char * name;
+    const char * settings;
+    int          width;
+    int          height;
+} kernel_check_t;
+
+static const kernel_check_t checks[] =
+{
+    { HB_FILTER_NLMEANS, "nlmeans",
+      "y-strength=6:y-origin-tune=1:y-patch-size=7:y-range=3:"
+      "y-frame-count=2:y-prefilter=0:"
+      "cb-strength=6:cb-origin-tune=1:cb-patch-size=7:cb-range=3:"
+      "cb-frame-count=2:cb-prefilter=0:"
+      "cr-strength=6:cr-origin-tune=1:cr-patch-size=7:cr-range=3:"
+      "cr-frame-count=2:cr-prefilter=0",
+      1278, 718 },
+};
+
+#define SSE2_FLAGS (AV_CPU_FLAG_MMX  | AV_CPU_FLAG_MMXEXT | \
+                    AV_CPU_FLAG_SSE  | AV_CPU_FLAG_SSE2)
+#define SSE4_FLAGS (SSE2_FLAGS | AV_CPU_FLAG_SSE3 | AV_CPU_FLAG_SSSE3 | \
+                    AV_CPU_FLAG_SSE4)
+#define AVX2_FLAGS (SSE4_FLAGS | AV_CPU_FLAG_SSE42 | AV_CPU_FLAG_AVX | \
+                    AV_CPU_FLAG_AVX2)
+
+static const struct
+{
+    const char * name;
+    int          flags;
+    int          hb_flags;
+} levels[] =
+{
+    { "C",       0,          0                  },
+    { "SSE2",    SSE2_FLAGS, 0                  },
+    { "SSE4.1",  SSE4_FLAGS, 0                  },
+    { "AVX2",    AVX2_FLAGS, 0                  },
+    { "AVX-512", AVX2_FLAGS, HB_CPU_FLAG_AVX512 },
+};
+
+#define LEVELS (sizeof(levels) / sizeof(levels[0]))
+
+static int failures;
+
+// Smooth gradients with noise on top, so that both the search of nlmeans
+// has something to work on
+static hb_buffer_t * make_frame( int width, int height, int index )
+{
+    hb_buffer_t  * buf  = hb_video_buffer_init(width, height);
+    unsigned int   seed = 0x12345678 + index * 7919;
+    int            pp, x, y;
+
+    for (pp = 0; pp < 3; pp++)
+    {
+        struct buffer_plane * plane = &buf->plane[pp];
+
+        for (y = 0; y < plane->height; y++)
+        {
+            uint8_t * row = plane->data + y * plane->stride;
+
+            for (x = 0; x < plane->width; x++)
+            {
+                int v;
+
+                seed = seed * 1103515245 + 12345;
+                v    = (x + y * 2 + index * 3 + pp * 64) & 0xff;
+                v   += (int)((seed >> 16) & 0x1f) - 16;
+                row[x] = v < 0 ? 0 : v > 255 ? 255 : v;
+            }
+        }
+    }
+    buf->s.start    = index * 3003;
+    buf->s.stop     = buf->s.start + 3003;
+    buf->s.duration = 3003;
+
+    return buf;
+}
+
+// Runs the filter over copies of 'frames' and returns the frames it put
+// out, or NULL if it failed.  '*us' gets the time spent in the filter.
+static hb_buffer_t * run_filter( const kernel_check_t * check,
+                                 hb_buffer_t ** frames, int64_t * us )
+{
+    hb_filter_object_t * filter = hb_filter_init(check->id);
+    hb_filter_init_t     init;
+    hb_buffer_list_t     list;
+    hb_buffer_t        * in, * out;
+    int                  ii;
+
+    memset(&init, 0, sizeof(init));
+    init.pix_fmt                 = AV_PIX_FMT_YUV420P;
+    init.geometry.width          = check->width;
+    init.geometry.height         = check->height;
+    init.geometry.par.num        = 1;
+    init.geometry.par.den        = 1;
+    init.vrate.num               = 30000;
+    init.vrate.den               = 1001;
+    filter->settings = hb_parse_filter_settings(check->settings);
+    if (filter->init(filter, &init))
+    {
+        hb_filter_close(&filter);
+        return NULL;
+    }
+
+    hb_buffer_list_clear(&list);
+    *us = 0;
+    for (ii = 0; ii <= FRAMES; ii++)
+    {
+        int64_t start;
+
+        in  = ii < FRAMES ? hb_buffer_dup(frames[ii]) : hb_buffer_eof_init();
+        out = NULL;
+        start = hb_get_time_us();
+        filter->work(filter, &in, &out);
+        *us += hb_get_time_us() - start;
+        hb_buffer_close(&in);
+        hb_buffer_list_append(&list, out);
+    }
+    filter->close(filter);
+    hb_filter_close(&filter);
+
+    // Drop the EOF buffer that terminates the list
+    out = hb_buffer_list_tail(&list);
+    if (out != NULL && (out->s.flags & HB_BUF_FLAG_EOF))
+    {
+        out = hb_buffer_list_rem_tail(&list);
+        hb_buffer_close(&out);
+    }
+    return hb_buffer_list_clear(&list);
+}
+
+static int same_frame( const hb_buffer_t * a, const hb_buffer_t * b )
+{
+    int pp, y;
+
+    for (pp = 0; pp < 3; pp++)
+    {
+        const struct buffer_plane * pa = &a->plane[pp];
+        const struct buffer_plane * pb = &b->plane[pp];
+
+        if (pa->width != pb->width || pa->height != pb->height)
+        {
+            return 0;
+        }
+        for (y = 0; y < pa->height; y++)
+        {
+            if (memcmp(pa->data + y * pa->stride,
+                       pb->data + y * pb->stride, pa->width))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void check_filter( const kernel_check_t * check,
+                          int cpu_flags, int hb_cpu_flags )
+{
+    hb_buffer_t * frames[FRAMES];
+    hb_buffer_t * ref = NULL;
+    int64_t       ref_us = 0;
+    int           ii, level;
+
+    for (ii = 0; ii < FRAMES; ii++)
+    {
+        frames[ii] = make_frame(check->width, check->height, ii);
+    }
+
+    for (level = 0; level < LEVELS; level++)
+    {
+        hb_buffer_t * out, * a, * b;
+        int64_t       us;
+        int           count;
+
+        if ((cpu_flags    & levels[level].flags)    != levels[level].flags ||
+            (hb_cpu_flags & levels[level].hb_flags) != levels[level].hb_flags)
+        {
+            continue;
+        }
+        av_set_cpu_flags_mask(levels[level].flags);
+        hb_set_cpu_flags_mask(levels[level].hb_flags);
+        out = run_filter(check, frames, &us);
+        if (out == NULL)
+        {
+            fprintf(stderr, "nlmeans: FAILED: %s %s did not initialize\n",
+                    check->name, levels[level].name);
+            failures++;
+            continue;
+        }
+
+        for (count = 0, a = out; a != NULL; a = a->next)
+        {
+            count++;
+        }
+        if (level == 0)
+        {
+            ref    = out;
+            ref_us = us;
+            fprintf(stderr, "nlmeans: %-10s %-7s %8.2f ms/frame\n",
+                    check->name, levels[level].name,
+                    us / 1000. / FRAMES);
+            if (count != FRAMES)
+            {
+                fprintf(stderr, "nlmeans: FAILED: %s put out %d of %d frames\n",
+                        check->name, count, FRAMES);
+                failures++;
+            }
+            continue;
+        }
+
+        for (ii = 0, a = ref, b = out; a != NULL && b != NULL;
+             ii++, a = a->next, b = b->next)
+        {
+            if (!same_frame(a, b))
+            {
+                break;
+            }
+        }
+        if (a != NULL || b != NULL)
+        {
+            fprintf(stderr, "nlmeans: FAILED: %s %s differs from C at frame %d\n",
+                    check->name, levels[level].name, ii);
+            failures++;
+        }
+        fprintf(stderr, "nlmeans: %-10s %-7s %8.2f ms/frame, %.2fx\n",
+                check->name, levels[level].name, us / 1000. / FRAMES,
+                us > 0 ? (double)ref_us / us : 0.);
+        hb_buffer_close(&out);
+    }
+
+    hb_buffer_close(&ref);
+    for (ii = 0; ii < FRAMES; ii++)
+    {
+        hb_buffer_close(&frames[ii]);
+    }
+}
+
+int main( int argc, char ** argv )
+{
+    hb_handle_t * h;
+    int           cpu_flags, hb_cpu_flags, ii;
+
+    if (hb_global_init() < 0)
+    {
+        return 1;
+    }
+    h = hb_init(0);
+
+    cpu_flags    = av_get_cpu_flags();
+    hb_cpu_flags = hb_get_cpu_flags();
+    for (ii = 0; ii < sizeof(checks) / sizeof(checks[0]); ii++)
+    {
+        check_filter(&checks[ii], cpu_flags, hb_cpu_flags);
+    }
+    av_set_cpu_flags_mask(~0);
+    hb_set_cpu_flags_mask(~0);
+
+    hb_close(&h);
+    hb_global_close();
+
+    if (failures)
+    {
+        return 1;
+    }
+    fprintf(stderr, "nlmeans: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,174 @@
+/* pp7.c
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*
+ * Checks that the x86 row kernels of pp7 give the same rows as the C one
+ * in each mode, and prints how long each takes per row.  The filter runs
+ * its rows over whole strides, which are multiples of 32, so filter_row is
+ * called here directly with widths that end in a partial run of 8 pixels.
+ */
+
+#include "hb.h"
+#include "libavutil/cpu.h"
+#include "deblock.h"
+
+#define MAX_WIDTH 1920
+#define STRIDE    (MAX_WIDTH + 32)
+#define ROWS      7     // rows that filter_row reads
+#define RUNS      200
+
+static const int widths[] = { 1, 7, 8, 9, 15, 17, 31, 33, 639, 1918, 1920 };
+
+#define WIDTHS (sizeof(widths) / sizeof(widths[0]))
+
+static const char * const modes[] = { "hard", "soft", "medium" };
+
+static const struct
+{
+    const char * name;
+    int          flags;
+} levels[] =
+{
+    { "SSE4.1", AV_CPU_FLAG_SSE4 },
+    { "AVX2",   AV_CPU_FLAG_SSE4 | AV_CPU_FLAG_AVX2 },
+};
+
+#define LEVELS (sizeof(levels) / sizeof(levels[0]))
+
+static const uint8_t dither[8] = { 0, 48, 12, 60, 3, 51, 15, 63 };
+
+static uint8_t  src[ROWS * STRIDE];
+static int      qp[MAX_WIDTH / 8 + 1];
+static DCTELEM  temp[4 * (MAX_WIDTH + 64)];
+static uint8_t  ref[MAX_WIDTH + 16], out[MAX_WIDTH + 16];
+static int      failures;
+
+// Blocky gradients with noise on top, so that every mode has edges to
+// smooth and coefficients on both sides of the thresholds
+static void make_rows( void )
+{
+    unsigned int seed = 0x12345678;
+    int          ii;
+
+    for (ii = 0; ii < ROWS * STRIDE; ii++)
+    {
+        int x = ii % STRIDE, y = ii / STRIDE, v;
+
+        seed = seed * 1103515245 + 12345;
+        v    = ((x >> 3) * 37 + (y >> 2) * 53) & 0xff;
+        v   += (int)((seed >> 16) & 0x1f) - 16;
+        src[ii] = v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+    for (ii = 0; ii < MAX_WIDTH / 8 + 1; ii++)
+    {
+        qp[ii] = 1 + ii * 7 % 31;
+    }
+}
+
+static void run_row( const pp7_functions_t * functions, uint8_t * dst,
+                     int width, int mode )
+{
+    memset(dst, 0xaa, MAX_WIDTH + 16);
+    // 8 pixels of padding on the left, as in the padded plane
+    functions->filter_row(dst, src + 8, STRIDE, width, qp,
+                          (const int (*)[16])pp7_threshold, pp7_factor,
+                          mode, dither, temp);
+}
+
+static int64_t time_row( const pp7_functions_t * functions, int mode )
+{
+    int64_t start;
+    int     ii;
+
+    // Once untimed, to warm up the caches
+    run_row(functions, out, MAX_WIDTH, mode);
+    start = hb_get_time_us();
+    for (ii = 0; ii < RUNS; ii++)
+    {
+        run_row(functions, out, MAX_WIDTH, mode);
+    }
+    return hb_get_time_us() - start;
+}
+
+static void check_mode( int mode, const pp7_functions_t * c,
+                        int cpu_flags )
+{
+    int64_t c_us = time_row(c, mode);
+    int     level, ii;
+
+    fprintf(stderr, "pp7: %-6s C      %7.2f us/row\n",
+            modes[mode], (double)c_us / RUNS);
+    for (level = 0; level < LEVELS; level++)
+    {
+        pp7_functions_t simd = *c;
+        int64_t         us;
+
+        if ((cpu_flags & levels[level].flags) != levels[level].flags)
+        {
+            continue;
+        }
+        av_set_cpu_flags_mask(levels[level].flags);
+        pp7_init_x86(&simd);
+        if (simd.filter_row == c->filter_row)
+        {
+            continue;
+        }
+
+        for (ii = 0; ii < WIDTHS; ii++)
+        {
+            run_row(c,     ref, widths[ii], mode);
+            run_row(&simd, out, widths[ii], mode);
+            // The bytes past the width must be left alone too
+            if (memcmp(ref, out, MAX_WIDTH + 16))
+            {
+                fprintf(stderr, "pp7: FAILED: %s %s differs from C "
+                        "at width %d\n", modes[mode], levels[level].name,
+                        widths[ii]);
+                failures++;
+            }
+        }
+
+        us = time_row(&simd, mode);
+        fprintf(stderr, "pp7: %-6s %-6s %7.2f us/row, %.2fx\n",
+                modes[mode], levels[level].name, (double)us / RUNS,
+                us > 0 ? (double)c_us / us : 0.);
+    }
+}
+
+int main( int argc, char ** argv )
+{
+    pp7_functions_t c;
+    int             cpu_flags, mode;
+
+    if (hb_global_init() < 0)
+    {
+        return 1;
+    }
+
+    make_rows();
+    pp7_init_c(&c);
+
+    cpu_flags = av_get_cpu_flags();
+#if defined(ARCH_X86)
+    for (mode = PP7_MODE_HARD; mode <= PP7_MODE_MEDIUM; mode++)
+    {
+        check_mode(mode, &c, cpu_flags);
+    }
+#endif
+    av_set_cpu_flags_mask(~0);
+
+    hb_global_close();
+
+    if (failures)
+    {
+        return 1;
+    }
+    fprintf(stderr, "pp7: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,137 @@
+/* spill.c
+
+   Copyright (c) 2003-2018 HandBrake Team
+   This file is part of the HandBrake source code
+   Homepage: <http://handbrake.fr/>.
+   It may be used under the terms of the GNU General Public License v2.
+   For full terms see the file COPYING file or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*
+ * Checks that the spill store keeps count of the queued data that is in
+ * memory while buffers are spilled, read back in place, unqueued and
+ * dropped.  The count is only visible through hb_spill_over(), so each
+ * check fills the store up to just below or just above its limit.
+ */
+
+#include "hb.h"
+
+#define LIMIT (1024 * 1024)
+#define HALF  (LIMIT / 2 + 1)
+
+static int failures;
+
+static void check( int ok, const char * what )
+{
+    if (!ok)
+    {
+        fprintf(stderr, "spill: FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static hb_buffer_t * queue_buffer( hb_spill_t * sp, int size, int seed )
+{
+    hb_buffer_t * b = hb_buffer_init(size);
+    int           ii;
+
+    for (ii = 0; ii < size; ii++)
+    {
+        b->data[ii] = (ii * 7 + seed) & 0xff;
+    }
+    hb_spill_queue(sp, b);
+    return b;
+}
+
+static int check_data( hb_buffer_t * b, int size, int seed )
+{
+    int ii;
+
+    if (b->data == NULL || b->size != size)
+    {
+        return 0;
+    }
+    for (ii = 0; ii < size; ii++)
+    {
+        if (b->data[ii] != ((ii * 7 + seed) & 0xff))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main( int argc, char ** argv )
+{
+    hb_handle_t * h;
+    hb_job_t      job;
+    hb_spill_t  * sp;
+    hb_buffer_t * a, * b, * c;
+
+    if (hb_global_init() < 0)
+    {
+        return 1;
+    }
+    h = hb_init(0);
+
+    memset(&job, 0, sizeof(job));
+    job.h            = h;
+    job.sequence_id  = 1;
+    job.memory_limit = LIMIT / (1024 * 1024);
+    sp = hb_spill_init(&job);
+    check(sp != NULL, "store created");
+    if (sp == NULL)
+    {
+        return 1;
+    }
+
+    a = queue_buffer(sp, HALF, 1);
+    check(!hb_spill_over(sp), "one buffer under the limit");
+    b = queue_buffer(sp, HALF, 2);
+    check(hb_spill_over(sp), "two buffers over the limit");
+
+    // Spilled data does not count, unqueued data is not in the store
+    check(hb_spill_out(a) == 0 && a->data == NULL, "buffer spilled");
+    check(!hb_spill_over(sp), "spilled buffer not counted");
+    hb_spill_unqueue(a);
+    check(check_data(a, HALF, 1), "unqueued buffer read back");
+    check(a->spill.store == NULL, "unqueued buffer unregistered");
+    hb_buffer_close(&a);
+    check(!hb_spill_over(sp), "unqueued buffer not counted");
+    c = queue_buffer(sp, HALF, 3);
+    check(hb_spill_over(sp), "remaining buffers still counted");
+
+    // Data read back in place counts again
+    check(hb_spill_out(c) == 0 && c->data == NULL, "buffer spilled again");
+    check(!hb_spill_over(sp), "spilled buffer not counted");
+    hb_spill_in(c);
+    check(check_data(c, HALF, 3), "buffer read back in place");
+    check(hb_spill_over(sp), "buffer read back counted");
+
+    // Closing a queued buffer drops it from the count
+    hb_buffer_close(&c);
+    check(!hb_spill_over(sp), "closed buffer not counted");
+    c = queue_buffer(sp, HALF, 4);
+    check(hb_spill_over(sp), "count back at two buffers");
+
+    hb_spill_unqueue(b);
+    hb_spill_unqueue(c);
+    check(check_data(b, HALF, 2) && check_data(c, HALF, 4),
+          "unspilled buffers unchanged");
+    hb_buffer_close(&b);
+    hb_buffer_close(&c);
+    c = queue_buffer(sp, LIMIT, 5);
+    check(!hb_spill_over(sp), "empty store counts from zero");
+    hb_buffer_close(&c);
+
+    hb_spill_close(&sp);
+    hb_close(&h);
+    hb_global_close();
+
+    if (failures)
+    {
+        return 1;
+    }
+    fprintf(stderr, "spill: all checks passed\n");
+    return 0;
+}